@@ -0,0 +1,683 @@
+#include "Arduino.h"
+#include "NativeSim.h"
+#include "ESP8266WiFi.h"
+#include "sntp.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <new>
+#include <vector>
+
+static uint64_t clockNanos = 0;
+static NativePin pins[NATIVE_PIN_COUNT];
+static NativePinObserver pinObserver = nullptr;
+static uint32_t writeRange = 1023;
+static uint32_t randomState = 1;
+static bool resetRequested = false;
+static bool consoleEcho = false;
+
+HardwareSerial Serial;
+EspClass ESP;
+
+// timer1 emulation
+static timercallback timerIsr = nullptr;
+static bool timerEnabled = false;
+static bool timerArmed = false;
+static bool timerLoop = false;
+static uint32_t timerTickPicos = 200000; // TIM_DIV16
+static uint64_t timerPeriodNanos = 0;
+static uint64_t timerDeadlineNanos = 0;
+
+// Inputs the runner has lined up for later, by time in ns
+static std::multimap<uint64_t, std::pair<uint8_t, int>> scheduledInputs;
+
+void nativeScheduleInput(uint8_t pin, int value, uint64_t atMicros)
+{
+  scheduledInputs.emplace(atMicros * 1000, std::make_pair(pin, value));
+}
+
+void nativeAdvanceMicros(uint64_t us)
+{
+  uint64_t target = clockNanos + us * 1000;
+  for (;;)
+  {
+    bool timerDue = timerEnabled && timerArmed && timerIsr && timerDeadlineNanos <= target;
+    bool inputDue = !scheduledInputs.empty() && scheduledInputs.begin()->first <= target;
+    if (inputDue && (!timerDue || scheduledInputs.begin()->first < timerDeadlineNanos))
+    {
+      auto input = scheduledInputs.begin()->second;
+      clockNanos = std::max(clockNanos, scheduledInputs.begin()->first);
+      scheduledInputs.erase(scheduledInputs.begin());
+      nativeSetInput(input.first, input.second);
+      continue;
+    }
+    if (!timerDue)
+    {
+      break;
+    }
+    clockNanos = timerDeadlineNanos;
+    if (timerLoop)
+    {
+      timerDeadlineNanos += timerPeriodNanos;
+    }
+    else
+    {
+      timerArmed = false;
+    }
+    timerIsr();
+  }
+  clockNanos = target;
+}
+
+uint64_t nativeMicros()
+{
+  return clockNanos / 1000;
+}
+
+uint64_t nativeNanos()
+{
+  return clockNanos;
+}
+
+static uint64_t wallEpochUs = 1766599200000000ULL;
+static int32_t wallDriftPpm = 0;
+static uint32_t wallJitterUs = 0;
+
+void nativeSetWallClock(uint64_t epochUs, int32_t driftPpm, uint32_t jitterUs)
+{
+  wallEpochUs = epochUs;
+  wallDriftPpm = driftPpm;
+  wallJitterUs = jitterUs;
+}
+
+bool nativeWallClock(uint64_t &utcUs)
+{
+  // Set by the first SNTP reply, taken to arrive as WiFi joins
+  static bool set = false;
+  if (!set && WiFi.status() != WL_CONNECTED)
+  {
+    return false;
+  }
+  set = true;
+
+  uint64_t local = nativeMicros();
+  uint64_t interval = (uint64_t)sntp_update_delay_MS_rfc_not_less_than_15000() * 1000;
+  uint64_t index = local / interval;
+  uint64_t update = index * interval; // Local time of the last update
+
+  // A fixed scramble of the update number stands in for the network
+  uint32_t hash = (uint32_t)(index * 0x9e3779b97f4a7c15ULL >> 32);
+  int64_t jitter = wallJitterUs ? (int64_t)(hash % (2 * wallJitterUs + 1)) - wallJitterUs : 0;
+  int64_t trueAtUpdate = wallEpochUs + update - (int64_t)update * wallDriftPpm / 1000000;
+  utcUs = trueAtUpdate + jitter + (local - update);
+  return true;
+}
+
+// The core's default: an hour between updates
+extern "C" __attribute__((weak)) uint32_t sntp_update_delay_MS_rfc_not_less_than_15000()
+{
+  return 3600000;
+}
+
+void timer1_isr_init()
+{
+}
+
+void timer1_attachInterrupt(timercallback userFunc)
+{
+  timerIsr = userFunc;
+}
+
+void timer1_detachInterrupt()
+{
+  timerIsr = nullptr;
+  timerArmed = false;
+}
+
+void timer1_enable(uint8_t divider, uint8_t int_type, uint8_t reload)
+{
+  (void)int_type;
+  // 80 MHz base clock: 12.5 ns, 200 ns or 3.2 us per tick
+  timerTickPicos = divider == TIM_DIV1 ? 12500 : divider == TIM_DIV16 ? 200000 : 3200000;
+  timerLoop = reload == TIM_LOOP;
+  timerEnabled = true;
+}
+
+void timer1_disable()
+{
+  timerEnabled = false;
+  timerArmed = false;
+}
+
+void timer1_write(uint32_t ticks)
+{
+  timerPeriodNanos = (uint64_t)ticks * timerTickPicos / 1000;
+  timerDeadlineNanos = clockNanos + timerPeriodNanos;
+  timerArmed = true;
+}
+
+const NativePin &nativePin(uint8_t pin)
+{
+  static const NativePin invalid = {0, 0, 0};
+  return pin < NATIVE_PIN_COUNT ? pins[pin] : invalid;
+}
+
+static void (*pinHandlers[NATIVE_PIN_COUNT])();
+static int pinHandlerModes[NATIVE_PIN_COUNT];
+
+void nativeSetInput(uint8_t pin, int value)
+{
+  if (pin < NATIVE_PIN_COUNT)
+  {
+    bool rising = !pins[pin].value && value;
+    bool falling = pins[pin].value && !value;
+    pins[pin].value = value;
+    int mode = pinHandlerModes[pin];
+    if (pinHandlers[pin] && ((rising && (mode & RISING)) || (falling && (mode & FALLING))))
+    {
+      pinHandlers[pin]();
+    }
+  }
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode)
+{
+  if (interrupt < NATIVE_PIN_COUNT)
+  {
+    pinHandlers[interrupt] = handler;
+    pinHandlerModes[interrupt] = mode;
+  }
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+  if (interrupt < NATIVE_PIN_COUNT)
+  {
+    pinHandlers[interrupt] = nullptr;
+  }
+}
+
+uint32_t nativeAnalogWriteRange()
+{
+  return writeRange;
+}
+
+void nativeSetPinObserver(NativePinObserver observer)
+{
+  pinObserver = observer;
+}
+
+bool nativeResetRequested()
+{
+  return resetRequested;
+}
+
+void nativeSetConsoleEcho(bool echo)
+{
+  consoleEcho = echo;
+}
+
+// 32 bits, as on the ESP8266, where unsigned long is: micros() wraps
+// after about 71 minutes and millis() after 49 days
+unsigned long millis()
+{
+  return (uint32_t)(clockNanos / 1000000);
+}
+
+unsigned long micros()
+{
+  return (uint32_t)(clockNanos / 1000);
+}
+
+void delay(unsigned long ms)
+{
+  nativeAdvanceMicros((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  nativeAdvanceMicros(us);
+}
+
+void yield()
+{
+}
+
+static void recordWrite(uint8_t pin, int value)
+{
+  if (pin >= NATIVE_PIN_COUNT)
+  {
+    return;
+  }
+  pins[pin].value = value;
+  pins[pin].writes++;
+  if (pinObserver)
+  {
+    pinObserver(pin, value, clockNanos / 1000);
+  }
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if (pin < NATIVE_PIN_COUNT)
+  {
+    pins[pin].mode = mode;
+    // Pull-ups read HIGH until the simulation drives the pin
+    if (mode == INPUT_PULLUP)
+    {
+      pins[pin].value = HIGH;
+    }
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  recordWrite(pin, value ? HIGH : LOW);
+}
+
+int digitalRead(uint8_t pin)
+{
+  return nativePin(pin).value ? HIGH : LOW;
+}
+
+void analogWrite(uint8_t pin, int value)
+{
+  recordWrite(pin, value);
+}
+
+void analogWriteRange(uint32_t range)
+{
+  writeRange = range;
+}
+
+void analogWriteFreq(uint32_t freq)
+{
+  (void)freq;
+}
+
+int analogRead(uint8_t pin)
+{
+  return nativePin(pin).value;
+}
+
+static uint32_t nextRandom()
+{
+  // xorshift32: deterministic across hosts so simulated runs are repeatable
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+long random(long howbig)
+{
+  if (howbig <= 0)
+  {
+    return 0;
+  }
+  return nextRandom() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+  if (howsmall >= howbig)
+  {
+    return howsmall;
+  }
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+  if (seed != 0)
+  {
+    randomState = (uint32_t)seed;
+  }
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+// Local time follows tz from here on, as on the device
+void configTime(const char *tz, const char *server1, const char *server2, const char *server3)
+{
+  setenv("TZ", tz, 1);
+  tzset();
+  (void)server1;
+  (void)server2;
+  (void)server3;
+}
+
+char *dtostrf(double number, signed char width, unsigned char prec, char *s)
+{
+  sprintf(s, "%*.*f", width, prec, number);
+  return s;
+}
+
+void String::fromDouble(double value, unsigned char decimals)
+{
+  char buf[33];
+  snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+  s = buf;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while (size--)
+  {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(const Printable &value)
+{
+  return value.printTo(*this);
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0)
+  {
+    return 0;
+  }
+  return write((const uint8_t *)buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if (consoleEcho)
+  {
+    putchar(c);
+  }
+  return 1;
+}
+
+void EspClass::reset()
+{
+  resetRequested = true;
+}
+
+static uint8_t rtcMemory[NATIVE_RTC_USER_BYTES];
+
+uint8_t *nativeRtcMemory()
+{
+  return rtcMemory;
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset * 4 + size > sizeof(rtcMemory))
+  {
+    return false;
+  }
+  memcpy(data, rtcMemory + offset * 4, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size)
+{
+  if (offset * 4 + size > sizeof(rtcMemory))
+  {
+    return false;
+  }
+  memcpy(rtcMemory + offset * 4, data, size);
+  return true;
+}
+
+// Flash, kept sector by sector as they are first written. The map belongs
+// to the simulation, so its allocations are not counted.
+static std::map<uint32_t, std::vector<uint8_t>> flashSectors;
+static int64_t flashPower = -1; // Bytes left before the cut; negative for no cut
+static uint64_t flashProgrammed = 0;
+
+static std::vector<uint8_t> &flashSector(uint32_t sector)
+{
+  NativeUntracked untracked;
+  std::vector<uint8_t> &bytes = flashSectors[sector];
+  if (bytes.empty())
+  {
+    bytes.assign(SPI_FLASH_SEC_SIZE, 0xff);
+  }
+  return bytes;
+}
+
+void nativeFlashClear()
+{
+  NativeUntracked untracked;
+  flashSectors.clear();
+}
+
+void nativeFlashPowerCut(int64_t bytes)
+{
+  flashPower = bytes;
+}
+
+uint64_t nativeFlashProgrammed()
+{
+  return flashProgrammed;
+}
+
+// File format: for each sector written, its number (4 bytes, little
+// endian) then its contents
+bool nativeFlashLoad(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    return false;
+  }
+  nativeFlashClear();
+  uint8_t number[4];
+  while (fread(number, 1, sizeof(number), file) == sizeof(number))
+  {
+    uint32_t sector = number[0] | number[1] << 8 | number[2] << 16 | (uint32_t)number[3] << 24;
+    std::vector<uint8_t> &bytes = flashSector(sector);
+    if (fread(bytes.data(), 1, bytes.size(), file) != bytes.size())
+    {
+      break;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+bool nativeFlashSave(const char *path)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file)
+  {
+    return false;
+  }
+  for (const auto &entry : flashSectors)
+  {
+    uint8_t number[4] = {(uint8_t)entry.first, (uint8_t)(entry.first >> 8), (uint8_t)(entry.first >> 16),
+                         (uint8_t)(entry.first >> 24)};
+    fwrite(number, 1, sizeof(number), file);
+    fwrite(entry.second.data(), 1, entry.second.size(), file);
+  }
+  fclose(file);
+  return true;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector)
+{
+  std::vector<uint8_t> &bytes = flashSector(sector);
+  if (flashPower == 0)
+  {
+    // Cut during the erase
+    memset(bytes.data(), 0xff, bytes.size() / 2);
+    flashPower = -2;
+  }
+  if (flashPower < -1)
+  {
+    return false;
+  }
+  memset(bytes.data(), 0xff, bytes.size());
+  flashProgrammed++;
+  flashPower -= flashPower > 0;
+  return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, const uint32_t *data, size_t size)
+{
+  if (address % 4 || size % 4 || address % SPI_FLASH_SEC_SIZE + size > SPI_FLASH_SEC_SIZE || flashPower < -1)
+  {
+    return false;
+  }
+  std::vector<uint8_t> &bytes = flashSector(address / SPI_FLASH_SEC_SIZE);
+  const uint8_t *source = (const uint8_t *)data;
+  for (size_t i = 0; i < size; i++)
+  {
+    if (flashPower == 0)
+    {
+      flashPower = -2;
+      return false;
+    }
+    bytes[address % SPI_FLASH_SEC_SIZE + i] &= source[i];
+    flashProgrammed++;
+    flashPower -= flashPower > 0;
+  }
+  return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size)
+{
+  if (address % 4 || size % 4 || address % SPI_FLASH_SEC_SIZE + size > SPI_FLASH_SEC_SIZE || flashPower < -1)
+  {
+    return false;
+  }
+  auto found = flashSectors.find(address / SPI_FLASH_SEC_SIZE);
+  if (found == flashSectors.end())
+  {
+    memset(data, 0xff, size);
+  }
+  else
+  {
+    memcpy(data, found->second.data() + address % SPI_FLASH_SEC_SIZE, size);
+  }
+  return true;
+}
+
+// Heap accounting: every C++ allocation the firmware makes is counted
+// against a heap the size of the ESP8266's, so leaks and per-request
+// allocations show up in getFreeHeap(). The simulation's own bookkeeping
+// (queued requests, the broker, the filesystem) runs inside NativeUntracked
+// scopes and is left out. Fragmentation is not modelled.
+#define NATIVE_HEAP_SIZE 52000
+
+struct AllocationHeader
+{
+  size_t size;
+  size_t tracked;
+};
+static_assert(sizeof(AllocationHeader) % alignof(std::max_align_t) == 0, "header keeps alignment");
+
+static size_t heapInUse = 0;
+static uint64_t allocations = 0;
+static int untrackedDepth = 0;
+
+static void *countedAlloc(size_t size)
+{
+  AllocationHeader *header = (AllocationHeader *)malloc(sizeof(AllocationHeader) + size);
+  if (!header)
+  {
+    throw std::bad_alloc();
+  }
+  header->size = size;
+  header->tracked = untrackedDepth == 0;
+  if (header->tracked)
+  {
+    heapInUse += size;
+    allocations++;
+  }
+  return header + 1;
+}
+
+static void countedFree(void *p)
+{
+  if (p)
+  {
+    AllocationHeader *header = (AllocationHeader *)p - 1;
+    if (header->tracked)
+    {
+      heapInUse -= header->size;
+    }
+    free(header);
+  }
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, size_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p); }
+
+NativeUntracked::NativeUntracked()
+{
+  untrackedDepth++;
+}
+
+NativeUntracked::~NativeUntracked()
+{
+  untrackedDepth--;
+}
+
+NativeTracked::NativeTracked() : saved(untrackedDepth)
+{
+  untrackedDepth = 0;
+}
+
+NativeTracked::~NativeTracked()
+{
+  untrackedDepth = saved;
+}
+
+size_t nativeHeapInUse()
+{
+  return heapInUse;
+}
+
+uint64_t nativeAllocationCount()
+{
+  return allocations;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+  return heapInUse < NATIVE_HEAP_SIZE ? NATIVE_HEAP_SIZE - heapInUse : 0;
+}
+
+uint32_t EspClass::getMaxFreeBlockSize()
+{
+  return getFreeHeap();
+}
+
+uint8_t EspClass::getHeapFragmentation()
+{
+  return 0;
+}
+
+uint32_t EspClass::getCycleCount()
+{
+  // Host wall time plus the virtual clock, expressed as 80 MHz cycles: code
+  // is charged for the host time it really takes and for any simulated
+  // blocking (delay(), network timeouts) it incurs
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+  return (uint32_t)(ns * 2 / 25 + nativeMicros() * 80);
+}
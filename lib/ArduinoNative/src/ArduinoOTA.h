@@ -0,0 +1,13 @@
+#pragma once
+
+#include "Arduino.h"
+
+class ArduinoOTAClass
+{
+public:
+  void setHostname(const char *hostname) { (void)hostname; }
+  void begin() {}
+  void handle() {}
+};
+
+extern ArduinoOTAClass ArduinoOTA;
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "Arduino.h"
+#include "Client.h"
+
+enum WiFiMode_t
+{
+  WIFI_OFF,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA
+};
+
+enum WiFiSleepType_t
+{
+  WIFI_NONE_SLEEP,
+  WIFI_LIGHT_SLEEP,
+  WIFI_MODEM_SLEEP
+};
+
+enum wl_status_t
+{
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6
+};
+
+class IPAddress : public Printable
+{
+public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : octets{a, b, c, d} {}
+  size_t printTo(Print &p) const override
+  {
+    return p.printf("%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+  }
+  uint8_t operator[](int index) const { return octets[index]; }
+  bool isSet() const { return octets[0] || octets[1] || octets[2] || octets[3]; }
+  bool fromString(const char *address)
+  {
+    unsigned a, b, c, d;
+    char extra;
+    if (sscanf(address, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 || (a | b | c | d) > 255)
+    {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+
+private:
+  uint8_t octets[4];
+};
+
+class ESP8266WiFiClass
+{
+public:
+  bool mode(WiFiMode_t m)
+  {
+    (void)m;
+    return true;
+  }
+  wl_status_t begin(const char *ssid, const char *passphrase = nullptr);
+  int8_t waitForConnectResult(unsigned long timeoutLength = 60000);
+  wl_status_t status();
+  bool isConnected() { return status() == WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  // Every name resolves straight away, to the in-process broker
+  int hostByName(const char *host, IPAddress &result, uint32_t timeoutMs = 10000)
+  {
+    (void)timeoutMs;
+    if (!result.fromString(host))
+    {
+      result = IPAddress(127, 0, 0, 1);
+    }
+    return 1;
+  }
+
+  // Recorded only: the simulated network never sleeps
+  bool setSleepMode(WiFiSleepType_t type, uint8_t listenInterval = 0)
+  {
+    sleepMode = type;
+    sleepListenInterval = listenInterval;
+    return true;
+  }
+  WiFiSleepType_t getSleepMode() { return sleepMode; }
+  uint8_t getListenInterval() { return sleepListenInterval; }
+
+private:
+  WiFiSleepType_t sleepMode = WIFI_NONE_SLEEP;
+  uint8_t sleepListenInterval = 0;
+};
+
+extern ESP8266WiFiClass WiFi;
+
+// Network I/O on the host is simulated at the protocol level for MQTT (see
+// PubSubClient), so a client that was never accepted carries no data; its
+// connect() stands for the TCP connect to the broker, which fails after the
+// client's timeout while the broker is away. Clients
+// accepted by a WiFiServer are real: either an in-process connection opened
+// by the runner (WiFiServer::nativeConnect) or, once the server's port is
+// mapped with nativeMapPort(), a TCP socket on the host.
+struct NativeConnection
+{
+  std::string rx; // Sent by the peer, not yet read by the firmware
+  std::string tx; // Written by the firmware (in-process connections)
+  int fd = -1;    // Host socket, or -1 for an in-process connection
+  bool open = true;       // Not yet stopped by the firmware
+  bool peerClosed = false; // The peer has finished sending
+  bool stalled = false;    // In-process peer that has stopped reading: tx fills the send window
+};
+
+class WiFiClient : public Client
+{
+public:
+  WiFiClient() {}
+  explicit WiFiClient(std::shared_ptr<NativeConnection> connection) : connection(connection) {}
+
+  int connect(const char *host, uint16_t port) override;
+  int connect(IPAddress ip, uint16_t port);
+  uint8_t connected() override;
+  void stop() override;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t size);
+  int availableForWrite();
+  void setTimeout(unsigned long timeout) { timeoutMs = timeout; }
+  void setNoDelay(bool noDelay);
+  explicit operator bool() const { return connection != nullptr; }
+
+private:
+  void pump();
+  std::shared_ptr<NativeConnection> connection;
+  unsigned long timeoutMs = 5000;
+};
+
+class WiFiServer
+{
+public:
+  WiFiServer(uint16_t port) : port(port) {}
+  void begin();
+  void setNoDelay(bool noDelay) { (void)noDelay; }
+  WiFiClient accept();
+  WiFiClient available() { return accept(); }
+
+  // Simulation: open a connection to the server on port, served from loop()
+  static std::shared_ptr<NativeConnection> nativeConnect(uint16_t port);
+
+private:
+  uint16_t port;
+  int listenFd = -1;
+};
+
+// Serve the device's port on a real host port, for tools on this machine
+void nativeMapPort(uint16_t devicePort, uint16_t hostPort);
+
+// How long WiFi.begin() takes to join the network, in virtual time
+// (0, the default, joins at once)
+void nativeSetWiFiJoinMs(uint32_t ms);
@@ -0,0 +1,168 @@
+#include "LittleFS.h"
+#include "NativeSim.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+FS LittleFS;
+
+static std::map<std::string, std::vector<uint8_t>> files;
+
+File::File(const char *path, bool writable, bool append) : writable(writable)
+{
+  NativeUntracked untracked;
+  this->path = path;
+  pos = append ? files[path].size() : 0;
+}
+
+size_t File::write(const uint8_t *buffer, size_t size)
+{
+  NativeUntracked untracked;
+  if (!writable || !*this)
+  {
+    return 0;
+  }
+  std::vector<uint8_t> &data = files[path.c_str()];
+  if (data.size() < pos + size)
+  {
+    data.resize(pos + size);
+  }
+  memcpy(data.data() + pos, buffer, size);
+  pos += size;
+  return size;
+}
+
+int File::available()
+{
+  return *this ? (int)(size() - pos) : 0;
+}
+
+int File::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t *buffer, size_t size)
+{
+  NativeUntracked untracked;
+  if (!*this)
+  {
+    return 0;
+  }
+  const std::vector<uint8_t> &data = files[path.c_str()];
+  size_t n = pos < data.size() ? std::min(size, data.size() - pos) : 0;
+  memcpy(buffer, data.data() + pos, n);
+  pos += n;
+  return n;
+}
+
+bool File::seek(uint32_t position)
+{
+  if (!*this || position > size())
+  {
+    return false;
+  }
+  pos = position;
+  return true;
+}
+
+size_t File::size() const
+{
+  auto it = files.find(path.c_str());
+  return it == files.end() ? 0 : it->second.size();
+}
+
+const char *File::name() const
+{
+  const char *slash = strrchr(path.c_str(), '/');
+  return slash ? slash + 1 : path.c_str();
+}
+
+bool Dir::next()
+{
+  NativeUntracked untracked;
+  std::string dir = prefix.c_str();
+  if (dir.empty() || dir.back() != '/')
+  {
+    dir += '/';
+  }
+  auto it = started ? files.upper_bound(current.c_str()) : files.lower_bound(dir);
+  started = true;
+  // Only direct children of the directory
+  for (; it != files.end() && it->first.compare(0, dir.size(), dir) == 0; ++it)
+  {
+    if (it->first.find('/', dir.size()) == std::string::npos)
+    {
+      current = it->first.c_str();
+      return true;
+    }
+  }
+  current = "";
+  return false;
+}
+
+String Dir::fileName() const
+{
+  NativeUntracked untracked;
+  const char *slash = strrchr(current.c_str(), '/');
+  return slash ? String(slash + 1) : current;
+}
+
+size_t Dir::fileSize() const
+{
+  auto it = files.find(current.c_str());
+  return it == files.end() ? 0 : it->second.size();
+}
+
+File Dir::openFile(const char *mode) const
+{
+  return LittleFS.open(current.c_str(), mode);
+}
+
+bool FS::format()
+{
+  NativeUntracked untracked;
+  files.clear();
+  return true;
+}
+
+bool FS::exists(const char *path)
+{
+  return files.count(path) > 0;
+}
+
+File FS::open(const char *path, const char *mode)
+{
+  NativeUntracked untracked;
+  if (mode[0] == 'r' && !exists(path))
+  {
+    return File();
+  }
+  if (mode[0] == 'w')
+  {
+    files[path].clear();
+  }
+  bool writable = mode[0] == 'w' || mode[0] == 'a' || mode[1] == '+';
+  return File(path, writable, mode[0] == 'a');
+}
+
+bool FS::remove(const char *path)
+{
+  NativeUntracked untracked;
+  return files.erase(path) > 0;
+}
+
+bool FS::rename(const char *from, const char *to)
+{
+  NativeUntracked untracked;
+  auto it = files.find(from);
+  if (it == files.end())
+  {
+    return false;
+  }
+  files[to] = it->second;
+  files.erase(from);
+  return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+// In-memory stand-in for the ESP8266 LittleFS. Every run starts with an
+// empty filesystem.
+
+#include "Arduino.h"
+
+class File : public Stream
+{
+public:
+  File() {}
+  File(const char *path, bool writable, bool append);
+
+  explicit operator bool() const { return path.length() > 0; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  size_t read(uint8_t *buffer, size_t size);
+  bool seek(uint32_t pos);
+  size_t position() const { return pos; }
+  size_t size() const;
+  const char *name() const;
+  void close() { path = ""; }
+
+private:
+  String path;
+  size_t pos = 0;
+  bool writable = false;
+};
+
+class Dir
+{
+public:
+  Dir(const char *path = "") : prefix(path) {}
+  bool next();
+  String fileName() const;
+  size_t fileSize() const;
+  File openFile(const char *mode) const;
+
+private:
+  String prefix;
+  String current;
+  bool started = false;
+};
+
+class FS
+{
+public:
+  bool begin() { return true; }
+  void end() {}
+  bool format();
+  bool exists(const char *path);
+  File open(const char *path, const char *mode);
+  bool remove(const char *path);
+  bool rename(const char *from, const char *to);
+  bool mkdir(const char *path)
+  {
+    (void)path;
+    return true;
+  }
+  Dir openDir(const char *path) { return Dir(path); }
+};
+
+extern FS LittleFS;
@@ -0,0 +1,92 @@
+#pragma once
+
+// Control surface for the host simulation: the virtual clock, the emulated
+// pins and the hooks the runner uses to feed input into the stand-in
+// network libraries.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Virtual clock. Starts at zero and only advances through these calls or
+// delay(); timer1 interrupts fire as the clock passes their deadlines.
+void nativeAdvanceMicros(uint64_t us);
+uint64_t nativeMicros();
+// The same clock at the resolution timer1 runs at, for timing its pulses
+uint64_t nativeNanos();
+
+// Wall clock as the SNTP client keeps it: it runs off the local clock,
+// which gains driftPpm on true time, and is stepped to true time, give or
+// take up to jitterUs of network delay, at every SNTP update. It is unset
+// until WiFi joins. True time at boot is epochUs; by default 2025-12-24
+// 18:00 UTC, no drift, no jitter.
+void nativeSetWallClock(uint64_t epochUs, int32_t driftPpm, uint32_t jitterUs);
+bool nativeWallClock(uint64_t &utcUs);
+
+// Emulated GPIO state
+struct NativePin
+{
+  uint8_t mode;
+  int value;          // digital level or last analogWrite duty
+  uint32_t writes;    // number of digitalWrite/analogWrite calls
+};
+
+const NativePin &nativePin(uint8_t pin);
+void nativeSetInput(uint8_t pin, int value);
+// Set an input when the virtual clock reaches atMicros, e.g. a button press
+// while the firmware sleeps
+void nativeScheduleInput(uint8_t pin, int value, uint64_t atMicros);
+uint32_t nativeAnalogWriteRange();
+
+// Called after every digitalWrite/analogWrite, e.g. to record an output trace
+typedef void (*NativePinObserver)(uint8_t pin, int value, uint64_t atMicros);
+void nativeSetPinObserver(NativePinObserver observer);
+
+// C++ heap accounting behind ESP.getFreeHeap(): bytes the firmware has
+// allocated and the number of allocations it has made since start
+size_t nativeHeapInUse();
+uint64_t nativeAllocationCount();
+
+// Allocations made while one of these is alive belong to the simulation
+// and are not counted
+struct NativeUntracked
+{
+  NativeUntracked();
+  ~NativeUntracked();
+};
+
+// Counts again inside an untracked scope, e.g. around a firmware callback
+struct NativeTracked
+{
+  NativeTracked();
+  ~NativeTracked();
+  int saved;
+};
+
+// User RTC memory (ESP.rtcUserMemoryRead/Write), which survives a reset
+// but not a power cycle: the runner can carry it from one run to the next
+#define NATIVE_RTC_USER_BYTES 512
+uint8_t *nativeRtcMemory();
+
+// Flash (ESP.flashEraseSector/flashWrite/flashRead), as NOR flash behaves:
+// erased bytes read 0xff and a write can only clear bits. Sectors never
+// written read erased.
+void nativeFlashClear();
+bool nativeFlashLoad(const char *path);
+bool nativeFlashSave(const char *path);
+
+// Power cut: after another `bytes` bytes have been programmed (an erase
+// counts as one), the flash loses power. The write in progress stops
+// part-way, an erase in progress leaves the sector half erased, and every
+// operation fails until power is restored with a negative count.
+void nativeFlashPowerCut(int64_t bytes);
+// Bytes programmed plus erases since start, for choosing where to cut
+uint64_t nativeFlashProgrammed();
+
+// Whether the simulated MQTT broker is up (PubSubClient::nativeSetBrokerAvailable)
+bool nativeBrokerAvailable();
+
+// Set by ESP.reset(); the runner decides what a reset means for the session
+bool nativeResetRequested();
+
+// Echo Serial/Telnet output to stdout (off by default to keep runs quiet)
+void nativeSetConsoleEcho(bool echo);
@@ -0,0 +1,385 @@
+#include "ArduinoOTA.h"
+#include "ESP8266WiFi.h"
+#include "NativeSim.h"
+#include "WiFiUdp.h"
+
+#include <arpa/inet.h>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+ESP8266WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+
+// The device's send window: what lwIP on the ESP8266 buffers per connection
+static const int sendWindow = 2 * 1460;
+
+static std::map<uint16_t, uint16_t> portMap;
+static std::map<uint16_t, std::deque<std::shared_ptr<NativeConnection>>> pending;
+
+void nativeMapPort(uint16_t devicePort, uint16_t hostPort)
+{
+  NativeUntracked untracked;
+  portMap[devicePort] = hostPort;
+}
+
+static uint32_t wifiJoinMs = 0;
+static bool wifiStarted = false;
+static uint64_t wifiJoinedAtUs = 0;
+
+void nativeSetWiFiJoinMs(uint32_t ms)
+{
+  wifiJoinMs = ms;
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char *ssid, const char *passphrase)
+{
+  (void)ssid;
+  (void)passphrase;
+  wifiStarted = true;
+  wifiJoinedAtUs = nativeMicros() + (uint64_t)wifiJoinMs * 1000;
+  return status();
+}
+
+int8_t ESP8266WiFiClass::waitForConnectResult(unsigned long timeoutLength)
+{
+  while (status() != WL_CONNECTED && timeoutLength--)
+  {
+    delay(1);
+  }
+  return status();
+}
+
+wl_status_t ESP8266WiFiClass::status()
+{
+  return wifiStarted && nativeMicros() >= wifiJoinedAtUs ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// Move whatever the host socket has received into rx
+void WiFiClient::pump()
+{
+  if (!connection || connection->fd < 0 || connection->peerClosed)
+  {
+    return;
+  }
+  NativeUntracked untracked;
+  char buffer[1024];
+  for (;;)
+  {
+    ssize_t n = recv(connection->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n > 0)
+    {
+      connection->rx.append(buffer, n);
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+      connection->peerClosed = true;
+    }
+    return;
+  }
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  IPAddress ip;
+  return WiFi.hostByName(host, ip, timeoutMs) && connect(ip, port);
+}
+
+// The broker connection: a broker that is away never answers the SYN, so
+// the connect blocks for the whole timeout, as the core's does
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  (void)ip;
+  (void)port;
+  if (!nativeBrokerAvailable())
+  {
+    nativeAdvanceMicros((uint64_t)timeoutMs * 1000);
+    return 0;
+  }
+  return 1;
+}
+
+uint8_t WiFiClient::connected()
+{
+  if (!connection)
+  {
+    return 1;
+  }
+  pump();
+  // Like the core: still connected while unread data remains
+  return connection->open && (!connection->peerClosed || !connection->rx.empty());
+}
+
+void WiFiClient::stop()
+{
+  if (!connection || !connection->open)
+  {
+    return;
+  }
+  connection->open = false;
+  if (connection->fd >= 0)
+  {
+    close(connection->fd);
+    connection->fd = -1;
+  }
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+  if (!connection)
+  {
+    return size;
+  }
+  if (!connection->open)
+  {
+    return 0;
+  }
+  NativeUntracked untracked;
+  if (connection->fd < 0)
+  {
+    size = min(size, (size_t)availableForWrite());
+    connection->tx.append(reinterpret_cast<const char *>(buffer), size);
+    return size;
+  }
+
+  size_t sent = 0;
+  while (sent < size)
+  {
+    ssize_t n = send(connection->fd, buffer + sent, size - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0)
+    {
+      sent += n;
+    }
+    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      // Host socket buffers are far larger than the device's window; a
+      // reader this slow has stopped reading
+      pollfd waiting = {connection->fd, POLLOUT, 0};
+      if (poll(&waiting, 1, 100) <= 0)
+      {
+        break;
+      }
+    }
+    else if (n < 0 && errno != EINTR)
+    {
+      connection->peerClosed = true;
+      break;
+    }
+  }
+  return sent;
+}
+
+int WiFiClient::available()
+{
+  if (!connection)
+  {
+    return 0;
+  }
+  pump();
+  return connection->rx.size();
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t size)
+{
+  if (!connection)
+  {
+    return 0;
+  }
+  pump();
+  NativeUntracked untracked;
+  size_t n = min(size, connection->rx.size());
+  memcpy(buffer, connection->rx.data(), n);
+  connection->rx.erase(0, n);
+  return n;
+}
+
+int WiFiClient::availableForWrite()
+{
+  if (!connection || !connection->open)
+  {
+    return 0;
+  }
+  if (connection->stalled)
+  {
+    return connection->tx.size() < (size_t)sendWindow ? sendWindow - connection->tx.size() : 0;
+  }
+  return sendWindow;
+}
+
+void WiFiClient::setNoDelay(bool noDelay)
+{
+  if (connection && connection->fd >= 0)
+  {
+    int flag = noDelay;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+}
+
+void WiFiServer::begin()
+{
+  auto mapped = portMap.find(port);
+  if (mapped == portMap.end() || listenFd >= 0)
+  {
+    return;
+  }
+
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(mapped->second);
+  if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFd, 16) < 0)
+  {
+    fprintf(stderr, "cannot listen on port %u: %s\n", mapped->second, strerror(errno));
+    close(listenFd);
+    listenFd = -1;
+    return;
+  }
+  fcntl(listenFd, F_SETFL, O_NONBLOCK);
+}
+
+WiFiClient WiFiServer::accept()
+{
+  NativeUntracked untracked;
+  std::deque<std::shared_ptr<NativeConnection>> &queue = pending[port];
+  if (!queue.empty())
+  {
+    std::shared_ptr<NativeConnection> connection = queue.front();
+    queue.pop_front();
+    return WiFiClient(connection);
+  }
+
+  if (listenFd >= 0)
+  {
+    int fd = ::accept(listenFd, nullptr, nullptr);
+    if (fd >= 0)
+    {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      std::shared_ptr<NativeConnection> connection = std::make_shared<NativeConnection>();
+      connection->fd = fd;
+      return WiFiClient(connection);
+    }
+  }
+  return WiFiClient();
+}
+
+std::shared_ptr<NativeConnection> WiFiServer::nativeConnect(uint16_t port)
+{
+  NativeUntracked untracked;
+  std::shared_ptr<NativeConnection> connection = std::make_shared<NativeConnection>();
+  pending[port].push_back(connection);
+  return connection;
+}
+
+uint8_t WiFiUDP::begin(uint16_t port)
+{
+  stop();
+  auto mapped = portMap.find(port);
+  if (mapped == portMap.end())
+  {
+    return 1;
+  }
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(mapped->second);
+  if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0)
+  {
+    fprintf(stderr, "cannot bind UDP port %u: %s\n", mapped->second, strerror(errno));
+    close(fd);
+    fd = -1;
+    return 0;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return 1;
+}
+
+void WiFiUDP::stop()
+{
+  if (fd >= 0)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+int WiFiUDP::parsePacket()
+{
+  remaining = 0;
+  if (fd < 0)
+  {
+    return 0;
+  }
+  sockaddr_in from = {};
+  socklen_t fromLength = sizeof(from);
+  ssize_t n = recvfrom(fd, packet, sizeof(packet), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&from), &fromLength);
+  if (n <= 0)
+  {
+    return 0;
+  }
+  uint32_t ip = ntohl(from.sin_addr.s_addr);
+  remoteAddress = IPAddress(ip >> 24, ip >> 16, ip >> 8, ip);
+  remotePortNumber = ntohs(from.sin_port);
+  length = remaining = n;
+  return n;
+}
+
+int WiFiUDP::read(uint8_t *buffer, size_t size)
+{
+  size_t n = min(size, (size_t)remaining);
+  memcpy(buffer, packet + length - remaining, n);
+  remaining -= n;
+  return n;
+}
+
+int WiFiUDP::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port)
+{
+  destination = ip;
+  destinationPort = port;
+  outgoingLength = 0;
+  return 1;
+}
+
+size_t WiFiUDP::write(const uint8_t *buffer, size_t size)
+{
+  size = min(size, sizeof(outgoing) - outgoingLength);
+  memcpy(outgoing + outgoingLength, buffer, size);
+  outgoingLength += size;
+  return size;
+}
+
+int WiFiUDP::endPacket()
+{
+  if (fd < 0)
+  {
+    return 1;
+  }
+  sockaddr_in to = {};
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = htonl((uint32_t)destination[0] << 24 | destination[1] << 16 | destination[2] << 8 | destination[3]);
+  to.sin_port = htons(destinationPort);
+  return sendto(fd, outgoing, outgoingLength, MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&to), sizeof(to)) ==
+         (ssize_t)outgoingLength;
+}
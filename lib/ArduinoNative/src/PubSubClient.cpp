@@ -0,0 +1,215 @@
+#include "PubSubClient.h"
+#include "NativeSim.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+static bool brokerAvailable = true;
+static std::set<std::string> subscriptions;
+static std::map<std::string, std::string> retained;
+static std::deque<std::pair<std::string, std::string>> pending;
+static uint32_t publishCount = 0;
+static std::string streamTopic;
+static std::string streamPayload;
+static size_t streamLength = 0;
+static bool streamRetained = false;
+
+PubSubClient::PubSubClient(Client &client)
+{
+  (void)client;
+}
+
+PubSubClient &PubSubClient::setServer(const char *domain, uint16_t port)
+{
+  (void)domain;
+  (void)port;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setCallback(std::function<void(char *, uint8_t *, unsigned int)> cb)
+{
+  callback = cb;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setSocketTimeout(uint16_t timeout)
+{
+  socketTimeout = timeout;
+  return *this;
+}
+
+PubSubClient &PubSubClient::setKeepAlive(uint16_t keepAlive)
+{
+  (void)keepAlive;
+  return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size)
+{
+  bufferSize = size;
+  return true;
+}
+
+bool PubSubClient::connect(const char *id, const char *user, const char *pass)
+{
+  (void)id;
+  (void)user;
+  (void)pass;
+  if (!brokerAvailable)
+  {
+    // A broker that stops answering after the TCP connect leaves a real
+    // connect waiting for CONNACK until the socket times out
+    nativeAdvanceMicros((uint64_t)socketTimeout * 1000000);
+    lastState = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  isConnected = true;
+  lastState = MQTT_CONNECTED;
+  return true;
+}
+
+void PubSubClient::disconnect()
+{
+  isConnected = false;
+  lastState = MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::connected()
+{
+  if (isConnected && !brokerAvailable)
+  {
+    isConnected = false;
+    lastState = MQTT_DISCONNECTED;
+    subscriptions.clear();
+  }
+  return isConnected;
+}
+
+int PubSubClient::state()
+{
+  return lastState;
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload, bool retain)
+{
+  return publish(topic, (const uint8_t *)payload, payload ? strlen(payload) : 0, retain);
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retain)
+{
+  NativeUntracked untracked;
+  if (!connected())
+  {
+    return false;
+  }
+  publishCount++;
+  if (retain)
+  {
+    retained[topic] = std::string((const char *)payload, length);
+  }
+  return true;
+}
+
+bool PubSubClient::beginPublish(const char *topic, unsigned int length, bool retain)
+{
+  NativeUntracked untracked;
+  if (!connected())
+  {
+    return false;
+  }
+  streamTopic = topic;
+  streamLength = length;
+  streamPayload.clear();
+  streamPayload.reserve(length);
+  streamRetained = retain;
+  return true;
+}
+
+int PubSubClient::endPublish()
+{
+  // The real client sends the length up front, so a payload of any other
+  // length corrupts the stream
+  if (!connected() || streamPayload.size() != streamLength)
+  {
+    return 0;
+  }
+  return publish(streamTopic.c_str(), (const uint8_t *)streamPayload.data(), streamPayload.size(), streamRetained) ? 1 : 0;
+}
+
+size_t PubSubClient::write(uint8_t c)
+{
+  NativeUntracked untracked;
+  streamPayload += (char)c;
+  return 1;
+}
+
+size_t PubSubClient::write(const uint8_t *buffer, size_t size)
+{
+  NativeUntracked untracked;
+  streamPayload.append((const char *)buffer, size);
+  return size;
+}
+
+bool PubSubClient::subscribe(const char *topic)
+{
+  NativeUntracked untracked;
+  if (!connected())
+  {
+    return false;
+  }
+  subscriptions.insert(topic);
+  return true;
+}
+
+bool PubSubClient::loop()
+{
+  if (!connected())
+  {
+    return false;
+  }
+  while (!pending.empty())
+  {
+    std::pair<std::string, std::string> message;
+    {
+      NativeUntracked untracked;
+      message = pending.front();
+      pending.pop_front();
+    }
+    if (callback && subscriptions.count(message.first))
+    {
+      callback(&message.first[0], (uint8_t *)&message.second[0], message.second.size());
+    }
+    NativeUntracked untracked; // The message itself is freed here
+  }
+  return true;
+}
+
+bool nativeBrokerAvailable()
+{
+  return brokerAvailable;
+}
+
+void PubSubClient::nativeSetBrokerAvailable(bool available)
+{
+  brokerAvailable = available;
+}
+
+void PubSubClient::nativeInject(const char *topic, const char *payload)
+{
+  NativeUntracked untracked;
+  pending.emplace_back(topic, payload);
+}
+
+uint32_t PubSubClient::nativePublishCount()
+{
+  return publishCount;
+}
+
+const char *PubSubClient::nativeRetained(const char *topic)
+{
+  auto it = retained.find(topic);
+  return it == retained.end() ? nullptr : it->second.c_str();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// PubSubClient stand-in backed by an in-process broker. Commands are injected
+// by the simulation and delivered from loop(); publishes are counted and the
+// last retained payload per topic is kept for inspection.
+
+#include <functional>
+#include "Arduino.h"
+#include "Client.h"
+
+#define MQTT_CONNECTED 0
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+class PubSubClient : public Print
+{
+public:
+  PubSubClient(Client &client);
+
+  PubSubClient &setServer(const char *domain, uint16_t port);
+  PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+  PubSubClient &setSocketTimeout(uint16_t timeout);
+  PubSubClient &setKeepAlive(uint16_t keepAlive);
+  bool setBufferSize(uint16_t size);
+  uint16_t getBufferSize() { return bufferSize; }
+
+  bool connect(const char *id, const char *user, const char *pass);
+  void disconnect();
+  bool connected();
+  int state();
+
+  bool publish(const char *topic, const char *payload, bool retained = false);
+  bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained = false);
+  bool beginPublish(const char *topic, unsigned int length, bool retained);
+  int endPublish();
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+
+  bool subscribe(const char *topic);
+  bool loop();
+
+  // Simulation controls
+  static void nativeSetBrokerAvailable(bool available);
+  static void nativeInject(const char *topic, const char *payload);
+  static uint32_t nativePublishCount();
+  static const char *nativeRetained(const char *topic);
+
+private:
+  MQTT_CALLBACK_SIGNATURE;
+  uint16_t socketTimeout = 15;
+  uint16_t bufferSize = 256;
+  bool isConnected = false;
+  int lastState = MQTT_DISCONNECTED;
+};
@@ -0,0 +1,5 @@
+#pragma once
+
+// POSIX timezone strings, as provided by the ESP8266 core
+#define TZ_Europe_London PSTR("GMT0BST,M3.5.0/1,M10.5.0")
+#define TZ_Etc_UTC PSTR("UTC0")
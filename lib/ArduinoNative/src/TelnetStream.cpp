@@ -0,0 +1,35 @@
+#include "TelnetStream.h"
+#include "NativeSim.h"
+
+#include <string>
+
+TelnetStreamClass TelnetStream;
+
+static std::string input;
+
+size_t TelnetStreamClass::write(uint8_t c)
+{
+  return Serial.write(c);
+}
+
+int TelnetStreamClass::available()
+{
+  return (int)input.size();
+}
+
+int TelnetStreamClass::read()
+{
+  if (input.empty())
+  {
+    return -1;
+  }
+  int c = (uint8_t)input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+void TelnetStreamClass::nativeInput(const char *text)
+{
+  NativeUntracked untracked;
+  input += text;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Telnet console stand-in: reads come from an input queue the simulation
+// fills, writes are echoed to stdout when console echo is enabled.
+class TelnetStreamClass : public Stream
+{
+public:
+  void begin(int port = 23) { (void)port; }
+  void stop() {}
+  size_t write(uint8_t c) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+
+  // Queue characters as if typed by a connected telnet client
+  void nativeInput(const char *text);
+};
+
+extern TelnetStreamClass TelnetStream;
@@ -0,0 +1,32 @@
+#include "TimeLib.h"
+#include "Arduino.h"
+
+static time_t baseTime = 0;
+static uint32_t baseMillis = 0;
+
+void setTime(time_t t)
+{
+  baseTime = t;
+  baseMillis = millis();
+}
+
+time_t now()
+{
+  return baseTime + (time_t)((uint32_t)(millis() - baseMillis) / 1000);
+}
+
+static struct tm breakTime()
+{
+  time_t t = now();
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  return tm;
+}
+
+int year() { return breakTime().tm_year + 1900; }
+int month() { return breakTime().tm_mon + 1; }
+int day() { return breakTime().tm_mday; }
+int hour() { return breakTime().tm_hour; }
+int minute() { return breakTime().tm_min; }
+int second() { return breakTime().tm_sec; }
+int weekday() { return breakTime().tm_wday + 1; }
@@ -0,0 +1,17 @@
+#pragma once
+
+// Subset of the PaulStoffregen Time library used by the controller
+
+#include <time.h>
+
+#define SECS_YR_2000 ((time_t)(946684800UL))
+
+void setTime(time_t t);
+time_t now();
+int year();
+int month();
+int day();
+int hour();
+int minute();
+int second();
+int weekday();
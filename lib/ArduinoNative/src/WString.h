@@ -0,0 +1,121 @@
+#pragma once
+
+// Minimal Arduino String for host builds, backed by std::string
+
+#include <stdlib.h>
+#include <strings.h>
+#include <string>
+
+class String
+{
+public:
+  String() {}
+  String(const char *str) { if (str) s = str; }
+  String(const String &other) : s(other.s) {}
+  String(char c) : s(1, c) {}
+  String(int value) : s(std::to_string(value)) {}
+  String(unsigned int value) : s(std::to_string(value)) {}
+  String(long value) : s(std::to_string(value)) {}
+  String(unsigned long value) : s(std::to_string(value)) {}
+  String(float value, unsigned char decimals = 2) { fromDouble(value, decimals); }
+  String(double value, unsigned char decimals = 2) { fromDouble(value, decimals); }
+
+  String &operator=(const String &other)
+  {
+    s = other.s;
+    return *this;
+  }
+  String &operator=(const char *str)
+  {
+    if (str)
+      s = str;
+    else
+      s.clear();
+    return *this;
+  }
+
+  bool concat(const String &str)
+  {
+    s += str.s;
+    return true;
+  }
+  bool concat(const char *str)
+  {
+    if (str)
+      s += str;
+    return true;
+  }
+  bool concat(const char *str, unsigned int length)
+  {
+    s.append(str, length);
+    return true;
+  }
+  bool concat(char c)
+  {
+    s += c;
+    return true;
+  }
+
+  String &operator+=(const String &rhs) { concat(rhs); return *this; }
+  String &operator+=(const char *rhs) { concat(rhs); return *this; }
+  String &operator+=(char rhs) { concat(rhs); return *this; }
+
+  friend String operator+(const String &lhs, const String &rhs)
+  {
+    String result(lhs);
+    result.concat(rhs);
+    return result;
+  }
+  friend String operator+(const String &lhs, const char *rhs)
+  {
+    String result(lhs);
+    result.concat(rhs);
+    return result;
+  }
+  friend String operator+(const char *lhs, const String &rhs)
+  {
+    String result(lhs);
+    result.concat(rhs);
+    return result;
+  }
+
+  bool operator==(const String &rhs) const { return s == rhs.s; }
+  bool operator==(const char *rhs) const { return rhs && s == rhs; }
+  bool equalsIgnoreCase(const char *rhs) const { return rhs && strcasecmp(s.c_str(), rhs) == 0; }
+  bool operator!=(const String &rhs) const { return s != rhs.s; }
+  bool operator!=(const char *rhs) const { return !(*this == rhs); }
+  char operator[](unsigned int index) const { return index < s.size() ? s[index] : 0; }
+
+  bool reserve(unsigned int size)
+  {
+    s.reserve(size);
+    return true;
+  }
+  unsigned int length() const { return s.size(); }
+  const char *c_str() const { return s.c_str(); }
+  bool isEmpty() const { return s.empty(); }
+
+  long toInt() const { return strtol(s.c_str(), nullptr, 10); }
+  float toFloat() const { return strtof(s.c_str(), nullptr); }
+  void toLowerCase()
+  {
+    for (char &c : s)
+    {
+      if (c >= 'A' && c <= 'Z')
+        c = c - 'A' + 'a';
+    }
+  }
+  void toUpperCase()
+  {
+    for (char &c : s)
+    {
+      if (c >= 'a' && c <= 'z')
+        c = c - 'a' + 'A';
+    }
+  }
+
+private:
+  void fromDouble(double value, unsigned char decimals);
+
+  std::string s;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "ESP8266WiFi.h"
+
+// UDP on the host: once the device port is mapped with nativeMapPort(), a
+// non-blocking socket bound to the mapped localhost port. Unmapped, nothing
+// arrives and sends go nowhere.
+class WiFiUDP : public Print
+{
+public:
+  ~WiFiUDP() { stop(); }
+
+  uint8_t begin(uint16_t port);
+  void stop();
+
+  // Next datagram: its size, or 0 if none is waiting
+  int parsePacket();
+  int available() { return remaining; }
+  int read(uint8_t *buffer, size_t size);
+  int read();
+  IPAddress remoteIP() const { return remoteAddress; }
+  uint16_t remotePort() const { return remotePortNumber; }
+
+  int beginPacket(IPAddress ip, uint16_t port);
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int endPacket();
+
+private:
+  int fd = -1;
+  uint8_t packet[1472];
+  int length = 0;
+  int remaining = 0;
+  IPAddress remoteAddress;
+  uint16_t remotePortNumber = 0;
+
+  uint8_t outgoing[1472];
+  size_t outgoingLength = 0;
+  IPAddress destination;
+  uint16_t destinationPort = 0;
+};
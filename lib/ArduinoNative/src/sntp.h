@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// The ESP8266 SNTP client has nothing to do on the host; time() is already
+// valid. The simulated wall clock (NativeSim.h) takes its update interval
+// from here, as the core's client does.
+extern "C" uint32_t sntp_update_delay_MS_rfc_not_less_than_15000();
@@ -0,0 +1,189 @@
+#include "audio.h"
+#include "fixed.h"
+#include "hal.h"
+
+// Goertzel coefficients, 2*cos(2*pi*k/AUDIO_BLOCK) in Q14. That is cos in
+// Q15, which the sine table already holds a quarter turn in.
+static const int32_t binCoeff[] = {
+    sineTable.v[64 + 256 * 1 / AUDIO_BLOCK],
+    sineTable.v[64 + 256 * 2 / AUDIO_BLOCK]};
+#define AUDIO_BINS (sizeof(binCoeff) / sizeof(binCoeff[0]))
+
+// Two windows, offset by half a block, so one of them completes every hop
+#define AUDIO_HOP (AUDIO_BLOCK / 2)
+
+static const uint32_t samplePeriodUs = 1000000UL / AUDIO_SAMPLE_HZ;
+static const uint8_t warmupHops = 32;                                                       // Let the average settle first
+static const uint8_t refractoryHops = (AUDIO_SAMPLE_HZ / 10 + AUDIO_HOP - 1) / AUDIO_HOP; // ~100 ms between onsets
+static const uint32_t noiseFloor = 1UL << 14; // Roughly 16 counts of signal; ADC noise stays well below
+
+static uint16_t ring[AUDIO_RING_SIZE];
+static volatile uint8_t ringHead = 0; // Written by the sampler
+static volatile uint8_t ringTail = 0; // Written by the detector
+static uint32_t nextSampleUs = 0;
+
+// Detector state
+static int32_t dcQ8 = -1; // DC level of the input, Q8; -1 until the first sample
+static int32_t s1[2][AUDIO_BINS], s2[2][AUDIO_BINS];
+static uint32_t broadband[2];
+static uint8_t hopFill = 0;
+static uint8_t window = 0; // The window that completes at the end of this hop
+static uint8_t warmup = warmupHops;
+static uint8_t refractory = 0;
+
+static AudioStats stats = {};
+
+void audioBegin()
+{
+  stats = {};
+  audioReset();
+}
+
+void audioReset()
+{
+  ringTail = ringHead;
+  nextSampleUs = halMicros();
+  dcQ8 = -1;
+  for (uint8_t w = 0; w < 2; w++)
+  {
+    for (uint8_t bin = 0; bin < AUDIO_BINS; bin++)
+    {
+      s1[w][bin] = s2[w][bin] = 0;
+    }
+    broadband[w] = 0;
+  }
+  hopFill = 0;
+  window = 0;
+  warmup = warmupHops;
+  refractory = 0;
+  stats.energy = 0;
+  stats.average = 0;
+}
+
+void audioPoll()
+{
+  uint32_t now = halMicros();
+  if ((int32_t)(now - nextSampleUs) < 0)
+  {
+    return;
+  }
+
+  // One sample per call. If whole periods went by, those samples are gone:
+  // count them and pick the grid up again rather than bunching samples.
+  uint32_t late = (now - nextSampleUs) / samplePeriodUs;
+  if (late > 0)
+  {
+    stats.dropped += late;
+    nextSampleUs += late * samplePeriodUs;
+  }
+  nextSampleUs += samplePeriodUs;
+  audioPush(halReadAudio());
+}
+
+void audioPush(uint16_t sample)
+{
+  uint8_t next = (ringHead + 1) & (AUDIO_RING_SIZE - 1);
+  if (next == ringTail)
+  {
+    stats.dropped++;
+    return;
+  }
+  ring[ringHead] = sample;
+  ringHead = next;
+  stats.samples++;
+}
+
+// Close window w, which now spans the last AUDIO_BLOCK samples: returns
+// the onset strength, 0 for none
+static uint8_t endWindow(uint8_t w)
+{
+  // Goertzel power per bin: s1^2 + s2^2 - coeff*s1*s2
+  uint32_t energy = broadband[w] << 3; // Same scale as a full-scale tone in one bin
+  for (uint8_t bin = 0; bin < AUDIO_BINS; bin++)
+  {
+    int32_t cross = ((binCoeff[bin] * s1[w][bin]) >> 14) * s2[w][bin];
+    energy += (uint32_t)(s1[w][bin] * s1[w][bin] + s2[w][bin] * s2[w][bin] - cross);
+    s1[w][bin] = s2[w][bin] = 0;
+  }
+  broadband[w] = 0;
+  stats.blocks++;
+  stats.energy = energy;
+
+  // Compare with the running average: 1/64 per hop (about half a second),
+  // faster while warming up so it starts from the signal's own level
+  uint32_t average = stats.average;
+  uint8_t shift = warmup > 0 ? 2 : 6;
+  stats.average = average - (average >> shift) + (energy >> shift);
+
+  if (warmup > 0)
+  {
+    warmup--;
+    return 0;
+  }
+  if (refractory > 0)
+  {
+    refractory--;
+    return 0;
+  }
+  if (energy < noiseFloor)
+  {
+    return 0;
+  }
+
+  // energy / average in 1/16ths; an onset is 1.5x and full strength 3x
+  uint32_t ratio = (energy >> 4) / ((average >> 8) + 1);
+  if (ratio < 24)
+  {
+    return 0;
+  }
+  refractory = refractoryHops;
+  stats.onsets++;
+  uint32_t strength = (ratio - 16) * 8;
+  return strength > 255 ? 255 : strength;
+}
+
+uint8_t audioProcess()
+{
+  uint8_t strongest = 0;
+  while (ringTail != ringHead)
+  {
+    int32_t sample = ring[ringTail];
+    ringTail = (ringTail + 1) & (AUDIO_RING_SIZE - 1);
+
+    // Remove the DC bias (mic modules sit at mid-scale), ~256 sample time constant
+    if (dcQ8 < 0)
+    {
+      dcQ8 = sample << 8;
+    }
+    dcQ8 += ((sample << 8) - dcQ8) >> 8;
+    int32_t x = sample - (dcQ8 >> 8);
+
+    for (uint8_t w = 0; w < 2; w++)
+    {
+      for (uint8_t bin = 0; bin < AUDIO_BINS; bin++)
+      {
+        int32_t s0 = x + ((binCoeff[bin] * s1[w][bin]) >> 14) - s2[w][bin];
+        s2[w][bin] = s1[w][bin];
+        s1[w][bin] = s0;
+      }
+      broadband[w] += x * x;
+    }
+
+    if (++hopFill == AUDIO_HOP)
+    {
+      hopFill = 0;
+      uint8_t onset = endWindow(window);
+      window ^= 1;
+      if (onset > strongest)
+      {
+        strongest = onset;
+      }
+    }
+  }
+  return strongest;
+}
+
+const AudioStats &audioStats()
+{
+  return stats;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+
+// Audio input for Music Sync: a mic or envelope follower on A0, sampled at
+// a fixed rate into a ring buffer and fed through a fixed-point onset
+// detector. Sampling runs from loop() on its own deadline grid; detection
+// drains the ring once per frame. The detector works in blocks of
+// AUDIO_BLOCK samples, so an onset is reported at most one block (16 ms at
+// 1 kHz) after it starts.
+//
+// Per block it measures the energy in two low Goertzel bins (the kick drum
+// region, 62 and 125 Hz at 1 kHz) plus the broadband energy, and reports an
+// onset when that rises 1.5x above its running average.
+
+#ifndef AUDIO_SAMPLE_HZ
+#define AUDIO_SAMPLE_HZ 1000
+#endif
+
+#define AUDIO_BLOCK 16
+#define AUDIO_RING_SIZE 64 // Power of two; four frames of samples at 1 kHz
+
+struct AudioStats
+{
+  uint32_t samples;   // Samples taken
+  uint32_t dropped;   // Sample slots missed because loop() was late, or the ring was full
+  uint32_t blocks;    // Blocks analysed
+  uint32_t onsets;    // Onsets detected
+  uint32_t energy;    // Onset energy of the last block
+  uint32_t average;   // Running average it is compared against
+};
+
+void audioBegin();
+
+// Forget the signal history, e.g. when Music Sync is selected
+void audioReset();
+
+// Take a sample if one is due; call as often as possible
+void audioPoll();
+
+// Queue one 10-bit sample (0-1023). audioPoll() uses this; host tools call
+// it directly to feed recorded audio through the detector.
+void audioPush(uint16_t sample);
+
+// Analyse everything queued. Returns the strength (1-255) of the strongest
+// onset found, or 0 if there was none.
+uint8_t audioProcess();
+
+const AudioStats &audioStats();
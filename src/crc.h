@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, as zlib), for records kept across resets and power
+// cuts. Bitwise: the records are a few bytes and written rarely.
+inline uint32_t crc32(const void *data, size_t length)
+{
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  uint32_t crc = 0xffffffff;
+  while (length--)
+  {
+    crc ^= *bytes++;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = crc >> 1 ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,130 @@
+#include "events.h"
+
+#include "hal.h"
+
+static const char streamHeaders[] PROGMEM =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "retry: 2000\n\n";
+
+bool EventStream::subscribe(WiFiClient client)
+{
+  for (Subscriber &subscriber : subscribers)
+  {
+    if (subscriber.open)
+    {
+      continue;
+    }
+    char headers[sizeof(streamHeaders)];
+    strcpy_P(headers, streamHeaders);
+    client.setNoDelay(true);
+    client.write(reinterpret_cast<const uint8_t *>(headers), strlen(headers));
+
+    subscriber.client = client;
+    subscriber.open = true;
+    subscriber.stale = !sendSnapshot(subscriber);
+    subscriber.since = halMillis();
+    counters.subscribed++;
+    counters.active++;
+    return true;
+  }
+  counters.rejected++;
+  return false;
+}
+
+// Frame json as one event and write it only if all of it fits
+bool EventStream::send(Subscriber &subscriber, const char *json)
+{
+  char event[EVENTS_EVENT_SIZE];
+  int length = snprintf(event, sizeof(event), "data: %s\n\n", json);
+  if (length <= 0 || length >= (int)sizeof(event) || subscriber.client.availableForWrite() < length)
+  {
+    return false;
+  }
+  if (subscriber.client.write(reinterpret_cast<const uint8_t *>(event), length) != (size_t)length)
+  {
+    // A partial event would corrupt the stream
+    close(subscriber);
+    return false;
+  }
+  subscriber.since = halMillis();
+  counters.sent++;
+  return true;
+}
+
+bool EventStream::sendSnapshot(Subscriber &subscriber)
+{
+  char json[EVENTS_EVENT_SIZE - 8];
+  snapshot(json, sizeof(json));
+  return send(subscriber, json);
+}
+
+void EventStream::publish(const char *json)
+{
+  for (Subscriber &subscriber : subscribers)
+  {
+    if (!subscriber.open)
+    {
+      continue;
+    }
+    // A stale subscriber is caught up by poll() with a snapshot
+    if (subscriber.stale || !send(subscriber, json))
+    {
+      if (!subscriber.stale)
+      {
+        subscriber.stale = true;
+        subscriber.since = halMillis();
+      }
+      counters.dropped++;
+    }
+  }
+}
+
+void EventStream::poll()
+{
+  uint32_t now = halMillis();
+  for (Subscriber &subscriber : subscribers)
+  {
+    if (!subscriber.open)
+    {
+      continue;
+    }
+    if (!subscriber.client.connected())
+    {
+      close(subscriber);
+    }
+    else if (subscriber.stale)
+    {
+      if (sendSnapshot(subscriber))
+      {
+        subscriber.stale = false;
+      }
+      else if (now - subscriber.since > EVENTS_STALL_TIMEOUT_MS)
+      {
+        counters.stalled++;
+        close(subscriber);
+      }
+    }
+    else if (now - subscriber.since > EVENTS_KEEPALIVE_MS)
+    {
+      // A write to a peer that has gone away fails and closes the stream
+      static const uint8_t keepAlive[] = {':', '\n', '\n'};
+      if (subscriber.client.availableForWrite() >= (int)sizeof(keepAlive))
+      {
+        subscriber.client.write(keepAlive, sizeof(keepAlive));
+      }
+      subscriber.since = now;
+    }
+  }
+}
+
+void EventStream::close(Subscriber &subscriber)
+{
+  subscriber.client.stop();
+  subscriber.client = WiFiClient();
+  subscriber.open = false;
+  counters.active--;
+}
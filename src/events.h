@@ -0,0 +1,68 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+// Server-Sent Events (GET /events): a small, fixed set of subscribers, each
+// a connection taken over from the HTTP server, that are pushed one line of
+// JSON whenever something changes.
+//
+// Nothing ever waits on a subscriber. An event is written whole into the
+// connection's send window or not at all; a subscriber without room misses
+// it and is marked stale, and once its window opens again it is sent a full
+// snapshot instead of the deltas it missed, so it ends up in the same state
+// as everyone else. One whose window stays shut is dropped.
+
+#define EVENTS_MAX_SUBSCRIBERS 4
+#define EVENTS_EVENT_SIZE 160          // Longest event, framing included
+#define EVENTS_KEEPALIVE_MS 15000      // Comment line on an idle stream, to find dead peers
+#define EVENTS_STALL_TIMEOUT_MS 10000  // Stale this long without the window opening: drop
+
+// Writes the full current state as one event's JSON into buffer
+typedef size_t (*EventSnapshot)(char *buffer, size_t size);
+
+struct EventStats
+{
+  uint32_t subscribed; // Since boot
+  uint32_t rejected;   // Turned away with every slot taken
+  uint32_t sent;       // Events written, snapshots included
+  uint32_t dropped;    // Events a stale subscriber missed
+  uint32_t stalled;    // Subscribers dropped for not reading
+  uint8_t active;
+};
+
+class EventStream
+{
+public:
+  EventStream(EventSnapshot snapshot) : snapshot(snapshot) {}
+
+  bool full() const { return counters.active >= EVENTS_MAX_SUBSCRIBERS; }
+
+  // Answer the request on client with the stream headers and a snapshot.
+  // Returns false (and leaves the client alone) when every slot is taken.
+  bool subscribe(WiFiClient client);
+
+  // Send one event's JSON to every subscriber
+  void publish(const char *json);
+
+  // Catch stale subscribers up, send keep-alives, close dead streams
+  void poll();
+
+  const EventStats &stats() const { return counters; }
+
+private:
+  struct Subscriber
+  {
+    WiFiClient client;
+    bool open;
+    bool stale;          // Missed an event; owed a snapshot
+    uint32_t since;      // Last write, or when it went stale
+  };
+
+  bool send(Subscriber &subscriber, const char *json);
+  bool sendSnapshot(Subscriber &subscriber);
+  void close(Subscriber &subscriber);
+
+  EventSnapshot snapshot;
+  Subscriber subscribers[EVENTS_MAX_SUBSCRIBERS];
+  EventStats counters = {};
+};
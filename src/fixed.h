@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+
+// Fixed-point helpers and waveform tables shared by the animations. The
+// ESP8266 has no FPU, so nothing on the per-frame path should touch float.
+//
+//   Q8.8   - 16 bits, 8 fractional (speed multipliers)
+//   Q16.16 - 32 bits, 16 fractional (the animation timebase, in ms)
+//   Phase  - 16-bit fraction of a full cycle, 0x10000 == 2*pi
+//
+// The tables are generated at compile time and live in RAM: they are read
+// every frame, and RAM avoids the aligned-read dance flash needs.
+
+typedef uint16_t q8_8_t;
+typedef int32_t q16_16_t;
+
+constexpr q8_8_t toQ8_8(float value)
+{
+  return (q8_8_t)(value * 256 + 0.5f);
+}
+
+constexpr q16_16_t toQ16_16(int32_t value)
+{
+  return value * 65536;
+}
+
+// Compile-time sine, only used to build the table below
+constexpr double tableSin(double x)
+{
+  const double pi = 3.14159265358979323846;
+  while (x > pi)
+    x -= 2 * pi;
+  while (x < -pi)
+    x += 2 * pi;
+  double term = x;
+  double sum = x;
+  for (int n = 1; n < 12; n++)
+  {
+    term *= -x * x / ((2 * n) * (2 * n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+// Compile-time exp and log, only used to build tables; range-reduced so
+// that the series converge in a few terms
+constexpr double tableExp(double x)
+{
+  int halvings = 0;
+  while (x > 0.5 || x < -0.5)
+  {
+    x /= 2;
+    halvings++;
+  }
+  double term = 1;
+  double sum = 1;
+  for (int n = 1; n < 16; n++)
+  {
+    term *= x / n;
+    sum += term;
+  }
+  while (halvings-- > 0)
+    sum *= sum;
+  return sum;
+}
+
+constexpr double tableLog(double x)
+{
+  int exponent = 0;
+  while (x < 0.5)
+  {
+    x *= 2;
+    exponent--;
+  }
+  while (x >= 1)
+  {
+    x /= 2;
+    exponent++;
+  }
+  double z = (x - 1) / (x + 1);
+  double term = z;
+  double sum = 0;
+  for (int n = 1; n < 40; n += 2)
+  {
+    sum += term / n;
+    term *= z * z;
+  }
+  return 2 * sum + exponent * 0.69314718055994530942;
+}
+
+// x to the power p, for 0 <= x
+constexpr double tablePow(double x, double p)
+{
+  return x > 0 ? tableExp(p * tableLog(x)) : 0;
+}
+
+constexpr int32_t roundToInt(double x)
+{
+  return (int32_t)(x >= 0 ? x + 0.5 : x - 0.5);
+}
+
+// One full sine cycle in Q15, with a guard entry so interpolation can read index + 1
+struct SineTable
+{
+  int16_t v[257];
+  constexpr SineTable() : v()
+  {
+    for (int i = 0; i <= 256; i++)
+    {
+      v[i] = (int16_t)roundToInt(tableSin(2 * 3.14159265358979323846 * i / 256) * 32767);
+    }
+  }
+};
+
+// Smoothstep ease-in-out, 0..255 -> 0..255
+struct EaseTable
+{
+  uint8_t v[256];
+  constexpr EaseTable() : v()
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      double x = i / 255.0;
+      v[i] = (uint8_t)roundToInt(x * x * (3 - 2 * x) * 255);
+    }
+  }
+};
+
+inline constexpr SineTable sineTable{};
+inline constexpr EaseTable easeTable{};
+
+static_assert(sineTable.v[0] == 0 && sineTable.v[64] == 32767 && sineTable.v[192] == -32767, "sine table");
+static_assert(easeTable.v[0] == 0 && easeTable.v[128] == 128 && easeTable.v[255] == 255, "ease table");
+
+// Sine of a phase in Q15, linearly interpolated between table entries
+inline int16_t sin16(uint16_t phase)
+{
+  uint8_t index = phase >> 8;
+  uint8_t frac = phase & 0xff;
+  int16_t a = sineTable.v[index];
+  int16_t b = sineTable.v[index + 1];
+  return a + (((int32_t)(b - a) * frac) >> 8);
+}
+
+// Triangle wave 0..255..0 over a phase. Two instructions, so no table needed.
+inline uint8_t triangle8(uint16_t phase)
+{
+  uint16_t x = phase >> 7;
+  return x < 256 ? x : 511 - x;
+}
+
+inline uint8_t ease8(uint8_t x)
+{
+  return easeTable.v[x];
+}
+
+// Exact x / 255 for 0 <= x < 65535, without a divide
+inline uint16_t div255(uint32_t x)
+{
+  return (x + 1 + (x >> 8)) >> 8;
+}
+
+// value * scale / 255
+inline uint8_t scale8(uint8_t value, uint8_t scale)
+{
+  return div255((uint16_t)value * scale);
+}
@@ -0,0 +1,200 @@
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <TimeLib.h>
+#include <sys/time.h>
+#include "hal.h"
+#ifdef ARDUINO_ARCH_ESP8266
+#include <coredecls.h>
+#include <gpio.h>
+#else
+#include <NativeSim.h>
+#endif
+
+void halBegin()
+{
+  pinMode(IN1_PIN, OUTPUT);
+  pinMode(IN2_PIN, OUTPUT);
+  pinMode(ENA_PIN, OUTPUT);
+  pinMode(MODE_BUTTON, INPUT_PULLUP); // Set button pin as input with pull-up resistor
+  halWriteBridge(0, false);
+}
+
+void IRAM_ATTR halWriteBridge(int dir, bool enable)
+{
+#ifdef ARDUINO_ARCH_ESP8266
+  // Straight to the GPIO set/clear registers: this runs on every PWM edge
+  uint32_t high = 0;
+  if (dir > 0)
+    high |= 1 << IN1_PIN;
+  else if (dir < 0)
+    high |= 1 << IN2_PIN;
+  if (enable)
+    high |= 1 << ENA_PIN;
+  uint32_t low = ((1 << IN1_PIN) | (1 << IN2_PIN) | (1 << ENA_PIN)) & ~high;
+  GPOC = low;
+  GPOS = high;
+#else
+  digitalWrite(IN1_PIN, dir > 0 ? HIGH : LOW);
+  digitalWrite(IN2_PIN, dir < 0 ? HIGH : LOW);
+  digitalWrite(ENA_PIN, enable ? HIGH : LOW);
+#endif
+}
+
+void halTimerBegin(HalTimerHandler handler, uint32_t firstTicks)
+{
+  timer1_isr_init();
+  timer1_attachInterrupt(handler);
+  timer1_enable(HAL_TIMER_TICKS_PER_US == 80 ? TIM_DIV1 : TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+  timer1_write(firstTicks);
+}
+
+void IRAM_ATTR halTimerArm(uint32_t ticks)
+{
+  timer1_write(ticks);
+}
+
+bool halButtonPressed()
+{
+  // LOW due to pull-up resistor
+  return digitalRead(MODE_BUTTON) == LOW;
+}
+
+static void (*buttonHandler)() = nullptr;
+static volatile bool sleepInterrupted = false;
+
+static void IRAM_ATTR onButtonEdge()
+{
+  sleepInterrupted = true;
+  buttonHandler();
+#ifdef ARDUINO_ARCH_ESP8266
+  esp_schedule(); // Ends the esp_delay() in halIdleSleep()
+#endif
+}
+
+void halButtonInterrupt(void (*onPress)())
+{
+  buttonHandler = onPress;
+  attachInterrupt(digitalPinToInterrupt(MODE_BUTTON), onButtonEdge, FALLING);
+}
+
+void halWiFiSleep(HalSleep sleep, uint8_t listenInterval)
+{
+  WiFi.setSleepMode(sleep == HAL_SLEEP_LIGHT   ? WIFI_LIGHT_SLEEP
+                    : sleep == HAL_SLEEP_MODEM ? WIFI_MODEM_SLEEP
+                                               : WIFI_NONE_SLEEP,
+                    sleep ? listenInterval : 0);
+#ifdef ARDUINO_ARCH_ESP8266
+  // In light sleep the CPU only wakes for the pin if asked to
+  if (sleep == HAL_SLEEP_LIGHT)
+  {
+    wifi_enable_gpio_wakeup(GPIO_ID_PIN(MODE_BUTTON), GPIO_PIN_INTR_LOLEVEL);
+  }
+  else
+  {
+    wifi_disable_gpio_wakeup();
+  }
+#endif
+}
+
+void halIdleSleep(uint32_t us)
+{
+  sleepInterrupted = false;
+#ifdef ARDUINO_ARCH_ESP8266
+  // The core drops into the WiFi sleep mode while the loop is suspended
+  uint32_t ms = (us + 999) / 1000;
+  esp_delay(ms, []() { return !sleepInterrupted; }, ms);
+#else
+  // The simulated clock runs on in steps, stopping at a press
+  uint64_t end = nativeMicros() + us;
+  while (!sleepInterrupted && nativeMicros() < end)
+  {
+    nativeAdvanceMicros(min<uint64_t>(1000, end - nativeMicros()));
+  }
+#endif
+}
+
+uint16_t halReadAudio()
+{
+  return analogRead(AUDIO_PIN);
+}
+
+uint32_t IRAM_ATTR halCycleCount()
+{
+  return ESP.getCycleCount();
+}
+
+uint32_t halCyclesPerUs()
+{
+  return ESP.getCpuFreqMHz();
+}
+
+bool halWallClock(uint64_t &utcUs)
+{
+#ifdef ARDUINO_ARCH_ESP8266
+  timeval now;
+  gettimeofday(&now, nullptr);
+  if (now.tv_sec < SECS_YR_2000)
+  {
+    return false;
+  }
+  utcUs = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  return true;
+#else
+  return nativeWallClock(utcUs);
+#endif
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+extern "C" uint32_t _FS_end;
+extern "C" uint32_t _EEPROM_start;
+#define JOURNAL_START ((uint32_t)&_FS_end - 0x40200000)
+#define JOURNAL_END ((uint32_t)&_EEPROM_start - 0x40200000 + HAL_FLASH_SECTOR_SIZE)
+#else
+// As the 4 MB layouts place them
+#define JOURNAL_START 0x3fa000
+#define JOURNAL_END 0x3fc000
+#endif
+
+uint8_t halJournalSectors()
+{
+  return (JOURNAL_END - JOURNAL_START) / HAL_FLASH_SECTOR_SIZE;
+}
+
+bool halJournalErase(uint8_t sector)
+{
+  return sector < halJournalSectors() && ESP.flashEraseSector(JOURNAL_START / HAL_FLASH_SECTOR_SIZE + sector);
+}
+
+bool halJournalWrite(uint8_t sector, uint32_t offset, const void *data, size_t size)
+{
+  return sector < halJournalSectors() &&
+         ESP.flashWrite(JOURNAL_START + sector * HAL_FLASH_SECTOR_SIZE + offset, static_cast<const uint32_t *>(data), size);
+}
+
+bool halJournalRead(uint8_t sector, uint32_t offset, void *data, size_t size)
+{
+  return sector < halJournalSectors() &&
+         ESP.flashRead(JOURNAL_START + sector * HAL_FLASH_SECTOR_SIZE + offset, static_cast<uint32_t *>(data), size);
+}
+
+// In IRAM, as the core's millis() and micros() are: the button interrupt
+// stamps its edge with halMicros(), and may fire while flash is busy
+uint32_t IRAM_ATTR halMillis()
+{
+  return millis();
+}
+
+uint32_t IRAM_ATTR halMicros()
+{
+  return micros();
+}
+
+long halRandom(long howbig)
+{
+  return random(howbig);
+}
+
+long halRandom(long howsmall, long howbig)
+{
+  return random(howsmall, howbig);
+}
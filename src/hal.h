@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hardware abstraction layer: everything the animation code needs from the
+// board goes through here, so the same code runs against the ESP8266 core or
+// the host simulation in lib/ArduinoNative.
+
+// Pin Definitions
+#define IN1_PIN D5     // Drives L298N (Light Set A) IN1
+#define IN2_PIN D6     // Drives L298N (Light Set B) IN2
+#define ENA_PIN D7     // PWM brightness control for L298N ENA
+#define MODE_BUTTON D2 // Push button
+#define AUDIO_PIN A0   // Mic or envelope follower for Music Sync
+
+void halBegin();
+
+// Drive the L298N: dir selects the set (1=Set A, -1=Set B, 0=neither) and
+// enable drives ENA. Safe to call from the output timer interrupt.
+void halWriteBridge(int dir, bool enable);
+
+// One-shot output timer (timer1). The handler runs in interrupt context and
+// re-arms the timer itself. Ticks are 200 ns (80 MHz / 16) by default; 80
+// ticks per us (80 MHz / 1) places the PWM edges 16 times more finely.
+#ifndef HAL_TIMER_TICKS_PER_US
+#define HAL_TIMER_TICKS_PER_US 5
+#endif
+static_assert(HAL_TIMER_TICKS_PER_US == 5 || HAL_TIMER_TICKS_PER_US == 80, "timer1 runs at 80 MHz / 16 or / 1");
+typedef void (*HalTimerHandler)();
+void halTimerBegin(HalTimerHandler handler, uint32_t firstTicks);
+void halTimerArm(uint32_t ticks);
+
+bool halButtonPressed();
+
+// Called in interrupt context when the button goes down; it also ends a
+// halIdleSleep() early
+void halButtonInterrupt(void (*onPress)());
+
+// Idle power saving. The radio sleeps between the access point's beacons,
+// in modem sleep (radio only) or light sleep (radio and CPU, woken by the
+// beacons it listens to, every listenInterval, or the button). It stays
+// associated, so MQTT and HTTP are reached at the next beacon it hears.
+enum HalSleep : uint8_t
+{
+  HAL_SLEEP_NONE,
+  HAL_SLEEP_MODEM,
+  HAL_SLEEP_LIGHT
+};
+void halWiFiSleep(HalSleep sleep, uint8_t listenInterval);
+
+// Sleep for up to us, ending early on a button press
+void halIdleSleep(uint32_t us);
+
+// One 10-bit sample of the audio input, 0-1023
+uint16_t halReadAudio();
+
+// CPU cycle counter, for profiling. Wraps every 53 s at 80 MHz.
+uint32_t halCycleCount();
+uint32_t halCyclesPerUs();
+
+// UTC in microseconds from the system clock SNTP keeps; false until it has
+// been set
+bool halWallClock(uint64_t &utcUs);
+
+// Flash sectors set aside for the settings journal: from the end of the
+// filesystem up to and including the EEPROM sector, which nothing here
+// uses (the linker scripts leave one sector spare between the two).
+// Offsets and sizes are multiples of 4 and data must be 4-byte aligned.
+#define HAL_FLASH_SECTOR_SIZE 4096
+uint8_t halJournalSectors();
+bool halJournalErase(uint8_t sector);
+bool halJournalWrite(uint8_t sector, uint32_t offset, const void *data, size_t size);
+bool halJournalRead(uint8_t sector, uint32_t offset, void *data, size_t size);
+
+uint32_t halMillis();
+uint32_t halMicros();
+long halRandom(long howbig);
+long halRandom(long howsmall, long howbig);
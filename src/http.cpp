@@ -0,0 +1,531 @@
+#include "http.h"
+
+#include "hal.h"
+
+static const char *reason(int code)
+{
+  switch (code)
+  {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 408:
+    return "Request Timeout";
+  case 413:
+    return "Payload Too Large";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "";
+  }
+}
+
+static HttpMethod parseMethod(const char *name)
+{
+  if (!strcmp(name, "GET"))
+    return HTTP_GET;
+  if (!strcmp(name, "HEAD"))
+    return HTTP_HEAD;
+  if (!strcmp(name, "POST"))
+    return HTTP_POST;
+  if (!strcmp(name, "PUT"))
+    return HTTP_PUT;
+  if (!strcmp(name, "DELETE"))
+    return HTTP_DELETE;
+  return HTTP_OTHER;
+}
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Decode %xx and '+' in place; the result is never longer
+static void urlDecode(char *text)
+{
+  char *out = text;
+  for (char *in = text; *in; in++)
+  {
+    if (*in == '%' && hexValue(in[1]) >= 0 && hexValue(in[2]) >= 0)
+    {
+      *out++ = hexValue(in[1]) << 4 | hexValue(in[2]);
+      in += 2;
+    }
+    else
+    {
+      *out++ = *in == '+' ? ' ' : *in;
+    }
+  }
+  *out = '\0';
+}
+
+void HttpServer::begin()
+{
+  listener.begin();
+  listener.setNoDelay(true);
+}
+
+void HttpServer::on(const char *uri, HttpMethod method, HttpHandler handler)
+{
+  if (routeCount < HTTP_MAX_ROUTES)
+  {
+    routes[routeCount++] = {uri, method, handler};
+  }
+}
+
+void HttpServer::poll()
+{
+  accept();
+  for (Connection &connection : connections)
+  {
+    if (connection.open)
+    {
+      service(connection);
+    }
+  }
+}
+
+void HttpServer::accept()
+{
+  for (WiFiClient client = listener.accept(); client; client = listener.accept())
+  {
+    Connection *slot = nullptr;
+    for (Connection &connection : connections)
+    {
+      if (!connection.open)
+      {
+        slot = &connection;
+        break;
+      }
+    }
+    if (!slot)
+    {
+      static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      client.write(reinterpret_cast<const uint8_t *>(busy), sizeof(busy) - 1);
+      client.stop();
+      counters.rejected++;
+      continue;
+    }
+
+    slot->client = client;
+    slot->client.setNoDelay(true);
+    slot->open = true;
+    slot->length = 0;
+    slot->headerEnd = 0;
+    slot->since = halMillis();
+    counters.connections++;
+    counters.active++;
+    counters.maxActive = max(counters.maxActive, counters.active);
+  }
+}
+
+void HttpServer::service(Connection &connection)
+{
+  // Take what has arrived, leaving room to terminate the body
+  int available = connection.client.available();
+  size_t room = sizeof(connection.buffer) - 1 - connection.length;
+  if (available > 0 && room > 0)
+  {
+    if (connection.length == 0)
+    {
+      // A new request: its time limit starts with its first byte
+      connection.since = halMillis();
+    }
+    connection.length += connection.client.read(reinterpret_cast<uint8_t *>(connection.buffer) + connection.length,
+                                                min((size_t)available, room));
+  }
+
+  // Serve every complete request in the buffer; clients may pipeline
+  while (connection.open && connection.length > 0)
+  {
+    if (connection.headerEnd == 0 && !parseHeaders(connection))
+    {
+      break;
+    }
+    size_t end = connection.headerEnd + connection.bodyLength;
+    if (connection.length < end)
+    {
+      break;
+    }
+    dispatch(connection);
+    if (!connection.open)
+    {
+      return;
+    }
+
+    // Keep anything after this request for the next one
+    memmove(connection.buffer, connection.buffer + end, connection.length - end);
+    connection.length -= end;
+    connection.headerEnd = 0;
+    connection.since = halMillis();
+    if (!connection.keepAlive || connection.failed)
+    {
+      close(connection);
+      return;
+    }
+  }
+  if (!connection.open)
+  {
+    return;
+  }
+
+  uint32_t waited = halMillis() - connection.since;
+  if (connection.length > 0 && connection.length == sizeof(connection.buffer) - 1 && connection.headerEnd == 0)
+  {
+    reject(connection, 413);
+  }
+  else if (connection.length > 0 && waited > HTTP_REQUEST_TIMEOUT_MS)
+  {
+    counters.timeouts++;
+    reject(connection, 408);
+  }
+  else if (!connection.client.connected() || (connection.length == 0 && waited > HTTP_IDLE_TIMEOUT_MS))
+  {
+    close(connection);
+  }
+}
+
+// Once the blank line has arrived: split out the request line and pick up
+// the headers we act on. Returns false while they are incomplete.
+bool HttpServer::parseHeaders(Connection &connection)
+{
+  char *buffer = connection.buffer;
+  buffer[connection.length] = '\0';
+  char *end = strstr(buffer, "\r\n\r\n");
+  if (!end)
+  {
+    return false;
+  }
+  connection.headerEnd = end + 4 - buffer;
+  connection.bodyLength = 0;
+  connection.form = false;
+  unsigned long contentLength = 0;
+  *end = '\0';
+
+  char *line = buffer;
+  char *next = strstr(line, "\r\n");
+  if (next)
+  {
+    *next = '\0';
+    next += 2;
+  }
+  char *version = strrchr(line, ' ');
+  connection.http10 = version && !strcmp(version + 1, "HTTP/1.0");
+  connection.keepAlive = !connection.http10;
+
+  while (next && *next)
+  {
+    char *header = next;
+    next = strstr(header, "\r\n");
+    if (next)
+    {
+      *next = '\0';
+      next += 2;
+    }
+    char *value = strchr(header, ':');
+    if (!value)
+    {
+      continue;
+    }
+    *value++ = '\0';
+    while (*value == ' ')
+    {
+      value++;
+    }
+    if (!strcasecmp(header, "Content-Length"))
+    {
+      contentLength = strtoul(value, nullptr, 10);
+    }
+    else if (!strcasecmp(header, "Connection"))
+    {
+      connection.keepAlive = connection.http10 ? !strcasecmp(value, "keep-alive") : strcasecmp(value, "close") != 0;
+    }
+    else if (!strcasecmp(header, "Content-Type"))
+    {
+      connection.form = !strncasecmp(value, "application/x-www-form-urlencoded", 33);
+    }
+  }
+
+  // Checked at full width: bodyLength would wrap a length of 64 KB or more
+  // into one that fits
+  if (contentLength > sizeof(connection.buffer) - 1 - connection.headerEnd)
+  {
+    reject(connection, 413);
+    return false;
+  }
+  connection.bodyLength = contentLength;
+  return true;
+}
+
+void HttpServer::dispatch(Connection &connection)
+{
+  counters.requests++;
+  current = &connection;
+  connection.chunked = false;
+  connection.failed = false;
+  connection.detached = false;
+  connection.head = false;
+  argCount = 0;
+
+  // The body ends where the next request may start; terminate it for the
+  // handler and put the byte back afterwards
+  char *requestBody = connection.buffer + connection.headerEnd;
+  char saved = requestBody[connection.bodyLength];
+  requestBody[connection.bodyLength] = '\0';
+  body = requestBody;
+  bodySize = connection.bodyLength;
+
+  // Request line: METHOD SP URI[?query] SP VERSION
+  char *method = connection.buffer;
+  char *uri = strchr(method, ' ');
+  if (!uri)
+  {
+    connection.keepAlive = false;
+    counters.errors++;
+    send(400, "text/plain", "Bad request");
+    current = nullptr;
+    return;
+  }
+  *uri++ = '\0';
+  char *version = strchr(uri, ' ');
+  if (version)
+  {
+    *version = '\0';
+  }
+  char *query = strchr(uri, '?');
+  if (query)
+  {
+    *query++ = '\0';
+    parseArgs(query);
+  }
+  if (connection.form)
+  {
+    parseArgs(requestBody);
+  }
+  currentMethod = parseMethod(method);
+  connection.head = currentMethod == HTTP_HEAD;
+
+  const Route *route = nullptr;
+  bool uriKnown = false;
+  for (uint8_t i = 0; i < routeCount; i++)
+  {
+    if (!strcmp(routes[i].uri, uri))
+    {
+      uriKnown = true;
+      // HEAD is answered as GET would be, without the body
+      if (routes[i].method == HTTP_ANY || routes[i].method == currentMethod ||
+          (connection.head && routes[i].method == HTTP_GET))
+      {
+        route = &routes[i];
+        break;
+      }
+    }
+  }
+  if (route)
+  {
+    route->handler();
+  }
+  else
+  {
+    send(404, "text/plain", uriKnown ? "Method not allowed" : "Not found");
+  }
+
+  requestBody[connection.bodyLength] = saved;
+  current = nullptr;
+  if (connection.detached)
+  {
+    // The handler owns the client now
+    connection.client = WiFiClient();
+    connection.open = false;
+    counters.active--;
+  }
+}
+
+void HttpServer::parseArgs(char *text)
+{
+  while (text && *text && argCount < HTTP_MAX_ARGS)
+  {
+    char *next = strchr(text, '&');
+    if (next)
+    {
+      *next++ = '\0';
+    }
+    char *value = strchr(text, '=');
+    if (value)
+    {
+      *value++ = '\0';
+      urlDecode(value);
+    }
+    urlDecode(text);
+    args[argCount++] = {text, value ? value : ""};
+    text = next;
+  }
+}
+
+HttpMethod HttpServer::method() const
+{
+  return currentMethod;
+}
+
+bool HttpServer::hasArg(const char *name) const
+{
+  if (!strcmp(name, "plain"))
+  {
+    return bodySize > 0;
+  }
+  for (uint8_t i = 0; i < argCount; i++)
+  {
+    if (!strcmp(args[i].name, name))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *HttpServer::arg(const char *name) const
+{
+  if (!strcmp(name, "plain"))
+  {
+    return body;
+  }
+  for (uint8_t i = 0; i < argCount; i++)
+  {
+    if (!strcmp(args[i].name, name))
+    {
+      return args[i].value;
+    }
+  }
+  return "";
+}
+
+size_t HttpServer::bodyLength() const
+{
+  return bodySize;
+}
+
+void HttpServer::send(int code, const char *contentType, const char *text)
+{
+  size_t length = strlen(text);
+  beginResponse(code, contentType, length);
+  write(text, length);
+}
+
+void HttpServer::beginResponse(int code, const char *contentType, size_t length)
+{
+  Connection &connection = *current;
+  // HTTP/1.0 has no chunked encoding: the body runs until the close
+  connection.chunked = length == HTTP_CHUNKED && !connection.http10;
+  if (length == HTTP_CHUNKED && connection.http10)
+  {
+    connection.keepAlive = false;
+  }
+
+  char header[160];
+  int size = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n", code, reason(code), contentType);
+  if (connection.chunked)
+  {
+    size += snprintf(header + size, sizeof(header) - size, "Transfer-Encoding: chunked\r\n");
+  }
+  else if (length != HTTP_CHUNKED)
+  {
+    size += snprintf(header + size, sizeof(header) - size, "Content-Length: %u\r\n", (unsigned)length);
+  }
+  size += snprintf(header + size, sizeof(header) - size, "Connection: %s\r\n\r\n",
+                   connection.keepAlive ? "keep-alive" : "close");
+  writeRaw(header, min(size, (int)sizeof(header) - 1));
+}
+
+void HttpServer::write(const char *data, size_t length)
+{
+  if (length == 0 || current->head)
+  {
+    return;
+  }
+  if (current->chunked)
+  {
+    char size[12];
+    writeRaw(size, sprintf(size, "%x\r\n", (unsigned)length));
+    writeRaw(data, length);
+    writeRaw("\r\n", 2);
+  }
+  else
+  {
+    writeRaw(data, length);
+  }
+}
+
+void HttpServer::endResponse()
+{
+  if (current->chunked && !current->head)
+  {
+    writeRaw("0\r\n\r\n", 5);
+  }
+}
+
+// Write as much as the send window takes. A reply larger than the window
+// waits for it to drain, but never longer than HTTP_WRITE_TIMEOUT_MS in
+// all; after that the rest is dropped and the connection closed.
+void HttpServer::writeRaw(const char *data, size_t length)
+{
+  Connection &connection = *current;
+  uint32_t start = halMillis();
+  while (length > 0 && !connection.failed)
+  {
+    size_t window = connection.client.availableForWrite();
+    if (window == 0)
+    {
+      if (halMillis() - start > HTTP_WRITE_TIMEOUT_MS || !connection.client.connected())
+      {
+        connection.failed = true;
+        break;
+      }
+      yield();
+      continue;
+    }
+    size_t written = connection.client.write(reinterpret_cast<const uint8_t *>(data), min(length, window));
+    if (written == 0)
+    {
+      connection.failed = true;
+      break;
+    }
+    data += written;
+    length -= written;
+  }
+}
+
+WiFiClient HttpServer::detach()
+{
+  current->detached = true;
+  return current->client;
+}
+
+void HttpServer::reject(Connection &connection, int code)
+{
+  counters.errors += code != 408;
+  current = &connection;
+  connection.keepAlive = false;
+  connection.chunked = false;
+  connection.failed = false;
+  connection.head = false;
+  send(code, "text/plain", reason(code));
+  current = nullptr;
+  close(connection);
+}
+
+void HttpServer::close(Connection &connection)
+{
+  connection.client.stop();
+  connection.client = WiFiClient();
+  connection.open = false;
+  counters.active--;
+}
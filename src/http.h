@@ -0,0 +1,134 @@
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+// Non-blocking HTTP/1.1 server. Up to HTTP_MAX_CLIENTS connections are
+// served side by side from loop(): each poll reads whatever has arrived on
+// every connection and dispatches a request once it is complete, so a slow
+// or half-open client only ever holds its own slot, never the loop.
+// Connections stay open between requests (keep-alive).
+//
+// Requests are parsed in place in a fixed buffer per connection; argument
+// values and the body are pointers into it, valid until the handler
+// returns. Nothing is allocated.
+
+#define HTTP_MAX_CLIENTS 4
+#define HTTP_BUFFER_SIZE 1024        // Request line, headers and body
+#define HTTP_MAX_ROUTES 20
+#define HTTP_MAX_ARGS 8
+#define HTTP_REQUEST_TIMEOUT_MS 2000 // First byte to end of body
+#define HTTP_IDLE_TIMEOUT_MS 5000    // Keep-alive connection between requests
+#define HTTP_WRITE_TIMEOUT_MS 20     // Waiting for the send window to open
+
+#define HTTP_CHUNKED ((size_t)-1) // Length of a streamed response
+
+enum HttpMethod : uint8_t
+{
+  HTTP_ANY,
+  HTTP_GET,
+  HTTP_HEAD,
+  HTTP_POST,
+  HTTP_PUT,
+  HTTP_DELETE,
+  HTTP_OTHER
+};
+
+typedef void (*HttpHandler)();
+
+struct HttpStats
+{
+  uint32_t connections; // Accepted since boot
+  uint32_t requests;    // Dispatched since boot
+  uint32_t rejected;    // Connections turned away with every slot busy
+  uint32_t timeouts;    // Requests that did not arrive in time
+  uint32_t errors;      // Malformed or oversized requests
+  uint8_t active;       // Connections open now
+  uint8_t maxActive;
+};
+
+class HttpServer
+{
+public:
+  HttpServer(uint16_t port) : listener(port) {}
+
+  void begin();
+  void on(const char *uri, HttpMethod method, HttpHandler handler);
+  void on(const char *uri, HttpHandler handler) { on(uri, HTTP_ANY, handler); }
+
+  // Accept, read and dispatch; call often. Never waits for a client.
+  void poll();
+
+  // While a handler runs. arg() returns "" for a missing argument; the
+  // body is the argument "plain" unless it is a form.
+  HttpMethod method() const;
+  bool hasArg(const char *name) const;
+  const char *arg(const char *name) const;
+  size_t bodyLength() const;
+
+  // Replies. send() is a complete response; a longer one is written with
+  // beginResponse() (HTTP_CHUNKED when the length is not known up front),
+  // then write() as often as needed, then endResponse().
+  void send(int code, const char *contentType, const char *body);
+  void beginResponse(int code, const char *contentType, size_t length);
+  void write(const char *data, size_t length);
+  void endResponse();
+
+  // Take over the current connection, e.g. for an event stream. The server
+  // frees the slot without closing it once the handler returns.
+  WiFiClient detach();
+
+  const HttpStats &stats() const { return counters; }
+
+private:
+  struct Route
+  {
+    const char *uri;
+    HttpMethod method;
+    HttpHandler handler;
+  };
+  struct Arg
+  {
+    const char *name;
+    const char *value;
+  };
+  struct Connection
+  {
+    WiFiClient client;
+    bool open;
+    bool keepAlive;
+    bool chunked; // The response being written
+    bool failed;  // A write timed out; close after this response
+    bool head;    // A HEAD request: the response is its headers only
+    bool detached;
+    uint16_t length;     // Bytes in buffer
+    uint16_t headerEnd;  // Start of the body, 0 until the headers are in
+    uint16_t bodyLength; // From Content-Length
+    bool form;           // Body is application/x-www-form-urlencoded
+    bool http10;
+    uint32_t since;      // First byte of the request, or the last reply
+    char buffer[HTTP_BUFFER_SIZE];
+  };
+
+  void accept();
+  void service(Connection &connection);
+  bool parseHeaders(Connection &connection);
+  void dispatch(Connection &connection);
+  void parseArgs(char *text);
+  void reject(Connection &connection, int code);
+  void writeRaw(const char *data, size_t length);
+  void close(Connection &connection);
+
+  WiFiServer listener;
+  Route routes[HTTP_MAX_ROUTES];
+  uint8_t routeCount = 0;
+  Connection connections[HTTP_MAX_CLIENTS];
+  HttpStats counters = {};
+
+  // The request being handled
+  Connection *current = nullptr;
+  HttpMethod currentMethod = HTTP_GET;
+  Arg args[HTTP_MAX_ARGS];
+  uint8_t argCount = 0;
+  const char *body = "";
+  size_t bodySize = 0;
+};
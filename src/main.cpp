@@ -1,5 +1,4 @@
 #include <ESP8266WiFi.h>
-#include <ESP8266WebServer.h>
 #include <ArduinoOTA.h>
 #include <TimeLib.h>
 #include <TelnetStream.h>
@@ -7,16 +6,38 @@
 #include <ArduinoJson.h>
 #include <sntp.h>
 #include <TZ.h>
+#include "audio.h"
+#include "events.h"
+#include "fixed.h"
+#include "hal.h"
+#include "http.h"
+#include "modes.h"
+#include "output.h"
+#include "pattern.h"
+#include "profiler.h"
+#include "realtime.h"
+#include "response.h"
+#include "rtcstate.h"
+#include "schedule.h"
+#include "scheduler.h"
+#include "settings.h"
+#include "showclock.h"
+#include "transition.h"
+#include "topics.h"
+#if defined(NATIVE_BUILD) && !__has_include("secrets.h")
+#include "secrets.example.h"
+#else
 #include "secrets.h"
+#endif
 
 // General Setup
 #define TIME_ZONE TZ_Europe_London
-
-// Pin Definitions
-#define IN1_PIN D5     // Drives L298N (Light Set A) IN1
-#define IN2_PIN D6     // Drives L298N (Light Set B) IN2
-#define ENA_PIN D7     // PWM brightness control for L298N ENA
-#define MODE_BUTTON D2 // Push button
+#ifndef NTP_SERVER
+#define NTP_SERVER "pool.ntp.org" // Trees sharing a LAN server stay closest in step
+#endif
+#define FRAME_RATE_HZ 250 // Animation frame clock; 4 ms covers All On at 5x speed
+#define MODE_TRANSITION_MS 1000 // Cross-fade when the Home Assistant mode select changes (0 cuts)
+#define MUSIC_QUIET_MS 3000 // Music Sync falls back to its simulated pulse after this long without a beat
 
 // FLASH_MAP_SETUP_CONFIG(FLASH_MAP_NO_FS)
 
@@ -31,60 +52,263 @@ const char *mqtt_user = MQTT_USER;
 const char *mqtt_password = MQTT_PASSWORD;
 const char *mqtt_client_id = "christmas-lights";
 
-// MQTT Topics
-const char *mqtt_state_topic = "homeassistant/light/christmas_lights/state";
-const char *mqtt_command_topic = "homeassistant/light/christmas_lights/set";
-const char *mqtt_mode_state_topic = "homeassistant/select/christmas_lights_mode/state";
-const char *mqtt_mode_command_topic = "homeassistant/select/christmas_lights_mode/set";
-const char *mqtt_speed_state_topic = "homeassistant/number/christmas_lights_speed/state";
-const char *mqtt_speed_command_topic = "homeassistant/number/christmas_lights_speed/set";
+// MQTT reconnect backoff: retries start at the minimum, double on every
+// failure up to the maximum, and get +/-25% jitter so a room full of trees
+// doesn't hammer a restarting broker in lockstep.
+const unsigned long mqttBackoffMin = 1000;          // ms
+const unsigned long mqttBackoffMax = 30000;         // ms
+// Resolving the broker and the TCP connect each give up after
+// mqttConnectTimeout, well above a WiFi round trip with modem sleep on (a
+// few beacon intervals). Once TCP is up, CONNACK and every write in the
+// session get mqttSocketTimeout.
+const unsigned long mqttConnectTimeout = 500;       // ms
+const uint16_t mqttSocketTimeout = 2;               // s
+
+// Idle: once the lights have been dark for IDLE_SETTLE_MS, frames stop, the
+// outputs are left switched off and the services are polled every
+// IDLE_POLL_MS, the loop sleeping in between with the radio in
+// IDLE_WIFI_SLEEP. A network command then takes up to IDLE_POLL_MS plus
+// IDLE_LISTEN_INTERVAL beacons to be seen; the button wakes it at once.
+#ifndef IDLE_POLL_MS
+#define IDLE_POLL_MS 100
+#endif
+#ifndef IDLE_WIFI_SLEEP
+#define IDLE_WIFI_SLEEP HAL_SLEEP_LIGHT
+#endif
+#ifndef IDLE_LISTEN_INTERVAL
+#define IDLE_LISTEN_INTERVAL 3 // Beacons the radio may sleep through (DTIM multiples)
+#endif
+#define IDLE_SETTLE_MS 2000
+#define IDLE_MIN_SLEEP_US 2000 // Shorter gaps are not worth sleeping for
+#define BEACON_INTERVAL_US 102400 // 100 TU, what access points send by default
+
+// ESP8266 supply by state at 3.3 V (datasheet), for the idle power estimate:
+// awake with the radio on, or asleep, averaged over the beacon wakes
+#define POWER_AWAKE_MW 231      // 70 mA
+#define POWER_MODEM_SLEEP_MW 50 // 15 mA
+#define POWER_LIGHT_SLEEP_MW 3  // 0.9 mA
+
+// State changes are coalesced and published at most once per window, one
+// message per topic, by a task of their own
+#ifndef MQTT_PUBLISH_WINDOW_MS
+#define MQTT_PUBLISH_WINDOW_MS 250
+#endif
+
+// Home Assistant entities: X(id, component, object id, name, unique id,
+// discovery fields, closing). Discovery payloads are put together from this
+// at compile time: name, unique_id and the state and command topics, then
+// the fields, then the closing. The select's fields end with an open options
+// list, which is filled with the mode names when it is published.
+#define HA_DEVICE_ID "\"device\":{\"identifiers\":[\"christmas_lights_esp8266\"]"
+#define HA_ENTITIES(X)                                                                                        \
+  X(LIGHT, "light", "christmas_lights", "Christmas Lights", "christmas_lights_main",                           \
+    "\"schema\":\"json\",\"brightness\":true,\"color_mode\":true,"                                         \
+    "\"supported_color_modes\":[\"brightness\"],\"brightness_scale\":255,\"transition\":true," HA_DEVICE_ID                      \
+    ",\"name\":\"Christmas Tree Lights\",\"model\":\"ESP8266 + L298N\",\"manufacturer\":\"DIY\"}",          \
+    ",\"optimistic\":false}")                                                                                \
+  X(MODE, "select", "christmas_lights_mode", "Christmas Lights Mode", "christmas_lights_mode",                 \
+    "\"options\":[", "]," HA_DEVICE_ID "}}")                                                                  \
+  X(SPEED, "number", "christmas_lights_speed", "Christmas Lights Speed", "christmas_lights_speed",             \
+    "\"min\":0.1,\"max\":5,\"step\":0.1,\"mode\":\"slider\"," HA_DEVICE_ID "}", "}")
+
+#define HA_TOPIC(component, object, suffix) "homeassistant/" component "/" object "/" suffix
+
+// MQTT Topics (arrays, so the command dispatch table can hash them at
+// compile time)
+#define HA_TOPICS(id, component, object, name, uniqueId, fields, closing)                                    \
+  constexpr char id##_STATE_TOPIC[] = HA_TOPIC(component, object, "state");                                   \
+  constexpr char id##_COMMAND_TOPIC[] = HA_TOPIC(component, object, "set");                                   \
+  constexpr char id##_CONFIG_TOPIC[] = HA_TOPIC(component, object, "config");
+HA_ENTITIES(HA_TOPICS)
+
+constexpr const char *mqtt_state_topic = LIGHT_STATE_TOPIC;
+constexpr const char *mqtt_command_topic = LIGHT_COMMAND_TOPIC;
+constexpr const char *mqtt_mode_state_topic = MODE_STATE_TOPIC;
+constexpr const char *mqtt_mode_command_topic = MODE_COMMAND_TOPIC;
+constexpr const char *mqtt_speed_state_topic = SPEED_STATE_TOPIC;
+constexpr const char *mqtt_speed_command_topic = SPEED_COMMAND_TOPIC;
+constexpr char mqtt_schedule_command_topic[] = "christmas_lights/schedule/set"; // Not a Home Assistant entity
 
 // Create instances
-ESP8266WebServer server(80);
+HttpServer server(80);
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
 
-// Light modes
-enum LightMode
-{
-  ALL_ON,
-  ALTERNATE_FLASH,
-  FADE_ALL,
-  FADE_ALTERNATE,
-  TWINKLE,
-  CHASE,
-  METEOR,
-  MUSIC_SYNC,
-  MODE_COUNT
-};
-
-const char *modeNames[] = {
-    "All On",
-    "Alternate Flash",
-    "Fade All",
-    "Fade Alternate",
-    "Twinkle",
-    "Chase",
-    "Meteor",
-    "Music Sync"};
+// Light modes (LIGHT_MODES) and their renderers are in modes.h
+#define MODE_OPTION(id, name, ms, render) ",\"" name "\""
 
 LightMode currentMode = ALL_ON;
 bool buttonPressed = false;
-unsigned long lastButtonPress = 0;
+uint32_t lastButtonPress = 0;
 const unsigned long debounceTime = 200; // Debounce time in milliseconds
 
 // Configurable parameters
 int maxBrightness = 255;     // Maximum brightness (0-255)
 float speedMultiplier = 1.0; // Speed multiplier (0.1 to 5.0)
+q8_8_t speedQ8 = toQ8_8(1.0); // speedMultiplier for the frame path
 bool lightsOn = true;        // Overall on/off state
 
-// Variables for animations
-int brightness = 255;
-int fadeAmount = 5;
-int direction = 1;
-unsigned long lastUpdate = 0;
-int animationStep = 0;
-int twinkleState[10] = {0}; // For twinkle effect
+// Animation state. Built-in modes render from the show time alone; only
+// patterns and Music Sync's reaction to the audio carry state between frames.
+ShowTime showTime = 0;         // Speed-scaled time since the mode started
+uint32_t lastFrameUs = 0; // When showTime last advanced
+ShowClock showClock;           // NTP time shared with the other controllers
+int64_t showPhaseError = 0;    // How far the shared phase was ahead of showTime
+uint32_t scheduleEvents = 0;   // Schedule rules run
+
+// Transitions. The level the lights are shown at ramps towards maxBrightness
+// (0 when off); a mode change can cross-fade from the mode being left, which
+// keeps rendering alongside, or holds its last frame if it was a pattern.
+Ramp levelRamp;
+Ramp modeFade;              // 0 to 255 << 8 over the cross-fade
+LightMode fadeFromMode = ALL_ON;
+ShowTime fadeFromShowTime = 0;
+Frame fadeFromFrame = {0, 0};
+Frame lastFrame = {0, 0};   // As last presented
+uint32_t transitionsStarted = 0;
+
+// Idle mode
+struct IdleStats
+{
+  uint32_t entries;
+  uint64_t idleUs;          // Time idle, up to idleSinceUs
+  uint64_t sleptUs;         // Of which asleep
+  uint32_t buttonWakeUs;    // Button press to handling, last and worst
+  uint32_t buttonWakeMaxUs;
+  uint32_t lightsWakeUs;    // Waking for the lights to the first lit frame, last and worst
+  uint32_t lightsWakeMaxUs;
+};
+IdleStats idleStats = {};
+uint32_t idleSinceUs = 0;      // Idle time is counted up to here
+volatile bool idling = false;  // schedulerIdle(), for the button interrupt
+uint32_t darkSinceMs = 0; // When the outputs last showed anything
+uint32_t wakeStartUs = 0;
+bool wakePending = false;      // Waiting for the first lit frame after waking
+volatile bool buttonEdge = false;
+volatile bool buttonEdgeIdle = false; // The edge came while idle
+volatile uint32_t buttonEdgeUs = 0;
+
+// Idle time so far and the estimated mean draw over it
+uint64_t idleTotalUs()
+{
+  return idleStats.idleUs + (schedulerIdle() ? halMicros() - idleSinceUs : 0);
+}
+
+uint32_t idlePowerMw()
+{
+  uint64_t total = idleTotalUs();
+  if (!total)
+  {
+    return 0;
+  }
+  const uint32_t sleepMw = IDLE_WIFI_SLEEP == HAL_SLEEP_LIGHT ? POWER_LIGHT_SLEEP_MW : POWER_MODEM_SLEEP_MW;
+  uint64_t slept = min(idleStats.sleptUs, total);
+  return (slept * sleepMw + (total - slept) * POWER_AWAKE_MW) / total;
+}
+
+// Longest a network command can wait in idle: a poll interval plus the
+// beacons the radio sleeps through
+uint32_t idleWakeBoundUs()
+{
+  return IDLE_POLL_MS * 1000 + IDLE_LISTEN_INTERVAL * BEACON_INTERVAL_US;
+}
+
+// Boot: the lights come up first, then the network in the background, one
+// stage at a time
+enum NetworkStage : uint8_t
+{
+  NETWORK_JOINING, // Waiting for WiFi
+  NETWORK_TIME,    // Services up, waiting for the first NTP reply
+  NETWORK_READY
+};
+NetworkStage networkStage = NETWORK_JOINING;
+SavedState savedState = {};  // Last state written to RTC memory
+bool stateRestored = false;  // This boot picked up where the last left off
+const char *stateSource = "defaults"; // Where: "rtc" after a reset, "flash" after a power cut
+uint32_t bootFirstFrameUs = 0; // Microseconds after power-on each was reached, 0 until then
+uint32_t bootWiFiUs = 0;
+uint32_t bootTimeUs = 0;
+uint32_t bootMQTTUs = 0;
+PatternPlayer patternPlayer;   // Plays pattern modes
+bool musicHeard = false;       // Music Sync is following the audio input
+uint32_t lastBeatMs = 0;
+bool musicSetA = true; // Set and level of the last beat, decaying
+int musicLevel = 0;
+
+// MQTT link state, driven one step at a time from loop()
+bool mqttWasConnected = false;
+uint32_t mqttRetryAt = 0;
+unsigned long mqttBackoff = mqttBackoffMin;
+uint32_t mqttOutageStart = 0;
+IPAddress mqttBrokerIP;        // Resolved once, again after a failed connect
+bool mqttTcpOpen = false;      // Connected to the broker, handshake next
+
+// MQTT link counters
+unsigned long mqttConnectAttempts = 0;
+unsigned long mqttConnectFailures = 0;
+unsigned long mqttOutages = 0;
+unsigned long mqttLastOutageMs = 0;
+unsigned long mqttTotalOutageMs = 0;
+
+// Outgoing state: what changed since the last flush, and how many changes
+// were folded into each publish
+enum PublishTopic : uint8_t
+{
+  PUBLISH_LIGHT,
+  PUBLISH_MODE,
+  PUBLISH_SPEED,
+  PUBLISH_DISCOVERY,
+  PUBLISH_TOPIC_COUNT
+};
+const char *const publishTopicNames[PUBLISH_TOPIC_COUNT] = {"light", "mode", "speed", "discovery"};
+uint8_t publishDirty = 0; // Bit per PublishTopic
+unsigned long publishChanges[PUBLISH_TOPIC_COUNT] = {0};
+unsigned long publishesSent[PUBLISH_TOPIC_COUNT] = {0};
+
+void markDirty(PublishTopic topic)
+{
+  publishDirty |= 1 << topic;
+  publishChanges[topic]++;
+}
+
+// Share of changes that did not need a publish of their own, in percent
+unsigned int publishSuppressedPercent(PublishTopic topic)
+{
+  unsigned long changes = publishChanges[topic];
+  unsigned long sent = min(publishesSent[topic], changes);
+  return changes ? (changes - sent) * 100 / changes : 0;
+}
+
+// Duration of the current outage, 0 while connected
+unsigned long mqttOutageMs()
+{
+  return mqttWasConnected ? 0 : halMillis() - mqttOutageStart;
+}
+
+bool isPatternMode(int mode)
+{
+  return mode >= MODE_COUNT;
+}
+
+bool modeValid(int mode)
+{
+  return mode >= 0 && (mode < MODE_COUNT || (mode < MODE_COUNT + PATTERN_SLOTS && patternInstalled(mode - MODE_COUNT)));
+}
+
+const char *modeName(int mode)
+{
+  return isPatternMode(mode) ? patternName(mode - MODE_COUNT) : modeNames[mode];
+}
+
+// The next built-in mode or installed pattern, wrapping round
+LightMode nextMode(int mode)
+{
+  do
+  {
+    mode = (mode + 1) % (MODE_COUNT + PATTERN_SLOTS);
+  } while (!modeValid(mode));
+  return static_cast<LightMode>(mode);
+}
 
 void printModeMenu()
 {
@@ -93,6 +317,8 @@ void printModeMenu()
   TelnetStream.println("  R - Reset controller");
   TelnetStream.println("  C - Close telnet connection");
   TelnetStream.println("  M - Cycle to next mode");
+  TelnetStream.println("  F - Show frame timing");
+  TelnetStream.println("  P - Show loop profile and heap");
   TelnetStream.println("  ? - Show this menu");
   TelnetStream.println("\nLight Modes (press number to select):");
 
@@ -103,6 +329,16 @@ void printModeMenu()
     TelnetStream.print(" - ");
     TelnetStream.println(modeNames[i]);
   }
+  for (int slot = 0; slot < PATTERN_SLOTS; slot++)
+  {
+    if (patternInstalled(slot))
+    {
+      TelnetStream.print("  ");
+      TelnetStream.print((char)('a' + slot)); // Patterns are lettered by slot
+      TelnetStream.print(" - ");
+      TelnetStream.println(patternName(slot));
+    }
+  }
   TelnetStream.println("=====================================\n");
 }
 
@@ -120,21 +356,18 @@ void log(const char *message)
   TelnetStream.println(message);
 }
 
-void connectToWiFi()
+// When a boot stage was reached; never 0, which means not yet
+uint32_t bootStamp()
+{
+  return max<uint32_t>(halMicros(), 1);
+}
+
+void startWiFi()
 {
   Serial.printf("Connecting to '%s'\n", wifi_ssid);
 
   WiFi.mode(WIFI_STA);
   WiFi.begin(wifi_ssid, wifi_password);
-  if (WiFi.waitForConnectResult() == WL_CONNECTED)
-  {
-    Serial.print("Connected. IP: ");
-    Serial.println(WiFi.localIP());
-  }
-  else
-  {
-    Serial.println("Connection Failed!");
-  }
 }
 
 void setUpOverTheAirProgramming()
@@ -143,59 +376,84 @@ void setUpOverTheAirProgramming()
   ArduinoOTA.begin();
 }
 
-void setDirection(int dir)
+// Built-in modes run to the shared show clock once it is synced; patterns
+// and an unsynced clock run from the mode change
+bool modeLocked(LightMode mode)
 {
-  // direction: 1=forward (Set A), -1=reverse (Set B), 0=off
-  if (dir > 0)
+  return !isPatternMode(mode) && showClock.stats().synced;
+}
+
+ShowTime modePhase(LightMode mode)
+{
+  if (!modeLocked(mode))
   {
-    digitalWrite(IN1_PIN, HIGH);
-    digitalWrite(IN2_PIN, LOW);
+    return 0;
   }
-  else if (dir < 0)
+  return showPhase(showClock.now(halMicros()), speedQ8, showAt(modeCycleMs(mode)));
+}
+
+// Fade the level to the current brightness and on/off state over ms. A
+// change made without calling this takes effect on the next frame.
+void startTransition(uint32_t ms)
+{
+  rampStart(levelRamp, lightsOn ? maxBrightness << 8 : 0, ms);
+  transitionsStarted += ms > 0;
+}
+
+void changeMode(LightMode newMode, uint32_t fadeMs = 0)
+{
+  if (fadeMs)
   {
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, HIGH);
+    fadeFromMode = currentMode;
+    fadeFromShowTime = showTime;
+    fadeFromFrame = lastFrame;
+    modeFade = {};
+    rampStart(modeFade, 255 << 8, fadeMs);
+    transitionsStarted++;
   }
   else
   {
-    digitalWrite(IN1_PIN, LOW);
-    digitalWrite(IN2_PIN, LOW);
+    modeFade = {};
   }
-}
 
-void setBrightness(int bright)
-{
-  // brightness: 0-255 (PWM value)
-  analogWrite(ENA_PIN, bright);
-}
+  if (isPatternMode(newMode) && !patternPlay(newMode - MODE_COUNT, patternPlayer))
+  {
+    log("Pattern could not be loaded, falling back to All On");
+    newMode = ALL_ON;
+  }
 
-void changeMode(LightMode newMode)
-{
   currentMode = newMode;
   char modeMsg[50];
-  sprintf(modeMsg, "Mode changed to: %s", modeNames[currentMode]);
+  sprintf(modeMsg, "Mode changed to: %s", modeName(currentMode));
   log(modeMsg);
 
-  // Reset animation variables when changing modes
-  brightness = 255;
-  fadeAmount = 5;
-  direction = 1;
-  animationStep = 0;
+  // Every mode starts from the beginning, or once the show clock is synced
+  // from wherever it is on every other controller
+  showTime = modePhase(currentMode);
+  musicHeard = false;
+  audioReset();
+  markDirty(PUBLISH_MODE);
+}
+
+void setSpeed(float speed)
+{
+  speedMultiplier = constrain(speed, 0.1f, 5.0f);
+  speedQ8 = toQ8_8(speedMultiplier);
+  markDirty(PUBLISH_SPEED);
 }
 
 void checkModeButton()
 {
-  // Check if button is pressed (LOW due to pull-up resistor)
-  if (digitalRead(MODE_BUTTON) == LOW)
+  // Check if button is pressed
+  if (halButtonPressed())
   {
-    if (!buttonPressed && (millis() - lastButtonPress > debounceTime))
+    if (!buttonPressed && (halMillis() - lastButtonPress > debounceTime))
     {
       buttonPressed = true;
-      lastButtonPress = millis();
+      lastButtonPress = halMillis();
 
       // Change to next mode
-      LightMode newMode = static_cast<LightMode>((currentMode + 1) % MODE_COUNT);
-      changeMode(newMode);
+      changeMode(nextMode(currentMode));
     }
   }
   else
@@ -204,534 +462,1481 @@ void checkModeButton()
   }
 }
 
-void allOn()
+// Music Sync from the audio input: every beat flips to the other set at a
+// level given by the beat's strength, which then decays towards the 40%
+// floor. Runs every frame; returns false while there is no music, so the
+// simulated pulse takes over.
+bool musicReact(Frame &frame, uint8_t brightness)
 {
-  // Rapidly alternate between both sets to make all lights appear on
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(20 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+  uint8_t beat = audioProcess();
+  int minBright = brightness * 2 / 5;
+  if (beat)
+  {
+    musicHeard = true;
+    lastBeatMs = halMillis();
+    musicSetA = !musicSetA;
+    musicLevel = minBright + div255((brightness - minBright) * beat);
+  }
+  else if (musicHeard && halMillis() - lastBeatMs > MUSIC_QUIET_MS)
+  {
+    musicHeard = false;
+  }
+  if (!musicHeard)
+  {
+    return false;
+  }
+
+  if (!beat && musicLevel > minBright)
   {
-    lastUpdate = currentMillis;
-    direction = -direction; // Flip between 1 and -1
-    setDirection(direction);
-    setBrightness(maxBrightness);
+    musicLevel -= (musicLevel - minBright + 31) >> 5;
   }
+  uint8_t level = constrain(musicLevel, 0, 255);
+  frame = musicSetA ? Frame{level, 0} : Frame{0, level};
+  return true;
 }
 
-void alternateFlash()
+void handleNumericInput(int input)
 {
-  // Alternate between set A and set B
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(500 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+  int modeIndex = input - '1'; // Convert from ASCII to 0-based index
+  if (modeIndex >= 0 && modeIndex < MODE_COUNT)
   {
-    lastUpdate = currentMillis;
-    direction = -direction; // Flip between 1 and -1
-    setDirection(direction);
-    setBrightness(maxBrightness);
+    changeMode(static_cast<LightMode>(modeIndex));
   }
 }
 
-void fadeAll()
+void handlePatternInput(int input)
 {
-  // Fade both sets of lights up and down together
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(30 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+  int mode = MODE_COUNT + input - 'a';
+  if (modeValid(mode))
   {
-    lastUpdate = currentMillis;
-
-    // Change brightness
-    brightness = brightness + fadeAmount;
+    changeMode(static_cast<LightMode>(mode));
+  }
+}
 
-    // Reverse fade direction when limits are reached
-    if (brightness <= 0 || brightness >= maxBrightness)
-    {
-      fadeAmount = -fadeAmount;
-      brightness = constrain(brightness, 0, maxBrightness);
+// Discovery payloads, generated from HA_ENTITIES. Topics stay in RAM for
+// beginPublish; the payloads live in flash.
+#define HA_DISCOVERY(id, component, object, name, uniqueId, fields, closing)                                 \
+  static const char id##_DISCOVERY_HEAD[] PROGMEM =                                                           \
+      "{\"name\":\"" name "\",\"unique_id\":\"" uniqueId "\",\"state_topic\":\"" HA_TOPIC(component, object, "state") \
+      "\",\"command_topic\":\"" HA_TOPIC(component, object, "set") "\"," fields;                                   \
+  static const char id##_DISCOVERY_TAIL[] PROGMEM = closing;
+HA_ENTITIES(HA_DISCOVERY)
+
+#define HA_ENTITY_ENUM(id, component, object, name, uniqueId, fields, closing) ENTITY_##id,
+enum HaEntity : uint8_t
+{
+  HA_ENTITIES(HA_ENTITY_ENUM)
+};
 
-      // Switch direction at the bottom of the fade
-      if (brightness <= 0)
-      {
-        direction = -direction;
-      }
-    }
+// The select options: the built-in modes, each with a leading comma
+static const char modeOptions[] PROGMEM = LIGHT_MODES(MODE_OPTION);
 
-    setDirection(direction);
-    setBrightness(brightness);
+// Copy PROGMEM text into the open publish in small pieces
+void mqttWrite_P(PGM_P text, size_t length)
+{
+  uint8_t chunk[64];
+  for (size_t offset = 0; offset < length; offset += sizeof(chunk))
+  {
+    size_t count = min(length - offset, sizeof(chunk));
+    memcpy_P(chunk, text + offset, count);
+    mqttClient.write(chunk, count);
   }
 }
 
-void fadeAlternate()
+// Stream one discovery message; the options go between head and tail
+void publishDiscovery(const char *topic, PGM_P head, size_t headLength, PGM_P tail, size_t tailLength, bool options)
 {
-  // Fade while alternating between sets
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(30 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+  size_t length = headLength + tailLength;
+  if (options)
   {
-    lastUpdate = currentMillis;
-
-    // Change brightness
-    brightness = brightness + fadeAmount;
-
-    // Reverse fade direction when limits are reached
-    if (brightness <= 0 || brightness >= maxBrightness)
+    length += sizeof(modeOptions) - 2; // Less the first comma and the terminator
+    for (int slot = 0; slot < PATTERN_SLOTS; slot++)
     {
-      fadeAmount = -fadeAmount;
-      brightness = constrain(brightness, 0, maxBrightness);
-
-      // Switch between sets at the bottom of the fade
-      if (brightness <= 0)
+      if (patternInstalled(slot))
       {
-        direction = -direction;
+        length += strlen(patternName(slot)) + 3; // Comma and quotes
       }
     }
-
-    setDirection(direction);
-    setBrightness(brightness);
   }
-}
 
-void twinkle()
-{
-  // Random twinkling effect
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(50 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+  if (!mqttClient.beginPublish(topic, length, true))
   {
-    lastUpdate = currentMillis;
-
-    // Randomly decide which set to use
-    if (random(10) > 5)
-    {
-      direction = 1;
-    }
-    else
+    return;
+  }
+  mqttWrite_P(head, headLength);
+  if (options)
+  {
+    mqttWrite_P(modeOptions + 1, sizeof(modeOptions) - 2);
+    // Pattern names are checked on upload to need no JSON escaping
+    for (int slot = 0; slot < PATTERN_SLOTS; slot++)
     {
-      direction = -1;
+      if (patternInstalled(slot))
+      {
+        const char *name = patternName(slot);
+        mqttClient.write(reinterpret_cast<const uint8_t *>(",\""), 2);
+        mqttClient.write(reinterpret_cast<const uint8_t *>(name), strlen(name));
+        mqttClient.write('"');
+      }
     }
-
-    // Random brightness
-    brightness = random(100, maxBrightness);
-
-    setDirection(direction);
-    setBrightness(brightness);
-    int delayTime = (int)(random(10, 50) / speedMultiplier);
-    delay(delayTime); // Small random delay for twinkling effect
   }
+  mqttWrite_P(tail, tailLength);
+  mqttClient.endPublish();
 }
 
-void chase()
+// Publish Home Assistant MQTT Discovery messages
+void publishHomeAssistantDiscovery()
 {
-  // Light chasing effect
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(100 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
-  {
-    lastUpdate = currentMillis;
+#define HA_PUBLISH(id, component, object, name, uniqueId, fields, closing)                                   \
+  publishDiscovery(id##_CONFIG_TOPIC, id##_DISCOVERY_HEAD, sizeof(id##_DISCOVERY_HEAD) - 1, id##_DISCOVERY_TAIL, \
+                   sizeof(id##_DISCOVERY_TAIL) - 1, ENTITY_##id == ENTITY_MODE);
+  HA_ENTITIES(HA_PUBLISH)
+#undef HA_PUBLISH
 
-    animationStep = (animationStep + 1) % 10;
-
-    if (animationStep < 5)
-    {
-      direction = 1; // Set A
-    }
-    else
-    {
-      direction = -1; // Set B
-    }
+  log("Home Assistant discovery messages published");
+}
 
-    // Brightness varies with position
-    int minBright = maxBrightness * 0.4;
-    int maxBright = maxBrightness;
-    brightness = minBright + (maxBright - minBright) * sin((PI * animationStep) / 5);
+// Publish MQTT state
+void publishMQTTState()
+{
+  char output[80];
+  snprintf_P(output, sizeof(output), PSTR("{\"state\":\"%s\",\"brightness\":%d,\"color_mode\":\"brightness\"}"),
+             lightsOn ? "ON" : "OFF", maxBrightness);
+  mqttClient.publish(mqtt_state_topic, output, true);
+
+  char msg[100];
+  snprintf(msg, sizeof(msg), "Published state: %s", output);
+  log(msg);
+}
 
-    setDirection(direction);
-    setBrightness(brightness);
-  }
+void publishMQTTMode()
+{
+  mqttClient.publish(mqtt_mode_state_topic, modeName(currentMode), true);
 }
 
-void meteor()
+void publishMQTTSpeed()
 {
-  // Meteor shower effect
-  unsigned long currentMillis = millis();
-  unsigned long interval = (unsigned long)(50 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
-  {
-    lastUpdate = currentMillis;
+  char speedStr[10];
+  dtostrf(speedMultiplier, 4, 2, speedStr);
+  mqttClient.publish(mqtt_speed_state_topic, speedStr, true);
+}
 
-    // Cycle through animation steps
-    animationStep = (animationStep + 1) % 20;
+// JSON commands (MQTT light commands, POST /config) are parsed into a static
+// arena: a command needs a few hundred bytes, and anything that does not fit
+// is rejected rather than taken from the heap. ArduinoJson takes its first
+// variant pool, 1 KB, from here (the native build sizes its pools to match).
+#define COMMAND_ARENA_SIZE 1536
 
-    if (animationStep < 10)
-    {
-      // Meteor on set A
-      direction = 1;
-      int stepBright = (animationStep < 5) ? (animationStep * 50) : (255 - (animationStep - 5) * 50);
-      brightness = map(stepBright, 0, 255, 0, maxBrightness);
-    }
-    else
-    {
-      // Meteor on set B
-      direction = -1;
-      int step = animationStep - 10;
-      int stepBright = (step < 5) ? (step * 50) : (255 - (step - 5) * 50);
-      brightness = map(stepBright, 0, 255, 0, maxBrightness);
-    }
+alignas(8) static uint8_t commandArenaBuffer[COMMAND_ARENA_SIZE];
+static JsonArena commandArena(commandArenaBuffer, sizeof(commandArenaBuffer));
+static JsonDocument commandDoc(&commandArena);
 
-    setDirection(direction);
-    setBrightness(brightness);
-  }
-}
+// Live state for GET /events. A subscriber gets the whole state when it
+// connects and from then on only the fields that changed, at most once per
+// EVENTS_INTERVAL_MS; keys are the same as in /status.
+#ifndef EVENTS_INTERVAL_MS
+#define EVENTS_INTERVAL_MS 50
+#endif
 
-void musicSync()
+struct StreamedState
 {
-  // Simulate music sync with pulsing pattern
-  unsigned long currentMillis = millis();
-  static int pulsePhase = 0;
+  int mode;
+  int brightness;
+  int speedCenti; // As shown, so a change below 0.01 is not an event
+  bool on;
+};
+StreamedState streamedState = {-1, -1, -1, false};
+
+StreamedState currentStreamedState()
+{
+  return {currentMode, maxBrightness, (int)lroundf(speedMultiplier * 100), lightsOn};
+}
 
-  unsigned long interval = (unsigned long)(30 / speedMultiplier);
-  if (currentMillis - lastUpdate > interval)
+// The fields of state that differ from since, or all of them without it.
+// The longest, a full state with a 24-character pattern name, is under 100
+// bytes.
+size_t formatState(char *buffer, size_t size, const StreamedState &state, const StreamedState *since)
+{
+  size_t length = 0;
+  if (!since || since->mode != state.mode)
+  {
+    length += snprintf_P(buffer + length, size - length, PSTR(",\"mode\":%d,\"mode_name\":\"%s\""), state.mode,
+                         modeName(state.mode));
+  }
+  if (!since || since->brightness != state.brightness)
+  {
+    length += snprintf_P(buffer + length, size - length, PSTR(",\"brightness\":%d"), state.brightness);
+  }
+  if (!since || since->speedCenti != state.speedCenti)
+  {
+    length += snprintf_P(buffer + length, size - length, PSTR(",\"speed\":%d.%02d"), state.speedCenti / 100,
+                         state.speedCenti % 100);
+  }
+  if (!since || since->on != state.on)
+  {
+    length += snprintf_P(buffer + length, size - length, PSTR(",\"state\":\"%s\""), state.on ? "on" : "off");
+  }
+  if (length == 0)
   {
-    lastUpdate = currentMillis;
+    buffer[0] = '\0';
+    return 0;
+  }
+  // Turn the leading comma into the opening brace
+  buffer[0] = '{';
+  buffer[length++] = '}';
+  buffer[length] = '\0';
+  return length;
+}
 
-    pulsePhase = (pulsePhase + 1) % 100;
+size_t stateSnapshot(char *buffer, size_t size)
+{
+  return formatState(buffer, size, currentStreamedState(), nullptr);
+}
 
-    // Create a pulsing pattern
-    int minBright = maxBrightness * 0.4;
-    int brightRange = maxBrightness - minBright;
-    if (pulsePhase < 50)
-    {
-      direction = 1;
-      brightness = minBright + brightRange * sin((PI * pulsePhase) / 50);
-    }
-    else
-    {
-      direction = -1;
-      brightness = minBright + brightRange * sin((PI * (pulsePhase - 50)) / 50);
-    }
+EventStream events(stateSnapshot);
 
-    setDirection(direction);
-    setBrightness(brightness);
+// Push what changed since the last run to every subscriber
+void publishStateEvents()
+{
+  events.poll();
+  StreamedState state = currentStreamedState();
+  if (events.stats().active == 0)
+  {
+    streamedState = state;
+    return;
+  }
+  char delta[EVENTS_EVENT_SIZE - 8];
+  if (formatState(delta, sizeof(delta), state, &streamedState) > 0)
+  {
+    events.publish(delta);
+    streamedState = state;
   }
 }
 
-void handleNumericInput(int input)
+static const char rootPage[] PROGMEM =
+    "<html><head><title>Christmas Lights Control</title></head><body>"
+    "<h1>Christmas Lights Controller</h1>"
+    "<p>Current Mode: <b>{0}</b></p>"
+    "<p>Brightness: <b>{1}</b></p>"
+    "<p>Speed: <b>{2}</b></p>"
+    "<p>State: <b>{3}</b></p>"
+    "<h2>API Endpoints:</h2>"
+    "<ul>"
+    "<li>GET /status - Get current status</li>"
+    "<li>GET /events - Live state changes (Server-Sent Events)</li>"
+    "<li>GET /metrics - Loop profile, heap and link metrics (Prometheus)</li>"
+    "<li>POST /mode?value=[0-{4}] - Set mode (patterns from {5})</li>"
+    "<li>POST /brightness?value=[0-255] - Set brightness</li>"
+    "<li>POST /speed?value=[0.1-5.0] - Set speed</li>"
+    "<li>POST /state?value=[on|off] - Turn on/off</li>"
+    "<li>POST /config - Set mode, brightness, speed and state at once (JSON body)</li>"
+    "<li>GET /patterns - List stored patterns</li>"
+    "<li>UDP port {7} - Realtime frame stream</li>"
+    "<li>POST /pattern?slot=[0-{6}] - Upload a pattern (hex body)</li>"
+    "<li>DELETE /pattern?slot=[0-{6}] - Remove a pattern</li>"
+    "<li>GET /schedule - Schedule rules, location and the next event</li>"
+    "<li>POST /schedule - Add or change a rule, or set the location (JSON body)</li>"
+    "<li>DELETE /schedule?rule=N - Remove a rule</li>"
+    "</ul>"
+    "</body></html>";
+
+// REST API Handlers. Replies are formatted into stack buffers or streamed
+// through response.h, so serving a request never touches the heap.
+void handleRoot()
 {
-  int modeIndex = input - '1'; // Convert from ASCII to 0-based index
-  if (modeIndex >= 0 && modeIndex < MODE_COUNT)
-  {
-    changeMode(static_cast<LightMode>(modeIndex));
-  }
+  char bright[4], speed[8], lastMode[4], firstPattern[4], lastSlot[4], realtimePort[6];
+  sprintf(bright, "%d", maxBrightness);
+  dtostrf(speedMultiplier, 1, 2, speed);
+  sprintf(lastMode, "%d", MODE_COUNT - 1);
+  sprintf(firstPattern, "%d", MODE_COUNT);
+  sprintf(lastSlot, "%d", PATTERN_SLOTS - 1);
+  sprintf(realtimePort, "%u", REALTIME_PORT);
+  const char *values[] = {modeName(currentMode), bright, speed, lightsOn ? "ON" : "OFF",
+                          lastMode, firstPattern, lastSlot, realtimePort};
+
+  responseBegin(server, 200, "text/html");
+  responseTemplate_P(rootPage, values, sizeof(values) / sizeof(values[0]));
+  responseEnd();
 }
 
-// Publish Home Assistant MQTT Discovery messages
-void publishHomeAssistantDiscovery()
+void handleEvents()
 {
-  JsonDocument doc;
-  String output;
-
-  // Light entity discovery
-  doc.clear();
-  doc["name"] = "Christmas Lights";
-  doc["unique_id"] = "christmas_lights_main";
-  doc["state_topic"] = mqtt_state_topic;
-  doc["command_topic"] = mqtt_command_topic;
-  doc["schema"] = "json";
-  doc["brightness"] = true;
-  doc["color_mode"] = true;
-  doc["supported_color_modes"][0] = "brightness";
-  doc["brightness_scale"] = 255;
-  doc["device"]["identifiers"][0] = "christmas_lights_esp8266";
-  doc["device"]["name"] = "Christmas Tree Lights";
-  doc["device"]["model"] = "ESP8266 + L298N";
-  doc["device"]["manufacturer"] = "DIY";
-  doc["optimistic"] = false;
-
-  log("Preparing light entity discovery message");
-
-  output = "";
-  serializeJson(doc, output);
-  mqttClient.publish("homeassistant/light/christmas_lights/config", output.c_str(), true);
-
-  // Mode select entity discovery
-  doc.clear();
-  doc["name"] = "Christmas Lights Mode";
-  doc["unique_id"] = "christmas_lights_mode";
-  doc["state_topic"] = mqtt_mode_state_topic;
-  doc["command_topic"] = mqtt_mode_command_topic;
-  JsonArray options = doc["options"].to<JsonArray>();
-  for (int i = 0; i < MODE_COUNT; i++)
+  if (events.full())
   {
-    options.add(modeNames[i]);
+    server.send(503, "text/plain", "Too many event subscribers");
+    return;
   }
-  doc["device"]["identifiers"][0] = "christmas_lights_esp8266";
-
-  output = "";
-  serializeJson(doc, output);
-  mqttClient.publish("homeassistant/select/christmas_lights_mode/config", output.c_str(), true);
-
-  // Speed number entity discovery
-  doc.clear();
-  doc["name"] = "Christmas Lights Speed";
-  doc["unique_id"] = "christmas_lights_speed";
-  doc["state_topic"] = mqtt_speed_state_topic;
-  doc["command_topic"] = mqtt_speed_command_topic;
-  doc["min"] = 0.1;
-  doc["max"] = 5.0;
-  doc["step"] = 0.1;
-  doc["mode"] = "slider";
-  doc["device"]["identifiers"][0] = "christmas_lights_esp8266";
-
-  output = "";
-  serializeJson(doc, output);
-  mqttClient.publish("homeassistant/number/christmas_lights_speed/config", output.c_str(), true);
-
-  log("Home Assistant discovery messages published");
+  // Bring the others up to date first, so that the snapshot the new one
+  // gets is the state the next delta is taken from
+  publishStateEvents();
+  events.subscribe(server.detach());
 }
 
-// Publish MQTT state
-void publishMQTTState()
+void handleStatus()
 {
-  JsonDocument doc;
-  doc["state"] = lightsOn ? "ON" : "OFF";
-  doc["brightness"] = maxBrightness;
-  doc["color_mode"] = "brightness";
-
-  String output;
-  serializeJson(doc, output);
-  mqttClient.publish(mqtt_state_topic, output.c_str(), true);
-
-  log(("Published state: " + output).c_str());
+  char speed[8];
+  dtostrf(speedMultiplier, 1, 2, speed);
+
+  responseBegin(server, 200, "application/json");
+  responsePrintf_P(PSTR("{\"mode\":%d,\"mode_name\":\"%s\",\"brightness\":%d,\"speed\":%s,\"state\":\"%s\","),
+                   currentMode, modeName(currentMode), maxBrightness, speed, lightsOn ? "on" : "off");
+
+  responsePrintf_P(PSTR("\"mqtt\":{\"connected\":%s,\"attempts\":%lu,\"failures\":%lu,\"outages\":%lu,"),
+                   mqttClient.connected() ? "true" : "false", mqttConnectAttempts, mqttConnectFailures, mqttOutages);
+  responsePrintf_P(PSTR("\"outage_ms\":%lu,\"last_outage_ms\":%lu,\"total_outage_ms\":%lu,\"publishes\":{"),
+                   mqttOutageMs(), mqttLastOutageMs, mqttTotalOutageMs);
+  for (uint8_t topic = 0; topic < PUBLISH_TOPIC_COUNT; topic++)
+  {
+    responsePrintf_P(PSTR("%s\"%s\":{\"changes\":%lu,\"sent\":%lu,\"suppressed_pct\":%u}"), topic ? "," : "",
+                     publishTopicNames[topic], publishChanges[topic], publishesSent[topic],
+                     publishSuppressedPercent(static_cast<PublishTopic>(topic)));
+  }
+  responseWrite_P(PSTR("}},"));
+
+  const FrameStats &stats = frameStats();
+  responsePrintf_P(PSTR("\"frames\":{\"period_us\":%u,\"count\":%u,\"missed\":%u,\"jitter_us\":%u,\"max_jitter_us\":%u},"),
+                   stats.periodUs, stats.frames, stats.missedDeadlines, stats.meanJitterUs, stats.maxJitterUs);
+
+  const AudioStats &audio = audioStats();
+  responsePrintf_P(PSTR("\"audio\":{\"sample_hz\":%d,\"samples\":%u,\"dropped\":%u,\"beats\":%u,\"active\":%s},"),
+                   AUDIO_SAMPLE_HZ, audio.samples, audio.dropped, audio.onsets, musicHeard ? "true" : "false");
+
+  const RealtimeStats &realtime = realtimeStats();
+  responsePrintf_P(PSTR("\"realtime\":{\"active\":%s,\"sessions\":%u,\"timeouts\":%u,\"packets\":%u,\"malformed\":%u,"),
+                   realtime.active ? "true" : "false", realtime.sessions, realtime.timeouts, realtime.packets,
+                   realtime.malformed);
+  responsePrintf_P(PSTR("\"frames\":%u,\"played\":%u,\"late\":%u,\"lost\":%u,\"overflows\":%u,\"underruns\":%u,"
+                        "\"buffered\":%u}"),
+                   realtime.frames, realtime.played, realtime.late, realtime.lost, realtime.overflows,
+                   realtime.underruns, realtime.buffered);
+
+  // Errors are signed: positive when NTP time, or the shared phase, is ahead
+  const ShowClockStats &clock = showClock.stats();
+  responsePrintf_P(PSTR(",\"clock\":{\"synced\":%s,\"locked\":%s,\"error_us\":%d,\"drift_ppb\":%d,\"slew_ppm\":%d,"
+                        "\"updates\":%u,\"steps\":%u,\"phase_error_us\":%ld}"),
+                   clock.synced ? "true" : "false", modeLocked(currentMode) ? "true" : "false", clock.errorUs,
+                   clock.driftPpb, clock.slewPpm, clock.updates, clock.steps, (long)(showPhaseError / 256));
+  responsePrintf_P(PSTR(",\"boot\":{\"restored\":%s,\"source\":\"%s\",\"first_frame_us\":%u,\"wifi_us\":%u,"
+                        "\"time_us\":%u,\"mqtt_us\":%u}"),
+                   stateRestored ? "true" : "false", stateSource, bootFirstFrameUs, bootWiFiUs, bootTimeUs,
+                   bootMQTTUs);
+  uint8_t rules = 0;
+  for (uint8_t index = 0; index < SCHEDULE_MAX_RULES; index++)
+  {
+    rules += scheduleRule(index).days != 0;
+  }
+  responsePrintf_P(PSTR(",\"schedule\":{\"rules\":%u,\"events\":%u,\"next\":%lld}"), rules, scheduleEvents,
+                   (long long)scheduleNextAt());
+  responsePrintf_P(PSTR(",\"transition\":{\"level\":%u,\"fading\":%s,\"started\":%u}"),
+                   (rampLevel(levelRamp) + 0x80) >> 8,
+                   rampRunning(levelRamp) || rampRunning(modeFade) ? "true" : "false", transitionsStarted);
+  responsePrintf_P(PSTR(",\"idle\":{\"idle\":%s,\"entries\":%u,\"idle_ms\":%llu,\"slept_ms\":%llu,\"power_mw\":%u,"
+                        "\"button_wake_us\":%u,\"lights_wake_us\":%u,\"wake_bound_us\":%u}"),
+                   schedulerIdle() ? "true" : "false", idleStats.entries, (unsigned long long)(idleTotalUs() / 1000),
+                   (unsigned long long)(idleStats.sleptUs / 1000), idlePowerMw(), idleStats.buttonWakeUs,
+                   idleStats.lightsWakeUs, idleWakeBoundUs());
+  const SettingsStats &settings = settingsStats();
+  responsePrintf_P(PSTR(",\"settings\":{\"pending\":%s,\"updates\":%u,\"writes\":%u,\"erases\":%u,"
+                        "\"failures\":%u,\"sector\":%u,\"used\":%u,\"capacity\":%u}}"),
+                   settings.pending ? "true" : "false", settings.updates, settings.writes, settings.erases,
+                   settings.failures, settings.sector, settings.used, settings.capacity);
+  responseEnd();
 }
 
-void publishMQTTMode()
+// Seconds with microsecond precision, without floating point
+void formatSeconds(char *out, uint64_t us)
 {
-  mqttClient.publish(mqtt_mode_state_topic, modeNames[currentMode], true);
+  sprintf(out, "%lu.%06lu", (unsigned long)(us / 1000000), (unsigned long)(us % 1000000));
 }
 
-void publishMQTTSpeed()
+void metricsPhase(const char *name, const PhaseProfile &phase)
 {
-  char speedStr[10];
-  dtostrf(speedMultiplier, 4, 2, speedStr);
-  mqttClient.publish(mqtt_speed_state_topic, speedStr, true);
+  char seconds[24];
+  uint32_t cumulative = 0;
+  for (uint8_t bucket = 0; bucket < PROFILE_BUCKETS - 1; bucket++)
+  {
+    cumulative += phase.buckets[bucket];
+    formatSeconds(seconds, profileBucketBoundUs(bucket));
+    responsePrintf_P(PSTR("lights_phase_seconds_bucket{phase=\"%s\",le=\"%s\"} %u\n"), name, seconds, cumulative);
+  }
+  responsePrintf_P(PSTR("lights_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %u\n"), name, phase.count);
+  formatSeconds(seconds, phase.totalCycles / halCyclesPerUs());
+  responsePrintf_P(PSTR("lights_phase_seconds_sum{phase=\"%s\"} %s\n"), name, seconds);
+  responsePrintf_P(PSTR("lights_phase_seconds_count{phase=\"%s\"} %u\n"), name, phase.count);
 }
 
-// REST API Handlers
-void handleRoot()
+// Prometheus text exposition of the loop profile, heap and link health
+void handleMetrics()
 {
-  String html = "<html><head><title>Christmas Lights Control</title></head><body>";
-  html += "<h1>Christmas Lights Controller</h1>";
-  html += "<p>Current Mode: <b>" + String(modeNames[currentMode]) + "</b></p>";
-  html += "<p>Brightness: <b>" + String(maxBrightness) + "</b></p>";
-  html += "<p>Speed: <b>" + String(speedMultiplier) + "</b></p>";
-  html += "<p>State: <b>" + String(lightsOn ? "ON" : "OFF") + "</b></p>";
-  html += "<h2>API Endpoints:</h2>";
-  html += "<ul>";
-  html += "<li>GET /status - Get current status</li>";
-  html += "<li>POST /mode?value=[0-" + String(MODE_COUNT - 1) + "] - Set mode</li>";
-  html += "<li>POST /brightness?value=[0-255] - Set brightness</li>";
-  html += "<li>POST /speed?value=[0.1-5.0] - Set speed</li>";
-  html += "<li>POST /state?value=[on|off] - Turn on/off</li>";
-  html += "</ul>";
-  html += "</body></html>";
-  server.send(200, "text/html", html);
+  responseBegin(server, 200, "text/plain; version=0.0.4");
+
+  responsePrintf_P(PSTR("# HELP lights_phase_seconds Duration of each run of a loop phase.\n"));
+  responsePrintf_P(PSTR("# TYPE lights_phase_seconds histogram\n"));
+  metricsPhase("frame", frameProfile());
+  for (int i = 0; i < schedulerTaskCount(); i++)
+  {
+    metricsPhase(schedulerTask(i).name, schedulerTask(i).profile);
+  }
+
+  char seconds[24];
+  responsePrintf_P(PSTR("# HELP lights_phase_max_seconds Longest run of a loop phase since boot.\n"));
+  responsePrintf_P(PSTR("# TYPE lights_phase_max_seconds gauge\n"));
+  formatSeconds(seconds, frameProfile().maxCycles / halCyclesPerUs());
+  responsePrintf_P(PSTR("lights_phase_max_seconds{phase=\"frame\"} %s\n"), seconds);
+  for (int i = 0; i < schedulerTaskCount(); i++)
+  {
+    formatSeconds(seconds, schedulerTask(i).profile.maxCycles / halCyclesPerUs());
+    responsePrintf_P(PSTR("lights_phase_max_seconds{phase=\"%s\"} %s\n"), schedulerTask(i).name, seconds);
+  }
+
+  const FrameStats &frames = frameStats();
+  responsePrintf_P(PSTR("# TYPE lights_frames_total counter\nlights_frames_total %u\n"), frames.frames);
+  responsePrintf_P(PSTR("# TYPE lights_frames_missed_total counter\nlights_frames_missed_total %u\n"), frames.missedDeadlines);
+  formatSeconds(seconds, frames.meanJitterUs);
+  responsePrintf_P(PSTR("# TYPE lights_frame_jitter_seconds gauge\nlights_frame_jitter_seconds %s\n"), seconds);
+  formatSeconds(seconds, frames.maxJitterUs);
+  responsePrintf_P(PSTR("# TYPE lights_frame_max_jitter_seconds gauge\nlights_frame_max_jitter_seconds %s\n"), seconds);
+
+  profileSampleHeap();
+  const HeapStats &heap = heapStats();
+  responsePrintf_P(PSTR("# TYPE lights_heap_free_bytes gauge\nlights_heap_free_bytes %u\n"), heap.free);
+  responsePrintf_P(PSTR("# TYPE lights_heap_min_free_bytes gauge\nlights_heap_min_free_bytes %u\n"), heap.minFree);
+  responsePrintf_P(PSTR("# TYPE lights_heap_max_block_bytes gauge\nlights_heap_max_block_bytes %u\n"), heap.maxBlock);
+  responsePrintf_P(PSTR("# TYPE lights_heap_fragmentation_percent gauge\nlights_heap_fragmentation_percent %u\n"),
+                heap.fragmentation);
+
+  responsePrintf_P(PSTR("# TYPE lights_mqtt_connected gauge\nlights_mqtt_connected %d\n"), mqttClient.connected() ? 1 : 0);
+  responsePrintf_P(PSTR("# TYPE lights_mqtt_connect_failures_total counter\nlights_mqtt_connect_failures_total %lu\n"),
+                mqttConnectFailures);
+  responsePrintf_P(PSTR("# TYPE lights_mqtt_outages_total counter\nlights_mqtt_outages_total %lu\n"), mqttOutages);
+  responseWrite_P(PSTR("# HELP lights_mqtt_state_changes_total State changes waiting to be published, by topic.\n"
+                       "# TYPE lights_mqtt_state_changes_total counter\n"));
+  for (uint8_t topic = 0; topic < PUBLISH_TOPIC_COUNT; topic++)
+  {
+    responsePrintf_P(PSTR("lights_mqtt_state_changes_total{topic=\"%s\"} %lu\n"), publishTopicNames[topic],
+                     publishChanges[topic]);
+  }
+  responseWrite_P(PSTR("# HELP lights_mqtt_publishes_total Coalesced publishes, by topic.\n"
+                       "# TYPE lights_mqtt_publishes_total counter\n"));
+  for (uint8_t topic = 0; topic < PUBLISH_TOPIC_COUNT; topic++)
+  {
+    responsePrintf_P(PSTR("lights_mqtt_publishes_total{topic=\"%s\"} %lu\n"), publishTopicNames[topic],
+                     publishesSent[topic]);
+  }
+  const HttpStats &http = server.stats();
+  responsePrintf_P(PSTR("# TYPE lights_http_requests_total counter\nlights_http_requests_total %u\n"), http.requests);
+  responsePrintf_P(PSTR("# TYPE lights_http_connections_total counter\nlights_http_connections_total %u\n"),
+                   http.connections);
+  responsePrintf_P(PSTR("# TYPE lights_http_connections gauge\nlights_http_connections %u\n"), http.active);
+  responsePrintf_P(PSTR("# TYPE lights_http_rejected_total counter\nlights_http_rejected_total %u\n"), http.rejected);
+  responsePrintf_P(PSTR("# TYPE lights_http_timeouts_total counter\nlights_http_timeouts_total %u\n"), http.timeouts);
+  responsePrintf_P(PSTR("# TYPE lights_http_errors_total counter\nlights_http_errors_total %u\n"), http.errors);
+  const EventStats &stream = events.stats();
+  responsePrintf_P(PSTR("# TYPE lights_events_subscribers gauge\nlights_events_subscribers %u\n"), stream.active);
+  responsePrintf_P(PSTR("# TYPE lights_events_rejected_total counter\nlights_events_rejected_total %u\n"),
+                   stream.rejected);
+  responsePrintf_P(PSTR("# TYPE lights_events_sent_total counter\nlights_events_sent_total %u\n"), stream.sent);
+  responsePrintf_P(PSTR("# TYPE lights_events_dropped_total counter\nlights_events_dropped_total %u\n"),
+                   stream.dropped);
+  responsePrintf_P(PSTR("# TYPE lights_events_stalled_total counter\nlights_events_stalled_total %u\n"),
+                   stream.stalled);
+  const RealtimeStats &realtime = realtimeStats();
+  responsePrintf_P(PSTR("# TYPE lights_realtime_active gauge\nlights_realtime_active %d\n"), realtime.active ? 1 : 0);
+  responseWrite_P(PSTR("# HELP lights_realtime_frames_total Realtime frames by what became of them.\n"
+                       "# TYPE lights_realtime_frames_total counter\n"));
+  responsePrintf_P(PSTR("lights_realtime_frames_total{outcome=\"received\"} %u\n"), realtime.frames);
+  responsePrintf_P(PSTR("lights_realtime_frames_total{outcome=\"played\"} %u\n"), realtime.played);
+  responsePrintf_P(PSTR("lights_realtime_frames_total{outcome=\"late\"} %u\n"), realtime.late);
+  responsePrintf_P(PSTR("lights_realtime_frames_total{outcome=\"lost\"} %u\n"), realtime.lost);
+  responsePrintf_P(PSTR("lights_realtime_frames_total{outcome=\"overflow\"} %u\n"), realtime.overflows);
+  responsePrintf_P(PSTR("# TYPE lights_realtime_underruns_total counter\nlights_realtime_underruns_total %u\n"),
+                   realtime.underruns);
+  const ShowClockStats &clock = showClock.stats();
+  responsePrintf_P(PSTR("# TYPE lights_clock_error_us gauge\nlights_clock_error_us %d\n"), clock.errorUs);
+  responsePrintf_P(PSTR("# TYPE lights_clock_drift_ppb gauge\nlights_clock_drift_ppb %d\n"), clock.driftPpb);
+  responsePrintf_P(PSTR("# TYPE lights_clock_updates_total counter\nlights_clock_updates_total %u\n"), clock.updates);
+  responsePrintf_P(PSTR("# TYPE lights_clock_steps_total counter\nlights_clock_steps_total %u\n"), clock.steps);
+  responsePrintf_P(PSTR("# TYPE lights_show_phase_error_us gauge\nlights_show_phase_error_us %ld\n"),
+                   (long)(showPhaseError / 256));
+  responseWrite_P(PSTR("# HELP lights_boot_seconds Time from power-on to each boot stage.\n"
+                       "# TYPE lights_boot_seconds gauge\n"));
+  const char *const stages[] = {"first_frame", "wifi", "time", "mqtt"};
+  const uint32_t reached[] = {bootFirstFrameUs, bootWiFiUs, bootTimeUs, bootMQTTUs};
+  for (uint8_t stage = 0; stage < 4; stage++)
+  {
+    if (reached[stage])
+    {
+      formatSeconds(seconds, reached[stage]);
+      responsePrintf_P(PSTR("lights_boot_seconds{stage=\"%s\"} %s\n"), stages[stage], seconds);
+    }
+  }
+  responsePrintf_P(PSTR("# TYPE lights_schedule_events_total counter\nlights_schedule_events_total %u\n"),
+                   scheduleEvents);
+  responsePrintf_P(PSTR("# HELP lights_transitions_total Fades started on the controller.\n"
+                        "# TYPE lights_transitions_total counter\nlights_transitions_total %u\n"),
+                   transitionsStarted);
+  responsePrintf_P(PSTR("# HELP lights_idle Whether the controller is idle (lights off, sleeping between polls).\n"
+                        "# TYPE lights_idle gauge\nlights_idle %d\n"
+                        "# TYPE lights_idle_entries_total counter\nlights_idle_entries_total %u\n"),
+                   schedulerIdle(), idleStats.entries);
+  formatSeconds(seconds, idleTotalUs());
+  responsePrintf_P(PSTR("# TYPE lights_idle_seconds_total counter\nlights_idle_seconds_total %s\n"), seconds);
+  formatSeconds(seconds, idleStats.sleptUs);
+  responsePrintf_P(PSTR("# TYPE lights_idle_sleep_seconds_total counter\nlights_idle_sleep_seconds_total %s\n"),
+                   seconds);
+  responsePrintf_P(PSTR("# HELP lights_idle_power_milliwatts Estimated mean draw while idle, from the time asleep.\n"
+                        "# TYPE lights_idle_power_milliwatts gauge\nlights_idle_power_milliwatts %u\n"),
+                   idlePowerMw());
+  responseWrite_P(PSTR("# HELP lights_wake_seconds Wake latency: button press to handling, and leaving idle to "
+                       "the first lit frame; last and worst.\n# TYPE lights_wake_seconds gauge\n"));
+  const char *const wakeEvents[] = {"button", "lights"};
+  const uint32_t wakeLast[] = {idleStats.buttonWakeUs, idleStats.lightsWakeUs};
+  const uint32_t wakeMax[] = {idleStats.buttonWakeMaxUs, idleStats.lightsWakeMaxUs};
+  for (uint8_t event = 0; event < 2; event++)
+  {
+    formatSeconds(seconds, wakeLast[event]);
+    responsePrintf_P(PSTR("lights_wake_seconds{event=\"%s\",stat=\"last\"} %s\n"), wakeEvents[event], seconds);
+    formatSeconds(seconds, wakeMax[event]);
+    responsePrintf_P(PSTR("lights_wake_seconds{event=\"%s\",stat=\"max\"} %s\n"), wakeEvents[event], seconds);
+  }
+  formatSeconds(seconds, idleWakeBoundUs());
+  responsePrintf_P(PSTR("# HELP lights_wake_bound_seconds Longest a network command waits while idle.\n"
+                        "# TYPE lights_wake_bound_seconds gauge\nlights_wake_bound_seconds %s\n"),
+                   seconds);
+  if (scheduleNextAt())
+  {
+    responsePrintf_P(PSTR("# HELP lights_schedule_next_timestamp_seconds When the next schedule rule runs.\n"
+                          "# TYPE lights_schedule_next_timestamp_seconds gauge\n"
+                          "lights_schedule_next_timestamp_seconds %lld\n"),
+                     (long long)scheduleNextAt());
+  }
+  const SettingsStats &settings = settingsStats();
+  responsePrintf_P(PSTR("# HELP lights_settings_updates_total Changes handed to the settings journal.\n"
+                        "# TYPE lights_settings_updates_total counter\nlights_settings_updates_total %u\n"),
+                   settings.updates);
+  responsePrintf_P(PSTR("# TYPE lights_settings_writes_total counter\nlights_settings_writes_total %u\n"),
+                   settings.writes);
+  responsePrintf_P(PSTR("# TYPE lights_settings_erases_total counter\nlights_settings_erases_total %u\n"),
+                   settings.erases);
+  responsePrintf_P(PSTR("# TYPE lights_settings_failures_total counter\nlights_settings_failures_total %u\n"),
+                   settings.failures);
+  responsePrintf_P(PSTR("# TYPE lights_uptime_seconds counter\nlights_uptime_seconds %lu\n"), (unsigned long)(halMillis() / 1000));
+
+  responseEnd();
 }
 
-void handleStatus()
+void sendError(const char *message)
 {
-  JsonDocument doc;
-  doc["mode"] = currentMode;
-  doc["mode_name"] = modeNames[currentMode];
-  doc["brightness"] = maxBrightness;
-  doc["speed"] = speedMultiplier;
-  doc["state"] = lightsOn ? "on" : "off";
-
-  String output;
-  serializeJson(doc, output);
-  server.send(200, "application/json", output);
+  char body[100];
+  snprintf_P(body, sizeof(body), PSTR("{\"status\":\"error\",\"message\":\"%s\"}"), message);
+  server.send(400, "application/json", body);
 }
 
 void handleSetMode()
 {
   if (server.hasArg("value"))
   {
-    int mode = server.arg("value").toInt();
-    if (mode >= 0 && mode < MODE_COUNT)
+    int mode = atoi(server.arg("value"));
+    if (modeValid(mode))
     {
       changeMode(static_cast<LightMode>(mode));
-      publishMQTTMode();
-      server.send(200, "application/json", "{\"status\":\"ok\",\"mode\":" + String(mode) + "}");
+      char body[40];
+      snprintf_P(body, sizeof(body), PSTR("{\"status\":\"ok\",\"mode\":%d}"), mode);
+      server.send(200, "application/json", body);
       return;
     }
   }
-  server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid mode\"}");
+  sendError("Invalid mode");
 }
 
 void handleSetBrightness()
 {
   if (server.hasArg("value"))
   {
-    int bright = server.arg("value").toInt();
+    int bright = atoi(server.arg("value"));
     if (bright >= 0 && bright <= 255)
     {
       maxBrightness = bright;
-      log(("Brightness set to: " + String(bright)).c_str());
-
-      // Apply brightness to current animation
-      if (currentMode == ALL_ON)
-      {
-        setBrightness(maxBrightness);
-      }
-
-      publishMQTTState();
-      server.send(200, "application/json", "{\"status\":\"ok\",\"brightness\":" + String(bright) + "}");
+      char msg[40];
+      sprintf(msg, "Brightness set to: %d", bright);
+      log(msg);
+
+      markDirty(PUBLISH_LIGHT);
+      char body[40];
+      snprintf_P(body, sizeof(body), PSTR("{\"status\":\"ok\",\"brightness\":%d}"), bright);
+      server.send(200, "application/json", body);
       return;
     }
   }
-  server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid brightness (0-255)\"}");
+  sendError("Invalid brightness (0-255)");
 }
 
 void handleSetSpeed()
 {
   if (server.hasArg("value"))
   {
-    float speed = server.arg("value").toFloat();
+    float speed = atof(server.arg("value"));
     if (speed >= 0.1 && speed <= 5.0)
     {
-      speedMultiplier = speed;
-      publishMQTTSpeed();
-      server.send(200, "application/json", "{\"status\":\"ok\",\"speed\":" + String(speed) + "}");
+      setSpeed(speed);
+      char value[8];
+      dtostrf(speed, 1, 2, value);
+      char body[40];
+      snprintf_P(body, sizeof(body), PSTR("{\"status\":\"ok\",\"speed\":%s}"), value);
+      server.send(200, "application/json", body);
       return;
     }
   }
-  server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid speed (0.1-5.0)\"}");
+  sendError("Invalid speed (0.1-5.0)");
 }
 
 void handleSetState()
 {
   if (server.hasArg("value"))
   {
-    String state = server.arg("value");
-    state.toLowerCase();
-    if (state == "on" || state == "off")
+    const char *state = server.arg("value");
+    bool on = !strcasecmp(state, "on");
+    if (on || !strcasecmp(state, "off"))
     {
-      lightsOn = (state == "on");
-      publishMQTTState();
-      server.send(200, "application/json", "{\"status\":\"ok\",\"state\":\"" + state + "\"}");
+      lightsOn = on;
+      markDirty(PUBLISH_LIGHT);
+      char body[40];
+      snprintf_P(body, sizeof(body), PSTR("{\"status\":\"ok\",\"state\":\"%s\"}"), on ? "on" : "off");
+      server.send(200, "application/json", body);
       return;
     }
   }
-  server.send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid state (on/off)\"}");
+  sendError("Invalid state (on/off)");
 }
 
-// MQTT callback function
-void mqttCallback(char *topic, byte *payload, unsigned int length)
+// A "transition" in seconds, as Home Assistant sends it, in ms; 0 if there
+// is none
+uint32_t transitionMs(JsonVariant seconds)
 {
-  String message;
-  for (unsigned int i = 0; i < length; i++)
-  {
-    message += (char)payload[i];
-  }
-
-  log(("MQTT message received on " + String(topic) + ": " + message).c_str());
+  float ms = seconds.as<float>() * 1000;
+  return ms > 0 ? (uint32_t)min(ms, (float)TRANSITION_MAX_MS) : 0;
+}
 
-  if (String(topic) == mqtt_command_topic)
+// Find a mode by number or by name; -1 if there is none
+int findMode(JsonVariant value)
+{
+  if (value.is<int>())
   {
-    // Handle light on/off commands
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, message);
-
-    if (!error)
-    {
-      if (doc["state"].is<const char*>())
-      {
-        String state = doc["state"];
-        lightsOn = (state == "ON");
-        log(("State changed to: " + state).c_str());
-        publishMQTTState();
-      }
-      if (doc["brightness"].is<int>())
-      {
-        maxBrightness = doc["brightness"];
-        log(("Brightness changed to: " + String(maxBrightness)).c_str());
-        publishMQTTState();
-      }
-    }
+    int mode = value;
+    return modeValid(mode) ? mode : -1;
   }
-  else if (String(topic) == mqtt_mode_command_topic)
+  const char *name = value;
+  for (int i = 0; name && i < MODE_COUNT + PATTERN_SLOTS; i++)
   {
-    // Handle mode change
-    for (int i = 0; i < MODE_COUNT; i++)
+    if (modeValid(i) && !strcmp(modeName(i), name))
     {
-      if (message == modeNames[i])
-      {
-        changeMode(static_cast<LightMode>(i));
-        publishMQTTMode();
-        break;
-      }
+      return i;
     }
   }
-  else if (String(topic) == mqtt_speed_command_topic)
-  {
-    // Handle speed change
-    speedMultiplier = message.toFloat();
-    speedMultiplier = constrain(speedMultiplier, 0.1, 5.0);
-    publishMQTTSpeed();
-  }
+  return -1;
 }
 
-// Connect to MQTT broker
-void connectMQTT()
+// Apply several settings from one JSON body, e.g.
+// {"mode":2,"brightness":128,"speed":1.5,"state":"on","transition":2}. Every
+// key is optional; all of them are checked before any is applied, so a bad
+// value changes nothing. A transition (seconds) fades the mode, brightness
+// and on/off state to the new settings.
+void handleConfig()
 {
-  while (!mqttClient.connected())
+  commandArena.reset();
+  if (deserializeJson(commandDoc, server.arg("plain"), server.bodyLength()))
   {
-    log("Connecting to MQTT...");
-    if (mqttClient.connect(mqtt_client_id, mqtt_user, mqtt_password))
-    {
-      log("MQTT connected");
-
-      // Subscribe to command topics
-      mqttClient.subscribe(mqtt_command_topic);
-      mqttClient.subscribe(mqtt_mode_command_topic);
-      mqttClient.subscribe(mqtt_speed_command_topic);
-
-      log("Command topics subscribed");
-
-      // Publish Home Assistant discovery messages
-      publishHomeAssistantDiscovery();
+    sendError("Body must be a JSON object");
+    return;
+  }
 
-      // Publish initial state
-      publishMQTTState();
-      publishMQTTMode();
-      publishMQTTSpeed();
+  JsonVariant modeValue = commandDoc["mode"];
+  JsonVariant brightValue = commandDoc["brightness"];
+  JsonVariant speedValue = commandDoc["speed"];
+  JsonVariant stateValue = commandDoc["state"];
+  JsonVariant transitionValue = commandDoc["transition"];
 
-      // log((String("Initial state published - brightness: ") + String(maxBrightness) +
-      //      ", mode: " + modeNames[currentMode] +
-      //      ", speed: " + String(speedMultiplier))
-      //         .c_str());
-    }
-    else
-    {
-      log("MQTT connection failed, retrying in 5 seconds");
-      delay(5000);
+  int mode = modeValue.isNull() ? -1 : findMode(modeValue);
+  if (!modeValue.isNull() && mode < 0)
+  {
+    sendError("Invalid mode");
+    return;
+  }
+  int bright = brightValue.is<int>() ? brightValue.as<int>() : -1;
+  if (!brightValue.isNull() && (bright < 0 || bright > 255))
+  {
+    sendError("Invalid brightness (0-255)");
+    return;
+  }
+  float speed = speedValue.is<float>() ? speedValue.as<float>() : 0;
+  if (!speedValue.isNull() && (speed < 0.1 || speed > 5.0))
+  {
+    sendError("Invalid speed (0.1-5.0)");
+    return;
+  }
+  const char *state = stateValue.is<const char *>() ? stateValue.as<const char *>() : "";
+  bool on = stateValue.is<bool>() ? stateValue.as<bool>() : !strcasecmp(state, "on");
+  if (!stateValue.isNull() && !stateValue.is<bool>() && !on && strcasecmp(state, "off"))
+  {
+    sendError("Invalid state (on/off)");
+    return;
+  }
+  if (!transitionValue.isNull() && (!transitionValue.is<float>() || transitionValue.as<float>() < 0))
+  {
+    sendError("Invalid transition (seconds)");
+    return;
+  }
+  uint32_t fadeMs = transitionMs(transitionValue);
+
+  if (mode >= 0)
+  {
+    changeMode(static_cast<LightMode>(mode), fadeMs);
+  }
+  if (bright >= 0)
+  {
+    maxBrightness = bright;
+    markDirty(PUBLISH_LIGHT);
+  }
+  if (!speedValue.isNull())
+  {
+    setSpeed(speed);
+  }
+  if (!stateValue.isNull())
+  {
+    lightsOn = on;
+    markDirty(PUBLISH_LIGHT);
+  }
+  if (bright >= 0 || !stateValue.isNull())
+  {
+    startTransition(fadeMs);
+  }
+  log("Configuration applied");
+
+  char speedText[8];
+  dtostrf(speedMultiplier, 1, 2, speedText);
+  char body[120];
+  snprintf_P(body, sizeof(body), PSTR("{\"status\":\"ok\",\"mode\":%d,\"brightness\":%d,\"speed\":%s,\"state\":\"%s\"}"),
+             currentMode, maxBrightness, speedText, lightsOn ? "on" : "off");
+  server.send(200, "application/json", body);
+}
+
+void handleListPatterns()
+{
+  responseBegin(server, 200, "application/json");
+  responsePrintf_P(PSTR("{\"slots\":%d,\"patterns\":["), PATTERN_SLOTS);
+  bool first = true;
+  for (int slot = 0; slot < PATTERN_SLOTS; slot++)
+  {
+    if (patternInstalled(slot))
+    {
+      // Pattern names are checked on upload to need no JSON escaping
+      responsePrintf_P(PSTR("%s{\"slot\":%d,\"mode\":%d,\"name\":\"%s\",\"size\":%u}"), first ? "" : ",", slot,
+                       MODE_COUNT + slot, patternName(slot), patternSize(slot));
+      first = false;
     }
   }
+  responseWrite_P(PSTR("]}"));
+  responseEnd();
 }
 
-void loop()
+
+// The mode list changed: tell Home Assistant about the new select options
+void patternsChanged(int slot)
 {
-  ArduinoOTA.handle();
-  server.handleClient();
+  if (currentMode == MODE_COUNT + slot)
+  {
+    // Replaced or removed while playing
+    changeMode(modeValid(currentMode) ? currentMode : ALL_ON);
+  }
+  markDirty(PUBLISH_DISCOVERY);
+}
 
-  // Maintain MQTT connection
-  if (!mqttClient.connected())
+int hexDigit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+void handleUploadPattern()
+{
+  int slot = server.hasArg("slot") ? atoi(server.arg("slot")) : -1;
+  if (slot < 0 || slot >= PATTERN_SLOTS)
   {
-    connectMQTT();
+    sendError("Invalid slot");
+    return;
   }
-  mqttClient.loop();
 
-  // Handle Telnet commands
+  // The body is the pattern image in hex; whitespace is ignored
+  const char *body = server.arg("plain");
+  uint8_t image[PATTERN_MAX_SIZE];
+  size_t size = 0;
+  int high = -1;
+  for (size_t i = 0; i < server.bodyLength(); i++)
+  {
+    char c = body[i];
+    if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+    {
+      continue;
+    }
+    int digit = hexDigit(c);
+    if (digit < 0 || (high < 0 && size == PATTERN_MAX_SIZE))
+    {
+      sendError(digit < 0 ? "Body must be hex" : "Pattern too large");
+      return;
+    }
+    if (high < 0)
+    {
+      high = digit;
+    }
+    else
+    {
+      image[size++] = high << 4 | digit;
+      high = -1;
+    }
+  }
+  if (high >= 0)
+  {
+    sendError("Odd number of hex digits");
+    return;
+  }
+
+  const char *error = patternSave(slot, image, size);
+  if (error)
+  {
+    sendError(error);
+    return;
+  }
+
+  char msg[60];
+  sprintf(msg, "Pattern '%s' stored in slot %d", patternName(slot), slot);
+  log(msg);
+  patternsChanged(slot);
+  char reply[50];
+  snprintf_P(reply, sizeof(reply), PSTR("{\"status\":\"ok\",\"slot\":%d,\"mode\":%d}"), slot, MODE_COUNT + slot);
+  server.send(200, "application/json", reply);
+}
+
+void handleDeletePattern()
+{
+  int slot = server.hasArg("slot") ? atoi(server.arg("slot")) : -1;
+  if (slot < 0 || !patternRemove(slot))
+  {
+    sendError("No pattern in that slot");
+    return;
+  }
+
+  patternsChanged(slot);
+  char reply[40];
+  snprintf_P(reply, sizeof(reply), PSTR("{\"status\":\"ok\",\"slot\":%d}"), slot);
+  server.send(200, "application/json", reply);
+}
+
+// Schedule edits, over REST and MQTT: one rule at a time, so that an edit
+// fits an MQTT message. A rule is
+//   {"rule":0,"at":"sunset","offset":-15,"days":["mon","fri"],"state":"on","mode":"Twinkle","brightness":200}
+// where "at" is "HH:MM" (local time), "sunrise" or "sunset", "offset" is
+// minutes from the sun event, and "days" defaults to every day. "rule"
+// defaults to the first free one. At least one of state, mode and
+// brightness is needed. {"rule":0,"delete":true} removes a rule, and
+// {"latitude":51.5,"longitude":-0.13} sets where sunrise and sunset are
+// worked out for; the two may come with a rule edit.
+const char *const dayNames[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+const char *editSchedule(int &index)
+{
+  index = -1;
+  JsonVariant latitude = commandDoc["latitude"];
+  JsonVariant longitude = commandDoc["longitude"];
+  bool location = !latitude.isNull() || !longitude.isNull();
+  if (location && (!latitude.is<float>() || !longitude.is<float>()))
+  {
+    return "Location needs latitude and longitude";
+  }
+
+  JsonVariant ruleValue = commandDoc["rule"];
+  JsonVariant at = commandDoc["at"];
+  if (ruleValue.isNull() && at.isNull())
+  {
+    return location ? scheduleSetLocation(lroundf(latitude.as<float>() * 1e6f), lroundf(longitude.as<float>() * 1e6f))
+                    : "Nothing to change";
+  }
+  index = ruleValue.is<int>() ? ruleValue.as<int>() : -1;
+  if (ruleValue.isNull())
+  {
+    for (int i = SCHEDULE_MAX_RULES - 1; i >= 0; i--)
+    {
+      index = scheduleRule(i).days ? index : i;
+    }
+    if (index < 0)
+    {
+      return "Schedule full";
+    }
+  }
+  if (index < 0 || index >= SCHEDULE_MAX_RULES)
+  {
+    return "Invalid rule";
+  }
+
+  ScheduleRule rule = {};
+  if (!commandDoc["delete"].as<bool>())
+  {
+    const char *when = at.as<const char *>();
+    int hours, minutes;
+    if (!when)
+    {
+      return "Rule needs \"at\"";
+    }
+    else if (!strcmp(when, "sunrise") || !strcmp(when, "sunset"))
+    {
+      rule.anchor = when[3] == 'r' ? ANCHOR_SUNRISE : ANCHOR_SUNSET;
+      rule.minutes = commandDoc["offset"].as<int>();
+    }
+    else if (sscanf(when, "%d:%d", &hours, &minutes) == 2 && hours >= 0 && hours < 24 && minutes >= 0 && minutes < 60)
+    {
+      rule.anchor = ANCHOR_TIME;
+      rule.minutes = hours * 60 + minutes;
+    }
+    else
+    {
+      return "Invalid time (HH:MM, sunrise or sunset)";
+    }
+
+    JsonVariant days = commandDoc["days"];
+    rule.days = days.isNull() ? SCHEDULE_EVERY_DAY : 0;
+    for (JsonVariant day : days.as<JsonArray>())
+    {
+      for (uint8_t i = 0; i < 7; i++)
+      {
+        rule.days |= day.is<const char *>() && !strcasecmp(day.as<const char *>(), dayNames[i]) ? 1 << i : 0;
+      }
+    }
+    if (!rule.days)
+    {
+      return "Invalid days (sun, mon, ... sat)";
+    }
+
+    JsonVariant state = commandDoc["state"];
+    JsonVariant mode = commandDoc["mode"];
+    JsonVariant brightness = commandDoc["brightness"];
+    const char *stateText = state.is<const char *>() ? state.as<const char *>() : "";
+    rule.on = state.isNull() ? -1 : state.is<bool>() ? state.as<bool>() : !strcasecmp(stateText, "on") ? 1 : 0;
+    if (!state.isNull() && !state.is<bool>() && !rule.on && strcasecmp(stateText, "off"))
+    {
+      return "Invalid state (on/off)";
+    }
+    rule.mode = mode.isNull() ? -1 : findMode(mode);
+    rule.brightness = brightness.isNull() ? -1 : brightness.is<int>() ? brightness.as<int>() : 256;
+    if (!mode.isNull() && rule.mode < 0)
+    {
+      return "Invalid mode";
+    }
+    if (rule.brightness < -1 || rule.brightness > 255)
+    {
+      return "Invalid brightness (0-255)";
+    }
+    if (rule.on < 0 && rule.mode < 0 && rule.brightness < 0)
+    {
+      return "Rule changes nothing (state, mode or brightness)";
+    }
+  }
+
+  if (location)
+  {
+    const char *error = scheduleSetLocation(lroundf(latitude.as<float>() * 1e6f), lroundf(longitude.as<float>() * 1e6f));
+    if (error)
+    {
+      return error;
+    }
+  }
+  return scheduleSetRule(index, rule);
+}
+
+// Local time, as "YYYY-MM-DD HH:MM"
+void formatLocal(char *buffer, size_t size, time_t t)
+{
+  tm local;
+  localtime_r(&t, &local);
+  strftime(buffer, size, "%Y-%m-%d %H:%M", &local);
+}
+
+// Microdegrees as decimal degrees
+void formatDegrees(char *buffer, int32_t microdegrees)
+{
+  uint32_t magnitude = microdegrees < 0 ? -(int64_t)microdegrees : microdegrees;
+  sprintf(buffer, "%s%u.%06u", microdegrees < 0 ? "-" : "", magnitude / 1000000, magnitude % 1000000);
+}
+
+void handleGetSchedule()
+{
+  char latitude[16], longitude[16];
+  formatDegrees(latitude, scheduleLatitude());
+  formatDegrees(longitude, scheduleLongitude());
+  responseBegin(server, 200, "application/json");
+  responsePrintf_P(PSTR("{\"latitude\":%s,\"longitude\":%s"), latitude, longitude);
+
+  // Today's sun and the next event, once the time is known
+  uint64_t utcUs;
+  if (halWallClock(utcUs))
+  {
+    time_t now = utcUs / 1000000;
+    time_t rise, set;
+    char when[20];
+    if (sunEvents(now, scheduleLatitude(), scheduleLongitude(), rise, set))
+    {
+      formatLocal(when, sizeof(when), rise);
+      responsePrintf_P(PSTR(",\"sunrise\":\"%s\""), when);
+      formatLocal(when, sizeof(when), set);
+      responsePrintf_P(PSTR(",\"sunset\":\"%s\""), when);
+    }
+    if (scheduleNextAt())
+    {
+      formatLocal(when, sizeof(when), scheduleNextAt());
+      responsePrintf_P(PSTR(",\"next\":{\"at\":\"%s\",\"rules\":["), when);
+      const char *separator = "";
+      for (uint8_t index = 0; index < SCHEDULE_MAX_RULES; index++)
+      {
+        if (scheduleNextRules() >> index & 1)
+        {
+          responsePrintf_P(PSTR("%s%u"), separator, index);
+          separator = ",";
+        }
+      }
+      responseWrite_P(PSTR("]}"));
+    }
+  }
+
+  responseWrite_P(PSTR(",\"rules\":["));
+  const char *separator = "";
+  for (uint8_t index = 0; index < SCHEDULE_MAX_RULES; index++)
+  {
+    const ScheduleRule &rule = scheduleRule(index);
+    if (!rule.days)
+    {
+      continue;
+    }
+    responsePrintf_P(PSTR("%s{\"rule\":%u,"), separator, index);
+    separator = ",";
+    if (rule.anchor == ANCHOR_TIME)
+    {
+      responsePrintf_P(PSTR("\"at\":\"%02d:%02d\""), rule.minutes / 60, rule.minutes % 60);
+    }
+    else
+    {
+      responsePrintf_P(PSTR("\"at\":\"%s\",\"offset\":%d"), rule.anchor == ANCHOR_SUNRISE ? "sunrise" : "sunset",
+                       rule.minutes);
+    }
+    responseWrite_P(PSTR(",\"days\":["));
+    const char *daySeparator = "";
+    for (uint8_t day = 0; day < 7; day++)
+    {
+      if (rule.days >> day & 1)
+      {
+        responsePrintf_P(PSTR("%s\"%s\""), daySeparator, dayNames[day]);
+        daySeparator = ",";
+      }
+    }
+    responseWrite_P(PSTR("]"));
+    if (rule.on >= 0)
+    {
+      responsePrintf_P(PSTR(",\"state\":\"%s\""), rule.on ? "on" : "off");
+    }
+    if (rule.mode >= 0)
+    {
+      // A pattern removed since reads back as its number
+      if (modeValid(rule.mode))
+      {
+        responsePrintf_P(PSTR(",\"mode\":\"%s\""), modeName(rule.mode));
+      }
+      else
+      {
+        responsePrintf_P(PSTR(",\"mode\":%d"), rule.mode);
+      }
+    }
+    if (rule.brightness >= 0)
+    {
+      responsePrintf_P(PSTR(",\"brightness\":%d"), rule.brightness);
+    }
+    responseWrite_P(PSTR("}"));
+  }
+  responseWrite_P(PSTR("]}"));
+  responseEnd();
+}
+
+void handleSetSchedule()
+{
+  commandArena.reset();
+  if (deserializeJson(commandDoc, server.arg("plain"), server.bodyLength()))
+  {
+    sendError("Body must be a JSON object");
+    return;
+  }
+  int index;
+  const char *error = editSchedule(index);
+  if (error)
+  {
+    sendError(error);
+    return;
+  }
+  log("Schedule changed");
+  char reply[40];
+  snprintf_P(reply, sizeof(reply), PSTR("{\"status\":\"ok\",\"rule\":%d}"), index);
+  server.send(200, "application/json", reply);
+}
+
+void handleDeleteSchedule()
+{
+  int index = server.hasArg("rule") ? atoi(server.arg("rule")) : -1;
+  if (index < 0 || !scheduleRule(index).days || scheduleSetRule(index, {}))
+  {
+    sendError("No rule with that number");
+    return;
+  }
+  log("Schedule changed");
+  char reply[40];
+  snprintf_P(reply, sizeof(reply), PSTR("{\"status\":\"ok\",\"rule\":%d}"), index);
+  server.send(200, "application/json", reply);
+}
+
+// Run the rules that are due. The next event is planned ahead, so most
+// seconds this is one compare.
+void runSchedule()
+{
+  uint64_t utcUs;
+  if (!halWallClock(utcUs))
+  {
+    return;
+  }
+  uint16_t due = scheduleDue(utcUs / 1000000);
+  for (uint8_t index = 0; due; index++, due >>= 1)
+  {
+    if (!(due & 1))
+    {
+      continue;
+    }
+    const ScheduleRule &rule = scheduleRule(index);
+    if (rule.on >= 0)
+    {
+      lightsOn = rule.on;
+    }
+    if (rule.brightness >= 0)
+    {
+      maxBrightness = rule.brightness;
+    }
+    if (rule.mode >= 0 && modeValid(rule.mode))
+    {
+      changeMode(static_cast<LightMode>(rule.mode));
+    }
+    markDirty(PUBLISH_LIGHT);
+    scheduleEvents++;
+    char msg[40];
+    snprintf(msg, sizeof(msg), "Schedule: rule %u ran", index);
+    log(msg);
+  }
+}
+
+// MQTT commands
+void handleLightCommand(const byte *payload, unsigned int length)
+{
+  commandArena.reset();
+  DeserializationError error = deserializeJson(commandDoc, payload, length);
+  if (error)
+  {
+    char msg[60];
+    snprintf(msg, sizeof(msg), "Light command rejected: %s", error.c_str());
+    log(msg);
+    return;
+  }
+
+  bool changed = false;
+  if (commandDoc["state"].is<const char *>())
+  {
+    const char *state = commandDoc["state"];
+    lightsOn = strcmp(state, "ON") == 0;
+    char msg[40];
+    snprintf(msg, sizeof(msg), "State changed to: %s", state);
+    log(msg);
+    changed = true;
+  }
+  if (commandDoc["brightness"].is<int>())
+  {
+    maxBrightness = commandDoc["brightness"];
+    char msg[40];
+    sprintf(msg, "Brightness changed to: %d", maxBrightness);
+    log(msg);
+    changed = true;
+  }
+  if (changed)
+  {
+    // The new state is reported straight away; the lights fade to it
+    uint32_t fadeMs = transitionMs(commandDoc["transition"]);
+    startTransition(fadeMs);
+    if (fadeMs)
+    {
+      char msg[40];
+      snprintf(msg, sizeof(msg), "Transition over %lu ms", (unsigned long)fadeMs);
+      log(msg);
+    }
+    markDirty(PUBLISH_LIGHT);
+  }
+}
+
+void handleModeCommand(const byte *payload, unsigned int length)
+{
+  for (int i = 0; i < MODE_COUNT + PATTERN_SLOTS; i++)
+  {
+    if (modeValid(i) && strlen(modeName(i)) == length && memcmp(modeName(i), payload, length) == 0)
+    {
+      changeMode(static_cast<LightMode>(i), MODE_TRANSITION_MS);
+      break;
+    }
+  }
+}
+
+void handleSpeedCommand(const byte *payload, unsigned int length)
+{
+  // The payload is not terminated; a number needs only a few characters
+  char number[16];
+  length = min(length, (unsigned int)sizeof(number) - 1);
+  memcpy(number, payload, length);
+  number[length] = '\0';
+  setSpeed(atof(number));
+}
+
+void handleScheduleCommand(const byte *payload, unsigned int length)
+{
+  commandArena.reset();
+  DeserializationError parseError = deserializeJson(commandDoc, payload, length);
+  int index;
+  const char *error = parseError ? "not a JSON object" : editSchedule(index);
+  char msg[80];
+  snprintf(msg, sizeof(msg), "Schedule command %s%s", error ? "rejected: " : "applied", error ? error : "");
+  log(msg);
+}
+
+static constexpr TopicRoute commandRoutes[] = {
+    topicRoute(mqtt_command_topic, handleLightCommand),
+    topicRoute(mqtt_mode_command_topic, handleModeCommand),
+    topicRoute(mqtt_speed_command_topic, handleSpeedCommand),
+    topicRoute(mqtt_schedule_command_topic, handleScheduleCommand),
+};
+static_assert(topicRoutesDistinct(commandRoutes, sizeof(commandRoutes) / sizeof(commandRoutes[0])),
+              "MQTT command topics must differ in length or hash");
+
+void mqttCallback(char *topic, byte *payload, unsigned int length)
+{
+  char msg[128];
+  snprintf(msg, sizeof(msg), "MQTT message received on %s: %.*s", topic, (int)length, (const char *)payload);
+  log(msg);
+
+  topicDispatch(commandRoutes, sizeof(commandRoutes) / sizeof(commandRoutes[0]), topic, payload, length);
+}
+
+// Subscribe and publish everything Home Assistant needs after a (re)connect
+void onMQTTConnected()
+{
+  log("MQTT connected");
+
+  // Subscribe to command topics
+  mqttClient.subscribe(mqtt_command_topic);
+  mqttClient.subscribe(mqtt_mode_command_topic);
+  mqttClient.subscribe(mqtt_speed_command_topic);
+  mqttClient.subscribe(mqtt_schedule_command_topic);
+
+  log("Command topics subscribed");
+
+  // Discovery and the initial state go out with the next flush
+  markDirty(PUBLISH_DISCOVERY);
+  markDirty(PUBLISH_LIGHT);
+  markDirty(PUBLISH_MODE);
+  markDirty(PUBLISH_SPEED);
+}
+
+// Publish everything that changed since the last flush, one message per
+// topic. Runs once per MQTT_PUBLISH_WINDOW_MS; while the broker is away the
+// changes wait for the next flush after reconnecting.
+void flushMQTTState()
+{
+  if (!publishDirty || !mqttClient.connected())
+  {
+    return;
+  }
+  uint8_t dirty = publishDirty;
+  publishDirty = 0;
+
+  // Discovery first, so Home Assistant knows the entities the state is for
+  if (dirty & (1 << PUBLISH_DISCOVERY))
+  {
+    publishHomeAssistantDiscovery();
+  }
+  if (dirty & (1 << PUBLISH_LIGHT))
+  {
+    publishMQTTState();
+  }
+  if (dirty & (1 << PUBLISH_MODE))
+  {
+    publishMQTTMode();
+  }
+  if (dirty & (1 << PUBLISH_SPEED))
+  {
+    publishMQTTSpeed();
+  }
+  for (uint8_t topic = 0; topic < PUBLISH_TOPIC_COUNT; topic++)
+  {
+    publishesSent[topic] += (dirty >> topic) & 1;
+  }
+}
+
+// A connection step failed: try again after the backoff, which doubles
+void mqttRetryLater(const char *failed)
+{
+  mqttConnectFailures++;
+  unsigned long jitter = halRandom(mqttBackoff / 2 + 1);
+  mqttRetryAt = halMillis() + mqttBackoff - mqttBackoff / 4 + jitter;
+
+  char msg[80];
+  sprintf(msg, "MQTT %s failed, retrying in %lu ms", failed, (unsigned long)(mqttRetryAt - halMillis()));
+  log(msg);
+
+  mqttBackoff = min(mqttBackoff * 2, mqttBackoffMax);
+}
+
+// Keep the MQTT connection alive without ever blocking loop() for long.
+// Connecting takes one step per call: resolving the broker (only once for
+// a name, not at all for an address), the TCP connect, then the MQTT
+// handshake, which with TCP already up only sends CONNECT and waits for
+// CONNACK. Failed attempts back off exponentially.
+void maintainMQTT()
+{
+  if (mqttClient.connected())
+  {
+    mqttClient.loop();
+    return;
+  }
+
+  uint32_t now = halMillis();
+  if (mqttWasConnected)
+  {
+    mqttWasConnected = false;
+    mqttOutageStart = now;
+    mqttOutages++;
+    mqttBackoff = mqttBackoffMin;
+    mqttRetryAt = now; // First retry straight away
+    log("MQTT connection lost");
+  }
+
+  if (mqttTcpOpen)
+  {
+    mqttTcpOpen = false;
+    // Checked first, or connect() would open the connection itself
+    if (espClient.connected() && mqttClient.connect(mqtt_client_id, mqtt_user, mqtt_password))
+    {
+      if (!bootMQTTUs)
+      {
+        bootMQTTUs = bootStamp();
+      }
+      mqttWasConnected = true;
+      mqttLastOutageMs = halMillis() - mqttOutageStart;
+      mqttTotalOutageMs += mqttLastOutageMs;
+      mqttBackoff = mqttBackoffMin;
+      onMQTTConnected();
+      return;
+    }
+    espClient.stop();
+    char failed[24];
+    sprintf(failed, "connect (state %d)", mqttClient.state());
+    mqttRetryLater(failed);
+    return;
+  }
+
+  if ((int32_t)(now - mqttRetryAt) < 0 || WiFi.status() != WL_CONNECTED)
+  {
+    return;
+  }
+
+  if (!mqttBrokerIP.isSet())
+  {
+    if (!WiFi.hostByName(mqtt_server, mqttBrokerIP, mqttConnectTimeout))
+    {
+      mqttBrokerIP = IPAddress();
+      mqttConnectAttempts++;
+      mqttRetryLater("lookup");
+    }
+    return;
+  }
+
+  mqttConnectAttempts++;
+  espClient.setTimeout(mqttConnectTimeout);
+  if (!espClient.connect(mqttBrokerIP, mqtt_port))
+  {
+    mqttBrokerIP = IPAddress();
+    mqttRetryLater("TCP connect");
+    return;
+  }
+  // The core applies the client's timeout to every later write too
+  espClient.setTimeout(mqttSocketTimeout * 1000UL);
+  mqttTcpOpen = true;
+}
+
+// Mean and worst time per run of a phase, and the bucket 99% of runs fit in
+void printPhase(const char *name, const PhaseProfile &phase)
+{
+  uint32_t cyclesPerUs = halCyclesPerUs();
+  uint32_t meanUs = phase.count ? phase.totalCycles / phase.count / cyclesPerUs : 0;
+  uint32_t below = 0;
+  uint8_t p99 = 0;
+  while (p99 < PROFILE_BUCKETS - 1 && (below += phase.buckets[p99]) < phase.count - phase.count / 100)
+  {
+    p99++;
+  }
+
+  char msg[100];
+  if (p99 < PROFILE_BUCKETS - 1)
+  {
+    sprintf(msg, "  %-8s %10u runs, mean %6u us, p99 < %6u us, max %6u us", name, phase.count, meanUs,
+            profileBucketBoundUs(p99), phase.maxCycles / cyclesPerUs);
+  }
+  else
+  {
+    sprintf(msg, "  %-8s %10u runs, mean %6u us, p99 > %6u us, max %6u us", name, phase.count, meanUs,
+            profileBucketBoundUs(PROFILE_BUCKETS - 2), phase.maxCycles / cyclesPerUs);
+  }
+  TelnetStream.println(msg);
+}
+
+void printProfile()
+{
+  TelnetStream.println("Loop profile since boot:");
+  printPhase("frame", frameProfile());
+  for (int i = 0; i < schedulerTaskCount(); i++)
+  {
+    printPhase(schedulerTask(i).name, schedulerTask(i).profile);
+  }
+
+  profileSampleHeap();
+  const HeapStats &heap = heapStats();
+  char msg[100];
+  sprintf(msg, "Heap: %u free (low %u), largest block %u, fragmentation %u%%", heap.free, heap.minFree,
+          heap.maxBlock, heap.fragmentation);
+  TelnetStream.println(msg);
+}
+
+void printFrameStats()
+{
+  const FrameStats &stats = frameStats();
+  char msg[120];
+  sprintf(msg, "Frames: %u @ %u us, jitter last %u us, mean %u us, max %u us, missed %u",
+          stats.frames, stats.periodUs, stats.lastJitterUs, stats.meanJitterUs, stats.maxJitterUs, stats.missedDeadlines);
+  TelnetStream.println(msg);
+  resetFrameStats();
+}
+
+// Handle Telnet commands
+void handleTelnet()
+{
   int input = TelnetStream.read();
   if (input != -1)
   {
@@ -752,14 +1957,22 @@ void loop()
 
     case 'M':
       // Change to next mode via Telnet
-      changeMode(static_cast<LightMode>((currentMode + 1) % MODE_COUNT));
+      changeMode(nextMode(currentMode));
+      break;
+
+    case 'F':
+      printFrameStats();
+      break;
+
+    case 'P':
+      printProfile();
       break;
 
     case '?':
       printModeMenu();
       break;
 
-    // Numeric mode selection (1-8)
+    // Numeric mode selection (1-8); patterns are selected by letter (a-h)
     case '1':
     case '2':
     case '3':
@@ -770,100 +1983,382 @@ void loop()
     case '8':
       handleNumericInput(input);
       break;
+
+    default:
+      handlePatternInput(input);
+      break;
     }
   }
+}
+
+void handleOTA()
+{
+  ArduinoOTA.handle();
+}
+
+void handleHTTP()
+{
+  server.poll();
+}
+
+// Only Music Sync listens, so the ADC is left alone otherwise
+void sampleAudio()
+{
+  if (currentMode == MUSIC_SYNC && lightsOn)
+  {
+    audioPoll();
+  }
+}
+
+// The SNTP client asks how long to wait between updates; an hour by default,
+// over which the crystal can drift by 100 ms
+extern "C" uint32_t sntp_update_delay_MS_rfc_not_less_than_15000()
+{
+  return SHOWCLOCK_NTP_INTERVAL_MS;
+}
 
-  // Check for mode button press
-  checkModeButton();
+// Read the system clock SNTP keeps into the show clock
+void disciplineClock()
+{
+  uint64_t utcUs;
+  uint32_t localUs = halMicros();
+  if (halWallClock(utcUs))
+  {
+    showClock.sample(localUs, utcUs);
+  }
+}
 
-  // Only run animations if lights are on
-  if (!lightsOn)
+// Put back the state saved before a reset or a power cut, if there is
+// one. RTC memory is written at once, the journal after a debounce, so RTC
+// memory is the newer when both are valid.
+void restoreState()
+{
+  SavedState saved;
+  SavedState journal;
+  bool journalValid = settingsBegin(journal);
+  if (rtcStateLoad(saved))
+  {
+    stateSource = "rtc";
+  }
+  else if (journalValid)
   {
-    setDirection(0);
-    setBrightness(0);
+    saved = journal;
+    stateSource = "flash";
+  }
+  else
+  {
+    log("No saved state, starting from the defaults");
     return;
   }
+  maxBrightness = saved.brightness;
+  lightsOn = saved.on;
+  setSpeed(saved.speedCenti / 100.0f);
+  changeMode(modeValid(saved.mode) ? static_cast<LightMode>(saved.mode) : ALL_ON);
+  savedState = saved;
+  stateRestored = true;
+  // A reset before the journal caught up: it still needs this state
+  settingsUpdate(saved);
+}
 
-  // Run the current light mode
-  switch (currentMode)
-  {
-  case ALL_ON:
-    allOn();
-    break;
-  case ALTERNATE_FLASH:
-    alternateFlash();
-    break;
-  case FADE_ALL:
-    fadeAll();
-    break;
-  case FADE_ALTERNATE:
-    fadeAlternate();
-    break;
-  case TWINKLE:
-    twinkle();
-    break;
-  case CHASE:
-    chase();
-    break;
-  case METEOR:
-    meteor();
-    break;
-  case MUSIC_SYNC:
-    musicSync();
-    break;
-  default:
-    allOn();
-    break;
+// Keep the state for the next boot: in RTC memory as soon as anything
+// changes, the write being a few microseconds, and in the flash journal
+// once it settles
+void saveState()
+{
+  SavedState state = {(uint8_t)currentMode, (uint8_t)maxBrightness, (uint16_t)lroundf(speedMultiplier * 100), lightsOn};
+  if (state.mode != savedState.mode || state.brightness != savedState.brightness ||
+      state.speedCenti != savedState.speedCenti || state.on != savedState.on)
+  {
+    rtcStateSave(state);
+    settingsUpdate(state);
+    savedState = state;
   }
+  settingsPoll();
 }
 
-void setup()
+// Bring the network up behind the animation: once WiFi has joined, start
+// the services that listen on it, then wait for NTP time
+void startNetwork()
 {
-  Serial.begin(115200);
-  analogWriteRange(255);
-  Serial.println("Booting...");
+  if (networkStage == NETWORK_JOINING)
+  {
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      return;
+    }
+    bootWiFiUs = bootStamp();
+    Serial.print("Connected. IP: ");
+    Serial.println(WiFi.localIP());
+
+    setUpOverTheAirProgramming();
+    TelnetStream.begin();
+    server.begin();
+    realtimeBegin();
+    configTime(TIME_ZONE, NTP_SERVER);
+    log("Network services started");
+    networkStage = NETWORK_TIME;
+  }
+  if (networkStage == NETWORK_TIME)
+  {
+    uint64_t utcUs;
+    if (!halWallClock(utcUs))
+    {
+      return;
+    }
+    bootTimeUs = bootStamp();
+    setTime(utcUs / 1000000);
+    disciplineClock();
+    networkStage = NETWORK_READY;
+
+    log("Christmas Lights Controller Ready");
+    printModeMenu();
+  }
+}
+
+// The current mode's frame at full brightness; the brightness is applied
+// by the output stage, in 16 bits
+Frame renderCurrent(bool lit, ShowTime advance)
+{
+  // A realtime stream takes over from the mode while it lasts
+  Frame streamed;
+  if (realtimeFrame(streamed))
+  {
+    return streamed;
+  }
+
+  // Only run animations while the lights are on or fading out
+  if (!lit)
+  {
+    return {0, 0};
+  }
+
+  // Patterns are interpreted step by step, so they are advanced rather
+  // than seeked; a long stall counts as one second
+  if (isPatternMode(currentMode))
+  {
+    patternAdvance(patternPlayer, min(advance, showAt(1000)) * 32 / 125); // us/256 to Q16.16 ms
+    return patternFrame(patternPlayer, 255);
+  }
+
+  // With music playing, Music Sync reacts to it instead
+  Frame frame;
+  if (currentMode == MUSIC_SYNC && musicReact(frame, 255))
+  {
+    return frame;
+  }
+
+  return renderMode(currentMode, showMs(showTime), 255, MODE_SEED);
+}
+
+// Render one animation frame; called by the scheduler at FRAME_RATE_HZ
+void renderFrame()
+{
+  // The show clock advances by however long it really was since the last
+  // frame, so a late or dropped frame does not slow the animation down
+  uint32_t now = halMicros();
+  if (!bootFirstFrameUs)
+  {
+    bootFirstFrameUs = bootStamp();
+  }
+  uint32_t elapsedUs = now - lastFrameUs;
+  lastFrameUs = now;
+  ShowTime advance = showAdvance(elapsedUs, speedQ8);
+  if (modeLocked(currentMode))
+  {
+    // Held to the shared phase: a speed change or clock correction is
+    // caught up gradually rather than jumped
+    showTime = showLock(showTime, advance, modePhase(currentMode), showAt(modeCycleMs(currentMode)), showPhaseError);
+  }
+  else
+  {
+    // Wrapped round the cycle as showLock() does, so a mode left running
+    // for weeks unsynced never outgrows showMs()
+    showTime = showWrap(showTime + advance, currentMode);
+  }
+
+  // Brightness and on/off changes made without a transition jump here
+  uint16_t target = lightsOn ? maxBrightness << 8 : 0;
+  if (target != levelRamp.to)
+  {
+    rampStart(levelRamp, target, 0);
+  }
+  uint16_t level = rampAdvance(levelRamp, elapsedUs);
+  Frame frame = renderCurrent(level != 0, advance);
+
+  // The mode being left fades out under the new one
+  if (rampRunning(modeFade))
+  {
+    fadeFromShowTime = showWrap(fadeFromShowTime + advance, fadeFromMode);
+    Frame from = isPatternMode(fadeFromMode) ? fadeFromFrame
+                                             : renderMode(fadeFromMode, showMs(fadeFromShowTime), 255, MODE_SEED);
+    frame = frameMix(from, frame, rampAdvance(modeFade, elapsedUs) >> 8);
+  }
+
+  lastFrame = frame;
+  Duty duty = outputDuty(frame, level);
+  outputBackBuffer() = duty;
+  outputPresent();
+
+  if (duty.a || duty.b)
+  {
+    darkSinceMs = halMillis();
+    if (wakePending)
+    {
+      wakePending = false;
+      idleStats.lightsWakeUs = now - wakeStartUs;
+      idleStats.lightsWakeMaxUs = max(idleStats.lightsWakeMaxUs, idleStats.lightsWakeUs);
+    }
+  }
+}
+
+void IRAM_ATTR onButtonPress()
+{
+  buttonEdgeUs = halMicros();
+  buttonEdgeIdle = idling;
+  buttonEdge = true;
+}
+
+// Something to show: the lights are on at a visible brightness, or a
+// realtime stream is playing. Idle is entered and left on this alone, so
+// the two can't disagree.
+bool wantsFrames()
+{
+  return (lightsOn && maxBrightness) || realtimeStats().active;
+}
 
-  connectToWiFi();
-  setUpOverTheAirProgramming();
+// Go idle once the lights have been dark a while and the network is up
+// (joining it needs the loop's full attention)
+void checkIdle()
+{
+  if (schedulerIdle() || networkStage != NETWORK_READY || wantsFrames() || !outputStopped() ||
+      halMillis() - darkSinceMs < IDLE_SETTLE_MS)
+  {
+    return;
+  }
+  schedulerSetIdle(IDLE_POLL_MS);
+  halWiFiSleep(IDLE_WIFI_SLEEP, IDLE_LISTEN_INTERVAL);
+  idleSinceUs = halMicros();
+  idling = true;
+  idleStats.entries++;
+  log("Idle: lights off, sleeping between polls");
+}
+
+void leaveIdle()
+{
+  halWiFiSleep(HAL_SLEEP_NONE, 0);
+  schedulerSetIdle(0);
+  idling = false;
+  wakeStartUs = halMicros();
+  idleStats.idleUs += wakeStartUs - idleSinceUs;
+  wakePending = true;
+  log("Awake");
+}
 
-  configTime(TIME_ZONE, "pool.ntp.org");
-  time_t now = time(nullptr);
-  while (now < SECS_YR_2000)
+void loop()
+{
+  // A press is handled as soon as the interrupt wakes the loop; only one
+  // that came while idle measures the wake
+  if (buttonEdge)
   {
-    delay(100);
-    now = time(nullptr);
+    buttonEdge = false;
+    bool pressWoke = schedulerIdle() && buttonEdgeIdle;
+    checkModeButton();
+    if (pressWoke)
+    {
+      idleStats.buttonWakeUs = halMicros() - buttonEdgeUs;
+      idleStats.buttonWakeMaxUs = max(idleStats.buttonWakeMaxUs, idleStats.buttonWakeUs);
+    }
   }
-  setTime(now);
 
-  TelnetStream.begin();
+  schedulerRun();
+  if (!schedulerIdle())
+  {
+    return;
+  }
+  // Anything that lights the outputs (a command, the schedule) or a realtime
+  // stream starting ends idle
+  if (wantsFrames())
+  {
+    leaveIdle();
+    return;
+  }
+  // Counted on every pass, as no span longer than micros() wraps in
+  // (about 71 minutes) can be measured
+  uint32_t now = halMicros();
+  idleStats.idleUs += now - idleSinceUs;
+  idleSinceUs = now;
+
+  uint32_t sleepUs = schedulerSleepUs();
+  if (sleepUs >= IDLE_MIN_SLEEP_US)
+  {
+    uint32_t start = halMicros();
+    halIdleSleep(sleepUs);
+    idleStats.sleptUs += halMicros() - start;
+  }
+}
 
-  pinMode(IN1_PIN, OUTPUT);
-  pinMode(IN2_PIN, OUTPUT);
-  pinMode(ENA_PIN, OUTPUT);
-  pinMode(MODE_BUTTON, INPUT_PULLUP); // Set button pin as input with pull-up resistor
+void setup()
+{
+  Serial.begin(115200);
+  Serial.println("Booting...");
 
-  // Initialize twinkle states
-  for (int i = 0; i < 10; i++)
+  // Lights first: outputs off, then the state from before the reset, so
+  // the first frame shows what was showing
+  halBegin();
+  halButtonInterrupt(onButtonPress);
+  outputBegin(OUTPUT_MULTIPLEX_HZ);
+  audioBegin();
+  if (!patternsBegin())
   {
-    twinkleState[i] = random(0, 255);
+    log("LittleFS mount failed, patterns unavailable");
   }
+  scheduleBegin();
+  restoreState();
+
+  // Everything that needs the network waits for it in the background
+  startWiFi();
 
   // Setup MQTT
   mqttClient.setServer(mqtt_server, mqtt_port);
   mqttClient.setCallback(mqttCallback);
-  mqttClient.setBufferSize(1024); // Increase buffer for discovery messages
-  connectMQTT();
+  mqttClient.setBufferSize(256); // Discovery is streamed, so this only bounds commands and state
+  mqttClient.setSocketTimeout(mqttSocketTimeout);
 
-  // Setup HTTP server
+  // HTTP routes; the server starts listening once WiFi is up
   server.on("/", handleRoot);
   server.on("/status", handleStatus);
+  server.on("/events", HTTP_GET, handleEvents);
+  server.on("/metrics", HTTP_GET, handleMetrics);
   server.on("/mode", HTTP_POST, handleSetMode);
   server.on("/brightness", HTTP_POST, handleSetBrightness);
   server.on("/speed", HTTP_POST, handleSetSpeed);
   server.on("/state", HTTP_POST, handleSetState);
-  server.begin();
-  log("HTTP server started");
-
-  log("Christmas Lights Controller Ready");
-  printModeMenu();
+  server.on("/config", HTTP_POST, handleConfig);
+  server.on("/patterns", HTTP_GET, handleListPatterns);
+  server.on("/pattern", HTTP_POST, handleUploadPattern);
+  server.on("/pattern", HTTP_DELETE, handleDeletePattern);
+  server.on("/schedule", HTTP_GET, handleGetSchedule);
+  server.on("/schedule", HTTP_POST, handleSetSchedule);
+  server.on("/schedule", HTTP_DELETE, handleDeleteSchedule);
+
+  // Network services and inputs share the time between frames. The audio
+  // sampler keeps its own deadlines, so it is polled on every pass. The
+  // services sit idle until startNetwork() has brought up what they use.
+  schedulerAddTask("audio", sampleAudio, 0);
+  schedulerAddTask("realtime", realtimePoll, 1);
+  schedulerAddTask("ota", handleOTA, 20);
+  schedulerAddTask("http", handleHTTP, 5);
+  schedulerAddTask("mqtt", maintainMQTT, 10);
+  schedulerAddTask("publish", flushMQTTState, MQTT_PUBLISH_WINDOW_MS);
+  schedulerAddTask("events", publishStateEvents, EVENTS_INTERVAL_MS);
+  schedulerAddTask("telnet", handleTelnet, 20);
+  schedulerAddTask("button", checkModeButton, 10);
+  schedulerAddTask("heap", profileSampleHeap, 1000);
+  schedulerAddTask("clock", disciplineClock, SHOWCLOCK_POLL_MS);
+  schedulerAddTask("network", startNetwork, 50);
+  schedulerAddTask("save", saveState, 100);
+  schedulerAddTask("schedule", runSchedule, 1000);
+  schedulerAddTask("idle", checkIdle, 100);
+  lastFrameUs = halMicros();
+  schedulerBegin(1000000L / FRAME_RATE_HZ, renderFrame);
 }
@@ -0,0 +1,180 @@
+#include "modes.h"
+
+// One set lit at level (clamped to 0-255), the other off
+static Frame showSet(bool setA, int level)
+{
+  uint8_t value = level < 0 ? 0 : level > 255 ? 255 : level;
+  return setA ? Frame{value, 0} : Frame{0, value};
+}
+
+#define MODE_NAME(id, name, ms, render) name,
+#define MODE_STEP(id, name, ms, render) ms,
+#define MODE_STEP_RATE(id, name, ms, render) reciprocal(ms),
+#define MODE_RENDERER(id, name, ms, render) render,
+
+// Reciprocals of the step and cycle lengths, worked out at compile time.
+// Rounded up, they keep every step boundary exact over a whole cycle.
+constexpr uint32_t reciprocal(uint32_t ms)
+{
+  return (0xffffffffULL + ms) / ms; // 2^32 / ms, rounded up
+}
+
+static constexpr uint16_t stepMs[MODE_COUNT] = {LIGHT_MODES(MODE_STEP)};
+static constexpr uint32_t stepRates[MODE_COUNT] = {LIGHT_MODES(MODE_STEP_RATE)};
+
+// Steps taken by time t, counted round a cycle of count steps. The first
+// step is taken as the mode starts.
+static uint32_t stepsAt(uint32_t t, LightMode mode, uint32_t count)
+{
+  uint32_t steps = ((uint64_t)t * stepRates[mode] >> 32) + 1;
+  return steps < count ? steps : steps - count;
+}
+
+// Both fades go from dark to full in 51 steps of 5, Fade All over four
+// ramps (up and down on each set) and Fade Alternate over two
+#define FADE_STEPS 51
+#define FADE_ALL_RAMPS 4
+#define FADE_ALTERNATE_RAMPS 2
+
+static constexpr uint32_t fadeRamp(LightMode mode)
+{
+  return FADE_STEPS * stepMs[mode];
+}
+
+// t times these is how far t is into a fade's cycle, as a Q0.32 phase
+static constexpr uint32_t fadeAllRate = reciprocal(FADE_ALL_RAMPS * fadeRamp(FADE_ALL));
+static constexpr uint32_t fadeAlternateRate = reciprocal(FADE_ALTERNATE_RAMPS * fadeRamp(FADE_ALTERNATE));
+
+// The fade cycles are short enough that the phase stays within 32 bits
+constexpr bool phaseFits(uint32_t cycle, uint32_t rate)
+{
+  return (uint64_t)(cycle - 1) * rate < (1ULL << 32);
+}
+
+static Frame renderAllOn(uint32_t /* t */, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Both sets lit: the output engine alternates them every multiplex slot
+  return {maxBrightness, maxBrightness};
+}
+
+static Frame renderAlternateFlash(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Set B first, then flip every step
+  return showSet(stepsAt(t, ALTERNATE_FLASH, 2) == 0, maxBrightness);
+}
+
+static Frame renderFadeAll(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Both sets of lights fade up and down together, swapping sets at the
+  // bottom of each fade. Starts at the top of set A's fade, a ramp in.
+  uint32_t phase = t * fadeAllRate + 0x40000000;
+  bool setA = phase < 0x80000000;
+  return showSet(setA, scale8(triangle8(phase >> 15), maxBrightness));
+}
+
+static Frame renderFadeAlternate(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Cross-fade between the sets: one fades up while the other fades down.
+  // Starts with set A at the top.
+  uint32_t phase = t * fadeAlternateRate + 0x80000000;
+  uint8_t a = scale8(triangle8(phase >> 16), maxBrightness);
+  return {a, (uint8_t)(maxBrightness - a)};
+}
+
+// Twinkles before the sequence repeats, so that it has a cycle too
+#define TWINKLE_CYCLE 65536
+
+static constexpr uint32_t twinkleSlot = stepMs[TWINKLE] + 30;
+static constexpr uint32_t twinkleRate = reciprocal(twinkleSlot);
+
+static Frame renderTwinkle(uint32_t t, uint8_t maxBrightness, uint32_t seed)
+{
+  // Random set at a random level from 40% up, each twinkle held 60-100 ms.
+  // Twinkle k starts up to 20 ms into slot k, so the one showing is found
+  // without walking the ones before it.
+  uint32_t k = (uint64_t)t * twinkleRate >> 32;
+  if (k > 0 && t < k * twinkleSlot + modeRandom(seed, 2 * k) % 21)
+  {
+    k--;
+  }
+  uint32_t r = modeRandom(seed, 2 * k + 1);
+  uint8_t level = 100 + (r >> 8) % 156;
+  return showSet(r % 10 > 5, scale8(level, maxBrightness));
+}
+
+static Frame renderChase(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Five positions on set A, then five on set B; brightness follows
+  // sin(PI * position / 5)
+  uint32_t position = stepsAt(t, CHASE, 10);
+  int minBright = maxBrightness * 2 / 5;
+  int brightness = minBright + (((maxBrightness - minBright) * sin16(position * (0x10000 / 10))) >> 15);
+  return showSet(position < 5, brightness);
+}
+
+static Frame renderMeteor(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // A meteor flares up and fades on set A, then on set B
+  uint32_t position = stepsAt(t, METEOR, 20);
+  bool setA = position < 10;
+  uint32_t step = setA ? position : position - 10;
+  int stepBright = step < 5 ? step * 50 : 255 - (step - 5) * 50;
+  return showSet(setA, div255(stepBright * maxBrightness));
+}
+
+static Frame renderMusicPulse(uint32_t t, uint8_t maxBrightness, uint32_t /* seed */)
+{
+  // Music Sync without music: half a sine per set, sin(PI * phase / 50)
+  uint32_t phase = stepsAt(t, MUSIC_SYNC, 100);
+  bool setA = phase < 50;
+  int minBright = maxBrightness * 2 / 5;
+  int brightRange = maxBrightness - minBright;
+  int brightness = minBright + ((brightRange * sin16((setA ? phase : phase - 50) * (0x8000 / 50))) >> 15);
+  return showSet(setA, brightness);
+}
+
+static constexpr uint32_t cycleMs(LightMode mode)
+{
+  return mode == ALTERNATE_FLASH  ? 2 * stepMs[mode]
+         : mode == FADE_ALL       ? FADE_ALL_RAMPS * fadeRamp(mode)
+         : mode == FADE_ALTERNATE ? FADE_ALTERNATE_RAMPS * fadeRamp(mode)
+         : mode == TWINKLE        ? TWINKLE_CYCLE * twinkleSlot
+         : mode == CHASE          ? 10 * stepMs[mode]
+         : mode == METEOR         ? 20 * stepMs[mode]
+         : mode == MUSIC_SYNC     ? 100 * stepMs[mode]
+                                  : stepMs[ALL_ON]; // Steady
+}
+
+// Counting steps by the rounded-up reciprocal gives t / ms exactly for
+// every t within the cycle
+constexpr bool stepsExact(uint32_t cycle, uint32_t ms)
+{
+  return (uint64_t)cycle * ((uint64_t)reciprocal(ms) * ms - (1ULL << 32)) < (1ULL << 32);
+}
+static_assert(stepsExact(cycleMs(ALTERNATE_FLASH), stepMs[ALTERNATE_FLASH]), "Alternate Flash steps");
+static_assert(stepsExact(cycleMs(TWINKLE), twinkleSlot), "Twinkle slots");
+static_assert(stepsExact(cycleMs(CHASE), stepMs[CHASE]), "Chase steps");
+static_assert(stepsExact(cycleMs(METEOR), stepMs[METEOR]), "Meteor steps");
+static_assert(stepsExact(cycleMs(MUSIC_SYNC), stepMs[MUSIC_SYNC]), "Music Sync steps");
+static_assert(phaseFits(cycleMs(FADE_ALL), fadeAllRate), "Fade All cycle");
+static_assert(phaseFits(cycleMs(FADE_ALTERNATE), fadeAlternateRate), "Fade Alternate cycle");
+
+const char *const modeNames[MODE_COUNT] = {LIGHT_MODES(MODE_NAME)};
+const uint16_t modeStepMs[MODE_COUNT] = {LIGHT_MODES(MODE_STEP)};
+static const ModeRenderer renderers[MODE_COUNT] = {LIGHT_MODES(MODE_RENDERER)};
+
+uint32_t modeCycleMs(LightMode mode)
+{
+  return cycleMs(mode);
+}
+
+Frame renderMode(LightMode mode, uint32_t t, uint8_t maxBrightness, uint32_t seed)
+{
+  mode = mode < MODE_COUNT ? mode : ALL_ON;
+  uint32_t cycle = cycleMs(mode);
+  if (t >= cycle)
+  {
+    t %= cycle;
+  }
+  return renderers[mode](t, maxBrightness, seed);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include "fixed.h"
+#include "output.h"
+
+// Built-in light modes as pure functions of time. A renderer computes its
+// frame from (t, maxBrightness, seed) alone: t is the show time in ms into
+// the mode, already scaled by the speed, and the seed drives a
+// counter-based PRNG. Nothing carries over from one frame to the next, so a
+// dropped frame costs nothing, any point in the show can be rendered
+// directly, and a speed change alters how fast t runs but never where it is.
+//
+// Pattern slots follow the built-in modes: mode MODE_COUNT + n plays the
+// pattern in slot n.
+// X(id, name, ms, render): the name is what Home Assistant, Telnet and
+// /status show; ms is the mode's step at 1x speed (one flash, chase
+// position or fade increment of 5).
+#define LIGHT_MODES(X)                                          \
+  X(ALL_ON, "All On", 20, renderAllOn)                          \
+  X(ALTERNATE_FLASH, "Alternate Flash", 500, renderAlternateFlash) \
+  X(FADE_ALL, "Fade All", 30, renderFadeAll)                    \
+  X(FADE_ALTERNATE, "Fade Alternate", 30, renderFadeAlternate)  \
+  X(TWINKLE, "Twinkle", 50, renderTwinkle)                      \
+  X(CHASE, "Chase", 100, renderChase)                           \
+  X(METEOR, "Meteor", 50, renderMeteor)                         \
+  X(MUSIC_SYNC, "Music Sync", 30, renderMusicPulse)
+
+#define MODE_ENUM(id, name, ms, render) id,
+
+enum LightMode : uint8_t
+{
+  LIGHT_MODES(MODE_ENUM)
+  MODE_COUNT
+};
+
+// Every controller uses the same seed, so trees started together twinkle
+// together
+#ifndef MODE_SEED
+#define MODE_SEED 0x5eed7ee5
+#endif
+
+typedef Frame (*ModeRenderer)(uint32_t t, uint8_t maxBrightness, uint32_t seed);
+
+extern const char *const modeNames[MODE_COUNT];
+extern const uint16_t modeStepMs[MODE_COUNT];
+
+// The renderers work within one cycle and count steps by multiplying by
+// reciprocals, so a frame costs no divide. A t past the cycle is wrapped
+// first, which does divide; the frame path passes wrapped times
+// (showWrap()), so it never gets there.
+Frame renderMode(LightMode mode, uint32_t t, uint8_t maxBrightness, uint32_t seed);
+
+// Every mode repeats: rendering at t and at t plus this many ms gives the
+// same frame
+uint32_t modeCycleMs(LightMode mode);
+
+// The nth number of the sequence for seed, computed directly rather than
+// by stepping a generator (Wellons' lowbias32 hash)
+inline uint32_t modeRandom(uint32_t seed, uint32_t n)
+{
+  uint32_t x = seed ^ (n * 0x9e3779b9u);
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Show time: real microseconds times the Q8.8 speed. Summing it is exact,
+// so the same real time at the same speeds always comes to the same t
+// however it was split into frames.
+typedef uint64_t ShowTime;
+
+inline ShowTime showAdvance(uint32_t elapsedUs, q8_8_t speed)
+{
+  return (ShowTime)elapsedUs * speed;
+}
+
+inline ShowTime showAt(uint32_t ms)
+{
+  return (ShowTime)ms * 256000;
+}
+
+// The same point in the mode's cycle, within the first one. Show time kept
+// wrapped never outgrows showMs(), however long the mode runs.
+inline ShowTime showWrap(ShowTime time, LightMode mode)
+{
+  ShowTime cycle = showAt(modeCycleMs(mode));
+  return time < cycle ? time : time % cycle;
+}
+
+// Whole ms of show time; only a wrapped time is sure to fit
+inline uint32_t showMs(ShowTime time)
+{
+  return time / 256000;
+}
@@ -0,0 +1,249 @@
+#ifdef NATIVE_BUILD
+
+// Host-side audio tooling for the Music Sync detector: WAV loading for the
+// runner (--wav feeds A0), offline detection against labelled onsets
+// (--detect) and a synthetic accuracy/cost benchmark for --bench.
+
+#include <Arduino.h>
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+#include "audio.h"
+
+// Load a PCM (8/16-bit) or float WAV as 10-bit A0 samples at AUDIO_SAMPLE_HZ.
+// Channels are mixed down and each output sample averages the input
+// samples it covers, which doubles as a crude anti-aliasing filter.
+bool loadWav(const char *path, std::vector<uint16_t> &samples)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    printf("%s: cannot open\n", path);
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    data.insert(data.end(), buffer, buffer + n);
+  }
+  fclose(file);
+
+  auto u16 = [&](size_t at) { return (uint32_t)(data[at] | data[at + 1] << 8); };
+  auto u32 = [&](size_t at) { return u16(at) | u16(at + 2) << 16; };
+  if (data.size() < 12 || memcmp(data.data(), "RIFF", 4) || memcmp(data.data() + 8, "WAVE", 4))
+  {
+    printf("%s: not a WAV file\n", path);
+    return false;
+  }
+
+  uint32_t format = 0, channels = 0, rate = 0, bits = 0;
+  size_t pcm = 0, pcmSize = 0;
+  for (size_t at = 12; at + 8 <= data.size();)
+  {
+    uint32_t size = u32(at + 4);
+    if (!memcmp(data.data() + at, "fmt ", 4) && at + 24 <= data.size())
+    {
+      format = u16(at + 8);
+      channels = u16(at + 10);
+      rate = u32(at + 12);
+      bits = u16(at + 22);
+    }
+    else if (!memcmp(data.data() + at, "data", 4))
+    {
+      pcm = at + 8;
+      pcmSize = min<size_t>(size, data.size() - pcm);
+    }
+    at += 8 + size + (size & 1);
+  }
+  bool supported = (format == 1 && (bits == 8 || bits == 16)) || (format == 3 && bits == 32);
+  if (!pcm || !channels || !rate || !supported)
+  {
+    printf("%s: only 8/16-bit PCM and 32-bit float WAV are supported\n", path);
+    return false;
+  }
+
+  size_t frameBytes = channels * bits / 8;
+  size_t frames = pcmSize / frameBytes;
+  auto frameValue = [&](size_t frame)
+  {
+    double sum = 0;
+    for (uint32_t c = 0; c < channels; c++)
+    {
+      const uint8_t *p = data.data() + pcm + frame * frameBytes + c * bits / 8;
+      if (bits == 8)
+        sum += (p[0] - 128) / 128.0;
+      else if (bits == 16)
+        sum += (int16_t)(p[0] | p[1] << 8) / 32768.0;
+      else
+      {
+        float f;
+        memcpy(&f, p, 4);
+        sum += f;
+      }
+    }
+    return sum / channels;
+  };
+
+  samples.clear();
+  for (size_t out = 0;; out++)
+  {
+    size_t first = (uint64_t)out * rate / AUDIO_SAMPLE_HZ;
+    size_t last = (uint64_t)(out + 1) * rate / AUDIO_SAMPLE_HZ;
+    if (last > frames)
+    {
+      break;
+    }
+    double sum = 0;
+    for (size_t frame = first; frame < max(last, first + 1); frame++)
+    {
+      sum += frameValue(frame);
+    }
+    double value = sum / max<size_t>(last - first, 1);
+    samples.push_back((uint16_t)constrain(512 + value * 511, 0.0, 1023.0));
+  }
+  return true;
+}
+
+// Run the detector over samples; returns the sample index each onset was reported at,
+// and, if asked, the host time per sample in ns
+static std::vector<size_t> detect(const std::vector<uint16_t> &samples, double *nsPerSample = nullptr)
+{
+  std::vector<size_t> onsets;
+  audioBegin();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    audioPush(samples[i]);
+    if (audioProcess())
+    {
+      onsets.push_back(i);
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  if (nsPerSample)
+  {
+    *nsPerSample = samples.empty() ? 0 : ns / samples.size();
+  }
+  return onsets;
+}
+
+// Match detections to labelled onsets: a hit is the first detection within
+// 50 ms after the true onset
+static void evaluate(const std::vector<double> &truth, const std::vector<size_t> &detected)
+{
+  const double window = 0.050;
+  std::vector<bool> used(detected.size(), false);
+  unsigned hits = 0;
+  double latencySum = 0, latencyMax = 0;
+  for (double t : truth)
+  {
+    for (size_t d = 0; d < detected.size(); d++)
+    {
+      // Reported at the end of the sample's period
+      double at = (detected[d] + 1) / (double)AUDIO_SAMPLE_HZ;
+      if (!used[d] && at >= t && at - t <= window)
+      {
+        used[d] = true;
+        hits++;
+        latencySum += at - t;
+        latencyMax = max(latencyMax, at - t);
+        break;
+      }
+    }
+  }
+  unsigned falsePositives = detected.size() - hits;
+  printf("onsets %zu, detected %zu: hits %u, missed %zu, false %u", truth.size(), detected.size(), hits,
+         truth.size() - hits, falsePositives);
+  if (hits)
+  {
+    printf(", latency mean %.1f ms, max %.1f ms", latencySum / hits * 1000, latencyMax * 1000);
+  }
+  printf("\n");
+}
+
+// --detect FILE.wav [--onsets LABELS]: labels are onset times in seconds,
+// one per line (the first column of an Audacity label track works)
+int runDetector(const char *wavPath, const char *onsetsPath)
+{
+  std::vector<uint16_t> samples;
+  if (!loadWav(wavPath, samples))
+  {
+    return 1;
+  }
+
+  double ns;
+  std::vector<size_t> detected = detect(samples, &ns);
+  for (size_t index : detected)
+  {
+    printf("%.3f\n", (index + 1) / (double)AUDIO_SAMPLE_HZ);
+  }
+  printf("%zu samples at %d Hz, %.1f host ns per sample, %u dropped\n", samples.size(), AUDIO_SAMPLE_HZ, ns,
+         audioStats().dropped);
+
+  if (onsetsPath)
+  {
+    FILE *file = fopen(onsetsPath, "r");
+    if (!file)
+    {
+      printf("%s: cannot open\n", onsetsPath);
+      return 1;
+    }
+    std::vector<double> truth;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+      double t;
+      if (sscanf(line, "%lf", &t) == 1)
+      {
+        truth.push_back(t);
+      }
+    }
+    fclose(file);
+    evaluate(truth, detected);
+  }
+  return 0;
+}
+
+// Synthetic track with known onsets: kick drums (decaying 55 Hz bursts) on
+// a loose 120 BPM grid over a bass line, hi-hat noise and ADC noise
+void benchAudio()
+{
+  const double seconds = 60;
+  std::vector<double> truth;
+  std::vector<double> signal((size_t)(seconds * AUDIO_SAMPLE_HZ), 0.0);
+  uint32_t seed = 12345;
+  auto noise = [&]()
+  {
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) / 8388608.0 - 1.0;
+  };
+
+  for (double t = 1.0; t < seconds - 1; t += 0.5 + noise() * 0.05)
+  {
+    truth.push_back(t);
+    for (size_t i = 0; i < 0.15 * AUDIO_SAMPLE_HZ; i++)
+    {
+      double dt = i / (double)AUDIO_SAMPLE_HZ;
+      signal[(size_t)(t * AUDIO_SAMPLE_HZ) + i] += 0.6 * exp(-dt / 0.04) * sin(2 * PI * 55 * dt);
+    }
+  }
+  std::vector<uint16_t> samples;
+  for (size_t i = 0; i < signal.size(); i++)
+  {
+    double t = i / (double)AUDIO_SAMPLE_HZ;
+    double bass = 0.1 * sin(2 * PI * 82 * t) * (fmod(t, 2.0) < 1.0 ? 1 : 0.5);
+    double hat = fmod(t + 0.25, 0.5) < 0.02 ? 0.15 * noise() : 0;
+    double value = signal[i] + bass + hat + 0.01 * noise();
+    samples.push_back((uint16_t)constrain(512 + value * 511, 0.0, 1023.0));
+  }
+
+  double ns;
+  std::vector<size_t> detected = detect(samples, &ns);
+  printf("\nmusic sync detector, synthetic %.0f s track at %d Hz: %.1f host ns per sample\n", seconds,
+         AUDIO_SAMPLE_HZ, ns);
+  evaluate(truth, detected);
+}
+
+#endif
@@ -0,0 +1,676 @@
+#ifdef NATIVE_BUILD
+
+// Micro-benchmarks for the native runner (--bench). Timings are host
+// nanoseconds, not ESP8266 cycles: they compare two paths on this machine
+// only. The host's FPU makes float as cheap as integer maths, where the
+// ESP8266 runs it in software (a float divide is hundreds of cycles), so
+// the float/fixed ratios here understate what the fixed-point paths save
+// on the device. Counting device cycles needs halCycleCount() on the
+// ESP8266 itself.
+
+#include <Arduino.h>
+#include <NativeSim.h>
+#include <PubSubClient.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "fixed.h"
+#include "hal.h"
+#include "modes.h"
+#include "output.h"
+#include "pattern.h"
+#include "schedule.h"
+#include "showclock.h"
+#include "transition.h"
+
+void benchAudio();
+void mqttCallback(char *topic, byte *payload, unsigned int length);
+void publishHomeAssistantDiscovery();
+extern PubSubClient mqttClient;
+
+static volatile int sink;
+static volatile float speeds[] = {0.1f, 0.5f, 1.0f, 1.5f, 2.5f, 5.0f};
+static volatile q8_8_t speedsQ8[] = {26, 128, 256, 384, 640, 1280};
+
+static double hostNsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Body>
+static double nsPerCall(Body body, uint32_t iterations)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    body(i);
+  }
+  return hostNsSince(start) / iterations;
+}
+
+static void report(const char *name, double floatNs, double fixedNs, int maxError)
+{
+  printf("%-16s %10.2f %10.2f %11.2f %6d\n", name, floatNs, fixedNs, fixedNs > 0 ? floatNs / fixedNs : 0, maxError);
+}
+
+// Reference implementations of the float path the animations used to take
+static int chaseFloat(int step, int maxBrightness)
+{
+  int minBright = maxBrightness * 0.4;
+  return minBright + (maxBrightness - minBright) * sin((PI * step) / 5);
+}
+
+static int chaseFixed(int step, int maxBrightness)
+{
+  int minBright = maxBrightness * 2 / 5;
+  return minBright + (((maxBrightness - minBright) * sin16(step * (0x10000 / 10))) >> 15);
+}
+
+static int pulseFloat(int phase, int maxBrightness)
+{
+  int minBright = maxBrightness * 0.4;
+  return minBright + (maxBrightness - minBright) * sin((PI * phase) / 50);
+}
+
+static int pulseFixed(int phase, int maxBrightness)
+{
+  int minBright = maxBrightness * 2 / 5;
+  return minBright + (((maxBrightness - minBright) * sin16(phase * (0x8000 / 50))) >> 15);
+}
+
+static int meteorFloat(int stepBright, int maxBrightness)
+{
+  return map(stepBright, 0, 255, 0, maxBrightness);
+}
+
+static int meteorFixed(int stepBright, int maxBrightness)
+{
+  return div255(stepBright * maxBrightness);
+}
+
+// Largest difference between the two paths over every input they see
+template <typename A, typename B>
+static int maxError(A reference, B candidate, int inputs)
+{
+  int worst = 0;
+  for (int maxBrightness = 0; maxBrightness <= 255; maxBrightness++)
+  {
+    for (int input = 0; input < inputs; input++)
+    {
+      // Negative results are clamped by setBrightness(), so compare what reaches the pin
+      int a = constrain(reference(input, maxBrightness), 0, 255);
+      int b = constrain(candidate(input, maxBrightness), 0, 255);
+      worst = max(worst, abs(a - b));
+    }
+  }
+  return worst;
+}
+
+// tools/patterns/fade-all.txt and meteor.txt
+static const uint8_t fadeAllPattern[] = {
+    'T', 'L', 'P', 0x01, 16, 'F', 'a', 'd', 'e', ' ', 'A', 'l', 'l', ' ', 'P', 'a', 't', 't', 'e', 'r', 'n',
+    0x01, 0xff, 0x00, 0x00, 0xfa, 0x05,
+    0x01, 0x00, 0x00, 0x00, 0xfa, 0x05,
+    0x01, 0x00, 0xff, 0x00, 0xfa, 0x05,
+    0x01, 0x00, 0x00, 0x00, 0xfa, 0x05};
+
+static const uint8_t meteorPattern[] = {
+    'T', 'L', 'P', 0x01, 14, 'M', 'e', 't', 'e', 'o', 'r', ' ', 'P', 'a', 't', 't', 'e', 'r', 'n',
+    0x01, 0xfa, 0x00, 0x00, 0xfa, 0x00,
+    0x01, 0x05, 0x00, 0x00, 0xfa, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0xfa, 0x00, 0xfa, 0x00,
+    0x01, 0x00, 0x05, 0x00, 0xfa, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+static PatternPlayer player;
+static const q16_16_t frameAdvance = toQ16_16(4); // 250 fps at 1x
+
+// One frame of a built-in mode, as renderFrame() runs it
+static ShowTime benchShowTime;
+
+template <LightMode mode>
+static void modeFrameCycle(uint32_t)
+{
+  benchShowTime = showWrap(benchShowTime + showAdvance(4000, 256), mode);
+  Frame frame = renderMode(mode, showMs(benchShowTime), 255, MODE_SEED);
+  sink = frame.a + frame.b;
+}
+
+static void patternFrameCycle(uint32_t)
+{
+  patternAdvance(player, frameAdvance);
+  Frame frame = patternFrame(player, 255);
+  sink = frame.a + frame.b;
+}
+
+static void comparePattern(const char *name, void (*mode)(uint32_t), const uint8_t *image, size_t size, uint32_t iterations)
+{
+  const char *error = patternValidate(image, size, nullptr);
+  if (error)
+  {
+    printf("%-16s %s\n", name, error);
+    return;
+  }
+  uint8_t header = 5 + image[4];
+  patternStart(player, image + header, size - header);
+  benchShowTime = 0;
+
+  double modeNs = nsPerCall(mode, iterations);
+  double patternNs = nsPerCall(patternFrameCycle, iterations);
+  printf("%-16s %10.2f %10.2f %8.2fx\n", name, modeNs, patternNs, modeNs > 0 ? patternNs / modeNs : 0);
+}
+
+// Built-in modes as functions of time: what a frame costs, and checks that
+// output does not depend on how the time was split into frames. For each
+// mode one run renders every 4 ms frame and another drops frames at random
+// (up to 15 in a row); they must agree wherever both render. The speed
+// changes mid-run, which must not move t by more than one frame's worth at
+// the new speed (10 ms at 2.5x). Each frame is also checked against the
+// same point one cycle on, which phase locking relies on.
+static void benchModes()
+{
+  printf("\n%-16s %10s %10s %10s %10s\n", "mode", "ns/frame", "mismatch", "max t step", "cycle err");
+  const uint32_t frames = 250 * 600; // Ten minutes
+  for (uint8_t mode = 0; mode < MODE_COUNT; mode++)
+  {
+    LightMode lightMode = static_cast<LightMode>(mode);
+    uint32_t cycle = modeCycleMs(lightMode);
+    uint32_t frameT = 0;
+    double ns = nsPerCall([lightMode, cycle, &frameT](uint32_t)
+                          {
+                            // Kept within the cycle, as the frame path keeps it
+                            frameT = frameT + 4 < cycle ? frameT + 4 : frameT + 4 - cycle;
+                            Frame frame = renderMode(lightMode, frameT, 255, MODE_SEED);
+                            sink = frame.a + frame.b;
+                          },
+                          frames);
+
+    ShowTime steady = 0, dropping = 0;
+    uint32_t skip = 0, mismatches = 0, worstJump = 0, cycleErrors = 0;
+    uint32_t lastMs = 0;
+    for (uint32_t i = 1; i <= frames; i++)
+    {
+      // 1x for the first half, then 2.5x, then 0.3x
+      q8_8_t speed = i < frames / 2 ? 256 : i < 3 * frames / 4 ? 640 : 77;
+      steady += showAdvance(4000, speed);
+      uint32_t t = showMs(steady);
+      Frame expected = renderMode(lightMode, t, 200, MODE_SEED);
+      Frame repeat = renderMode(lightMode, t + cycle, 200, MODE_SEED);
+      cycleErrors += repeat.a != expected.a || repeat.b != expected.b;
+
+      worstJump = max(worstJump, t - lastMs);
+      lastMs = t;
+
+      // Frames the dropping run misses still pass time, just unrendered
+      dropping += showAdvance(4000, speed);
+      if (skip > 0)
+      {
+        skip--;
+      }
+      else
+      {
+        Frame frame = renderMode(lightMode, showMs(dropping), 200, MODE_SEED);
+        mismatches += frame.a != expected.a || frame.b != expected.b;
+        skip = modeRandom(1, i) % 64 < 4 ? modeRandom(2, i) % 16 : 0;
+      }
+
+    }
+    printf("%-16s %10.2f %10u %7u ms %10u\n", modeNames[mode], ns, mismatches, worstJump, cycleErrors);
+  }
+}
+
+// A controller in the show clock simulation. Its local clock gains
+// driftPpm on true time from boot, and its system clock is stepped to true
+// time, give or take the NTP jitter, at every SNTP update.
+struct SimController
+{
+  uint64_t bootUs;
+  int32_t driftPpm;
+  uint32_t id;
+  ShowClock clock;
+  ShowTime showTime;
+  LightMode mode;
+  q8_8_t speed;
+  uint64_t lastLocalUs;
+  int64_t phaseError;
+};
+
+static uint64_t simLocal(const SimController &c, uint64_t trueUs)
+{
+  uint64_t sinceBoot = trueUs - c.bootUs;
+  return sinceBoot + (int64_t)sinceBoot * c.driftPpm / 1000000;
+}
+
+static uint64_t simWall(const SimController &c, uint64_t localUs, uint32_t jitterUs)
+{
+  uint64_t interval = (uint64_t)SHOWCLOCK_NTP_INTERVAL_MS * 1000;
+  uint64_t index = localUs / interval;
+  uint64_t update = index * interval;
+  int64_t jitter = jitterUs ? (int64_t)(modeRandom(c.id, index) % (2 * jitterUs + 1)) - jitterUs : 0;
+  return 1766599200000000ULL + c.bootUs + update - (int64_t)update * c.driftPpm / 1000000 + jitter + (localUs - update);
+}
+
+static ShowTime simPhase(const SimController &c, uint64_t localUs)
+{
+  return showPhase(c.clock.now(localUs), c.speed, showAt(modeCycleMs(c.mode)));
+}
+
+// Advance a controller to true time trueUs: clock samples every second and
+// frames every 4 ms of its local time
+static void simRun(SimController &c, uint64_t trueUs, uint32_t jitterUs)
+{
+  uint64_t local = simLocal(c, trueUs);
+  if (local / 4000 == c.lastLocalUs / 4000)
+  {
+    return;
+  }
+  if (local / 1000000 != c.lastLocalUs / 1000000 || c.lastLocalUs == 0)
+  {
+    c.clock.sample(local, simWall(c, local, jitterUs));
+  }
+  ShowTime advance = showAdvance(local - c.lastLocalUs, c.speed);
+  c.showTime = showLock(c.showTime, advance, simPhase(c, local), showAt(modeCycleMs(c.mode)), c.phaseError);
+  c.lastLocalUs = local;
+}
+
+// Two controllers booted at different times, with crystals drifting apart
+// and NTP replies jittered, play Fade All for two hours; the speed changes
+// at 90 minutes and the mode at 100, each reaching the two controllers 40 ms
+// apart. Skew is the difference between their show clocks at the same true
+// time, phase how far apart the animations are in ms of the mode at 1x:
+// worst while the clocks learn their drift (the first half hour), and 99th
+// percentile and worst over the second hour. Relock is how long after the
+// speed change both were within 1 ms of the shared phase.
+static void benchShowClock()
+{
+  struct Scenario
+  {
+    const char *name;
+    int32_t driftA, driftB;
+    uint32_t jitterUs;
+  };
+  static const Scenario scenarios[] = {
+      {"+-30 ppm", 30, -30, 0},
+      {"+-30 ppm, 2 ms", 30, -30, 2000},
+      {"+-100 ppm, 5 ms", 100, -100, 5000},
+  };
+
+  printf("\n%-16s %12s %12s %12s %12s %12s %9s\n", "show clock", "learn skew", "skew p99", "skew max",
+         "phase p99", "phase max", "relock");
+  for (const Scenario &scenario : scenarios)
+  {
+    SimController a = {0, scenario.driftA, 1, ShowClock(), 0, FADE_ALL, 256, 0, 0};
+    SimController b = {7300000, scenario.driftB, 2, ShowClock(), 0, FADE_ALL, 256, 0, 0};
+
+    const uint64_t minute = 60000000, end = 120 * minute, changeSpeed = 90 * minute, changeMode = 100 * minute;
+    const uint64_t lag = 40000;
+    std::vector<int64_t> skews, phases;
+    int64_t learnSkew = 0;
+    uint64_t relockUs = 0;
+    for (uint64_t t = b.bootUs; t < end; t += 1000)
+    {
+      for (SimController *c : {&a, &b})
+      {
+        uint64_t received = c == &a ? 0 : lag;
+        if (t == changeSpeed + received)
+        {
+          c->speed = 384;
+        }
+        if (t == changeMode + received)
+        {
+          c->mode = CHASE;
+          c->showTime = simPhase(*c, simLocal(*c, t));
+        }
+        simRun(*c, t, scenario.jitterUs);
+      }
+      if (t >= changeSpeed + lag + 4000 && !relockUs && max(abs(a.phaseError), abs(b.phaseError)) < (int64_t)showAt(1))
+      {
+        relockUs = t - changeSpeed;
+      }
+      if (t % 100000)
+      {
+        continue;
+      }
+
+      if (!b.clock.stats().synced)
+      {
+        continue;
+      }
+      int64_t skew = (int64_t)(a.clock.now(simLocal(a, t)) - b.clock.now(simLocal(b, t)));
+      skew = skew < 0 ? -skew : skew;
+      if (t < 30 * minute)
+      {
+        learnSkew = max(learnSkew, skew);
+        continue;
+      }
+      if (t < end / 2 || (t >= changeSpeed && t < changeSpeed + minute) || (t >= changeMode && t < changeMode + lag))
+      {
+        continue;
+      }
+      // Each controller's show time now, between its frames
+      ShowTime cycle = showAt(modeCycleMs(a.mode));
+      ShowTime atA = a.showTime + showAdvance(simLocal(a, t) - a.lastLocalUs, a.speed);
+      ShowTime atB = b.showTime + showAdvance(simLocal(b, t) - b.lastLocalUs, b.speed);
+      int64_t apart = (int64_t)((atA + cycle - atB % cycle) % cycle);
+      apart = min(apart, (int64_t)cycle - apart);
+      skews.push_back(skew);
+      phases.push_back(apart / 256);
+    }
+    std::sort(skews.begin(), skews.end());
+    std::sort(phases.begin(), phases.end());
+    printf("%-16s %9.2f ms %9.2f ms %9.2f ms %9.2f ms %9.2f ms %7.1f s\n", scenario.name, learnSkew / 1e3,
+           skews[skews.size() * 99 / 100] / 1e3, skews.back() / 1e3, phases[phases.size() * 99 / 100] / 1e3,
+           phases.back() / 1e3, relockUs / 1e6);
+  }
+}
+
+// MQTT command dispatch: messages per second through the full callback
+// (logging, state changes and the state publish included) and the heap
+// allocations each one makes
+static void benchMqtt()
+{
+  struct Message
+  {
+    const char *name;
+    const char *topic;
+    const char *payload;
+  };
+  static const Message messages[] = {
+      {"light json", "homeassistant/light/christmas_lights/set", "{\"state\":\"ON\",\"brightness\":200}"},
+      {"light fade", "homeassistant/light/christmas_lights/set",
+       "{\"state\":\"ON\",\"brightness\":200,\"transition\":10}"},
+      {"mode", "homeassistant/select/christmas_lights_mode/set", "Twinkle"},
+      {"speed", "homeassistant/number/christmas_lights_speed/set", "1.50"},
+      {"unknown topic", "homeassistant/light/christmas_lights/other", "ON"},
+  };
+  const uint32_t iterations = 200000;
+
+  printf("\n%-16s %12s %10s %12s\n", "mqtt command", "msgs/s", "ns/msg", "allocs/msg");
+  for (const Message &message : messages)
+  {
+    char topic[64];
+    byte payload[64];
+    strcpy(topic, message.topic);
+    size_t length = strlen(message.payload);
+    memcpy(payload, message.payload, length);
+
+    NativeTracked tracked;
+    uint64_t allocations = nativeAllocationCount();
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+      mqttCallback(topic, payload, length);
+    }
+    double ns = hostNsSince(start) / iterations;
+    allocations = nativeAllocationCount() - allocations;
+
+    printf("%-16s %12.0f %10.1f %12.2f\n", message.name, 1e9 / ns, ns,
+           (double)allocations / iterations);
+  }
+
+  // The discovery burst sent on every reconnect
+  mqttClient.connect("bench", "", "");
+  const uint32_t bursts = 20000;
+  NativeTracked tracked;
+  uint64_t allocations = nativeAllocationCount();
+  uint32_t published = PubSubClient::nativePublishCount();
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < bursts; i++)
+  {
+    publishHomeAssistantDiscovery();
+  }
+  double ns = hostNsSince(start) / bursts;
+  allocations = nativeAllocationCount() - allocations;
+  published = PubSubClient::nativePublishCount() - published;
+  printf("%-16s %12s %10.1f %12.2f  (%u of %u messages sent)\n", "discovery", "", ns,
+         (double)allocations / bursts, published, bursts * 3);
+  mqttClient.disconnect();
+}
+
+// A 10 s fade from off to full brightness, run on the device from one
+// command, against Home Assistant stepping the brightness one command per
+// level. The ramp is driven by frames 3-5 ms apart; it has to rise every
+// frame by no more than the time allows and land exactly on the target.
+static void benchTransition()
+{
+  printf("\n%-16s %10s %10s %10s %10s %10s\n", "transition", "messages", "us/fade", "frames", "max step", "end");
+
+  Ramp ramp = {};
+  rampStart(ramp, 255 << 8, 10000);
+  uint32_t frames = 0, elapsed = 0;
+  uint16_t level = 0, maxStep = 0;
+  bool monotonic = true;
+  auto start = std::chrono::steady_clock::now();
+  while (rampRunning(ramp))
+  {
+    uint32_t frameUs = 3000 + modeRandom(1, frames) % 2001;
+    uint16_t next = rampAdvance(ramp, frameUs);
+    monotonic &= next >= level;
+    maxStep = std::max<uint16_t>(maxStep, next - level);
+    level = next;
+    elapsed += frameUs;
+    frames++;
+  }
+  double rampUs = hostNsSince(start) / 1000;
+  printf("%-16s %10u %10.1f %10u %10.2f %10.2f  (%s, %.3f s)\n", "device ramp", 1, rampUs, frames, maxStep / 256.0,
+         level / 256.0, monotonic ? "monotonic" : "NOT MONOTONIC", elapsed / 1e6);
+
+  // The same fade as Home Assistant fakes it: a command per brightness step
+  char topic[] = "homeassistant/light/christmas_lights/set";
+  char payload[64];
+  start = std::chrono::steady_clock::now();
+  for (int bright = 1; bright <= 255; bright++)
+  {
+    int length = snprintf(payload, sizeof(payload), "{\"state\":\"ON\",\"brightness\":%d}", bright);
+    mqttCallback(topic, (byte *)payload, length);
+  }
+  printf("%-16s %10u %10.1f\n", "stepped by HA", 255, hostNsSince(start) / 1000);
+}
+
+// The output stage before and after the gamma table and dithering. Per
+// frame (Fade Alternate): the old path rendered at the brightness, the new
+// one renders at full and looks both sets up in the gamma table, scaling
+// them by the brightness in 16 bits. Per slot: the interrupt's arithmetic. Then a slow fade of one set from off to
+// full in 4096 perceived steps (12 bits), each held for 1024 slots: how many
+// steps come out brighter than the one before, and how bright the first
+// lit step is, as a share of full.
+static uint32_t legacySlotTicks(uint8_t level, uint32_t slotTicks)
+{
+  const uint32_t minPulse = 4 * HAL_TIMER_TICKS_PER_US;
+  uint32_t onTicks = (level * ((slotTicks << 16) / 255)) >> 16;
+  if (onTicks < minPulse)
+  {
+    return onTicks < minPulse / 2 ? 0 : minPulse;
+  }
+  return slotTicks - onTicks < minPulse ? slotTicks : onTicks;
+}
+
+static void benchOutput()
+{
+  outputBegin(OUTPUT_MULTIPLEX_HZ);
+  const uint32_t slotTicks = outputSlotLength();
+  const uint32_t iterations = 2000000;
+
+  // t stays within Fade Alternate's cycle, as the frame path keeps it
+  double legacyFrame = nsPerCall([](uint32_t i)
+                                 {
+                                   Frame frame = renderMode(FADE_ALTERNATE, i * 4 & 2047, i >> 11, MODE_SEED);
+                                   sink = frame.a + frame.b;
+                                 },
+                                 iterations);
+  double frameNs = nsPerCall([](uint32_t i)
+                             {
+                               Frame frame = renderMode(FADE_ALTERNATE, i * 4 & 2047, 255, MODE_SEED);
+                               Duty duty = outputDuty(frame, i >> 11 << 8);
+                               sink = duty.a + duty.b;
+                             },
+                             iterations);
+  double legacySlot = nsPerCall([slotTicks](uint32_t i)
+                                { sink = legacySlotTicks(i, slotTicks); },
+                                iterations);
+  int32_t carried = 0;
+  double slotNs = nsPerCall([&carried](uint32_t i)
+                            { sink = outputSlotTicks(i * 40503u, carried); },
+                            iterations);
+
+  const uint32_t steps = 4096, slots = 1024;
+  uint32_t legacyRising = 0, rising = 0;
+  double legacyFirst = 0, first = 0, legacyLast = 0, last = 0;
+  carried = 0;
+  for (uint32_t step = 1; step < steps; step++)
+  {
+    uint16_t brightness = step * 0xff00 / (steps - 1);
+    uint16_t duty = outputDuty({255, 0}, brightness).a;
+    uint8_t legacyLevel = (brightness + 0x80) >> 8;
+    uint64_t on = 0, legacyOn = 0;
+    for (uint32_t i = 0; i < slots; i++)
+    {
+      on += outputSlotTicks(duty, carried);
+      legacyOn += legacySlotTicks(legacyLevel, slotTicks);
+    }
+    double average = (double)on / slots / slotTicks;
+    double legacyAverage = (double)legacyOn / slots / slotTicks;
+    rising += average > last;
+    legacyRising += legacyAverage > legacyLast;
+    first = first ? first : average;
+    legacyFirst = legacyFirst ? legacyFirst : legacyAverage;
+    last = average;
+    legacyLast = legacyAverage;
+  }
+
+  printf("\n%-16s %10s %10s %10s %10s %10s\n", "output", "ns/frame", "ns/slot", "rising", "bits", "first %");
+  printf("%-16s %10.2f %10.2f %10u %10.1f %10.4f\n", "8-bit linear", legacyFrame, legacySlot, legacyRising,
+         log2(legacyRising + 1.0), legacyFirst * 100);
+  printf("%-16s %10.2f %10.2f %10u %10.1f %10.4f  (gamma %.1f, %s, %u ticks/slot)\n", "gamma+dither", frameNs,
+         slotNs, rising, log2(rising + 1.0), first * 100, (double)OUTPUT_GAMMA, OUTPUT_DITHER ? "dithered" : "rounded",
+         slotTicks);
+}
+
+// The same NOAA equations as sunEvents(), in double precision
+static bool sunEventsDouble(time_t t, double latitude, double longitude, double &rise, double &set)
+{
+  const double radians = 3.14159265358979323846 / 180;
+  double n = floor((t + longitude * 240 - 946728000 + 43200) / 86400.0);
+  double jStar = n - longitude / 360;
+  double anomaly = fmod(357.5291 + 0.98560028 * jStar, 360);
+  double centre = 1.9148 * sin(anomaly * radians) + 0.0200 * sin(2 * anomaly * radians) +
+                  0.0003 * sin(3 * anomaly * radians);
+  double ecliptic = fmod(anomaly + centre + 180 + 102.9372, 360);
+  double transit = 946728000 + (jStar + 0.0053 * sin(anomaly * radians) - 0.0069 * sin(2 * ecliptic * radians)) * 86400;
+  double sinDeclination = sin(ecliptic * radians) * sin(23.4397 * radians);
+  double cosDeclination = cos(asin(sinDeclination));
+  double cosHourAngle = (sin(-0.833 * radians) - sin(latitude * radians) * sinDeclination) /
+                        (cos(latitude * radians) * cosDeclination);
+  if (cosHourAngle <= -1 || cosHourAngle >= 1)
+  {
+    return false;
+  }
+  double halfDay = acos(cosHourAngle) / radians / 360 * 86400;
+  rise = transit - halfDay;
+  set = transit + halfDay;
+  return true;
+}
+
+// Fixed-point sunrise and sunset against the double-precision equations,
+// every day of 2025-2034 at latitudes from 60 S to 70 N. up/down counts
+// days on which the two disagree over whether the sun rises at all.
+static void benchSun()
+{
+  printf("\n%-16s %10s %10s %10s %10s\n", "sun", "days", "max err s", "up/down", "ns");
+  const int32_t latitudes[] = {-60000000, -33868800, 0, 40712800, 51507400, 60169900, 65000000, 70000000};
+  const int32_t longitude = -127800;
+  for (int32_t latitude : latitudes)
+  {
+    uint32_t days = 0, mismatched = 0;
+    double worst = 0;
+    for (time_t t = 1735732800; t < 1735732800 + 3652 * 86400LL; t += 86400)
+    {
+      time_t rise, set;
+      double riseDouble, setDouble;
+      bool fixed = sunEvents(t, latitude, longitude, rise, set);
+      bool reference = sunEventsDouble(t, latitude / 1e6, longitude / 1e6, riseDouble, setDouble);
+      days++;
+      if (fixed != reference)
+      {
+        mismatched++;
+        continue;
+      }
+      if (fixed)
+      {
+        worst = std::max({worst, fabs(rise - riseDouble), fabs(set - setDouble)});
+      }
+    }
+    time_t rise, set;
+    double ns = nsPerCall([&](uint32_t i)
+                          { sink = sunEvents(1735732800 + i * 86400LL, latitude, longitude, rise, set); },
+                          100000);
+    char name[16];
+    snprintf(name, sizeof(name), "lat %+.1f", latitude / 1e6);
+    printf("%-16s %10u %10.0f %10u %10.1f\n", name, days, worst, mismatched, ns);
+  }
+
+  // London on Christmas Eve 2025: 08:05 and 15:55 GMT by the almanac
+  time_t rise, set;
+  sunEvents(1766577600, 51507400, -127800, rise, set);
+  printf("London 2025-12-24: sunrise %02ld:%02ld, sunset %02ld:%02ld UTC\n", (long)(rise % 86400 / 3600),
+         (long)(rise % 3600 / 60), (long)(set % 86400 / 3600), (long)(set % 3600 / 60));
+}
+
+int runBenchmarks()
+{
+  const uint32_t iterations = 2000000;
+
+  printf("%-16s %10s %10s %11s %6s\n", "per frame", "float ns", "fixed ns", "float/fixed", "maxerr");
+
+  // Frame timebase: the old per-mode interval divide vs the show time
+  // advance renderFrame() takes (a multiply by the Q8.8 speed)
+  double floatNs = nsPerCall([](uint32_t i)
+                             { sink = (unsigned long)(30 / speeds[i % 6]); },
+                             iterations);
+  double fixedNs = nsPerCall([](uint32_t i)
+                             { sink = showAdvance(3000 + (i & 2047), speedsQ8[i % 6]) >> 8; },
+                             iterations);
+  report("timebase", floatNs, fixedNs, 0);
+
+  floatNs = nsPerCall([](uint32_t i)
+                      { sink = chaseFloat(i % 10, 255 - (i & 127)); },
+                      iterations);
+  fixedNs = nsPerCall([](uint32_t i)
+                      { sink = chaseFixed(i % 10, 255 - (i & 127)); },
+                      iterations);
+  report("chase", floatNs, fixedNs, maxError(chaseFloat, chaseFixed, 10));
+
+  floatNs = nsPerCall([](uint32_t i)
+                      { sink = pulseFloat(i % 50, 255 - (i & 127)); },
+                      iterations);
+  fixedNs = nsPerCall([](uint32_t i)
+                      { sink = pulseFixed(i % 50, 255 - (i & 127)); },
+                      iterations);
+  report("music sync", floatNs, fixedNs, maxError(pulseFloat, pulseFixed, 50));
+
+  floatNs = nsPerCall([](uint32_t i)
+                      { sink = meteorFloat(i & 255, 255 - (i & 127)); },
+                      iterations);
+  fixedNs = nsPerCall([](uint32_t i)
+                      { sink = meteorFixed(i & 255, 255 - (i & 127)); },
+                      iterations);
+  report("meteor", floatNs, fixedNs, maxError(meteorFloat, meteorFixed, 256));
+
+  printf("\n%-16s %10s %10s %9s\n", "per frame", "mode ns", "pattern ns", "ratio");
+  comparePattern("fade all", modeFrameCycle<FADE_ALL>, fadeAllPattern, sizeof(fadeAllPattern), iterations);
+  comparePattern("meteor", modeFrameCycle<METEOR>, meteorPattern, sizeof(meteorPattern), iterations);
+
+  benchModes();
+  benchOutput();
+  benchShowClock();
+  benchSun();
+
+  benchAudio();
+  benchMqtt();
+  benchTransition();
+
+  return 0;
+}
+
+#endif
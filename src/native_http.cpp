@@ -0,0 +1,336 @@
+#ifdef NATIVE_BUILD
+
+// HTTP from the runner's side: requests are written into in-process
+// connections to the firmware's server and loop() runs until the reply is
+// complete. Used for the runner's setup requests and the soak test
+// (--soak, and test/test_soak).
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <NativeSim.h>
+#include <chrono>
+#include <string>
+#include "native_http.h"
+
+void setup();
+void loop();
+
+extern unsigned long publishChanges[];
+extern unsigned long publishesSent[];
+size_t stateSnapshot(char *buffer, size_t size);
+
+static unsigned long stepUs = 100; // Simulated cost of one loop()
+
+void nativeHttpSetLoopCost(unsigned long loopUs)
+{
+  stepUs = loopUs;
+}
+
+// Length of the first complete response in raw, or 0 if it is not all there
+static size_t responseLength(const std::string &raw)
+{
+  size_t headerEnd = raw.find("\r\n\r\n");
+  if (headerEnd == std::string::npos)
+  {
+    return 0;
+  }
+  headerEnd += 4;
+  std::string headers = raw.substr(0, headerEnd);
+  if (headers.find("Transfer-Encoding: chunked") != std::string::npos)
+  {
+    size_t end = raw.find("\r\n0\r\n\r\n", headerEnd - 2);
+    return end == std::string::npos ? 0 : end + 7;
+  }
+  size_t field = headers.find("Content-Length: ");
+  size_t length = field == std::string::npos ? 0 : strtoul(headers.c_str() + field + 16, nullptr, 10);
+  return raw.size() >= headerEnd + length ? headerEnd + length : 0;
+}
+
+// Status code of a response, with its body de-chunked into body
+static int parseResponse(const std::string &raw, size_t length, std::string *body)
+{
+  int code = 0;
+  sscanf(raw.c_str(), "HTTP/1.%*d %d", &code);
+  if (!body)
+  {
+    return code;
+  }
+  size_t headerEnd = raw.find("\r\n\r\n") + 4;
+  body->clear();
+  if (raw.substr(0, headerEnd).find("Transfer-Encoding: chunked") == std::string::npos)
+  {
+    body->assign(raw, headerEnd, length - headerEnd);
+    return code;
+  }
+  for (size_t at = headerEnd; at < length;)
+  {
+    size_t size = strtoul(raw.c_str() + at, nullptr, 16);
+    at = raw.find("\r\n", at) + 2;
+    body->append(raw, at, size);
+    at += size + 2;
+    if (size == 0)
+    {
+      break;
+    }
+  }
+  return code;
+}
+
+static std::string formatRequest(const char *method, const char *uri, const char *query, const char *body, bool close)
+{
+  char header[256];
+  snprintf(header, sizeof(header),
+           "%s %s%s%s HTTP/1.1\r\nHost: christmas-lights\r\nContent-Type: text/plain\r\n"
+           "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+           method, uri, *query ? "?" : "", query, strlen(body), close ? "close" : "keep-alive");
+  return std::string(header) + body;
+}
+
+// Send one request on connection and run loop() until its reply is in.
+// Returns the status code, or 0 if the server closed or did not answer.
+static int exchange(NativeConnection &connection, const std::string &request, std::string *body)
+{
+  NativeUntracked untracked;
+  connection.rx += request;
+  for (uint32_t loops = 0; loops < 1000000; loops++)
+  {
+    size_t length = responseLength(connection.tx);
+    if (length > 0)
+    {
+      int code = parseResponse(connection.tx, length, body);
+      connection.tx.erase(0, length);
+      return code;
+    }
+    if (!connection.open)
+    {
+      break;
+    }
+    // Only the firmware's allocations count, not the runner's strings
+    {
+      NativeTracked tracked;
+      loop();
+    }
+    nativeAdvanceMicros(stepUs);
+  }
+  return 0;
+}
+
+int nativeHttp(const char *method, const char *uri, const char *query, const char *body, std::string *reply)
+{
+  std::shared_ptr<NativeConnection> connection = WiFiServer::nativeConnect(80);
+  return exchange(*connection, formatRequest(method, uri, query, body, true), reply);
+}
+
+// A GET /events subscriber as the runner sees it: the state put together
+// from the events read so far
+struct EventReader
+{
+  std::shared_ptr<NativeConnection> connection;
+  std::string mode, brightness, speed, state;
+  unsigned long events = 0;
+};
+
+// The value of key ("\"mode\":") in a line of JSON, or "" if it is not there
+static std::string jsonField(const std::string &json, const char *key)
+{
+  size_t at = json.find(key);
+  if (at == std::string::npos)
+  {
+    return "";
+  }
+  at += strlen(key);
+  return json.substr(at, json.find_first_of(",}", at) - at);
+}
+
+static void applyState(EventReader &reader, const std::string &json)
+{
+  const char *keys[] = {"\"mode\":", "\"brightness\":", "\"speed\":", "\"state\":"};
+  std::string *fields[] = {&reader.mode, &reader.brightness, &reader.speed, &reader.state};
+  for (int i = 0; i < 4; i++)
+  {
+    std::string value = jsonField(json, keys[i]);
+    if (!value.empty())
+    {
+      *fields[i] = value;
+    }
+  }
+}
+
+// Read every complete event the subscriber has been sent
+static void readEvents(EventReader &reader)
+{
+  std::string &tx = reader.connection->tx;
+  size_t at = 0;
+  for (size_t end; (end = tx.find("\n\n", at)) != std::string::npos; at = end + 2)
+  {
+    if (tx.compare(at, 6, "data: ") == 0)
+    {
+      applyState(reader, tx.substr(at + 6, end - at - 6));
+      reader.events++;
+    }
+  }
+  tx.erase(0, at);
+}
+
+// Whether the subscriber has arrived at the device's current state
+static bool upToDate(const EventReader &reader)
+{
+  char snapshot[160];
+  stateSnapshot(snapshot, sizeof(snapshot));
+  EventReader current;
+  applyState(current, snapshot);
+  return reader.mode == current.mode && reader.brightness == current.brightness && reader.speed == current.speed &&
+         reader.state == current.state;
+}
+
+// Serve a long mix of requests over keep-alive connections and check that
+// nothing on the request path allocates and the heap ends where it started
+SoakResult soak(unsigned long requests)
+{
+  struct SoakRequest
+  {
+    const char *method;
+    const char *uri;
+    const char *query;
+    const char *body;
+    int code;
+  };
+  static const SoakRequest mix[] = {
+      {"GET", "/", "", "", 200},
+      {"GET", "/status", "", "", 200},
+      {"POST", "/mode", "value=2", "", 200},
+      {"GET", "/metrics", "", "", 200},
+      {"POST", "/brightness", "value=128", "", 200},
+      {"GET", "/patterns", "", "", 200},
+      {"POST", "/speed", "value=1.5", "", 200},
+      {"POST", "/state", "value=off", "", 200},
+      {"POST", "/mode", "value=99", "", 400},
+      {"POST", "/state", "value=ON", "", 200},
+      {"POST", "/config", "", "{\"mode\":\"Twinkle\",\"brightness\":200,\"speed\":2,\"state\":\"on\"}", 200},
+      {"POST", "/config", "", "{\"mode\":0,\"brightness\":300}", 400},
+      {"GET", "/nowhere", "", "", 404},
+      {"POST", "/mode", "value=0", "", 200},
+      {"POST", "/brightness", "value=255", "", 200},
+  };
+  const unsigned long mixSize = sizeof(mix) / sizeof(mix[0]);
+  const unsigned long perConnection = 100; // Then reconnect, as clients do
+
+  setup();
+  std::shared_ptr<NativeConnection> connection = WiFiServer::nativeConnect(80);
+  // One pass first so lazily created state (MQTT session, first frame) is in
+  // the baseline
+  for (unsigned long i = 0; i < mixSize; i++)
+  {
+    exchange(*connection, formatRequest(mix[i].method, mix[i].uri, mix[i].query, mix[i].body, false), nullptr);
+  }
+
+  // Event subscribers alongside: one that keeps reading, one that stops
+  // reading for a few seconds and one that never reads again
+  EventReader reader, resumed, stalled;
+  for (EventReader *subscriber : {&reader, &resumed, &stalled})
+  {
+    subscriber->connection = WiFiServer::nativeConnect(80);
+    exchange(*subscriber->connection, formatRequest("GET", "/events", "", "", false), nullptr);
+  }
+  resumed.connection->stalled = true;
+  stalled.connection->stalled = true;
+  unsigned long resumeAt = nativeMicros() + 3000000;
+
+  NativeUntracked untracked;
+  uint64_t allocationBaseline = nativeAllocationCount();
+  size_t baseline = nativeHeapInUse();
+  size_t lowest = baseline;
+  size_t highest = baseline;
+  unsigned long failures = 0;
+  auto hostStart = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < requests; i++)
+  {
+    if (i % perConnection == 0)
+    {
+      connection = WiFiServer::nativeConnect(80);
+    }
+    const SoakRequest &r = mix[i % mixSize];
+    bool last = i % perConnection == perConnection - 1;
+    int code = exchange(*connection, formatRequest(r.method, r.uri, r.query, r.body, last), nullptr);
+    if (code != r.code)
+    {
+      if (failures++ < 5)
+      {
+        printf("%s %s%s%s: %d, expected %d\n", r.method, r.uri, *r.query ? "?" : "", r.query, code, r.code);
+      }
+    }
+
+    readEvents(reader);
+    if (resumed.connection->stalled && nativeMicros() >= resumeAt)
+    {
+      resumed.connection->stalled = false;
+    }
+    if (!resumed.connection->stalled)
+    {
+      readEvents(resumed);
+    }
+
+    size_t inUse = nativeHeapInUse();
+    lowest = inUse < lowest ? inUse : lowest;
+    highest = inUse > highest ? inUse : highest;
+  }
+  auto hostElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+
+  uint64_t allocations = nativeAllocationCount() - allocationBaseline;
+  size_t final = nativeHeapInUse();
+
+  // Let the last changes reach the subscribers
+  for (int i = 0; i < 100; i++)
+  {
+    {
+      NativeTracked tracked;
+      loop();
+    }
+    nativeAdvanceMicros(1000);
+  }
+  readEvents(reader);
+  readEvents(resumed);
+
+  SoakResult result;
+  result.requests = requests;
+  result.connections = (requests + perConnection - 1) / perConnection;
+  result.unexpected = failures;
+  result.heapBaseline = baseline;
+  result.heapLowest = lowest;
+  result.heapHighest = highest;
+  result.heapFinal = final;
+  result.allocations = allocations;
+  result.readerEvents = reader.events;
+  result.resumedEvents = resumed.events;
+  result.readerInSync = upToDate(reader);
+  result.resumedInSync = upToDate(resumed);
+  result.stalledDropped = !stalled.connection->open;
+  result.hostSeconds = hostElapsed;
+  return result;
+}
+
+bool soakPassed(const SoakResult &result)
+{
+  return result.heapFinal <= result.heapBaseline && result.allocations == 0 && result.unexpected == 0 &&
+         result.readerInSync && result.resumedInSync && result.stalledDropped;
+}
+
+int runSoak(unsigned long requests)
+{
+  SoakResult result = soak(requests);
+  printf("soak: %lu requests on %lu connections in %.3f s host (%.0f requests/s), %lu unexpected replies\n",
+         result.requests, result.connections, result.hostSeconds, result.requests / result.hostSeconds,
+         result.unexpected);
+  printf("heap in use: baseline %zu, min %zu, max %zu, final %zu bytes\n", result.heapBaseline, result.heapLowest,
+         result.heapHighest, result.heapFinal);
+  printf("allocations while serving: %llu\n", (unsigned long long)result.allocations);
+  printf("mqtt state changes: light %lu, mode %lu, speed %lu; publishes: light %lu, mode %lu, speed %lu\n",
+         publishChanges[0], publishChanges[1], publishChanges[2], publishesSent[0], publishesSent[1], publishesSent[2]);
+  printf("events: %lu read by a steady subscriber (%s), %lu by one that paused (%s); one that stopped reading was %s\n",
+         result.readerEvents, result.readerInSync ? "in sync" : "OUT OF SYNC", result.resumedEvents,
+         result.resumedInSync ? "in sync" : "OUT OF SYNC", result.stalledDropped ? "dropped" : "NOT DROPPED");
+  printf("simulated %.1f s\n", nativeMicros() / 1e6);
+  return soakPassed(result) ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+// HTTP from the runner's side (native build only): requests written into
+// in-process connections to the firmware's server, and the soak test.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// One request on a fresh connection; the status code, or 0 without a reply
+int nativeHttp(const char *method, const char *uri, const char *query, const char *body, std::string *reply);
+// Simulated cost of one loop() while waiting for a reply
+void nativeHttpSetLoopCost(unsigned long loopUs);
+
+// What a soak run saw. It passes when the heap ends where it started with
+// no allocation on the request path, every reply is the expected one, the
+// two subscribers that read end on the device's state and the one that
+// stopped reading is dropped.
+struct SoakResult
+{
+  unsigned long requests;
+  unsigned long connections;
+  unsigned long unexpected;  // Replies with another status code than expected
+  size_t heapBaseline;       // Heap in use after the warm-up pass
+  size_t heapLowest;
+  size_t heapHighest;
+  size_t heapFinal;
+  uint64_t allocations;      // Made by the firmware while serving
+  unsigned long readerEvents;
+  unsigned long resumedEvents;
+  bool readerInSync;         // Read steadily throughout
+  bool resumedInSync;        // Stopped reading for 3 s, then went on
+  bool stalledDropped;       // Never read again
+  double hostSeconds;
+};
+
+bool soakPassed(const SoakResult &result);
+
+// Serve requests from a mix of every endpoint; setup() runs first, so once
+// per process
+SoakResult soak(unsigned long requests);
+// soak(), reported on stdout; the runner's exit code
+int runSoak(unsigned long requests);
@@ -0,0 +1,477 @@
+#ifdef NATIVE_BUILD
+
+// Host entry point for [env:native]: runs setup() and loop() against the
+// virtual clock and reports what the L298N outputs did.
+//
+//   .pio/build/native/program --mode 2 --speed 1.5 --seconds 60
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <NativeSim.h>
+#include <PubSubClient.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "audio.h"
+#include "hal.h"
+#include "native_http.h"
+#include "output.h"
+#include "realtime.h"
+
+void setup();
+void loop();
+int runBenchmarks();
+int runDetector(const char *wavPath, const char *onsetsPath);
+bool loadWav(const char *path, std::vector<uint16_t> &samples);
+
+int runPowerCut();
+
+// Time-weighted view of the bridge pins: for each set, how long ENA was
+// high while that set was selected, overall and in each multiplex cycle
+// (the level the eye sees, 0-255)
+struct OutputStats
+{
+  int in1 = LOW;
+  int in2 = LOW;
+  int ena = LOW;
+  uint64_t lastEventUs = 0;
+  uint64_t onUs[2] = {0, 0};
+  uint32_t polaritySwitches = 0;
+  uint32_t enableEdges = 0;
+  uint64_t cycleUs = 0;
+  uint64_t cycleOnUs[2] = {0, 0};
+  uint32_t cycles = 0;
+  uint8_t level[2] = {0, 0};
+  uint8_t peak[2] = {0, 0};
+  uint32_t levelChanges[2] = {0, 0};
+};
+
+static OutputStats stats;
+
+static void endCycle()
+{
+  stats.cycles++;
+  for (int set = 0; set < 2; set++)
+  {
+    uint8_t level = stats.cycleOnUs[set] * 255 / stats.cycleUs;
+    stats.levelChanges[set] += stats.cycles > 1 && level != stats.level[set];
+    stats.level[set] = level;
+    stats.peak[set] = max(stats.peak[set], level);
+    stats.cycleOnUs[set] = 0;
+  }
+}
+
+static void accumulate(uint64_t nowUs)
+{
+  while (stats.lastEventUs < nowUs)
+  {
+    uint64_t cycleEnd = (stats.lastEventUs / stats.cycleUs + 1) * stats.cycleUs;
+    uint64_t until = min(nowUs, cycleEnd);
+    if (stats.ena && stats.in1 != stats.in2)
+    {
+      stats.onUs[stats.in1 ? 0 : 1] += until - stats.lastEventUs;
+      stats.cycleOnUs[stats.in1 ? 0 : 1] += until - stats.lastEventUs;
+    }
+    stats.lastEventUs = until;
+    if (until == cycleEnd)
+    {
+      endCycle();
+    }
+  }
+}
+
+// Output trace (--trace): a record for every change of the bridge outputs,
+// i.e. every change of set or of ENA, timed from the start of the run.
+// FILE.csv gets "us,set,enable" lines (set A, B or -); any other name a
+// compact binary: "TLT" 0x01, then per record a LEB128 varint of
+// (us since the last record << 3 | IN1 | IN2 << 1 | ENA << 2).
+struct OutputTrace
+{
+  FILE *file = nullptr;
+  bool csv = false;
+  uint64_t startUs = 0;
+  uint64_t lastUs = 0;
+  uint8_t written = 0xff; // Last state recorded
+  uint8_t pending = 0;    // Set by the writes at pendingUs, which may not be done
+  uint64_t pendingUs = 0;
+  uint32_t records = 0;
+};
+
+static OutputTrace trace;
+
+static bool traceOpen(const char *path, uint64_t startUs)
+{
+  trace.file = fopen(path, "wb");
+  if (!trace.file)
+  {
+    printf("cannot write %s\n", path);
+    return false;
+  }
+  size_t length = strlen(path);
+  trace.csv = length > 4 && !strcmp(path + length - 4, ".csv");
+  trace.startUs = trace.lastUs = trace.pendingUs = startUs;
+  trace.pending = (stats.in1 ? 1 : 0) | (stats.in2 ? 2 : 0) | (stats.ena ? 4 : 0);
+  fputs(trace.csv ? "us,set,enable\n" : "TLT\x01", trace.file);
+  return true;
+}
+
+static void traceWrite(uint8_t state, uint64_t atUs)
+{
+  if (state == trace.written)
+  {
+    return;
+  }
+  if (trace.csv)
+  {
+    const char *set = (state & 3) == 1 ? "A" : (state & 3) == 2 ? "B" : "-";
+    fprintf(trace.file, "%llu,%s,%d\n", (unsigned long long)(atUs - trace.startUs), set, state >> 2 & 1);
+  }
+  else
+  {
+    uint64_t value = (atUs - trace.lastUs) << 3 | state;
+    do
+    {
+      fputc((value & 0x7f) | (value > 0x7f ? 0x80 : 0), trace.file);
+      value >>= 7;
+    } while (value);
+  }
+  trace.written = state;
+  trace.lastUs = atUs;
+  trace.records++;
+}
+
+// halWriteBridge() sets the three pins one after another at the same
+// instant, so a state is only recorded once time has moved on from it
+static void traceUpdate(uint64_t atUs)
+{
+  if (atUs != trace.pendingUs)
+  {
+    traceWrite(trace.pending, trace.pendingUs);
+  }
+  trace.pending = (stats.in1 ? 1 : 0) | (stats.in2 ? 2 : 0) | (stats.ena ? 4 : 0);
+  trace.pendingUs = atUs;
+}
+
+static void traceClose()
+{
+  traceWrite(trace.pending, trace.pendingUs);
+  fclose(trace.file);
+  trace.file = nullptr;
+}
+
+static void onPinWrite(uint8_t pin, int value, uint64_t atMicros)
+{
+  accumulate(atMicros);
+  if (pin == IN1_PIN)
+  {
+    stats.polaritySwitches += value != stats.in1;
+    stats.in1 = value;
+  }
+  else if (pin == IN2_PIN)
+  {
+    stats.in2 = value;
+  }
+  else if (pin == ENA_PIN)
+  {
+    stats.enableEdges += value != stats.ena;
+    stats.ena = value;
+  }
+  if (trace.file)
+  {
+    traceUpdate(atMicros);
+  }
+}
+
+static void request(const char *uri, const char *query, const char *body = "")
+{
+  std::string reply;
+  int code = nativeHttp("POST", uri, query, body, &reply);
+  if (code != 200)
+  {
+    printf("POST %s?%s: %d %s\n", uri, query, code, reply.c_str());
+  }
+}
+
+static void usage(const char *program)
+{
+  printf("Usage: %s [--mode N] [--speed X] [--brightness N] [--off]\n"
+         "          [--pattern SLOT:HEX] [--seconds N] [--loop-us N]\n"
+         "          [--broker-outage START:END] [--wav FILE]\n"
+         "          [--listen PORT] [--realtime] [--trace FILE[.csv]]\n"
+         "          [--wifi-join-ms N] [--rtc FILE] [--flash FILE]\n"
+         "          [--press SECONDS]... [--status] [--metrics] [--verbose]\n"
+         "       %s --detect FILE.wav [--onsets LABELS]\n"
+         "       %s --soak N\n"
+         "       %s --power-cut\n"
+         "       %s --bench\n",
+         program, program, program, program, program);
+}
+
+// The runner, as a function, so that the native tests can run it too
+int nativeMain(int argc, char **argv)
+{
+  int mode = -1;
+  const char *speed = nullptr;
+  const char *bright = nullptr;
+  bool off = false;
+  double seconds = 10;
+  unsigned long loopUs = 100; // simulated cost of one loop() iteration
+  bool verbose = false;
+  bool printStatus = false;
+  bool printMetrics = false;
+  double outageStart = -1; // seconds into the run the MQTT broker goes away
+  double outageEnd = -1;
+  const char *pattern = nullptr; // SLOT:HEX, as printed by tools/pattern.py
+  const char *wav = nullptr;     // Played into A0 for Music Sync
+  const char *detectWav = nullptr;
+  const char *onsets = nullptr;
+  unsigned long soakRequests = 0;
+  bool realtime = false; // Follow the host clock instead of loop-us steps
+  const char *tracePath = nullptr;
+  const char *rtcPath = nullptr; // RTC memory carried over from the last run, as across a reset
+  const char *flashPath = nullptr; // Flash carried over, as across a power cut
+  std::vector<double> presses;     // Seconds into the run the mode button is pressed
+
+  for (int i = 1; i < argc; i++)
+  {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--mode") && hasValue)
+      mode = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--speed") && hasValue)
+      speed = argv[++i];
+    else if (!strcmp(argv[i], "--brightness") && hasValue)
+      bright = argv[++i];
+    else if (!strcmp(argv[i], "--off"))
+      off = true;
+    else if (!strcmp(argv[i], "--pattern") && hasValue)
+      pattern = argv[++i];
+    else if (!strcmp(argv[i], "--seconds") && hasValue)
+      seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--loop-us") && hasValue)
+      loopUs = strtoul(argv[++i], nullptr, 10);
+    else if (!strcmp(argv[i], "--broker-outage") && hasValue)
+      sscanf(argv[++i], "%lf:%lf", &outageStart, &outageEnd);
+    else if (!strcmp(argv[i], "--status"))
+      printStatus = true;
+    else if (!strcmp(argv[i], "--metrics"))
+      printMetrics = true;
+    else if (!strcmp(argv[i], "--verbose"))
+      verbose = true;
+    else if (!strcmp(argv[i], "--wav") && hasValue)
+      wav = argv[++i];
+    else if (!strcmp(argv[i], "--detect") && hasValue)
+      detectWav = argv[++i];
+    else if (!strcmp(argv[i], "--onsets") && hasValue)
+      onsets = argv[++i];
+    else if (!strcmp(argv[i], "--listen") && hasValue)
+    {
+      // The web server on TCP and the realtime stream on UDP
+      uint16_t port = atoi(argv[++i]);
+      nativeMapPort(80, port);
+      nativeMapPort(REALTIME_PORT, port);
+    }
+    else if (!strcmp(argv[i], "--realtime"))
+      realtime = true;
+    else if (!strcmp(argv[i], "--trace") && hasValue)
+      tracePath = argv[++i];
+    else if (!strcmp(argv[i], "--wifi-join-ms") && hasValue)
+      nativeSetWiFiJoinMs(strtoul(argv[++i], nullptr, 10));
+    else if (!strcmp(argv[i], "--rtc") && hasValue)
+      rtcPath = argv[++i];
+    else if (!strcmp(argv[i], "--flash") && hasValue)
+      flashPath = argv[++i];
+    else if (!strcmp(argv[i], "--press") && hasValue)
+      presses.push_back(atof(argv[++i]));
+    else if (!strcmp(argv[i], "--power-cut"))
+      return runPowerCut();
+    else if (!strcmp(argv[i], "--soak") && hasValue)
+      soakRequests = strtoul(argv[++i], nullptr, 10);
+    else if (!strcmp(argv[i], "--bench"))
+      return runBenchmarks();
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (detectWav)
+  {
+    return runDetector(detectWav, onsets);
+  }
+
+  if (soakRequests)
+  {
+    nativeSetConsoleEcho(verbose);
+    nativeHttpSetLoopCost(loopUs);
+    return runSoak(soakRequests);
+  }
+
+  std::vector<uint16_t> audio;
+  if (wav && !loadWav(wav, audio))
+  {
+    return 1;
+  }
+
+  if (rtcPath)
+  {
+    FILE *rtc = fopen(rtcPath, "rb");
+    if (rtc)
+    {
+      fread(nativeRtcMemory(), 1, NATIVE_RTC_USER_BYTES, rtc);
+      fclose(rtc);
+    }
+  }
+
+  if (flashPath)
+  {
+    nativeFlashLoad(flashPath);
+  }
+
+  nativeSetConsoleEcho(verbose);
+  nativeHttpSetLoopCost(loopUs);
+  setup();
+
+  char query[32];
+  if (pattern && strchr(pattern, ':'))
+  {
+    snprintf(query, sizeof(query), "slot=%d", atoi(pattern));
+    request("/pattern", query, strchr(pattern, ':') + 1);
+  }
+  if (mode >= 0)
+  {
+    snprintf(query, sizeof(query), "value=%d", mode);
+    request("/mode", query);
+  }
+  if (speed)
+  {
+    snprintf(query, sizeof(query), "value=%s", speed);
+    request("/speed", query);
+  }
+  if (bright)
+  {
+    snprintf(query, sizeof(query), "value=%s", bright);
+    request("/brightness", query);
+  }
+  if (off)
+  {
+    request("/state", "value=off");
+  }
+
+  nativeSetPinObserver(onPinWrite);
+  uint64_t startUs = nativeMicros();
+  stats.lastEventUs = startUs;
+  stats.cycleUs = 1000000 / outputMultiplexHz();
+  if (tracePath && !traceOpen(tracePath, startUs))
+  {
+    return 1;
+  }
+  uint64_t endUs = startUs + (uint64_t)(seconds * 1e6);
+  for (double press : presses)
+  {
+    // Held for 100 ms, so the press lands on the pin even while the firmware sleeps
+    uint64_t at = startUs + (uint64_t)(press * 1e6);
+    nativeScheduleInput(MODE_BUTTON, LOW, at);
+    nativeScheduleInput(MODE_BUTTON, HIGH, at + 100000);
+  }
+  uint64_t loops = 0;
+
+  auto hostStart = std::chrono::steady_clock::now();
+  while (nativeMicros() < endUs && !nativeResetRequested())
+  {
+    if (outageStart >= 0)
+    {
+      double t = (nativeMicros() - startUs) / 1e6;
+      PubSubClient::nativeSetBrokerAvailable(t < outageStart || t >= outageEnd);
+    }
+    if (!audio.empty())
+    {
+      // The recording starts with the run and then loops
+      size_t index = (nativeMicros() - startUs) * AUDIO_SAMPLE_HZ / 1000000;
+      nativeSetInput(AUDIO_PIN, audio[index % audio.size()]);
+    }
+    loop();
+    loops++;
+    if (realtime)
+    {
+      // Let the virtual clock catch up with the host, so a slow loop() shows
+      // up as frame jitter as it would on the device
+      uint64_t hostUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStart).count();
+      if (startUs + hostUs > nativeMicros())
+      {
+        nativeAdvanceMicros(startUs + hostUs - nativeMicros());
+      }
+      else
+      {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+    else
+    {
+      nativeAdvanceMicros(loopUs);
+    }
+  }
+  auto hostElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+  accumulate(nativeMicros());
+  if (trace.file)
+  {
+    traceClose();
+  }
+
+  double simulated = (nativeMicros() - startUs) / 1e6;
+  printf("simulated %.3f s in %llu loop() calls (host %.3f s, %.3f us/loop)\n",
+         simulated, (unsigned long long)loops, hostElapsed, loops ? hostElapsed * 1e6 / loops : 0.0);
+  // Perceived level: the share of time a set is actually driven, on the 0-255 scale
+  const char *setNames[] = {"Set A", "Set B"};
+  for (int set = 0; set < 2; set++)
+  {
+    double on = simulated > 0 ? stats.onUs[set] / 1e6 / simulated : 0;
+    printf("%s: on %.1f%% of the time, mean level %.1f, peak %u, level changed in %.1f%% of %u cycles\n",
+           setNames[set], on * 100, on * 255, stats.peak[set],
+           stats.cycles > 1 ? stats.levelChanges[set] * 100.0 / (stats.cycles - 1) : 0.0, stats.cycles);
+  }
+  printf("polarity switches: %u, ENA edges: %u\n", stats.polaritySwitches, stats.enableEdges);
+  if (tracePath)
+  {
+    printf("trace: %u records to %s\n", trace.records, tracePath);
+  }
+
+  if (rtcPath)
+  {
+    FILE *rtc = fopen(rtcPath, "wb");
+    if (rtc)
+    {
+      fwrite(nativeRtcMemory(), 1, NATIVE_RTC_USER_BYTES, rtc);
+      fclose(rtc);
+    }
+  }
+  if (flashPath)
+  {
+    nativeFlashSave(flashPath);
+  }
+
+  if (printStatus)
+  {
+    std::string reply;
+    nativeHttp("GET", "/status", "", "", &reply);
+    printf("%s\n", reply.c_str());
+  }
+  if (printMetrics)
+  {
+    std::string reply;
+    nativeHttp("GET", "/metrics", "", "", &reply);
+    printf("%s", reply.c_str());
+  }
+  return 0;
+}
+
+// pio test links the tests' own main()
+#ifndef PIO_UNIT_TESTING
+int main(int argc, char **argv)
+{
+  return nativeMain(argc, argv);
+}
+#endif
+
+#endif
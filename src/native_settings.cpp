@@ -0,0 +1,142 @@
+#ifdef NATIVE_BUILD
+
+// Power-cut check for the settings journal (--power-cut, and
+// test/test_settings): writes a run of changes long enough to fill every
+// sector twice, cutting the power after every possible number of
+// programmed bytes, and checks that each time the journal reads back as
+// the last change written, then takes more writes.
+
+#include <Arduino.h>
+#include <NativeSim.h>
+#include "hal.h"
+#include "settings.h"
+
+// The nth change of the run: every field moves
+static SavedState changeAt(uint32_t n)
+{
+  return {(uint8_t)(n % 8), (uint8_t)(n * 7 + 1), (uint16_t)(10 + n % 990), n % 3 != 0};
+}
+
+static bool sameState(const SavedState &a, const SavedState &b)
+{
+  return a.mode == b.mode && a.brightness == b.brightness && a.speedCenti == b.speedCenti && a.on == b.on;
+}
+
+static void printState(const char *label, bool valid, const SavedState &state)
+{
+  if (valid)
+  {
+    printf("  %s: mode %u brightness %u speed %u %s\n", label, state.mode, state.brightness, state.speedCenti,
+           state.on ? "on" : "off");
+  }
+  else
+  {
+    printf("  %s: nothing\n", label);
+  }
+}
+
+// Write changes from..to-1 and return how many were reported written
+static uint32_t writeChanges(uint32_t from, uint32_t to, SavedState &last, bool &anyWritten)
+{
+  uint32_t written = 0;
+  for (uint32_t n = from; n < to; n++)
+  {
+    settingsUpdate(changeAt(n));
+    if (!settingsFlush())
+    {
+      break;
+    }
+    last = changeAt(n);
+    anyWritten = true;
+    written++;
+  }
+  return written;
+}
+
+// The whole sweep; returns the number of cut points that failed
+uint32_t powerCutSweep()
+{
+  SavedState state;
+  nativeFlashClear();
+  settingsBegin(state);
+  const SettingsStats &stats = settingsStats();
+  uint32_t changes = stats.capacity * halJournalSectors() * 2 + 7;
+
+  // How many bytes the whole run programs: every cut point up to that
+  uint64_t start = nativeFlashProgrammed();
+  SavedState last = {};
+  bool anyWritten = false;
+  writeChanges(0, changes, last, anyWritten);
+  uint64_t total = nativeFlashProgrammed() - start;
+  printf("power cut: %u changes, %u records a sector, %u sectors, %llu bytes programmed\n", changes,
+         stats.capacity, halJournalSectors(), (unsigned long long)total);
+
+  uint32_t failures = 0;
+  for (uint64_t cut = 0; cut <= total; cut++)
+  {
+    nativeFlashClear();
+    nativeFlashPowerCut(-1);
+    settingsBegin(state);
+    nativeFlashPowerCut(cut);
+    last = {};
+    anyWritten = false;
+    uint32_t written = writeChanges(0, changes, last, anyWritten);
+
+    // Power back: what is read must be the last change reported written,
+    // or the one being written at the cut if its missing bytes were all
+    // 0xff anyway (erased flash already holds them), and never anything
+    // else
+    nativeFlashPowerCut(-1);
+    SavedState recovered = {};
+    bool valid = settingsBegin(recovered);
+    bool ok = valid ? (anyWritten && sameState(recovered, last)) || sameState(recovered, changeAt(written))
+                    : !anyWritten;
+
+    // And the journal must carry on from there
+    SavedState next = {};
+    bool nextWritten = false;
+    writeChanges(written + 1, written + 2, next, nextWritten);
+    SavedState after = {};
+    ok = ok && nextWritten && settingsBegin(after) && sameState(after, next);
+    if (!ok && failures++ < 5)
+    {
+      printf("cut after %llu bytes (%u changes written):\n", (unsigned long long)cut, written);
+      printState("expected", anyWritten, last);
+      printState("recovered", valid, recovered);
+    }
+  }
+  printf("%llu cut points, %u failures\n", (unsigned long long)total + 1, failures);
+  return failures;
+}
+
+// A brightness slider dragged for five seconds, 20 changes a second, is
+// one write once it stops
+const SettingsStats &dragSlider()
+{
+  SavedState state;
+  nativeFlashClear();
+  settingsBegin(state);
+  for (uint32_t i = 0; i < 100; i++)
+  {
+    settingsUpdate({0, (uint8_t)(i * 2), 100, true});
+    settingsPoll();
+    nativeAdvanceMicros(50000);
+  }
+  for (uint32_t i = 0; i <= SETTINGS_DEBOUNCE_MS / 100; i++)
+  {
+    settingsPoll();
+    nativeAdvanceMicros(100000);
+  }
+  return settingsStats();
+}
+
+int runPowerCut()
+{
+  uint32_t failures = powerCutSweep();
+  const SettingsStats &stats = dragSlider();
+  printf("slider: %u changes, %u writes (a write at most every %u ms while it moves)\n", stats.updates,
+         stats.writes, SETTINGS_MAX_DELAY_MS);
+  return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,195 @@
+#include <Arduino.h>
+#include "output.h"
+#include "fixed.h"
+#include "hal.h"
+
+// Pulses shorter than this are lost to interrupt latency, so a slot is
+// either fully off, fully on, or has both edges at least this far apart
+#define MIN_PULSE_TICKS (4 * HAL_TIMER_TICKS_PER_US)
+
+// Perceived level to duty, Q16, with a guard entry so the brightness can
+// be interpolated between entries. Never below the level itself, so every
+// level above 0 stays lit.
+struct GammaTable
+{
+  uint16_t v[257];
+  constexpr GammaTable() : v()
+  {
+    for (int i = 0; i <= 256; i++)
+    {
+      int32_t duty = i < 256 ? roundToInt(tablePow(i / 255.0, OUTPUT_GAMMA) * 65535) : 65535;
+      v[i] = duty > i ? duty : i;
+    }
+  }
+};
+
+static constexpr GammaTable gammaTable{};
+static_assert(gammaTable.v[0] == 0 && gammaTable.v[255] == 65535 && gammaTable.v[1] > 0, "gamma table");
+
+static Duty frames[2] = {{0, 0}, {0, 0}};
+static volatile uint8_t front = 0;
+
+static uint16_t multiplexHz = OUTPUT_MULTIPLEX_HZ;
+static uint32_t slotTicks;
+static uint32_t slotScaled; // slotTicks >> (8 - dutyShift), so duty times it fits 32 bits
+static uint8_t dutyShift;   // duty * slotScaled >> dutyShift is Q8 ticks
+static uint16_t minDuty;    // Dimmest duty shown, one shortest pulse every OUTPUT_DITHER_SLOTS slots
+
+// Interrupt state
+static uint8_t slot = 0;         // 0 = Set A's slot, 1 = Set B's
+static int8_t slotDirection = 0;
+static uint32_t offTicks = 0;    // Rest of the slot once ENA drops, 0 if no off edge pending
+static int32_t dither[2];        // What each set's slots still owe, Q8 ticks
+static volatile bool stopped = false; // Timer left unarmed while both sets are dark
+
+uint32_t IRAM_ATTR outputSlotTicks(uint16_t duty, int32_t &carried)
+{
+  if (duty == 0 || duty == 0xffff)
+  {
+    carried = 0;
+    return duty ? slotTicks : 0;
+  }
+#if OUTPUT_DITHER
+  duty = duty < minDuty ? minDuty : duty;
+  int32_t wanted = carried + (int32_t)((uint32_t)duty * slotScaled >> dutyShift);
+#else
+  int32_t wanted = (uint32_t)duty * slotScaled >> dutyShift;
+#endif
+
+  // Off or the shortest pulse, whichever is nearer, and the same just
+  // short of the whole slot
+  int32_t length = slotTicks;
+  int32_t onTicks = (wanted + 0x80) >> 8;
+  if (onTicks < MIN_PULSE_TICKS)
+  {
+    onTicks = onTicks < MIN_PULSE_TICKS / 2 ? 0 : MIN_PULSE_TICKS;
+  }
+  else if (length - onTicks < MIN_PULSE_TICKS)
+  {
+    onTicks = length - onTicks < MIN_PULSE_TICKS / 2 ? length : length - MIN_PULSE_TICKS;
+  }
+#if OUTPUT_DITHER
+  carried = wanted - onTicks * 256;
+#endif
+  return onTicks;
+}
+
+static void IRAM_ATTR onOutputTimer()
+{
+  if (offTicks)
+  {
+    // Falling edge inside the slot
+    halWriteBridge(slotDirection, false);
+    halTimerArm(offTicks);
+    offTicks = 0;
+    return;
+  }
+
+  // Start of the next slot
+  slot ^= 1;
+  const Duty &duty = frames[front];
+  uint8_t set;
+  if (duty.a && duty.b)
+  {
+    set = slot;
+  }
+  else if (duty.a || duty.b)
+  {
+    set = duty.a ? 0 : 1;
+  }
+  else
+  {
+    // Dark: the bridge is switched off once and the timer left to stop
+    // until a lit frame is presented
+    dither[0] = dither[1] = 0;
+    halWriteBridge(0, false);
+    stopped = true;
+    return;
+  }
+  slotDirection = set == 0 ? 1 : -1;
+
+  uint32_t onTicks = outputSlotTicks(set == 0 ? duty.a : duty.b, dither[set]);
+  if (onTicks == 0 || onTicks == slotTicks)
+  {
+    halWriteBridge(slotDirection, onTicks != 0);
+    halTimerArm(slotTicks);
+  }
+  else
+  {
+    halWriteBridge(slotDirection, true);
+    offTicks = slotTicks - onTicks;
+    halTimerArm(onTicks);
+  }
+}
+
+void outputBegin(uint16_t hz)
+{
+  multiplexHz = constrain(hz, OUTPUT_MIN_MULTIPLEX_HZ, OUTPUT_MAX_MULTIPLEX_HZ);
+  slotTicks = 1000000UL * HAL_TIMER_TICKS_PER_US / 2 / multiplexHz;
+  uint8_t shift = 0;
+  while (slotTicks >> shift > 0xffff)
+  {
+    shift++;
+  }
+  slotScaled = slotTicks >> shift;
+  dutyShift = 8 - shift;
+  minDuty = max<uint32_t>(((uint32_t)MIN_PULSE_TICKS << 16) / (OUTPUT_DITHER_SLOTS * slotTicks), 1);
+  halTimerBegin(onOutputTimer, slotTicks);
+}
+
+uint16_t outputMultiplexHz()
+{
+  return multiplexHz;
+}
+
+uint32_t outputSlotLength()
+{
+  return slotTicks;
+}
+
+// value * scale / 65535, exact at both ends
+static inline uint16_t scale16(uint16_t value, uint16_t scale)
+{
+  return ((uint32_t)value * scale + value) >> 16;
+}
+
+Duty outputDuty(Frame frame, uint16_t brightness)
+{
+  // The brightness only changes during a fade, so its duty is kept
+  static uint16_t lastBrightness = 0;
+  static uint16_t level = 0;
+  if (brightness != lastBrightness)
+  {
+    uint8_t index = brightness >> 8;
+    uint16_t low = gammaTable.v[index];
+    level = low + (((uint32_t)(gammaTable.v[index + 1] - low) * (brightness & 0xff)) >> 8);
+    lastBrightness = brightness;
+  }
+  return {scale16(gammaTable.v[frame.a], level), scale16(gammaTable.v[frame.b], level)};
+}
+
+Duty &outputBackBuffer()
+{
+  return frames[front ^ 1];
+}
+
+void outputPresent()
+{
+  // Finish writing the back buffer before the interrupt can switch to it
+  __asm__ __volatile__("" ::: "memory");
+  front ^= 1;
+  // Start the new back buffer from what is on screen
+  frames[front ^ 1] = frames[front];
+  // The interrupt runs to completion, so if it has stopped it saw a dark
+  // frame and will not run again until armed here
+  if (stopped && (frames[front].a || frames[front].b))
+  {
+    stopped = false;
+    halTimerArm(MIN_PULSE_TICKS);
+  }
+}
+
+bool outputStopped()
+{
+  return stopped;
+}
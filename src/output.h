@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+// Output engine: the timer interrupt multiplexes the two light sets and
+// generates the ENA PWM in software, so what the lights show no longer
+// depends on how quickly loop() comes round. Every multiplex cycle has one
+// slot per set; a set lit on its own gets both slots.
+//
+// The engine owns timer1, so analogWrite() (which shares it) is not used.
+//
+// Modes render perceived levels (Frame, 0-255). They are shown as linear
+// duties (Duty, Q16) through a gamma table, with the brightness applied in
+// 16 bits after it, so a fade moves in steps far finer than 8 bits. The PWM
+// edge is placed to a timer tick (HAL_TIMER_TICKS_PER_US), and what a slot
+// cannot show, below a tick or below the shortest pulse the interrupt can
+// time, is carried to the set's next slot (sigma-delta dithering), so on
+// average every set shows its duty exactly, down to the lowest levels.
+
+#ifndef OUTPUT_MULTIPLEX_HZ
+#define OUTPUT_MULTIPLEX_HZ 200 // Full A+B cycles per second
+#endif
+
+#define OUTPUT_MIN_MULTIPLEX_HZ 50
+#define OUTPUT_MAX_MULTIPLEX_HZ 2000
+
+#ifndef OUTPUT_GAMMA
+#define OUTPUT_GAMMA 2.2 // Perceived level to duty; 1 is linear
+#endif
+
+#ifndef OUTPUT_DITHER
+#define OUTPUT_DITHER 1 // 0 rounds every slot on its own, as before
+#endif
+
+// The dimmest a set goes before it is off: one shortest pulse in this many
+// of its slots, so the dithering never flickers slower than 50 Hz
+#define OUTPUT_DITHER_SLOTS 4
+
+// What each light set shows, 0-255. Both non-zero multiplexes them, one slot each.
+struct Frame
+{
+  uint8_t a;
+  uint8_t b;
+};
+
+// The share of each slot a set is driven, 0-65535
+struct Duty
+{
+  uint16_t a;
+  uint16_t b;
+};
+
+void outputBegin(uint16_t multiplexHz);
+uint16_t outputMultiplexHz();
+
+// A frame at a brightness (Q8.8, 0 to 255 << 8), through the gamma table
+Duty outputDuty(Frame frame, uint16_t brightness);
+
+// Double-buffered duties: write the back buffer, then present it. The
+// interrupt only ever reads the front buffer, so it never sees half a frame.
+Duty &outputBackBuffer();
+void outputPresent();
+
+// True while both sets are dark and the timer is stopped: nothing is
+// written to the bridge until a lit frame is presented
+bool outputStopped();
+
+// Timer ticks a set is driven for in one slot at duty. dither is what the
+// set's earlier slots owe (Q8 ticks), carried in and out. The interrupt's
+// own arithmetic, for --bench.
+uint32_t outputSlotTicks(uint16_t duty, int32_t &dither);
+uint32_t outputSlotLength();
@@ -0,0 +1,360 @@
+#include "pattern.h"
+
+#include <LittleFS.h>
+#include <string.h>
+
+static const uint8_t patternMagic[] = {'T', 'L', 'P', 0x01};
+static const uint8_t headerSize = sizeof(patternMagic) + 1; // Plus the name
+
+// Operand bytes after each opcode
+static uint8_t operandSize(uint8_t op)
+{
+  switch (op)
+  {
+  case OP_END:
+    return 0;
+  case OP_KEY:
+    return 5;
+  case OP_HOLD:
+    return 2;
+  case OP_REPEAT:
+    return 3;
+  default:
+    return 0xff;
+  }
+}
+
+static uint16_t read16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+const char *patternValidate(const uint8_t *data, size_t size, char *name)
+{
+  if (size > PATTERN_MAX_SIZE)
+  {
+    return "Pattern too large";
+  }
+  if (size < headerSize || memcmp(data, patternMagic, sizeof(patternMagic)) != 0)
+  {
+    return "Not a pattern";
+  }
+
+  uint8_t nameLength = data[sizeof(patternMagic)];
+  if (nameLength == 0 || nameLength > PATTERN_MAX_NAME || (size_t)(headerSize + nameLength) >= size)
+  {
+    return "Bad pattern name";
+  }
+  const uint8_t *text = data + headerSize;
+  for (uint8_t i = 0; i < nameLength; i++)
+  {
+    // Printable, and nothing that would need escaping in JSON or HTML
+    if (text[i] < ' ' || text[i] > '~' || strchr("\"\\<>&", text[i]))
+    {
+      return "Bad pattern name";
+    }
+  }
+
+  // Walk the instructions, marking where each one starts so REPEAT targets
+  // can be checked
+  const uint8_t *code = text + nameLength;
+  uint16_t length = size - headerSize - nameLength;
+  uint8_t starts[PATTERN_MAX_SIZE / 8] = {0};
+  bool advances = false;
+  for (uint16_t pc = 0; pc < length;)
+  {
+    uint8_t op = code[pc];
+    uint8_t operands = operandSize(op);
+    if (operands == 0xff)
+    {
+      return "Unknown instruction";
+    }
+    if (pc + 1 + operands > length)
+    {
+      return "Truncated instruction";
+    }
+    starts[pc / 8] |= 1 << (pc % 8);
+
+    const uint8_t *args = code + pc + 1;
+    if (op == OP_KEY)
+    {
+      if (args[2] > EASE_STEP)
+      {
+        return "Unknown ease";
+      }
+      advances |= read16(args + 3) > 0;
+    }
+    else if (op == OP_HOLD)
+    {
+      advances |= read16(args) > 0;
+    }
+    else if (op == OP_REPEAT)
+    {
+      uint16_t target = read16(args + 1);
+      if (target >= pc || !(starts[target / 8] & (1 << (target % 8))))
+      {
+        return "Bad REPEAT target";
+      }
+    }
+    pc += 1 + operands;
+  }
+  if (!advances)
+  {
+    return "Pattern has no timed instructions";
+  }
+
+  if (name)
+  {
+    memcpy(name, text, nameLength);
+    name[nameLength] = '\0';
+  }
+  return nullptr;
+}
+
+// Run control instructions until a KEY or HOLD is loaded. Zero-length steps
+// are bounded by the caller, so a pattern can never stall the frame.
+static void fetch(PatternPlayer &player)
+{
+  for (uint8_t budget = 16; budget > 0; budget--)
+  {
+    if (player.pc >= player.length || player.code[player.pc] == OP_END)
+    {
+      player.pc = 0;
+      player.repeatDepth = 0;
+      continue;
+    }
+
+    uint16_t pc = player.pc;
+    const uint8_t *args = player.code + pc + 1;
+    switch (player.code[pc])
+    {
+    case OP_KEY:
+      player.to = {args[0], args[1]};
+      player.ease = args[2];
+      player.durationMs = read16(args + 3);
+      player.rate = player.durationMs ? (1UL << 24) / player.durationMs : 0;
+      player.pc += 6;
+      return;
+
+    case OP_HOLD:
+      player.ease = EASE_LINEAR;
+      player.durationMs = read16(args);
+      player.rate = player.durationMs ? (1UL << 24) / player.durationMs : 0;
+      player.pc += 3;
+      return;
+
+    case OP_REPEAT:
+    {
+      // Find this loop's counter; anything above it belongs to loops that
+      // have been left
+      int depth = player.repeatDepth - 1;
+      while (depth >= 0 && player.repeatPc[depth] != pc)
+      {
+        depth--;
+      }
+      if (depth < 0 && args[0] > 0 && player.repeatDepth < PATTERN_MAX_REPEATS)
+      {
+        depth = player.repeatDepth++;
+        player.repeatPc[depth] = pc;
+        player.repeatLeft[depth] = args[0];
+      }
+
+      if (depth >= 0 && player.repeatLeft[depth] > 0)
+      {
+        player.repeatLeft[depth]--;
+        player.repeatDepth = depth + 1;
+        player.pc = read16(args + 1);
+      }
+      else
+      {
+        player.repeatDepth = depth >= 0 ? depth : player.repeatDepth;
+        player.pc += 4;
+      }
+      break;
+    }
+    }
+  }
+
+  // Out of budget: hold where we are for a frame
+  player.ease = EASE_LINEAR;
+  player.durationMs = 0;
+}
+
+void patternStart(PatternPlayer &player, const uint8_t *code, uint16_t length)
+{
+  player.code = code;
+  player.length = length;
+  player.pc = 0;
+  player.from = {0, 0};
+  player.to = {0, 0};
+  player.elapsed = 0;
+  player.repeatDepth = 0;
+  fetch(player);
+}
+
+void patternAdvance(PatternPlayer &player, q16_16_t dt)
+{
+  if (!player.code)
+  {
+    return;
+  }
+
+  player.elapsed += dt;
+  for (uint8_t steps = 0; player.elapsed >= ((uint32_t)player.durationMs << 16); steps++)
+  {
+    if (steps == 16)
+    {
+      // A run of zero-length steps; carry on next frame
+      player.elapsed = 0;
+      break;
+    }
+    player.elapsed -= (uint32_t)player.durationMs << 16;
+    player.from = player.to;
+    fetch(player);
+  }
+}
+
+Frame patternFrame(const PatternPlayer &player, uint8_t maxBrightness)
+{
+  uint8_t t = 255;
+  if (player.ease == EASE_STEP)
+  {
+    t = 0;
+  }
+  else if (player.durationMs > 0)
+  {
+    // The fraction done in 1/256ths. elapsed < durationMs, so the product
+    // stays below 2^32.
+    t = ((player.elapsed >> 8) * player.rate) >> 24;
+    if (player.ease == EASE_SMOOTH)
+    {
+      t = ease8(t);
+    }
+  }
+
+  uint8_t a = div255(player.from.a * (255 - t) + player.to.a * t);
+  uint8_t b = div255(player.from.b * (255 - t) + player.to.b * t);
+  return {scale8(a, maxBrightness), scale8(b, maxBrightness)};
+}
+
+// Storage
+
+static char names[PATTERN_SLOTS][PATTERN_MAX_NAME + 1];
+static uint16_t sizes[PATTERN_SLOTS];
+static uint8_t playing[PATTERN_MAX_SIZE]; // Image of the pattern being played
+
+static void slotPath(uint8_t slot, char *path)
+{
+  sprintf(path, "/patterns/%u.tlp", slot);
+}
+
+// Read a slot's file into buffer; returns its size, or 0 if missing or invalid
+static uint16_t loadSlot(uint8_t slot, uint8_t *buffer, char *name)
+{
+  char path[24];
+  slotPath(slot, path);
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    return 0;
+  }
+  size_t size = file.size();
+  bool complete = size <= PATTERN_MAX_SIZE && file.read(buffer, size) == size;
+  file.close();
+  return complete && !patternValidate(buffer, size, name) ? size : 0;
+}
+
+bool patternsBegin()
+{
+  if (!LittleFS.begin())
+  {
+    return false;
+  }
+  LittleFS.mkdir("/patterns");
+
+  uint8_t buffer[PATTERN_MAX_SIZE];
+  for (uint8_t slot = 0; slot < PATTERN_SLOTS; slot++)
+  {
+    sizes[slot] = loadSlot(slot, buffer, names[slot]);
+  }
+  return true;
+}
+
+bool patternInstalled(uint8_t slot)
+{
+  return slot < PATTERN_SLOTS && sizes[slot] > 0;
+}
+
+const char *patternName(uint8_t slot)
+{
+  return patternInstalled(slot) ? names[slot] : "";
+}
+
+uint16_t patternSize(uint8_t slot)
+{
+  return slot < PATTERN_SLOTS ? sizes[slot] : 0;
+}
+
+const char *patternSave(uint8_t slot, const uint8_t *data, size_t size)
+{
+  if (slot >= PATTERN_SLOTS)
+  {
+    return "Invalid slot";
+  }
+  char name[PATTERN_MAX_NAME + 1];
+  const char *error = patternValidate(data, size, name);
+  if (error)
+  {
+    return error;
+  }
+
+  char path[24];
+  slotPath(slot, path);
+  File file = LittleFS.open(path, "w");
+  if (!file)
+  {
+    return "Could not open pattern file";
+  }
+  size_t written = file.write(data, size);
+  file.close();
+  if (written != size)
+  {
+    LittleFS.remove(path);
+    sizes[slot] = 0;
+    return "Filesystem full";
+  }
+
+  strcpy(names[slot], name);
+  sizes[slot] = size;
+  return nullptr;
+}
+
+bool patternRemove(uint8_t slot)
+{
+  if (!patternInstalled(slot))
+  {
+    return false;
+  }
+  char path[24];
+  slotPath(slot, path);
+  LittleFS.remove(path);
+  sizes[slot] = 0;
+  return true;
+}
+
+bool patternPlay(uint8_t slot, PatternPlayer &player)
+{
+  if (!patternInstalled(slot))
+  {
+    return false;
+  }
+  // Re-read and re-check: the cached name says nothing about the flash now
+  uint16_t size = loadSlot(slot, playing, nullptr);
+  if (size == 0)
+  {
+    return false;
+  }
+  uint8_t headerLength = headerSize + playing[sizeof(patternMagic)];
+  patternStart(player, playing + headerLength, size - headerLength);
+  return true;
+}
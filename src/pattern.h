@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fixed.h"
+#include "output.h"
+
+// Keyframe patterns: small bytecode programs stored in LittleFS and played
+// by an interpreter that needs no heap. A pattern is a header followed by
+// instructions; durations are little-endian ms at 1x speed and levels are
+// 0-255, scaled by the maximum brightness when rendered.
+//
+//   'T' 'L' 'P' 0x01             magic and format version
+//   len name[len]                display name, 1-PATTERN_MAX_NAME printable
+//                                ASCII bytes, none of " \ < > &
+//   instructions...
+//
+//   0x00                         END     start again from the first instruction
+//   0x01 a b ease ms_lo ms_hi    KEY     ramp the sets from where they are to (a, b)
+//   0x02 ms_lo ms_hi             HOLD    keep the current levels
+//   0x03 count pc_lo pc_hi       REPEAT  jump back to instruction offset pc count
+//                                        more times, then fall through
+//
+// Running off the end of the program behaves like END. Instruction offsets
+// count from the first instruction, not the start of the file.
+
+#define PATTERN_SLOTS 8
+#define PATTERN_MAX_SIZE 256
+#define PATTERN_MAX_NAME 24
+#define PATTERN_MAX_REPEATS 4 // Nesting depth of REPEAT loops
+
+enum PatternOp : uint8_t
+{
+  OP_END = 0x00,
+  OP_KEY = 0x01,
+  OP_HOLD = 0x02,
+  OP_REPEAT = 0x03
+};
+
+enum PatternEase : uint8_t
+{
+  EASE_LINEAR,
+  EASE_SMOOTH, // Smoothstep in and out
+  EASE_STEP    // Hold the old levels, jump at the end
+};
+
+struct PatternPlayer
+{
+  const uint8_t *code = nullptr;
+  uint16_t length = 0;
+  uint16_t pc = 0;
+  Frame from = {0, 0}; // Levels at the start of the current instruction
+  Frame to = {0, 0};
+  uint8_t ease = EASE_LINEAR;
+  uint16_t durationMs = 0;
+  uint32_t rate = 0;    // 2^24 / durationMs, so frames need no divide
+  uint32_t elapsed = 0; // Into the current instruction, Q16.16 ms
+  uint8_t repeatDepth = 0;
+  uint16_t repeatPc[PATTERN_MAX_REPEATS];
+  uint8_t repeatLeft[PATTERN_MAX_REPEATS];
+};
+
+// Check a pattern image; returns nullptr if it is valid, else the reason.
+// On success name receives the display name (PATTERN_MAX_NAME + 1 bytes).
+const char *patternValidate(const uint8_t *data, size_t size, char *name);
+
+// Play an instruction stream (the part after the header) from the start
+void patternStart(PatternPlayer &player, const uint8_t *code, uint16_t length);
+
+// Advance by dt of speed-scaled time, Q16.16 ms
+void patternAdvance(PatternPlayer &player, q16_16_t dt);
+
+// Levels at the current point, scaled to maxBrightness
+Frame patternFrame(const PatternPlayer &player, uint8_t maxBrightness);
+
+// Pattern slots in LittleFS (/patterns/<slot>.tlp). Names are cached at
+// boot so listing modes never touches flash; only the playing pattern is
+// held in RAM.
+bool patternsBegin();
+bool patternInstalled(uint8_t slot);
+const char *patternName(uint8_t slot);
+uint16_t patternSize(uint8_t slot);
+const char *patternSave(uint8_t slot, const uint8_t *data, size_t size);
+bool patternRemove(uint8_t slot);
+bool patternPlay(uint8_t slot, PatternPlayer &player);
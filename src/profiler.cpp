@@ -0,0 +1,46 @@
+#include <Arduino.h>
+#include "hal.h"
+#include "profiler.h"
+
+static HeapStats heap = {0, UINT32_MAX, 0, 0};
+
+void profileRecord(PhaseProfile &phase, uint32_t cycles)
+{
+  phase.count++;
+  phase.totalCycles += cycles;
+  if (cycles > phase.maxCycles)
+  {
+    phase.maxCycles = cycles;
+  }
+
+  // Bucket = bit length of the duration in us, capped
+  uint32_t us = cycles / halCyclesPerUs();
+  uint8_t bucket = 0;
+  while (us > 0 && bucket < PROFILE_BUCKETS - 1)
+  {
+    us >>= 1;
+    bucket++;
+  }
+  phase.buckets[bucket]++;
+}
+
+uint32_t profileBucketBoundUs(uint8_t bucket)
+{
+  return 1UL << bucket;
+}
+
+void profileSampleHeap()
+{
+  heap.free = ESP.getFreeHeap();
+  heap.maxBlock = ESP.getMaxFreeBlockSize();
+  heap.fragmentation = ESP.getHeapFragmentation();
+  if (heap.free < heap.minFree)
+  {
+    heap.minFree = heap.free;
+  }
+}
+
+const HeapStats &heapStats()
+{
+  return heap;
+}
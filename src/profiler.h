@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Loop profiler: the scheduler times every phase it runs (the frame and
+// each task) with the cycle counter and files the result into a fixed
+// log2 histogram, so there is no allocation and the cost is a few cycles.
+//
+// Bucket 0 counts runs under 1 us, bucket n (1 <= n < PROFILE_BUCKETS - 1)
+// runs of [2^(n-1), 2^n) us, and the last bucket everything longer.
+
+#define PROFILE_BUCKETS 16 // Last finite bound 2^14 us = 16.4 ms
+
+struct PhaseProfile
+{
+  uint32_t count;
+  uint64_t totalCycles;
+  uint32_t maxCycles;
+  uint32_t buckets[PROFILE_BUCKETS];
+};
+
+void profileRecord(PhaseProfile &phase, uint32_t cycles);
+
+// Upper bound of a bucket in us (the last bucket has none)
+uint32_t profileBucketBoundUs(uint8_t bucket);
+
+struct HeapStats
+{
+  uint32_t free;
+  uint32_t minFree; // Low-water mark since boot
+  uint32_t maxBlock;
+  uint8_t fragmentation; // Percent
+};
+
+// Sample the heap; call periodically
+void profileSampleHeap();
+const HeapStats &heapStats();
@@ -0,0 +1,244 @@
+#include "realtime.h"
+
+#include <WiFiUdp.h>
+#include <string.h>
+#include "hal.h"
+
+#define ACK_QUEUE 8 // Power of two
+
+struct BufferedFrame
+{
+  uint16_t seq;
+  bool valid;
+  uint8_t a;
+  uint8_t b;
+  uint16_t durationMs;
+};
+
+static WiFiUDP udp;
+static RealtimeStats stats;
+
+static BufferedFrame buffer[REALTIME_BUFFER_FRAMES];
+static uint16_t nextSeq;        // The next frame to play
+static bool playing;            // False while (re)filling to the prebuffer level
+static bool starved;            // Ran dry; an underrun once the stream resumes
+static Frame current;           // The frame on show
+static int32_t remainingUs;     // Of the frame on show
+static uint32_t lastPacketMs;
+static uint32_t lastFrameUs;
+
+// Played frames waiting to be acknowledged, and where to
+static uint16_t ackSeq[ACK_QUEUE];
+static uint8_t ackHead, ackTail;
+static bool ackWanted;
+static IPAddress ackAddress;
+static uint16_t ackPort;
+
+static BufferedFrame &slot(uint16_t seq)
+{
+  return buffer[seq & (REALTIME_BUFFER_FRAMES - 1)];
+}
+
+static void startSession(uint16_t seq)
+{
+  memset(buffer, 0, sizeof(buffer));
+  stats.buffered = 0;
+  stats.active = true;
+  stats.sessions++;
+  nextSeq = seq;
+  playing = false;
+  starved = false;
+  current = {0, 0};
+  remainingUs = 0;
+  lastFrameUs = halMicros();
+  ackHead = ackTail = 0;
+}
+
+static void store(uint16_t seq, uint8_t a, uint8_t b, uint16_t durationMs)
+{
+  int16_t ahead = (int16_t)(seq - nextSeq);
+  if (ahead >= 4 * REALTIME_BUFFER_FRAMES || ahead <= -4 * REALTIME_BUFFER_FRAMES)
+  {
+    // Too far out to be jitter: the sender restarted its numbering
+    startSession(seq);
+    ahead = 0;
+  }
+  if (ahead < 0)
+  {
+    stats.late++;
+    return;
+  }
+  // No room: drop the oldest frames to make it
+  while (ahead >= REALTIME_BUFFER_FRAMES)
+  {
+    BufferedFrame &oldest = slot(nextSeq);
+    if (oldest.valid && oldest.seq == nextSeq)
+    {
+      oldest.valid = false;
+      stats.buffered--;
+      stats.overflows++;
+    }
+    else
+    {
+      stats.lost++;
+    }
+    nextSeq++;
+    ahead--;
+  }
+
+  BufferedFrame &entry = slot(seq);
+  if (entry.valid && entry.seq == seq)
+  {
+    stats.late++;
+    return;
+  }
+  entry = {seq, true, a, b, durationMs};
+  stats.buffered++;
+  stats.frames++;
+}
+
+static void receive(const uint8_t *packet, int length)
+{
+  if (length < 6 || memcmp(packet, "TLR\x01", 4) != 0)
+  {
+    stats.malformed++;
+    return;
+  }
+  uint8_t flags = packet[4];
+  uint8_t count = packet[5];
+  if (count == 0 || count > REALTIME_MAX_PACKET_FRAMES || length != 8 + 4 * count)
+  {
+    stats.malformed++;
+    return;
+  }
+  uint16_t seq = packet[6] | packet[7] << 8;
+  if (!stats.active)
+  {
+    startSession(seq);
+  }
+  stats.packets++;
+  lastPacketMs = halMillis();
+  ackWanted = flags & 1;
+  ackAddress = udp.remoteIP();
+  ackPort = udp.remotePort();
+
+  const uint8_t *frame = packet + 8;
+  for (uint8_t i = 0; i < count; i++, frame += 4)
+  {
+    store(seq + i, frame[0], frame[1], frame[2] | frame[3] << 8);
+  }
+}
+
+void realtimeBegin()
+{
+  udp.begin(REALTIME_PORT);
+}
+
+void realtimePoll()
+{
+  uint8_t packet[8 + 4 * REALTIME_MAX_PACKET_FRAMES];
+  int size;
+  while ((size = udp.parsePacket()) > 0)
+  {
+    if (size > (int)sizeof(packet))
+    {
+      stats.malformed++;
+      continue;
+    }
+    receive(packet, udp.read(packet, sizeof(packet)));
+  }
+
+  while (ackTail != ackHead)
+  {
+    uint16_t seq = ackSeq[ackTail++ & (ACK_QUEUE - 1)];
+    uint8_t ack[8] = {'T', 'L', 'A', 0x01, (uint8_t)seq, (uint8_t)(seq >> 8), stats.buffered, 0};
+    udp.beginPacket(ackAddress, ackPort);
+    udp.write(ack, sizeof(ack));
+    udp.endPacket();
+  }
+}
+
+// Move on to the next frame in sequence. Gaps are skipped once a later
+// frame is waiting; with nothing waiting the current frame is held.
+static bool advance()
+{
+  if (stats.buffered == 0)
+  {
+    return false;
+  }
+  for (;;)
+  {
+    BufferedFrame &entry = slot(nextSeq);
+    if (entry.valid && entry.seq == nextSeq)
+    {
+      entry.valid = false;
+      stats.buffered--;
+      stats.played++;
+      current = {entry.a, entry.b};
+      remainingUs += (int32_t)entry.durationMs * 1000;
+      if (ackWanted && (uint8_t)(ackHead - ackTail) < ACK_QUEUE)
+      {
+        ackSeq[ackHead++ & (ACK_QUEUE - 1)] = nextSeq;
+      }
+      nextSeq++;
+      return true;
+    }
+    stats.lost++;
+    nextSeq++;
+  }
+}
+
+bool realtimeFrame(Frame &frame)
+{
+  if (!stats.active)
+  {
+    return false;
+  }
+  if (halMillis() - lastPacketMs > REALTIME_TIMEOUT_MS)
+  {
+    stats.active = false;
+    stats.timeouts++;
+    return false;
+  }
+
+  uint32_t now = halMicros();
+  int32_t elapsedUs = now - lastFrameUs;
+  lastFrameUs = now;
+
+  if (!playing)
+  {
+    // Hold back until the buffer can ride out some jitter
+    if (stats.buffered < REALTIME_PREBUFFER_FRAMES)
+    {
+      frame = current;
+      return true;
+    }
+    playing = true;
+    remainingUs = 0;
+    elapsedUs = 0;
+    // Counted here rather than when the buffer ran dry, so the end of a
+    // stream is not an underrun
+    stats.underruns += starved;
+    starved = false;
+  }
+
+  remainingUs -= elapsedUs;
+  while (remainingUs <= 0)
+  {
+    if (!advance())
+    {
+      // Ran dry: keep showing the last frame and refill before going on
+      starved = true;
+      playing = false;
+      remainingUs = 0;
+      break;
+    }
+  }
+  frame = current;
+  return true;
+}
+
+const RealtimeStats &realtimeStats()
+{
+  return stats;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include "output.h"
+
+// UDP realtime mode: a host drives the light sets frame by frame, for shows
+// kept in sync across several trees. Frames carry a sequence number and how
+// long to show them; they go into a jitter buffer that the frame clock plays
+// out, so packets can arrive early, late or out of order without the lights
+// stuttering. While frames keep coming the stream overrides the current
+// mode; REALTIME_TIMEOUT_MS after the last packet the mode takes over again.
+//
+// Packet format on REALTIME_PORT (the port next to DDP's), little-endian.
+// DDP itself carries pixel data, not timed frames, so this is its own:
+//
+//   'T' 'L' 'R' 0x01             magic and version
+//   flags                        bit 0: acknowledge each frame as it plays
+//   count                        frames in the packet, 1-REALTIME_MAX_PACKET_FRAMES
+//   seq_lo seq_hi                sequence number of the first frame; the rest follow on
+//   count x (a b ms_lo ms_hi)    set levels 0-255 and how long to show them
+//
+// Playout keeps to the timeline the durations set out: a frame shorter than
+// the frame clock period (4 ms) may never be shown if the next one is already
+// due. Levels are scaled by the maximum brightness; off means off.
+// Acknowledgements go back to the sender's address and port:
+//
+//   'T' 'L' 'A' 0x01 seq_lo seq_hi buffered 0x00
+
+#define REALTIME_PORT 4049
+#define REALTIME_MAX_PACKET_FRAMES 32
+#define REALTIME_BUFFER_FRAMES 32 // Power of two
+#define REALTIME_PREBUFFER_FRAMES 2 // Frames held back before playing, the jitter allowance
+#define REALTIME_TIMEOUT_MS 1000
+
+struct RealtimeStats
+{
+  uint32_t packets;   // Valid packets received
+  uint32_t malformed; // Datagrams that were not realtime packets
+  uint32_t frames;    // Frames received
+  uint32_t played;    // Frames shown
+  uint32_t late;      // Arrived after their turn, or twice
+  uint32_t lost;      // Never arrived; skipped at their turn
+  uint32_t overflows; // Dropped unplayed because the buffer was full
+  uint32_t underruns; // Times the buffer ran dry mid-stream
+  uint32_t sessions;  // Streams started
+  uint32_t timeouts;  // Streams ended by silence
+  uint8_t buffered;   // Frames waiting now
+  bool active;
+};
+
+void realtimeBegin();
+
+// Read waiting packets into the buffer and send acknowledgements; call often
+void realtimePoll();
+
+// From the frame clock: the streamed frame due now, or false when no stream
+// is running and the mode should render instead
+bool realtimeFrame(Frame &frame);
+
+const RealtimeStats &realtimeStats();
@@ -0,0 +1,90 @@
+#include "response.h"
+
+static HttpServer *current = nullptr;
+static char buffer[RESPONSE_CHUNK];
+static size_t length = 0;
+
+static void flush()
+{
+  if (length > 0)
+  {
+    current->write(buffer, length);
+    length = 0;
+  }
+}
+
+static void append(const char *text, size_t size, bool progmem)
+{
+  while (size > 0)
+  {
+    if (length == sizeof(buffer))
+    {
+      flush();
+    }
+    size_t n = min(size, sizeof(buffer) - length);
+    if (progmem)
+    {
+      memcpy_P(buffer + length, text, n);
+    }
+    else
+    {
+      memcpy(buffer + length, text, n);
+    }
+    length += n;
+    text += n;
+    size -= n;
+  }
+}
+
+void responseBegin(HttpServer &server, int code, const char *contentType)
+{
+  current = &server;
+  length = 0;
+  server.beginResponse(code, contentType, HTTP_CHUNKED);
+}
+
+void responseWrite(const char *text)
+{
+  append(text, strlen(text), false);
+}
+
+void responseWrite_P(PGM_P text)
+{
+  append(text, strlen_P(text), true);
+}
+
+void responsePrintf_P(PGM_P format, ...)
+{
+  char line[160];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf_P(line, sizeof(line), format, args);
+  va_end(args);
+  append(line, constrain(size, 0, (int)sizeof(line) - 1), false);
+}
+
+void responseTemplate_P(PGM_P tmpl, const char *const *values, uint8_t count)
+{
+  // Copy runs of literal text straight from flash; substitute {n}
+  PGM_P run = tmpl;
+  PGM_P p = tmpl;
+  for (char c; (c = pgm_read_byte(p)) != '\0'; p++)
+  {
+    uint8_t index = pgm_read_byte(p + 1) - '0';
+    if (c == '{' && index < count && pgm_read_byte(p + 2) == '}')
+    {
+      append(run, p - run, true);
+      responseWrite(values[index]);
+      p += 2;
+      run = p + 1;
+    }
+  }
+  append(run, p - run, true);
+}
+
+void responseEnd()
+{
+  flush();
+  current->endResponse();
+  current = nullptr;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "http.h"
+
+// Streamed HTTP responses: the body is assembled in a fixed buffer and sent
+// as a chunk whenever it fills, so a handler never builds its reply on the
+// heap and the reply's size is not limited by the buffer. Text can come from
+// RAM or PROGMEM; templates fill {0}..{9} placeholders from a list of values.
+
+#define RESPONSE_CHUNK 512
+
+void responseBegin(HttpServer &server, int code, const char *contentType);
+void responseWrite(const char *text);
+void responseWrite_P(PGM_P text);
+void responsePrintf_P(PGM_P format, ...);
+void responseTemplate_P(PGM_P tmpl, const char *const *values, uint8_t count);
+void responseEnd();
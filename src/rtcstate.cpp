@@ -0,0 +1,42 @@
+#include "rtcstate.h"
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "crc.h"
+
+#define RTC_STATE_MAGIC 0x544c5331 // "TLS1"
+
+struct RtcRecord
+{
+  uint32_t magic;
+  uint8_t mode;
+  uint8_t brightness;
+  uint8_t on;
+  uint8_t reserved;
+  uint16_t speedCenti;
+  uint16_t reserved2;
+  uint32_t crc; // CRC-32 of everything above
+};
+
+bool rtcStateLoad(SavedState &state)
+{
+  RtcRecord record;
+  if (!ESP.rtcUserMemoryRead(RTC_STATE_OFFSET, reinterpret_cast<uint32_t *>(&record), sizeof(record)))
+  {
+    return false;
+  }
+  if (record.magic != RTC_STATE_MAGIC ||
+      record.crc != crc32(&record, offsetof(RtcRecord, crc)))
+  {
+    return false;
+  }
+  state = {record.mode, record.brightness, record.speedCenti, record.on != 0};
+  return true;
+}
+
+void rtcStateSave(const SavedState &state)
+{
+  RtcRecord record = {RTC_STATE_MAGIC, state.mode, state.brightness, state.on, 0, state.speedCenti, 0, 0};
+  record.crc = crc32(&record, offsetof(RtcRecord, crc));
+  ESP.rtcUserMemoryWrite(RTC_STATE_OFFSET, reinterpret_cast<uint32_t *>(&record), sizeof(record));
+}
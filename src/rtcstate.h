@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// The lighting state, kept in RTC memory so that after a reset, a crash or
+// an OTA reboot the lights come straight back as they were, before WiFi is
+// even up. RTC memory does not survive losing power; a cold boot finds
+// nothing valid (the CRC fails) and starts from the defaults.
+
+#define RTC_STATE_OFFSET 0 // In 4-byte blocks of user RTC memory
+
+struct SavedState
+{
+  uint8_t mode;
+  uint8_t brightness;
+  uint16_t speedCenti; // Speed multiplier x 100
+  bool on;
+};
+
+// False when RTC memory holds no valid state
+bool rtcStateLoad(SavedState &state);
+
+void rtcStateSave(const SavedState &state);
@@ -0,0 +1,341 @@
+#include "schedule.h"
+
+#include <LittleFS.h>
+#include <stddef.h>
+#include <string.h>
+#include "crc.h"
+#include "fixed.h"
+
+#define SCHEDULE_MAGIC 0x01534c54 // "TLS\x01"
+
+// Until one is set: London
+#define DEFAULT_LATITUDE 51507400
+#define DEFAULT_LONGITUDE -127800
+
+// An event this far behind the clock was missed, not late
+#define SCHEDULE_LATE_S 60
+
+struct ScheduleFile
+{
+  uint32_t magic;
+  int32_t latitude;
+  int32_t longitude;
+  ScheduleRule rules[SCHEDULE_MAX_RULES];
+  uint32_t crc; // CRC-32 of the above
+};
+static_assert(sizeof(ScheduleRule) == 8, "rules are stored as they are in memory");
+
+static ScheduleFile schedule;
+static bool planned = false;
+static time_t plannedFrom = 0; // The plan covers events after this
+static time_t nextAt = 0;
+static uint16_t nextRules = 0;
+
+// Angles are fractions of a turn in 32 bits, so that they wrap as angles
+// do; sin16 takes the top 16
+constexpr uint32_t turns(double degrees)
+{
+  return (uint32_t)(int64_t)(degrees / 360 * 4294967296.0 + (degrees < 0 ? -0.5 : 0.5));
+}
+
+static int16_t sinTurns(uint32_t angle)
+{
+  return sin16(angle >> 16);
+}
+
+// The hour angle of sunrise turns on a difference of sines that is small
+// at high latitudes, where sin16's table is too coarse, so it is worked out
+// from sines in Q30: Taylor series over at most an eighth of a turn, good
+// to a few parts in 2^30
+#define Q30 (1LL << 30)
+
+static int64_t sinSeries(int64_t radians)
+{
+  static const uint8_t divisors[] = {110, 72, 42, 20, 6};
+  int64_t square = radians * radians >> 30;
+  int64_t sum = Q30;
+  for (uint8_t divisor : divisors)
+  {
+    sum = Q30 - (square * sum >> 30) / divisor;
+  }
+  return radians * sum >> 30;
+}
+
+static int64_t cosSeries(int64_t radians)
+{
+  static const uint8_t divisors[] = {132, 90, 56, 30, 12, 2};
+  int64_t square = radians * radians >> 30;
+  int64_t sum = Q30;
+  for (uint8_t divisor : divisors)
+  {
+    sum = Q30 - (square * sum >> 30) / divisor;
+  }
+  return sum;
+}
+
+static int32_t sin30(uint32_t angle)
+{
+  uint32_t quadrant = angle >> 30;
+  uint32_t within = angle & 0x3fffffff;
+  bool upper = within > 0x20000000; // Past the eighth: from the quarter down
+  int64_t radians = (int64_t)(upper ? 0x40000000 - within : within) * 1686629713 >> 30; // pi/2, Q30
+  int64_t value = (quadrant & 1) != upper ? cosSeries(radians) : sinSeries(radians);
+  return quadrant & 2 ? -value : value;
+}
+
+static int32_t cos30(uint32_t angle)
+{
+  return sin30(angle + 0x40000000);
+}
+
+// Angle (0 to half a turn) whose cosine is x, Q30
+static uint32_t acos30(int32_t x)
+{
+  uint32_t low = 0;
+  uint32_t high = 0x80000000;
+  while (high - low > 1)
+  {
+    uint32_t middle = low + (high - low) / 2;
+    if (cos30(middle) > x)
+    {
+      low = middle;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static uint32_t isqrt(uint64_t x)
+{
+  uint64_t root = 0;
+  for (uint64_t bit = 1ULL << 62; bit; bit >>= 2)
+  {
+    if (x >= root + bit)
+    {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+static int64_t floorDiv(int64_t a, int64_t b)
+{
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+#define J2000 946728000 // 2000-01-01 12:00 UTC, the epoch of the equations
+
+bool sunEvents(time_t t, int32_t latitude, int32_t longitude, time_t &rise, time_t &set)
+{
+  // Solar noon nearest t: n days after J2000, less the longitude's share
+  // of a day (jStar, in 1/65536 days)
+  int64_t longitudeSeconds = (int64_t)longitude * 240 / 1000000;
+  int64_t n = floorDiv((int64_t)t + longitudeSeconds - J2000 + 43200, 86400);
+  int64_t jStar = n * 65536 - (int64_t)longitude * 65536 / 360000000;
+
+  // Mean anomaly, equation of centre and ecliptic longitude
+  const int64_t anomalyPerDay = (int64_t)(0.98560028 / 360 * 4294967296.0 + 0.5);
+  uint32_t anomaly = turns(357.5291) + (uint32_t)(anomalyPerDay * jStar >> 16);
+  int64_t centre = ((int64_t)turns(1.9148) * sinTurns(anomaly) + (int64_t)turns(0.0200) * sinTurns(2 * anomaly) +
+                    (int64_t)turns(0.0003) * sinTurns(3 * anomaly)) >> 15;
+  uint32_t ecliptic = anomaly + (uint32_t)centre + turns(180 + 102.9372);
+
+  // Solar transit: 0.0053 and 0.0069 days are 457.92 s and 596.16 s
+  int64_t transit = J2000 + n * 86400 - longitudeSeconds +
+                    (45792LL * sinTurns(anomaly) - 59616LL * sinTurns(2 * ecliptic)) / (100 * 32768);
+
+  // Declination, then the hour angle at which the sun's centre is 0.833
+  // degrees below the horizon (refraction and its radius), all Q30
+  int64_t sinDeclination = (int64_t)sin30(ecliptic) * 427116999 >> 30; // sin(23.4397)
+  int64_t cosDeclination = isqrt((uint64_t)(Q30 * Q30 - sinDeclination * sinDeclination));
+  uint32_t latitudeTurns = (uint32_t)((int64_t)latitude * 4294967296LL / 360000000);
+  int64_t numerator = -15610145 - (sin30(latitudeTurns) * sinDeclination >> 30); // sin(-0.833)
+  int64_t denominator = cos30(latitudeTurns) * cosDeclination >> 30;
+  if (denominator <= 0 || numerator >= denominator || numerator <= -denominator)
+  {
+    return false;
+  }
+  uint32_t hourAngle = acos30(numerator * Q30 / denominator);
+  int64_t halfDay = (int64_t)hourAngle * 86400 >> 32;
+  rise = transit - halfDay;
+  set = transit + halfDay;
+  return true;
+}
+
+void scheduleBegin()
+{
+  File file = LittleFS.open(SCHEDULE_PATH, "r");
+  bool valid = file && file.read((uint8_t *)&schedule, sizeof(schedule)) == sizeof(schedule) &&
+               schedule.magic == SCHEDULE_MAGIC && schedule.crc == crc32(&schedule, offsetof(ScheduleFile, crc));
+  if (file)
+  {
+    file.close();
+  }
+  if (!valid)
+  {
+    memset(&schedule, 0, sizeof(schedule));
+    schedule.latitude = DEFAULT_LATITUDE;
+    schedule.longitude = DEFAULT_LONGITUDE;
+  }
+  planned = false;
+}
+
+// Write the schedule out after a change, which also calls for a new plan
+static const char *store()
+{
+  planned = false;
+  schedule.magic = SCHEDULE_MAGIC;
+  schedule.crc = crc32(&schedule, offsetof(ScheduleFile, crc));
+  File file = LittleFS.open(SCHEDULE_PATH, "w");
+  if (!file)
+  {
+    return "Could not open schedule file";
+  }
+  size_t written = file.write((const uint8_t *)&schedule, sizeof(schedule));
+  file.close();
+  if (written != sizeof(schedule))
+  {
+    LittleFS.remove(SCHEDULE_PATH);
+    return "Filesystem full";
+  }
+  return nullptr;
+}
+
+const ScheduleRule &scheduleRule(uint8_t index)
+{
+  static const ScheduleRule unused = {};
+  return index < SCHEDULE_MAX_RULES ? schedule.rules[index] : unused;
+}
+
+const char *scheduleSetRule(uint8_t index, const ScheduleRule &rule)
+{
+  if (index >= SCHEDULE_MAX_RULES)
+  {
+    return "Invalid rule";
+  }
+  bool timeOfDay = rule.anchor == ANCHOR_TIME;
+  if (rule.days & ~SCHEDULE_EVERY_DAY || rule.anchor > ANCHOR_SUNSET ||
+      (timeOfDay ? rule.minutes < 0 || rule.minutes >= 24 * 60
+                 : rule.minutes < -SCHEDULE_MAX_OFFSET || rule.minutes > SCHEDULE_MAX_OFFSET))
+  {
+    return "Invalid time";
+  }
+  if (rule.on > 1 || rule.brightness > 255)
+  {
+    return "Invalid action";
+  }
+  schedule.rules[index] = rule.days ? rule : ScheduleRule{};
+  return store();
+}
+
+const char *scheduleSetLocation(int32_t latitude, int32_t longitude)
+{
+  if (latitude < -90000000 || latitude > 90000000 || longitude < -180000000 || longitude > 180000000)
+  {
+    return "Invalid location";
+  }
+  schedule.latitude = latitude;
+  schedule.longitude = longitude;
+  return store();
+}
+
+int32_t scheduleLatitude()
+{
+  return schedule.latitude;
+}
+
+int32_t scheduleLongitude()
+{
+  return schedule.longitude;
+}
+
+// Find the first event after time after: every rule on every local day
+// from yesterday (a sunset offset can reach into today) to a week ahead
+static void plan(time_t after)
+{
+  planned = true;
+  plannedFrom = after;
+  nextAt = 0;
+  nextRules = 0;
+  tm today;
+  localtime_r(&after, &today);
+  for (int offset = -1; offset <= 7; offset++)
+  {
+    tm day = today;
+    day.tm_mday += offset;
+    day.tm_hour = 12;
+    day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+    time_t noon = mktime(&day); // Also works out the weekday
+    time_t rise = 0, set = 0;
+    bool sun = sunEvents(noon, schedule.latitude, schedule.longitude, rise, set);
+    for (uint8_t index = 0; index < SCHEDULE_MAX_RULES; index++)
+    {
+      const ScheduleRule &rule = schedule.rules[index];
+      if (!(rule.days >> day.tm_wday & 1))
+      {
+        continue;
+      }
+      time_t at;
+      if (rule.anchor == ANCHOR_TIME)
+      {
+        tm local = day;
+        local.tm_hour = rule.minutes / 60;
+        local.tm_min = rule.minutes % 60;
+        local.tm_isdst = -1;
+        at = mktime(&local);
+      }
+      else if (sun)
+      {
+        at = (rule.anchor == ANCHOR_SUNRISE ? rise : set) + rule.minutes * 60;
+      }
+      else
+      {
+        continue;
+      }
+      if (at <= after || (nextAt && at > nextAt))
+      {
+        continue;
+      }
+      nextRules = at == nextAt ? nextRules | 1 << index : 1 << index;
+      nextAt = at;
+    }
+  }
+}
+
+uint16_t scheduleDue(time_t now)
+{
+  // Plan again after an edit, if the clock stepped back or well past the
+  // next event, or daily while there is nothing in the next week (a polar
+  // night, say)
+  if (!planned || now < plannedFrom || (nextAt && now - nextAt > SCHEDULE_LATE_S) ||
+      (!nextAt && now - plannedFrom >= 86400))
+  {
+    plan(now);
+  }
+  if (!nextAt || now < nextAt)
+  {
+    return 0;
+  }
+  uint16_t due = nextRules;
+  plan(nextAt);
+  return due;
+}
+
+time_t scheduleNextAt()
+{
+  return nextAt;
+}
+
+uint16_t scheduleNextRules()
+{
+  return nextRules;
+}
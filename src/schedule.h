@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Schedule: on/off, mode and brightness changes the controller makes by
+// itself, at a time of day or relative to sunrise or sunset, so the trees
+// still switch at dusk with WiFi or the broker down. Sunrise and sunset are
+// worked out on the device, in fixed point, for the location set here.
+//
+// The next event is planned whenever the rules, the location or the clock
+// change; in between, checking for it is one compare. Events missed while
+// the controller was off, or before it first had NTP time, are not made up.
+//
+// Rules and location are kept in LittleFS (SCHEDULE_PATH):
+//
+//   'T' 'L' 'S' 0x01           magic and format version
+//   latitude longitude         int32 each, microdegrees (north, east positive)
+//   rule[SCHEDULE_MAX_RULES]   ScheduleRule, 8 bytes each
+//   crc                        CRC-32 of everything above
+
+#define SCHEDULE_MAX_RULES 16
+#define SCHEDULE_PATH "/schedule.bin"
+#define SCHEDULE_MAX_OFFSET 720 // Minutes either side of sunrise or sunset
+
+enum ScheduleAnchor : uint8_t
+{
+  ANCHOR_TIME,    // minutes after local midnight
+  ANCHOR_SUNRISE, // minutes after sunrise (negative for before)
+  ANCHOR_SUNSET
+};
+
+// Fields left at -1 are not changed by the rule. An unused rule has no days.
+struct ScheduleRule
+{
+  uint8_t days;       // Local weekdays the rule runs on: bit 0 Sunday ... bit 6 Saturday
+  uint8_t anchor;     // ScheduleAnchor
+  int16_t minutes;
+  int8_t on;          // 1 on, 0 off
+  int8_t mode;
+  int16_t brightness; // 0-255
+};
+
+#define SCHEDULE_EVERY_DAY 0x7f
+
+// Load the schedule; starts empty if there is none. LittleFS must be
+// mounted.
+void scheduleBegin();
+
+// Unused rules read back with days == 0
+const ScheduleRule &scheduleRule(uint8_t index);
+
+// Replace a rule (days == 0 clears it) or the location, and save; returns
+// an error message, or nullptr on success
+const char *scheduleSetRule(uint8_t index, const ScheduleRule &rule);
+const char *scheduleSetLocation(int32_t latitude, int32_t longitude);
+
+int32_t scheduleLatitude();
+int32_t scheduleLongitude();
+
+// Rules due at time now (UTC), as a bit mask by index, 0 most of the time.
+// Call at least once a second; it plans the next event when it needs to.
+uint16_t scheduleDue(time_t now);
+
+// The next planned event and the rules that run at it; 0 if none is
+// planned
+time_t scheduleNextAt();
+uint16_t scheduleNextRules();
+
+// Sunrise and sunset (UTC) on the day around time t, by the NOAA solar
+// equations in fixed point; within 3 s of the full calculation up to 65
+// degrees of latitude and 10 s at 70, where the sun only just rises.
+// False if the sun stays up or down all day there.
+bool sunEvents(time_t t, int32_t latitude, int32_t longitude, time_t &rise, time_t &set);
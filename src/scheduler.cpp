@@ -0,0 +1,137 @@
+#include "scheduler.h"
+#include "hal.h"
+
+static TaskFunction frameRenderer = nullptr;
+static uint32_t nextFrameUs = 0;
+static FrameStats stats = {};
+static PhaseProfile frameRenderProfile = {};
+
+static Task tasks[MAX_TASKS];
+static int taskCount = 0;
+static uint32_t idleIntervalUs = 0; // 0 while not idle
+
+void schedulerBegin(uint32_t framePeriodUs, TaskFunction renderFrame)
+{
+  frameRenderer = renderFrame;
+  stats = {};
+  stats.periodUs = framePeriodUs;
+  nextFrameUs = halMicros();
+}
+
+bool schedulerAddTask(const char *name, TaskFunction run, uint32_t intervalMs)
+{
+  if (taskCount >= MAX_TASKS)
+  {
+    return false;
+  }
+  tasks[taskCount++] = {name, run, intervalMs * 1000, (uint32_t)halMicros(), 0, {}};
+  return true;
+}
+
+static void runFrame(uint32_t now)
+{
+  uint32_t lateness = now - nextFrameUs;
+  stats.lastJitterUs = lateness;
+  stats.meanJitterUs = stats.meanJitterUs - stats.meanJitterUs / 16 + lateness / 16;
+  if (lateness > stats.maxJitterUs)
+  {
+    stats.maxJitterUs = lateness;
+  }
+
+  uint32_t start = halCycleCount();
+  frameRenderer();
+  profileRecord(frameRenderProfile, halCycleCount() - start);
+  stats.frames++;
+
+  // Deadlines are absolute, so a late frame doesn't push the ones after it.
+  // Only when a whole period has been lost do we skip ahead on the grid.
+  nextFrameUs += stats.periodUs;
+  if ((int32_t)(now - nextFrameUs) >= 0)
+  {
+    uint32_t behind = (now - nextFrameUs) / stats.periodUs + 1;
+    stats.missedDeadlines += behind;
+    nextFrameUs += behind * stats.periodUs;
+  }
+}
+
+void schedulerRun()
+{
+  uint32_t now = halMicros();
+  if (frameRenderer && !idleIntervalUs && (int32_t)(now - nextFrameUs) >= 0)
+  {
+    runFrame(now);
+  }
+
+  for (int i = 0; i < taskCount; i++)
+  {
+    Task &task = tasks[i];
+    now = halMicros();
+    if ((int32_t)(now - task.nextRunUs) < 0)
+    {
+      continue;
+    }
+    uint32_t start = halCycleCount();
+    task.run();
+    profileRecord(task.profile, halCycleCount() - start);
+    task.runs++;
+    // Services only need a minimum rate, so a late task simply restarts its interval
+    task.nextRunUs = now + (task.intervalUs > idleIntervalUs ? task.intervalUs : idleIntervalUs);
+  }
+}
+
+void schedulerSetIdle(uint32_t intervalMs)
+{
+  uint32_t now = halMicros();
+  idleIntervalUs = intervalMs * 1000;
+  if (!idleIntervalUs)
+  {
+    nextFrameUs = now;
+    for (int i = 0; i < taskCount; i++)
+    {
+      tasks[i].nextRunUs = now;
+    }
+  }
+}
+
+bool schedulerIdle()
+{
+  return idleIntervalUs != 0;
+}
+
+uint32_t schedulerSleepUs()
+{
+  uint32_t now = halMicros();
+  int32_t sleep = idleIntervalUs ? idleIntervalUs : nextFrameUs - now;
+  for (int i = 0; i < taskCount; i++)
+  {
+    int32_t due = tasks[i].nextRunUs - now;
+    sleep = due < sleep ? due : sleep;
+  }
+  return sleep > 0 ? sleep : 0;
+}
+
+const FrameStats &frameStats()
+{
+  return stats;
+}
+
+void resetFrameStats()
+{
+  stats.maxJitterUs = 0;
+  stats.missedDeadlines = 0;
+}
+
+const PhaseProfile &frameProfile()
+{
+  return frameRenderProfile;
+}
+
+int schedulerTaskCount()
+{
+  return taskCount;
+}
+
+const Task &schedulerTask(int index)
+{
+  return tasks[index];
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include "profiler.h"
+
+// Cooperative scheduler: a fixed-rate frame clock for the animation plus a
+// short list of periodic service tasks (network, Telnet, button) that run in
+// the slack between frames. Nothing scheduled here may block.
+
+typedef void (*TaskFunction)();
+
+struct FrameStats
+{
+  uint32_t periodUs;        // Target frame period
+  uint32_t frames;          // Frames rendered since boot
+  uint32_t missedDeadlines; // Frame slots skipped because we were a full period late
+  uint32_t lastJitterUs;    // Lateness of the most recent frame
+  uint32_t meanJitterUs;    // Running mean of the lateness (1/16 EWMA)
+  uint32_t maxJitterUs;     // Worst lateness since the stats were last reset
+};
+
+struct Task
+{
+  const char *name;
+  TaskFunction run;
+  uint32_t intervalUs;
+  uint32_t nextRunUs;
+  uint32_t runs;
+  PhaseProfile profile;
+};
+
+#define MAX_TASKS 16
+
+void schedulerBegin(uint32_t framePeriodUs, TaskFunction renderFrame);
+bool schedulerAddTask(const char *name, TaskFunction run, uint32_t intervalMs);
+
+// Call from loop(): renders the frame if its deadline has passed, then runs
+// every task that is due
+void schedulerRun();
+
+// Idle: no frames, and no task runs more often than every intervalMs (0
+// ends idle; frames start again straight away and every task runs on the
+// next pass)
+void schedulerSetIdle(uint32_t intervalMs);
+bool schedulerIdle();
+
+// How long until a frame or a task is next due, for sleeping in between
+uint32_t schedulerSleepUs();
+
+const FrameStats &frameStats();
+void resetFrameStats();
+
+// Where the time goes: the frame renderer's profile and each task's
+const PhaseProfile &frameProfile();
+int schedulerTaskCount();
+const Task &schedulerTask(int index);
@@ -1,5 +1,5 @@
-#define SECRET_SSID "PrettyFly_IoT"
-#define SECRET_PASS "add_me!"
+#define WIFI_SSID "PrettyFly_IoT"
+#define WIFI_PASS "add_me!"
 
 #define MQTT_SERVER "192.168.." // Change to your HA IP/hostname
 #define MQTT_USER ""            // Leave empty if no auth
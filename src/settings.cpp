@@ -0,0 +1,239 @@
+#include "settings.h"
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+#include "crc.h"
+#include "hal.h"
+
+#define JOURNAL_MAGIC 0x314a4c54 // "TLJ1"
+#define RECORD_VERSION 1
+#define JOURNAL_MAX_SECTORS 8
+
+struct SectorHeader
+{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t crc; // CRC-32 of the above
+};
+
+struct Record
+{
+  uint8_t version;
+  uint8_t mode;
+  uint8_t brightness;
+  uint8_t on;
+  uint16_t speedCenti;
+  uint16_t reserved;
+  uint32_t crc; // CRC-32 of the above
+};
+
+#define RECORDS_PER_SECTOR ((HAL_FLASH_SECTOR_SIZE - sizeof(SectorHeader)) / sizeof(Record))
+
+static SettingsStats stats;
+static uint8_t sectors;
+static bool headerValid; // The current sector has a header
+static SavedState written; // Last state written, if any
+static SavedState wanted;  // Last state noted, if any
+static bool haveWritten;
+static bool haveWanted;
+static uint32_t firstChangeMs;
+static uint32_t lastChangeMs;
+
+static bool sameState(const SavedState &a, const SavedState &b)
+{
+  return a.mode == b.mode && a.brightness == b.brightness && a.speedCenti == b.speedCenti && a.on == b.on;
+}
+
+static uint32_t recordOffset(uint16_t slot)
+{
+  return sizeof(SectorHeader) + slot * sizeof(Record);
+}
+
+static bool readHeader(uint8_t sector, uint32_t &sequence)
+{
+  SectorHeader header;
+  if (!halJournalRead(sector, 0, &header, sizeof(header)) || header.magic != JOURNAL_MAGIC ||
+      header.crc != crc32(&header, offsetof(SectorHeader, crc)))
+  {
+    return false;
+  }
+  sequence = header.sequence;
+  return true;
+}
+
+// Find the last valid record in a sector, and the first slot after
+// everything written to it (a torn record still takes up its slot)
+static bool scanSector(uint8_t sector, SavedState &state, uint16_t &used)
+{
+  static const Record erased = {0xff, 0xff, 0xff, 0xff, 0xffff, 0xffff, 0xffffffff};
+  bool found = false;
+  used = 0;
+  for (uint16_t slot = 0; slot < RECORDS_PER_SECTOR; slot++)
+  {
+    Record record;
+    if (!halJournalRead(sector, recordOffset(slot), &record, sizeof(record)))
+    {
+      break;
+    }
+    if (memcmp(&record, &erased, sizeof(record)) == 0)
+    {
+      continue;
+    }
+    used = slot + 1;
+    if (record.version == RECORD_VERSION && record.crc == crc32(&record, offsetof(Record, crc)))
+    {
+      state = {record.mode, record.brightness, record.speedCenti, record.on != 0};
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool settingsBegin(SavedState &state)
+{
+  stats = {};
+  stats.capacity = RECORDS_PER_SECTOR;
+  sectors = min(halJournalSectors(), (uint8_t)JOURNAL_MAX_SECTORS);
+  headerValid = false;
+  haveWritten = haveWanted = false;
+  if (sectors < 2)
+  {
+    return false;
+  }
+
+  uint32_t sequences[JOURNAL_MAX_SECTORS];
+  bool valid[JOURNAL_MAX_SECTORS];
+  for (uint8_t sector = 0; sector < sectors; sector++)
+  {
+    valid[sector] = readHeader(sector, sequences[sector]);
+  }
+
+  // Newest sector first. Appends go on after whatever is in it, valid or
+  // not; if none of it is valid, the state comes from the one before.
+  for (;;)
+  {
+    int newest = -1;
+    for (uint8_t sector = 0; sector < sectors; sector++)
+    {
+      if (valid[sector] && (newest < 0 || (int32_t)(sequences[sector] - sequences[newest]) > 0))
+      {
+        newest = sector;
+      }
+    }
+    if (newest < 0)
+    {
+      return false;
+    }
+    valid[newest] = false;
+    uint16_t used;
+    bool found = scanSector(newest, state, used);
+    if (!headerValid)
+    {
+      stats.sector = newest;
+      stats.sequence = sequences[newest];
+      stats.used = used;
+      headerValid = true;
+    }
+    if (found)
+    {
+      written = wanted = state;
+      haveWritten = haveWanted = true;
+      return true;
+    }
+  }
+}
+
+// Start the next sector with record: erase it, write the record, then the
+// header that makes it current
+static bool startSector(const Record &record)
+{
+  uint8_t next = headerValid ? (stats.sector + 1) % sectors : 0;
+  SectorHeader header = {JOURNAL_MAGIC, headerValid ? stats.sequence + 1 : 0, 0};
+  header.crc = crc32(&header, offsetof(SectorHeader, crc));
+  stats.erases++;
+  if (!halJournalErase(next) || !halJournalWrite(next, recordOffset(0), &record, sizeof(record)) ||
+      !halJournalWrite(next, 0, &header, sizeof(header)))
+  {
+    return false;
+  }
+  stats.sector = next;
+  stats.sequence = header.sequence;
+  stats.used = 1;
+  headerValid = true;
+  return true;
+}
+
+static bool writeRecord(const SavedState &state)
+{
+  Record record = {RECORD_VERSION, state.mode, state.brightness, state.on, state.speedCenti, 0xffff, 0};
+  record.crc = crc32(&record, offsetof(Record, crc));
+  bool ok;
+  if (!headerValid || stats.used >= RECORDS_PER_SECTOR)
+  {
+    ok = startSector(record);
+  }
+  else
+  {
+    // A failed write still uses up the slot
+    ok = halJournalWrite(stats.sector, recordOffset(stats.used++), &record, sizeof(record));
+  }
+  if (!ok)
+  {
+    stats.failures++;
+    return false;
+  }
+  stats.writes++;
+  return true;
+}
+
+void settingsUpdate(const SavedState &state)
+{
+  if (haveWanted && sameState(state, wanted))
+  {
+    return;
+  }
+  uint32_t now = halMillis();
+  if (!stats.pending)
+  {
+    firstChangeMs = now;
+  }
+  lastChangeMs = now;
+  wanted = state;
+  haveWanted = true;
+  stats.updates++;
+  stats.pending = !haveWritten || !sameState(wanted, written);
+}
+
+bool settingsFlush()
+{
+  if (!stats.pending || sectors < 2)
+  {
+    return true;
+  }
+  if (!writeRecord(wanted))
+  {
+    // Try again after another debounce
+    lastChangeMs = halMillis();
+    return false;
+  }
+  written = wanted;
+  haveWritten = true;
+  stats.pending = false;
+  return true;
+}
+
+void settingsPoll()
+{
+  uint32_t now = halMillis();
+  if (stats.pending &&
+      (now - lastChangeMs >= SETTINGS_DEBOUNCE_MS || now - firstChangeMs >= SETTINGS_MAX_DELAY_MS))
+  {
+    settingsFlush();
+  }
+}
+
+const SettingsStats &settingsStats()
+{
+  return stats;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include "rtcstate.h"
+
+// Settings journal: the lighting state kept in flash, so it survives losing
+// power as well as a reset. Each change is appended to the current sector
+// as a CRC-checked record and the last valid record wins, so a write cut
+// short by a power cut leaves the one before it in force. When a sector
+// fills, the next is erased and takes over; its header, carrying a sequence
+// number, is written only after its first record, so the newest sector with
+// a valid header always holds a complete record.
+//
+// Writes are behind a debounce: dragging a brightness slider is a burst of
+// changes that ends up as one record.
+
+#define SETTINGS_DEBOUNCE_MS 2000   // Written once changes stop for this long...
+#define SETTINGS_MAX_DELAY_MS 10000 // ...or at most this long after the first
+
+struct SettingsStats
+{
+  uint32_t updates;   // Changes handed to the journal
+  uint32_t writes;    // Records written
+  uint32_t erases;    // Sectors erased
+  uint32_t failures;  // Flash operations that failed
+  uint16_t used;      // Records in the current sector
+  uint16_t capacity;  // Records a sector holds
+  uint8_t sector;     // Current sector
+  uint32_t sequence;  // Sectors filled since the journal was first written
+  bool pending;       // A change is waiting to be written
+};
+
+// Read the journal back; false when it holds no valid record (state is
+// left alone)
+bool settingsBegin(SavedState &state);
+
+// Note the current state; written once it settles
+void settingsUpdate(const SavedState &state);
+
+// Write a settled change; call every SETTINGS_POLL_MS or so
+void settingsPoll();
+
+// Write any pending change now. False if a flash operation failed.
+bool settingsFlush();
+
+const SettingsStats &settingsStats();
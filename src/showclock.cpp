@@ -0,0 +1,94 @@
+#include "showclock.h"
+
+// A system clock reading differing from the last by more than this, beyond
+// the time that passed, is an SNTP update
+#define SHOWCLOCK_UPDATE_US 20
+
+static int64_t clamp(int64_t value, int64_t limit)
+{
+  return value > limit ? limit : value < -limit ? -limit : value;
+}
+
+int64_t ShowClock::slewed(uint32_t elapsedUs) const
+{
+  // Until the pending error is gone
+  int64_t slewed = (int64_t)elapsedUs * counters.slewPpm / 1000000;
+  return clamp(slewed, pendingUs < 0 ? -pendingUs : pendingUs);
+}
+
+uint64_t ShowClock::now(uint32_t localUs) const
+{
+  if (!counters.synced)
+  {
+    return 0;
+  }
+  uint32_t elapsed = localUs - baseLocalUs;
+  return baseUtcUs + elapsed + (int64_t)elapsed * counters.driftPpb / -1000000000 + slewed(elapsed);
+}
+
+void ShowClock::sample(uint32_t localUs, uint64_t utcUs)
+{
+  // Between updates the system clock runs off the same crystal as the
+  // local one, so the two differ by a constant (wrapping with micros())
+  uint32_t offset = (uint32_t)utcUs - localUs;
+  int32_t moved = offset - systemOffset;
+  systemOffset = offset;
+  bool update = moved > SHOWCLOCK_UPDATE_US || moved < -SHOWCLOCK_UPDATE_US;
+
+  // Move the base up, so now() never has to span a micros() wrap
+  uint64_t current = now(localUs);
+  pendingUs -= slewed(localUs - baseLocalUs);
+  baseLocalUs = localUs;
+  baseUtcUs = current;
+  if (counters.synced && !update)
+  {
+    return;
+  }
+
+  counters.updates++;
+  int64_t error = (int64_t)(utcUs - current);
+  uint32_t sinceUpdate = localUs - updateLocalUs;
+  updateLocalUs = localUs;
+  if (!counters.synced || error > SHOWCLOCK_STEP_US || error < -SHOWCLOCK_STEP_US)
+  {
+    // First reading, or too far out to slew in reasonable time
+    baseUtcUs = utcUs;
+    pendingUs = 0;
+    counters.slewPpm = 0;
+    counters.errorUs = counters.synced ? clamp(error, INT32_MAX) : 0;
+    counters.steps += counters.synced;
+    counters.synced = true;
+    return;
+  }
+
+  // What was left after the last update's correction came from running at
+  // the wrong rate since: take part of it as a correction to the rate
+  int64_t driftPpb = counters.driftPpb - error * 1000000000 / sinceUpdate / SHOWCLOCK_FREQ_GAIN;
+  counters.driftPpb = clamp(driftPpb, SHOWCLOCK_MAX_FREQ_PPM * 1000);
+
+  // And slew out part of the error itself over the next few seconds, so
+  // one noisy reply only moves the clock part of the way
+  // (e us over s seconds is e / s us a second: e / s ppm)
+  pendingUs = error / SHOWCLOCK_OFFSET_GAIN;
+  counters.slewPpm = clamp(pendingUs / SHOWCLOCK_SLEW_SECONDS, SHOWCLOCK_MAX_SLEW_PPM);
+  counters.errorUs = error;
+}
+
+ShowTime showLock(ShowTime time, ShowTime advance, ShowTime target, ShowTime cycle, int64_t &error)
+{
+  time = (time + advance) % cycle;
+  // Shortest way round the cycle from time to target
+  int64_t ahead = (int64_t)((target + cycle - time) % cycle);
+  if (ahead > (int64_t)(cycle / 2))
+  {
+    ahead -= cycle;
+  }
+  error = ahead;
+
+  int64_t step = showAt(SHOW_LOCK_STEP_MS);
+  if (ahead > step || ahead < -step)
+  {
+    return target;
+  }
+  return (time + cycle + clamp(ahead, advance / SHOW_LOCK_SLEW)) % cycle;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include "modes.h"
+
+// Show clock shared by every controller in the room. The system clock is
+// read off the local crystal, which can drift by 100 ms an hour, and SNTP
+// steps it back to NTP time at every update; those steps would jump the
+// animation. This clock takes each update as a measurement instead: it
+// slews toward NTP time over a few seconds, and learns how fast the crystal
+// runs so it drifts less before the next one. Built-in modes
+// phase-lock to it: a mode at a given speed is at the same point in its
+// cycle on every synced controller, however long each has been running.
+
+#define SHOWCLOCK_POLL_MS 1000          // How often the system clock is read for an update
+#define SHOWCLOCK_NTP_INTERVAL_MS 64000 // SNTP update interval (ntpd's minimum poll)
+#define SHOWCLOCK_STEP_US 128000        // Errors beyond this are stepped, as ntpd does
+#define SHOWCLOCK_SLEW_SECONDS 4        // An error is slewed out over about this long...
+#define SHOWCLOCK_MAX_SLEW_PPM 5000     // ...at up to 0.5%, far below a visible change of speed
+#define SHOWCLOCK_OFFSET_GAIN 2         // Each update corrects 1/2 the error...
+#define SHOWCLOCK_FREQ_GAIN 4           // ...and moves the drift estimate 1/4 of the way
+#define SHOWCLOCK_MAX_FREQ_PPM 500
+
+// Phase lock: a controller off the shared phase by more than SHOW_LOCK_STEP_MS
+// of show time jumps to it; less than that, it runs up to 1/SHOW_LOCK_SLEW
+// faster or slower until it catches up, so a speed change never jumps
+#define SHOW_LOCK_STEP_MS 2000
+#define SHOW_LOCK_SLEW 8
+
+struct ShowClockStats
+{
+  uint32_t updates; // SNTP updates seen
+  uint32_t steps;   // Times the offset was stepped instead of slewed
+  int32_t errorUs;  // NTP time minus show clock at the last update
+  int32_t driftPpb; // How much faster than NTP time the local clock runs
+  int32_t slewPpm;  // Rate the last error is being slewed out at
+  bool synced;      // Once NTP time has been read
+};
+
+class ShowClock
+{
+public:
+  // Read the system clock (UTC us) at local time localUs. Call every
+  // SHOWCLOCK_POLL_MS; readings only count when SNTP has updated it.
+  void sample(uint32_t localUs, uint64_t utcUs);
+
+  // UTC microseconds at local time localUs, within the time since the last
+  // sample; 0 until synced
+  uint64_t now(uint32_t localUs) const;
+
+  const ShowClockStats &stats() const { return counters; }
+
+private:
+  int64_t slewed(uint32_t elapsedUs) const;
+
+  // The clock read baseUtcUs at local time baseLocalUs, since when it has
+  // slewed out up to pendingUs at counters.slewPpm
+  uint32_t baseLocalUs = 0;
+  uint64_t baseUtcUs = 0;
+  int64_t pendingUs = 0;
+  uint32_t systemOffset = 0; // System clock minus local clock: changes only at an update
+  uint32_t updateLocalUs = 0;
+  ShowClockStats counters = {};
+};
+
+// Where a mode at speed is in its cycle at clock time utcUs: the phase every
+// synced controller aims for, as if all had started the mode at the epoch
+inline ShowTime showPhase(uint64_t utcUs, q8_8_t speed, ShowTime cycle)
+{
+  // (utcUs * speed) mod cycle, without overflowing 64 bits
+  return (utcUs % cycle) * speed % cycle;
+}
+
+// Advance time (within cycle) by advance, pulled toward target. error is
+// set to how far target was ahead (+) or behind (-) before the correction.
+ShowTime showLock(ShowTime time, ShowTime advance, ShowTime target, ShowTime cycle, int64_t &error);
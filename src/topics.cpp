@@ -0,0 +1,84 @@
+#include "topics.h"
+
+#include <string.h>
+
+bool topicDispatch(const TopicRoute *routes, size_t count, const char *topic, const uint8_t *payload, unsigned int length)
+{
+  size_t topicLength = strlen(topic);
+  uint32_t hash = topicHash(topic, topicLength);
+  for (size_t i = 0; i < count; i++)
+  {
+    const TopicRoute &route = routes[i];
+    // The full compare only guards against a hash collision with a topic
+    // we do not subscribe to
+    if (route.hash == hash && route.length == topicLength && memcmp(route.topic, topic, topicLength) == 0)
+    {
+      route.handler(payload, length);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Each block is preceded by its size so a block that is not the last can
+// still be copied when it grows
+static const size_t blockHeader = 8;
+
+static size_t blockSize(const uint8_t *block)
+{
+  uint32_t size;
+  memcpy(&size, block - blockHeader, sizeof(size));
+  return size;
+}
+
+void *JsonArena::allocate(size_t bytes)
+{
+  size_t needed = blockHeader + ((bytes + 7) & ~(size_t)7);
+  if (needed > size - used)
+  {
+    return nullptr;
+  }
+  uint8_t *block = buffer + used + blockHeader;
+  uint32_t stored = bytes;
+  memcpy(block - blockHeader, &stored, sizeof(stored));
+  used += needed;
+  highWater = used > highWater ? used : highWater;
+  last = block;
+  return block;
+}
+
+void *JsonArena::reallocate(void *ptr, size_t bytes)
+{
+  uint8_t *block = static_cast<uint8_t *>(ptr);
+  if (!block)
+  {
+    return allocate(bytes);
+  }
+  if (block == last)
+  {
+    // Grow or shrink in place
+    size_t start = block - buffer;
+    size_t needed = (bytes + 7) & ~(size_t)7;
+    if (needed > size - start)
+    {
+      return nullptr;
+    }
+    uint32_t stored = bytes;
+    memcpy(block - blockHeader, &stored, sizeof(stored));
+    used = start + needed;
+    highWater = used > highWater ? used : highWater;
+    return block;
+  }
+
+  size_t old = blockSize(block);
+  if (bytes <= old)
+  {
+    return block;
+  }
+  uint8_t *moved = static_cast<uint8_t *>(allocate(bytes));
+  if (moved)
+  {
+    memcpy(moved, block, old);
+  }
+  return moved;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// MQTT command dispatch: subscribed topics live in a constant table keyed on
+// their length and FNV-1a hash, both worked out at compile time, so an
+// incoming message costs one pass over its topic plus one compare. Handlers
+// get the payload where PubSubClient left it, unterminated.
+
+typedef void (*TopicHandler)(const uint8_t *payload, unsigned int length);
+
+struct TopicRoute
+{
+  uint32_t hash;
+  uint8_t length;
+  const char *topic;
+  TopicHandler handler;
+};
+
+constexpr uint32_t topicHash(const char *topic, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ (uint8_t)topic[i]) * 16777619u;
+  }
+  return hash;
+}
+
+constexpr size_t topicLength(const char *topic)
+{
+  size_t length = 0;
+  while (topic[length])
+  {
+    length++;
+  }
+  return length;
+}
+
+constexpr TopicRoute topicRoute(const char *topic, TopicHandler handler)
+{
+  return {topicHash(topic, topicLength(topic)), (uint8_t)topicLength(topic), topic, handler};
+}
+
+// For a static_assert that no two routes share a key
+constexpr bool topicRoutesDistinct(const TopicRoute *routes, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    for (size_t j = i + 1; j < count; j++)
+    {
+      if (routes[i].hash == routes[j].hash && routes[i].length == routes[j].length)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Run the handler for topic; returns false if no route matches
+bool topicDispatch(const TopicRoute *routes, size_t count, const char *topic, const uint8_t *payload, unsigned int length);
+
+// A fixed arena for ArduinoJson, so JSON commands are parsed into bounded
+// static memory. reset() before each parse; when the arena is full the
+// parse fails with NoMemory instead of growing the heap.
+class JsonArena : public ArduinoJson::Allocator
+{
+public:
+  JsonArena(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {}
+
+  void reset() { used = 0; last = nullptr; }
+  size_t peak() const { return highWater; }
+
+  void *allocate(size_t bytes) override;
+  void deallocate(void *) override {}
+  void *reallocate(void *ptr, size_t bytes) override;
+
+private:
+  uint8_t *buffer;
+  size_t size;
+  size_t used = 0;
+  size_t highWater = 0;
+  uint8_t *last = nullptr; // Most recent block, which can be resized in place
+};
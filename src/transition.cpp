@@ -0,0 +1,39 @@
+#include "transition.h"
+
+void rampStart(Ramp &ramp, uint16_t to, uint32_t ms)
+{
+  ramp.from = rampLevel(ramp);
+  ramp.to = to;
+  ramp.progress = 0;
+  if (!ms || ramp.from == to)
+  {
+    ramp.from = to;
+    ramp.rate = 0;
+    return;
+  }
+  if (ms > TRANSITION_MAX_MS)
+  {
+    ms = TRANSITION_MAX_MS;
+  }
+  // At least 1000 us, so the rate fits 32 bits; at the hour-long limit it
+  // is still within 0.4% of the time asked for
+  ramp.rate = (1ULL << 40) / ((uint64_t)ms * 1000);
+}
+
+uint16_t rampAdvance(Ramp &ramp, uint32_t elapsedUs)
+{
+  if (!ramp.rate)
+  {
+    return ramp.to;
+  }
+  uint64_t progress = ramp.progress + ((uint64_t)elapsedUs * ramp.rate >> 8);
+  if (progress >> 32)
+  {
+    ramp.from = ramp.to;
+    ramp.progress = 0;
+    ramp.rate = 0;
+    return ramp.to;
+  }
+  ramp.progress = progress;
+  return rampLevel(ramp);
+}
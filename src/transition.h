@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include "fixed.h"
+#include "output.h"
+
+// Transitions: brightness, on/off and mode changes fade on the controller,
+// on the frame clock, so a Home Assistant "transition" is one command
+// rather than a stream of brightness steps.
+//
+// A ramp moves a Q8.8 level in a straight line. Its progress is a Q0.32
+// fraction of the way, advanced every frame by the elapsed time times a
+// rate worked out once when the ramp starts, so a frame costs a multiply
+// and never a divide. It lands exactly on the target however the time was
+// split into frames.
+
+#define TRANSITION_MAX_MS 3600000UL // An hour; longer requests are cut to this
+
+struct Ramp
+{
+  uint16_t from;     // Q8.8
+  uint16_t to;       // Q8.8
+  uint32_t progress; // Q0.32 of the way from `from` to `to`
+  uint32_t rate;     // Progress per us, Q0.40; 0 once the ramp has arrived
+};
+
+// Head for to from wherever the ramp is now, arriving in ms (0 jumps)
+void rampStart(Ramp &ramp, uint16_t to, uint32_t ms);
+
+// Move on by elapsedUs and return the level
+uint16_t rampAdvance(Ramp &ramp, uint32_t elapsedUs);
+
+inline uint16_t rampLevel(const Ramp &ramp)
+{
+  // 16 x 15 bits, so the product stays within 32
+  return ramp.from + ((int32_t)(ramp.to - ramp.from) * (int32_t)(ramp.progress >> 17) >> 15);
+}
+
+inline bool rampRunning(const Ramp &ramp)
+{
+  return ramp.rate != 0;
+}
+
+// weight/255 of the way from one frame to another
+inline Frame frameMix(Frame from, Frame to, uint8_t weight)
+{
+  return {(uint8_t)div255(from.a * (255 - weight) + to.a * weight),
+          (uint8_t)div255(from.b * (255 - weight) + to.b * weight)};
+}
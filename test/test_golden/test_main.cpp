@@ -0,0 +1,139 @@
+// Golden output traces: every built-in mode is run through the native
+// runner exactly as test/golden/mode-N.trace was recorded, and its bridge
+// outputs must match the recording edge for edge. A change to the
+// animation, scheduling or output code that alters what the lights show
+// fails here; if the change is meant to, record the traces again (see the
+// README).
+//
+//   pio test -e native
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unity.h>
+#include <vector>
+#include "modes.h"
+
+int nativeMain(int argc, char **argv);
+
+// How the golden traces were recorded
+#define GOLDEN_SPEED "1.5"
+#define GOLDEN_BRIGHTNESS "200"
+#define GOLDEN_SECONDS "5"
+
+struct TraceRecord
+{
+  uint64_t us;
+  uint8_t state; // IN1 | IN2 << 1 | ENA << 2
+};
+
+static std::string goldenPath(int mode)
+{
+  std::string path = __FILE__;
+  path = path.substr(0, path.rfind("test_golden")) + "golden/mode-" + std::to_string(mode) + ".trace";
+  return path;
+}
+
+// The runner's binary format: "TLT" 0x01, then a LEB128 varint per record
+// of (us since the last record << 3 | state)
+static bool readTrace(const std::string &path, std::vector<TraceRecord> &records)
+{
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+  {
+    return false;
+  }
+  char magic[4];
+  bool valid = fread(magic, 1, 4, file) == 4 && !memcmp(magic, "TLT\x01", 4);
+  uint64_t us = 0, value = 0;
+  int shift = 0, c;
+  while (valid && (c = fgetc(file)) != EOF)
+  {
+    value |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+    if (c & 0x80)
+    {
+      continue;
+    }
+    us += value >> 3;
+    records.push_back({us, (uint8_t)(value & 7)});
+    value = shift = 0;
+  }
+  fclose(file);
+  return valid && !shift;
+}
+
+static std::string describe(const TraceRecord &record)
+{
+  const char *set = (record.state & 3) == 1 ? "A" : (record.state & 3) == 2 ? "B" : "-";
+  char text[48];
+  snprintf(text, sizeof(text), "%.6f s set %s enable %d", record.us / 1e6, set, record.state >> 2 & 1);
+  return text;
+}
+
+// The runner keeps its state in globals, so each run gets a fresh process
+static bool recordTrace(int mode, const std::string &path)
+{
+  fflush(stdout); // Or the child writes out the parent's buffered output too
+  pid_t child = fork();
+  if (child == 0)
+  {
+    freopen("/dev/null", "w", stdout);
+    std::string modeArg = std::to_string(mode);
+    const char *args[] = {"program", "--mode", modeArg.c_str(), "--speed", GOLDEN_SPEED,
+                          "--brightness", GOLDEN_BRIGHTNESS, "--seconds", GOLDEN_SECONDS,
+                          "--trace", path.c_str()};
+    _exit(nativeMain(sizeof(args) / sizeof(args[0]), (char **)args));
+  }
+  int status;
+  return child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void checkMode(int mode)
+{
+  std::vector<TraceRecord> golden, rendered;
+  std::string path = goldenPath(mode);
+  TEST_ASSERT_TRUE_MESSAGE(readTrace(path, golden), ("cannot read " + path).c_str());
+
+  char renderedPath[] = "/tmp/golden-XXXXXX";
+  int fd = mkstemp(renderedPath);
+  TEST_ASSERT_TRUE(fd >= 0);
+  close(fd);
+  bool recorded = recordTrace(mode, renderedPath) && readTrace(renderedPath, rendered);
+  unlink(renderedPath);
+  TEST_ASSERT_TRUE_MESSAGE(recorded, "the runner did not produce a trace");
+
+  for (size_t i = 0; i < golden.size() && i < rendered.size(); i++)
+  {
+    if (golden[i].us != rendered[i].us || golden[i].state != rendered[i].state)
+    {
+      std::string message = "first difference at record " + std::to_string(i) + ": " + describe(golden[i]) +
+                            " golden, " + describe(rendered[i]) + " now";
+      TEST_FAIL_MESSAGE(message.c_str());
+    }
+  }
+  std::string message = "identical for " + std::to_string(std::min(golden.size(), rendered.size())) +
+                        " records, then " + std::to_string(golden.size()) + " golden and " +
+                        std::to_string(rendered.size()) + " now";
+  TEST_ASSERT_EQUAL_MESSAGE(golden.size(), rendered.size(), message.c_str());
+}
+
+#define GOLDEN_TEST(id, name, ms, render) \
+  static void test_##id() { checkMode(id); }
+#define RUN_GOLDEN_TEST(id, name, ms, render) RUN_TEST(test_##id);
+
+LIGHT_MODES(GOLDEN_TEST)
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+  UNITY_BEGIN();
+  LIGHT_MODES(RUN_GOLDEN_TEST)
+  return UNITY_END();
+}
@@ -0,0 +1,145 @@
+// Output engine on the simulated timer1: frames go through outputDuty()
+// and outputPresent(), the interrupt drives the bridge pins, and the time
+// each set is driven (IN1 or IN2 with ENA high) must come to its duty's
+// share of its slots.
+//
+//   pio test -e native -f test_output
+
+#include <Arduino.h>
+#include <NativeSim.h>
+#include <unity.h>
+#include "hal.h"
+#include "output.h"
+
+// Time-weighted bridge state, from the pin writes. Pulses are timer ticks
+// of 0.2 us, so they are timed in nanoseconds, not the observer's
+// microseconds.
+static int in1, in2, ena;
+static uint64_t lastNs;
+static uint64_t onNs[2];
+
+static void onPinWrite(uint8_t pin, int value, uint64_t)
+{
+  uint64_t now = nativeNanos();
+  onNs[0] += ena && in1 ? now - lastNs : 0;
+  onNs[1] += ena && in2 ? now - lastNs : 0;
+  lastNs = now;
+  if (pin == IN1_PIN)
+    in1 = value;
+  else if (pin == IN2_PIN)
+    in2 = value;
+  else if (pin == ENA_PIN)
+    ena = value;
+}
+
+// Present duty, let it settle, then return how long each set was driven
+// over the next second
+static void measure(Duty duty, uint64_t (&driven)[2])
+{
+  outputBackBuffer() = duty;
+  outputPresent();
+  nativeAdvanceMicros(100000);
+  onPinWrite(0xff, 0, nativeMicros());
+  onNs[0] = onNs[1] = 0;
+  nativeAdvanceMicros(1000000);
+  onPinWrite(0xff, 0, nativeMicros());
+  driven[0] = onNs[0] / 1000;
+  driven[1] = onNs[1] / 1000;
+}
+
+// Microseconds a set at duty is driven in a second, sharing the cycle
+// with the other set or not
+static uint32_t expectedUs(uint16_t duty, bool shared)
+{
+  return (uint64_t)duty * (shared ? 500000 : 1000000) / 65535;
+}
+
+// Within 0.2%, and a few microseconds for the edges at either end
+#define ASSERT_DRIVEN(expected, actual, message) \
+  TEST_ASSERT_UINT32_WITHIN_MESSAGE((expected) / 500 + 10, expected, actual, message)
+
+static void test_one_set_gets_every_slot()
+{
+  const uint16_t duties[] = {65535, 49152, 32768, 4096, 300};
+  for (uint16_t duty : duties)
+  {
+    uint64_t driven[2];
+    measure({duty, 0}, driven);
+    ASSERT_DRIVEN(expectedUs(duty, false), driven[0], "set A alone");
+    TEST_ASSERT_EQUAL_UINT32(0, driven[1]);
+    measure({0, duty}, driven);
+    ASSERT_DRIVEN(expectedUs(duty, false), driven[1], "set B alone");
+    TEST_ASSERT_EQUAL_UINT32(0, driven[0]);
+  }
+}
+
+static void test_both_sets_share_the_cycle()
+{
+  const Duty duties[] = {{65535, 65535}, {40000, 10000}, {1000, 60000}, {200, 200}};
+  for (const Duty &duty : duties)
+  {
+    uint64_t driven[2];
+    measure(duty, driven);
+    ASSERT_DRIVEN(expectedUs(duty.a, true), driven[0], "set A");
+    ASSERT_DRIVEN(expectedUs(duty.b, true), driven[1], "set B");
+  }
+}
+
+// Below one shortest pulse a slot, the dithering still shows the duty on
+// average
+static void test_dim_duties_are_dithered()
+{
+  for (uint16_t duty = 40; duty <= 160; duty += 40)
+  {
+    uint64_t driven[2];
+    measure({duty, 0}, driven);
+    ASSERT_DRIVEN(expectedUs(duty, false), driven[0], "dithered set A");
+  }
+}
+
+static void test_frames_go_through_the_gamma_table()
+{
+  Duty full = outputDuty({255, 0}, 255 << 8);
+  TEST_ASSERT_EQUAL_UINT32(65535, full.a);
+  TEST_ASSERT_EQUAL_UINT32(0, full.b);
+  Duty dimmest = outputDuty({1, 1}, 255 << 8);
+  TEST_ASSERT_TRUE(dimmest.a > 0 && dimmest.a == dimmest.b);
+  Duty half = outputDuty({128, 255}, 128 << 8);
+  TEST_ASSERT_TRUE(half.a < half.b && half.b < 65535);
+
+  uint64_t driven[2];
+  measure(half, driven);
+  ASSERT_DRIVEN(expectedUs(half.a, true), driven[0], "set A at half brightness");
+  ASSERT_DRIVEN(expectedUs(half.b, true), driven[1], "set B at half brightness");
+}
+
+static void test_dark_stops_the_timer()
+{
+  uint64_t driven[2];
+  measure({0, 0}, driven);
+  TEST_ASSERT_TRUE(outputStopped());
+  TEST_ASSERT_EQUAL_UINT32(0, driven[0] + driven[1]);
+  TEST_ASSERT_EQUAL_INT(LOW, ena);
+
+  measure({32768, 0}, driven);
+  TEST_ASSERT_FALSE(outputStopped());
+  ASSERT_DRIVEN(expectedUs(32768, false), driven[0], "set A after dark");
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+  nativeSetPinObserver(onPinWrite);
+  halBegin();
+  outputBegin(OUTPUT_MULTIPLEX_HZ);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_one_set_gets_every_slot);
+  RUN_TEST(test_both_sets_share_the_cycle);
+  RUN_TEST(test_dim_duties_are_dithered);
+  RUN_TEST(test_frames_go_through_the_gamma_table);
+  RUN_TEST(test_dark_stops_the_timer);
+  return UNITY_END();
+}
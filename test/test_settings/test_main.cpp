@@ -0,0 +1,36 @@
+// Settings journal against power loss: the --power-cut sweep cuts the power
+// after every possible number of programmed bytes of a run that fills every
+// journal sector twice, and each time the journal must read back as the
+// last change written and go on taking writes.
+//
+//   pio test -e native -f test_settings
+
+#include <unity.h>
+#include "settings.h"
+
+uint32_t powerCutSweep();
+const SettingsStats &dragSlider();
+
+static void test_power_cut_at_every_byte()
+{
+  TEST_ASSERT_EQUAL_UINT32(0, powerCutSweep());
+}
+
+static void test_slider_drag_is_one_write()
+{
+  const SettingsStats &stats = dragSlider();
+  TEST_ASSERT_EQUAL_UINT32(100, stats.updates);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.writes);
+  TEST_ASSERT_FALSE(stats.pending);
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_power_cut_at_every_byte);
+  RUN_TEST(test_slider_drag_is_one_write);
+  return UNITY_END();
+}
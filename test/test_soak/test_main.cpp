@@ -0,0 +1,43 @@
+// Soak: 5000 requests from a mix of every GET and POST endpoint, bad values
+// included, over keep-alive connections, with three /events subscribers
+// listening (see runSoak). 25 s of simulated time, long enough for the one
+// that stops reading to be dropped.
+//
+//   pio test -e native -f test_soak
+
+#include <unity.h>
+#include "native_http.h"
+
+static SoakResult result;
+
+static void test_heap_ends_where_it_started()
+{
+  TEST_ASSERT_EQUAL_UINT32(result.heapBaseline, result.heapFinal);
+  TEST_ASSERT_EQUAL_UINT32(0, result.allocations);
+}
+
+static void test_every_reply_as_expected()
+{
+  TEST_ASSERT_EQUAL_UINT32(5000, result.requests);
+  TEST_ASSERT_EQUAL_UINT32(0, result.unexpected);
+}
+
+static void test_subscribers_end_in_sync()
+{
+  TEST_ASSERT_TRUE_MESSAGE(result.readerInSync, "the steady subscriber missed a change");
+  TEST_ASSERT_TRUE_MESSAGE(result.resumedInSync, "the subscriber that paused was not caught up");
+  TEST_ASSERT_TRUE_MESSAGE(result.stalledDropped, "the subscriber that stopped reading was not dropped");
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+  result = soak(5000);
+  UNITY_BEGIN();
+  RUN_TEST(test_heap_ends_where_it_started);
+  RUN_TEST(test_every_reply_as_expected);
+  RUN_TEST(test_subscribers_end_in_sync);
+  return UNITY_END();
+}
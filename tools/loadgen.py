@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Load the controller's web server and report latency and frame timing.
+
+Each client thread keeps one connection open and sends a mix of status reads
+and setting changes. Slow clients open a connection and trickle a request a
+byte at a time, the way a stalled phone or a slowloris would, to check that
+they only cost their own slot. Frame statistics from /status are read before
+and after so the effect of the load on the light output is visible.
+
+    tools/loadgen.py christmas-lights.local --clients 3 --seconds 30
+    tools/loadgen.py 127.0.0.1:8080 --clients 3 --slow 1    # native --listen
+"""
+
+import argparse
+import http.client
+import json
+import random
+import socket
+import threading
+import time
+
+MIX = [
+    ("GET", "/status", None),
+    ("GET", "/status", None),
+    ("GET", "/metrics", None),
+    ("POST", "/brightness?value=%d", "brightness"),
+    ("POST", "/config", "config"),
+    ("GET", "/", None),
+]
+
+
+def frames(host, port):
+    connection = http.client.HTTPConnection(host, port, timeout=5)
+    connection.request("GET", "/status")
+    status = json.loads(connection.getresponse().read())
+    connection.close()
+    return status["frames"]
+
+
+def client(host, port, deadline, results):
+    latencies = []
+    errors = 0
+    connection = http.client.HTTPConnection(host, port, timeout=5)
+    while time.monotonic() < deadline:
+        method, uri, kind = random.choice(MIX)
+        body = None
+        headers = {}
+        if kind == "brightness":
+            uri = uri % random.randrange(256)
+        elif kind == "config":
+            body = json.dumps({"brightness": random.randrange(256), "speed": 1.5, "state": "on"})
+            headers["Content-Type"] = "application/json"
+        start = time.monotonic()
+        try:
+            connection.request(method, uri, body, headers)
+            response = connection.getresponse()
+            response.read()
+            if response.status != 200:
+                errors += 1
+            if response.getheader("Connection", "").lower() == "close":
+                connection.close()
+        except (OSError, http.client.HTTPException):
+            errors += 1
+            connection.close()
+            connection = http.client.HTTPConnection(host, port, timeout=5)
+            continue
+        latencies.append(time.monotonic() - start)
+    connection.close()
+    results.append((latencies, errors))
+
+
+def slow_client(host, port, deadline):
+    request = b"GET /status HTTP/1.1\r\nHost: lights\r\n\r\n"
+    while time.monotonic() < deadline:
+        try:
+            with socket.create_connection((host, port), timeout=5) as s:
+                for byte in request:
+                    if time.monotonic() >= deadline:
+                        return
+                    s.sendall(bytes([byte]))
+                    time.sleep(0.5)
+                s.recv(4096)
+        except OSError:
+            time.sleep(0.5)
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="HOST or HOST:PORT")
+    parser.add_argument("--clients", type=int, default=3, help="keep-alive client connections")
+    parser.add_argument("--slow", type=int, default=0, help="connections trickling one byte every 0.5 s")
+    parser.add_argument("--seconds", type=float, default=30)
+    options = parser.parse_args()
+
+    host, _, port = options.host.partition(":")
+    port = int(port or 80)
+
+    before = frames(host, port)
+    time.sleep(0.1)  # Let the server see that connection close and free its slot
+    deadline = time.monotonic() + options.seconds
+    results = []
+    threads = [threading.Thread(target=slow_client, args=(host, port, deadline)) for _ in range(options.slow)]
+    threads += [threading.Thread(target=client, args=(host, port, deadline, results)) for _ in range(options.clients)]
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+    after = frames(host, port)
+
+    latencies = sorted(latency for result in results for latency in result[0])
+    errors = sum(result[1] for result in results)
+    print("%d requests in %.1f s (%.0f requests/s), %d errors" % (len(latencies), elapsed, len(latencies) / elapsed, errors))
+    if latencies:
+        print("latency ms: p50 %.1f, p95 %.1f, p99 %.1f, max %.1f" % tuple(
+            1000 * v for v in (percentile(latencies, 0.5), percentile(latencies, 0.95), percentile(latencies, 0.99), latencies[-1])))
+    print("frames: %d rendered, %d missed deadlines, mean jitter %d us, max jitter %d us" % (
+        after["count"] - before["count"], after["missed"] - before["missed"], after["jitter_us"], after["max_jitter_us"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Assemble light patterns for the controller and optionally upload them.
+
+A pattern source file has one instruction per line; '#' starts a comment.
+
+    name Slow Breathe         display name (Home Assistant mode name)
+    top:                      label, for repeat
+    key 255 0 smooth 1500     ramp set A to 255, set B to 0 over 1500 ms
+    hold 200                  keep the current levels for 200 ms
+    repeat 3 top              jump back to the label 3 more times
+    end                       start again from the top (implied at the end)
+
+Ease is linear, smooth or step. Durations are ms at 1x speed.
+
+    tools/pattern.py tools/patterns/breathe.txt                # print hex
+    tools/pattern.py tools/patterns/breathe.txt --upload christmas-lights.local 0
+"""
+
+import argparse
+import struct
+import sys
+import urllib.request
+
+MAGIC = b"TLP\x01"
+EASES = {"linear": 0, "smooth": 1, "step": 2}
+MAX_SIZE = 256
+
+
+def assemble(source):
+    name = None
+    code = bytearray()
+    labels = {}
+    fixups = []  # (offset of the pc operand, label, line number)
+
+    for number, line in enumerate(source.splitlines(), 1):
+        line = line.split("#", 1)[0].strip()
+        if not line:
+            continue
+        if line.endswith(":"):
+            labels[line[:-1]] = len(code)
+            continue
+
+        op, *args = line.split()
+        op = op.lower()
+        try:
+            if op == "name":
+                name = line.split(None, 1)[1]
+            elif op == "key":
+                a, b, ease, ms = args
+                code += struct.pack("<BBBBH", 0x01, int(a), int(b), EASES[ease], int(ms))
+            elif op == "hold":
+                (ms,) = args
+                code += struct.pack("<BH", 0x02, int(ms))
+            elif op == "repeat":
+                count, label = args
+                code += struct.pack("<BB", 0x03, int(count))
+                fixups.append((len(code), label, number))
+                code += b"\0\0"
+            elif op == "end":
+                code.append(0x00)
+            else:
+                raise ValueError("unknown instruction '%s'" % op)
+        except (ValueError, KeyError, struct.error, IndexError) as e:
+            sys.exit("line %d: %s" % (number, e))
+
+    for offset, label, number in fixups:
+        if label not in labels:
+            sys.exit("line %d: unknown label '%s'" % (number, label))
+        struct.pack_into("<H", code, offset, labels[label])
+
+    if not name:
+        sys.exit("pattern needs a name")
+    if any(c in name for c in '"\\<>&') or len(name) > 24:
+        sys.exit("pattern name must be at most 24 characters, without \" \\ < > &")
+    encoded = name.encode("ascii")
+    image = MAGIC + bytes([len(encoded)]) + encoded + bytes(code)
+    if len(image) > MAX_SIZE:
+        sys.exit("pattern is %d bytes, the limit is %d" % (len(image), MAX_SIZE))
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("source")
+    parser.add_argument("--upload", nargs=2, metavar=("HOST", "SLOT"))
+    options = parser.parse_args()
+
+    with open(options.source) as f:
+        image = assemble(f.read())
+
+    if not options.upload:
+        print(image.hex())
+        return
+
+    host, slot = options.upload
+    request = urllib.request.Request(
+        "http://%s/pattern?slot=%s" % (host, slot),
+        data=image.hex().encode(),
+        headers={"Content-Type": "text/plain"},
+        method="POST",
+    )
+    with urllib.request.urlopen(request) as response:
+        print(response.read().decode())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Stream frames to the controller's UDP realtime port and measure playout.
+
+Sends an animation (the two sets fading against each other) as sequenced
+frames at a fixed rate, asks the controller to acknowledge each frame as it
+starts to show, and reports the latency from sending a frame to it going on
+show, plus frames that never played. --jitter and --loss disturb the stream
+the way a busy WiFi network would, to exercise the jitter buffer. The
+controller's own counters are read from /status before and after.
+
+    tools/realtime.py christmas-lights.local --fps 50 --seconds 20
+    tools/realtime.py 127.0.0.1:8080 --http 127.0.0.1:8080 --fps 100 --jitter 15 --loss 1   # native --listen
+"""
+
+import argparse
+import heapq
+import http.client
+import json
+import math
+import random
+import socket
+import struct
+import threading
+import time
+
+PORT = 4049
+FLAG_ACK = 1
+
+
+def realtime_status(address):
+    host, _, port = address.partition(":")
+    connection = http.client.HTTPConnection(host, int(port or 80), timeout=5)
+    connection.request("GET", "/status")
+    status = json.loads(connection.getresponse().read())
+    connection.close()
+    return status["realtime"]
+
+
+def frame(index, fps):
+    level = int(127.5 + 127.5 * math.sin(2 * math.pi * index / fps))  # One fade per second
+    return level, 255 - level
+
+
+def packet(seq, frames, duration_ms):
+    data = struct.pack("<4sBBH", b"TLR\x01", FLAG_ACK, len(frames), seq & 0xFFFF)
+    for a, b in frames:
+        data += struct.pack("<BBH", a, b, duration_ms)
+    return data
+
+
+def receive_acks(sock, played, stop):
+    while not stop.is_set():
+        try:
+            data = sock.recv(64)
+        except socket.timeout:
+            continue
+        if len(data) == 8 and data[:4] == b"TLA\x01":
+            seq, buffered = struct.unpack_from("<HB", data, 4)
+            played.setdefault(seq, (time.monotonic(), buffered))
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", help="HOST or HOST:PORT (UDP, default %d)" % PORT)
+    parser.add_argument("--http", metavar="HOST[:PORT]", help="where to read /status (default HOST:80)")
+    parser.add_argument("--fps", type=float, default=50)
+    parser.add_argument("--per-packet", type=int, default=1, help="frames per packet")
+    parser.add_argument("--seconds", type=float, default=10)
+    parser.add_argument("--jitter", type=float, default=0, help="random extra send delay, up to this many ms")
+    parser.add_argument("--loss", type=float, default=0, help="percentage of packets not sent")
+    options = parser.parse_args()
+
+    host, _, port = options.host.partition(":")
+    target = (host, int(port or PORT))
+    http_address = options.http or host
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(0.1)
+    played = {}
+    stop = threading.Event()
+    receiver = threading.Thread(target=receive_acks, args=(sock, played, stop))
+    receiver.start()
+
+    before = realtime_status(http_address)
+    period = 1 / options.fps
+    duration_ms = round(1000 * period)
+    total = int(options.seconds * options.fps) // options.per_packet * options.per_packet
+
+    # Every packet goes out at its nominal time plus its jitter, which can
+    # reorder them as a real network does
+    start = time.monotonic() + 0.1
+    queue = []
+    sent = {}
+    unsent = 0
+    for first in range(0, total, options.per_packet):
+        frames = [frame(i, options.fps) for i in range(first, first + options.per_packet)]
+        due = start + first * period + random.uniform(0, options.jitter / 1000)
+        if random.uniform(0, 100) < options.loss:
+            unsent += options.per_packet
+            continue
+        heapq.heappush(queue, (due, first, packet(first, frames, duration_ms)))
+    while queue:
+        due, first, data = heapq.heappop(queue)
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        now = time.monotonic()
+        for seq in range(first, first + options.per_packet):
+            sent[seq & 0xFFFF] = now
+        sock.sendto(data, target)
+
+    time.sleep(0.5)
+    stop.set()
+    receiver.join()
+    after = realtime_status(http_address)
+    sock.close()
+
+    latencies = sorted(1000 * (played[seq][0] - sent[seq]) for seq in played if seq in sent)
+    print("%d frames at %g fps in %.1f s, %d not sent (--loss), %d played, %d never played" % (
+        total, options.fps, options.seconds, unsent, len(latencies), total - unsent - len(latencies)))
+    if latencies:
+        print("send to show ms: min %.1f, p50 %.1f, p95 %.1f, p99 %.1f, max %.1f" % (
+            latencies[0], percentile(latencies, 0.5), percentile(latencies, 0.95), percentile(latencies, 0.99),
+            latencies[-1]))
+    counters = ("frames", "played", "late", "lost", "overflows", "underruns", "sessions", "timeouts")
+    print("controller: " + ", ".join("%s %d" % (key, after[key] - before[key]) for key in counters))
+
+
+if __name__ == "__main__":
+    main()
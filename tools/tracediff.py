@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Compare two output traces recorded by the native runner's --trace.
+
+Reports where the two first differ and how long each light set was lit in
+each, e.g. a mode's golden trace in test/golden against a fresh recording:
+
+    .pio/build/native/program --mode 2 --speed 1.5 --brightness 200 --seconds 5 --trace now.trace
+    tools/tracediff.py test/golden/mode-2.trace now.trace
+
+Traces are CSV (us,set,enable) or the binary format described in
+src/native_main.cpp; the two need not be in the same format. Exits 1 when
+the traces differ.
+"""
+
+import argparse
+import sys
+
+SETS = {"A": 1, "B": 2, "-": 0}
+NAMES = {1: "A", 2: "B"}
+
+
+def read_trace(path):
+    """Return the trace as a list of (us, in1 | in2 << 1, enable)."""
+    with open(path, "rb") as f:
+        data = f.read()
+    records = []
+    if data.startswith(b"TLT\x01"):
+        us = 0
+        value = shift = 0
+        for byte in data[4:]:
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if byte & 0x80:
+                continue
+            us += value >> 3
+            records.append((us, value & 3, value >> 2 & 1))
+            value = shift = 0
+    else:
+        for line in data.decode().splitlines()[1:]:
+            us, bridge, enable = line.split(",")
+            records.append((int(us), SETS[bridge], int(enable)))
+    return records
+
+
+def lit_us(records):
+    """Microseconds each set was driven, up to the last record."""
+    lit = {1: 0, 2: 0}
+    for (us, bridge, enable), (next_us, _, _) in zip(records, records[1:]):
+        if enable and bridge in lit:
+            lit[bridge] += next_us - us
+    return lit
+
+
+def describe(record):
+    us, bridge, enable = record
+    return "%.6f s set %s enable %d" % (us / 1e6, NAMES.get(bridge, "-"), enable)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("before")
+    parser.add_argument("after")
+    options = parser.parse_args()
+
+    before = read_trace(options.before)
+    after = read_trace(options.after)
+    lit_before, lit_after = lit_us(before), lit_us(after)
+    for bridge in (1, 2):
+        print("set %s lit %.6f s before, %.6f s after" % (NAMES[bridge], lit_before[bridge] / 1e6,
+                                                          lit_after[bridge] / 1e6))
+
+    for index, (old, new) in enumerate(zip(before, after)):
+        if old != new:
+            print("first difference at record %d: %s before, %s after" % (index, describe(old), describe(new)))
+            sys.exit(1)
+    if len(before) != len(after):
+        print("identical for %d records, then %d before and %d after" % (min(len(before), len(after)),
+                                                                        len(before), len(after)))
+        sys.exit(1)
+    print("identical: %d records" % len(before))
+
+
+if __name__ == "__main__":
+    main()